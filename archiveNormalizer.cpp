@@ -0,0 +1,736 @@
+/*!
+  @file archiveNormalizer.cpp
+  @author Charles Irick
+*/
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <zlib.h>
+#include "archiveNormalizer.h"
+
+static const size_t TAR_BLOCK = 512;
+static const size_t STREAM_BUFFER = 1 << 16;
+static const uint64_t MAX_HEADER_DATA = 1 << 20;
+/* Long names and pax headers beyond this are not trusted */
+
+/*! Sequential stream of bytes an archive is read from */
+class ArchiveNormalizer::Source
+{
+public:
+  virtual ~Source() {}
+  /* Returns bytes read, 0 at the end, -1 on error */
+  virtual ssize_t Read(void* buffer, size_t len) = 0;
+
+  /*! ReadFull
+  Read exactly len bytes unless the stream ends first */
+  ssize_t ReadFull(void* buffer, size_t len)
+  {
+    size_t done = 0;
+    while(done < len)
+    {
+      ssize_t got = Read((char*)buffer + done, len - done);
+      if(got < 0)
+      {
+        return -1;
+      }
+      if(got == 0)
+      {
+        break;
+      }
+      done += got;
+    }
+    return done;
+  }
+
+  /*! Drain
+  Pass everything up to the end of the stream to a hash */
+  bool Drain(Sha256* sha)
+  {
+    std::vector<char> buffer(STREAM_BUFFER);
+    ssize_t got;
+    while((got = Read(&buffer[0], buffer.size())) > 0)
+    {
+      sha->Update(&buffer[0], got);
+    }
+    return got == 0;
+  }
+
+  /*! Copy
+  Pass the next len bytes to a hash, or skip them without one */
+  bool Copy(uint64_t len, Sha256* sha)
+  {
+    std::vector<char> buffer(std::min<uint64_t>(len, STREAM_BUFFER));
+    while(len > 0)
+    {
+      ssize_t got = Read(&buffer[0], std::min<uint64_t>(len, buffer.size()));
+      if(got <= 0)
+      {
+        return false;
+      }
+      if(sha)
+      {
+        sha->Update(&buffer[0], got);
+      }
+      len -= got;
+    }
+    return true;
+  }
+};
+
+/*! Byte range of a file read through the I/O backend */
+class ArchiveNormalizer::FileSource : public ArchiveNormalizer::Source
+{
+public:
+  FileSource(IoBackend& backend, int file, uint64_t start, uint64_t stop)
+    :io(backend), handle(file), pos(start), end(stop) {}
+
+  ssize_t Read(void* buffer, size_t len)
+  {
+    len = std::min<uint64_t>(len, end - pos);
+    if(len == 0)
+    {
+      return 0;
+    }
+    ssize_t got = io.Read(handle, buffer, len, pos);
+    if(got > 0)
+    {
+      pos += got;
+    }
+    return got;
+  }
+
+private:
+  IoBackend& io;
+  int handle;
+  uint64_t pos;
+  uint64_t end;
+};
+
+/*! Decompressed view of a deflate or gzip stream */
+class ArchiveNormalizer::InflateSource : public ArchiveNormalizer::Source
+{
+public:
+  /*! Constructor, window_bits as for inflateInit2: -15 for raw
+  deflate, 15 + 32 for gzip members one after another */
+  InflateSource(Source& compressed, int window_bits)
+    :in(compressed), input(STREAM_BUFFER), gzip(window_bits > 15),
+     ok(false), done(false), input_end(false), members(0)
+  {
+    memset(&stream, 0, sizeof(stream));
+    ok = inflateInit2(&stream, window_bits) == Z_OK;
+  }
+  ~InflateSource()
+  {
+    if(ok)
+    {
+      inflateEnd(&stream);
+    }
+  }
+
+  ssize_t Read(void* buffer, size_t len)
+  {
+    if(!ok)
+    {
+      return -1;
+    }
+    stream.next_out = (Bytef*)buffer;
+    stream.avail_out = len;
+
+    while(!done && stream.avail_out == len)
+    {
+      if(!Fill())
+      {
+        return -1;
+      }
+
+      int ret = inflate(&stream, Z_NO_FLUSH);
+      if(ret == Z_STREAM_END)
+      {
+        members++;
+        /* gzip files may hold several members back to back */
+        if(gzip && Fill() && stream.avail_in > 0)
+        {
+          inflateReset(&stream);
+          continue;
+        }
+        done = true;
+      }
+      else if(ret == Z_DATA_ERROR && gzip && members > 0 &&
+              stream.avail_out == len)
+      {
+        /* Trailing garbage after a complete member, as gzip -d
+        does we ignore it */
+        done = true;
+      }
+      else if(ret != Z_OK && !(ret == Z_BUF_ERROR && !input_end))
+      {
+        return -1;
+      }
+    }
+    return len - stream.avail_out;
+  }
+
+private:
+  /* Read more compressed data once the last is used up */
+  bool Fill()
+  {
+    if(stream.avail_in == 0 && !input_end)
+    {
+      ssize_t got = in.Read(&input[0], input.size());
+      if(got < 0)
+      {
+        return false;
+      }
+      input_end = (got == 0);
+      stream.next_in = (Bytef*)&input[0];
+      stream.avail_in = got;
+    }
+    return true;
+  }
+
+  Source& in;
+  std::vector<char> input;
+  z_stream stream;
+  bool gzip;
+  bool ok;
+  bool done;
+  bool input_end;
+  unsigned long members;
+};
+
+static uint16_t Le16(const unsigned char* p) { return p[0] | (p[1] << 8); }
+static uint32_t Le32(const unsigned char* p) { return Le16(p) | ((uint32_t)Le16(p + 2) << 16); }
+static uint64_t Le64(const unsigned char* p) { return Le32(p) | ((uint64_t)Le32(p + 4) << 32); }
+
+/*! TarNumber
+Numeric tar header field, octal or GNU base-256 */
+static uint64_t TarNumber(const unsigned char* field, size_t len)
+{
+  uint64_t value = 0;
+
+  if(field[0] & 0x80)
+  {
+    for(size_t i = 1; i < len; i++)
+    {
+      value = (value << 8) | field[i];
+    }
+    return value;
+  }
+  for(size_t i = 0; i < len && field[i] != 0; i++)
+  {
+    if(field[i] >= '0' && field[i] <= '7')
+    {
+      value = (value << 3) | (field[i] - '0');
+    }
+  }
+  return value;
+}
+
+/*! TarString
+Text field of a tar header, not always NUL terminated */
+static std::string TarString(const unsigned char* field, size_t len)
+{
+  const unsigned char* end = (const unsigned char*)memchr(field, 0, len);
+  return std::string((const char*)field, end ? end - field : len);
+}
+
+/*! IsTarHeader
+If a block is a ustar header with a valid checksum */
+static bool IsTarHeader(const unsigned char* block)
+{
+  if(memcmp(block + 257, "ustar", 5) != 0)
+  {
+    return false;
+  }
+  uint64_t sum = 0;
+  for(size_t i = 0; i < TAR_BLOCK; i++)
+  {
+    sum += (i >= 148 && i < 156) ? ' ' : block[i];
+  }
+  return sum == TarNumber(block + 148, 8);
+}
+
+/*! CanonicalName
+Drop the leading "./" some tar invocations put on every member */
+static std::string CanonicalName(std::string name)
+{
+  while(name.compare(0, 2, "./") == 0)
+  {
+    name.erase(0, 2);
+  }
+  return name;
+}
+
+/*! ParseFormats
+Parse a comma separated list of formats to normalize
+
+@param const std::string & spec
+gzip, tar, zip or all
+@param unsigned int & formats
+@return boolean
+If every format name was recognised
+*/
+bool ArchiveNormalizer::ParseFormats(const std::string& spec, unsigned int& formats)
+{
+  std::istringstream names(spec);
+  std::string name;
+
+  formats = 0;
+  while(std::getline(names, name, ','))
+  {
+    if(name == "gzip")     formats |= ARCHIVE_GZIP;
+    else if(name == "tar") formats |= ARCHIVE_TAR;
+    else if(name == "zip") formats |= ARCHIVE_ZIP;
+    else if(name == "all") formats |= ARCHIVE_GZIP | ARCHIVE_TAR | ARCHIVE_ZIP;
+    else
+    {
+      return false;
+    }
+  }
+  return formats != 0;
+}
+
+/*! IsCandidate
+If the name of a file says it may be an archive. Only those are
+opened, the content then has to agree.
+
+@param const std::string & path
+@return boolean
+*/
+bool ArchiveNormalizer::IsCandidate(const std::string& path)
+{
+  static const char* const extensions[] =
+    { ".gz", ".tgz", ".tar", ".zip", ".jar", ".war", ".ear", ".whl" };
+  size_t dot = path.rfind('.');
+
+  if(dot == std::string::npos || path.find('/', dot) != std::string::npos)
+  {
+    return false;
+  }
+  std::string ext = path.substr(dot);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  for(auto candidate : extensions)
+  {
+    if(ext == candidate)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*! Normalize
+Compute the canonical digest of an archive
+
+@param const std::string & path
+@param Digest & digest
+@return boolean
+If the file is an archive of an enabled format and could be read
+*/
+bool ArchiveNormalizer::Normalize(const std::string& path, Digest& digest)
+{
+  unsigned char head[TAR_BLOCK];
+  FileStat st;
+  bool ok = false;
+
+  if(!io.Stat(path, st) || st.type != ENTRY_FILE)
+  {
+    return false;
+  }
+  int handle = io.Open(path);
+  if(handle < 0)
+  {
+    return false;
+  }
+
+  FileSource file(io, handle, 0, st.ident.size);
+  ssize_t got = file.ReadFull(head, sizeof(head));
+
+  if((formats & ARCHIVE_GZIP) && got >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+  {
+    FileSource whole(io, handle, 0, st.ident.size);
+    InflateSource data(whole, 15 + 32);
+    unsigned char first[TAR_BLOCK];
+    ssize_t len = data.ReadFull(first, sizeof(first));
+
+    if(len == (ssize_t)TAR_BLOCK && (formats & ARCHIVE_TAR) && IsTarHeader(first))
+    {
+      ok = NormalizeTar(data, first, digest);
+    }
+    else if(len >= 0)
+    {
+      Sha256 sha;
+      sha.Update("gzip\n", 5);
+      sha.Update(first, len);
+      ok = data.Drain(&sha);
+      sha.Final(digest);
+    }
+  }
+  else if((formats & ARCHIVE_TAR) && got == (ssize_t)TAR_BLOCK && IsTarHeader(head))
+  {
+    ok = NormalizeTar(file, head, digest);
+  }
+  else if((formats & ARCHIVE_ZIP) && got >= 4 && head[0] == 'P' && head[1] == 'K' &&
+          ((head[2] == 3 && head[3] == 4) || (head[2] == 5 && head[3] == 6)))
+  {
+    ok = NormalizeZip(handle, st.ident.size, digest);
+  }
+
+  io.Close(handle);
+  return ok;
+}
+
+/*! NormalizeTar
+Read a tar stream member by member, hashing the data of each
+
+@param Source & in
+Stream positioned after the first header
+@param const unsigned char * first
+First header block, already read
+@param Digest & digest
+@return boolean
+If the archive could be read to its end
+*/
+bool ArchiveNormalizer::NormalizeTar(Source& in, const unsigned char* first, Digest& digest)
+{
+  std::vector<Member> members;
+  unsigned char block[TAR_BLOCK];
+  std::string long_name, long_link, pax_path, pax_link;
+  uint64_t pax_size = 0;
+  bool have_pax_size = false;
+
+  memcpy(block, first, TAR_BLOCK);
+  for(;;)
+  {
+    bool end = true;
+    for(size_t i = 0; i < TAR_BLOCK && end; i++)
+    {
+      end = block[i] == 0;
+    }
+    if(end)
+    {
+      break;
+    }
+    if(!IsTarHeader(block))
+    {
+      return false;
+    }
+
+    char type = block[156] ? (char)block[156] : '0';
+    uint64_t size = TarNumber(block + 124, 12);
+    uint64_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    /* Extension headers describe the member that follows */
+    if(type == 'L' || type == 'K' || type == 'x')
+    {
+      if(size > MAX_HEADER_DATA)
+      {
+        return false;
+      }
+      std::string data(size, '\0');
+      if(in.ReadFull(&data[0], size) != (ssize_t)size || !in.Copy(padding, NULL))
+      {
+        return false;
+      }
+      if(type == 'L')
+      {
+        long_name = data.substr(0, data.find('\0'));
+      }
+      else if(type == 'K')
+      {
+        long_link = data.substr(0, data.find('\0'));
+      }
+      else
+      {
+        /* Records are "<len> <key>=<value>\n" */
+        size_t pos = 0;
+        while(pos < data.size())
+        {
+          size_t len = strtoul(data.c_str() + pos, NULL, 10);
+          size_t space = data.find(' ', pos);
+          if(len == 0 || space == std::string::npos || pos + len > data.size())
+          {
+            break;
+          }
+          std::string record = data.substr(space + 1, pos + len - space - 2);
+          size_t eq = record.find('=');
+          if(eq != std::string::npos)
+          {
+            std::string key = record.substr(0, eq);
+            if(key == "path")          pax_path = record.substr(eq + 1);
+            else if(key == "linkpath") pax_link = record.substr(eq + 1);
+            else if(key == "size")
+            {
+              pax_size = strtoull(record.c_str() + eq + 1, NULL, 10);
+              have_pax_size = true;
+            }
+          }
+          pos += len;
+        }
+      }
+    }
+    else if(type == 'g')
+    {
+      if(!in.Copy(size + padding, NULL))
+      {
+        return false;
+      }
+    }
+    else
+    {
+      Member member;
+      std::string prefix = TarString(block + 345, 155);
+      std::string name = TarString(block, 100);
+
+      if(!prefix.empty())
+      {
+        name = prefix + "/" + name;
+      }
+      member.name = CanonicalName(!pax_path.empty() ? pax_path :
+                                  !long_name.empty() ? long_name : name);
+      member.link = !pax_link.empty() ? pax_link :
+                    !long_link.empty() ? long_link : TarString(block + 157, 100);
+      member.type = type;
+      member.mode = TarNumber(block + 100, 8) & 07777;
+      if(have_pax_size)
+      {
+        size = pax_size;
+        padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+      }
+      member.size = size;
+
+      Sha256 sha;
+      if(!in.Copy(size, &sha) || !in.Copy(padding, NULL))
+      {
+        return false;
+      }
+      sha.Final(member.digest);
+      members.push_back(member);
+
+      long_name.clear();
+      long_link.clear();
+      pax_path.clear();
+      pax_link.clear();
+      have_pax_size = false;
+    }
+
+    ssize_t got = in.ReadFull(block, TAR_BLOCK);
+    if(got == 0)
+    {
+      /* Archives cut right after a member, without the two zero
+      blocks, still list every member */
+      break;
+    }
+    if(got != (ssize_t)TAR_BLOCK)
+    {
+      return false;
+    }
+  }
+
+  Finish("tar", members, digest);
+  return true;
+}
+
+/*! NormalizeZip
+Read a zip archive through its central directory, hashing the
+decompressed data of every member
+
+@param int handle
+@param uint64_t file_size
+@param Digest & digest
+@return boolean
+If the archive could be read
+*/
+bool ArchiveNormalizer::NormalizeZip(int handle, uint64_t file_size, Digest& digest)
+{
+  std::vector<Member> members;
+  uint64_t tail_len = std::min<uint64_t>(file_size, 22 + 0xFFFF);
+  std::vector<unsigned char> tail(tail_len);
+  unsigned char* eocd = NULL;
+
+  if(tail_len < 22 ||
+     io.Read(handle, &tail[0], tail_len, file_size - tail_len) != (ssize_t)tail_len)
+  {
+    return false;
+  }
+  for(size_t i = tail_len - 22; ; i--)
+  {
+    if(Le32(&tail[i]) == 0x06054b50)
+    {
+      eocd = &tail[i];
+      break;
+    }
+    if(i == 0)
+    {
+      return false;
+    }
+  }
+
+  uint64_t entries = Le16(eocd + 10);
+  uint64_t cd_size = Le32(eocd + 12);
+  uint64_t cd_offset = Le32(eocd + 16);
+  uint64_t eocd_pos = file_size - tail_len + (eocd - &tail[0]);
+
+  /* Zip64 archives keep the real values in another record, found
+  through a locator right before the end record */
+  if(entries == 0xFFFF || cd_size == 0xFFFFFFFF || cd_offset == 0xFFFFFFFF)
+  {
+    unsigned char locator[20], record[56];
+    if(eocd_pos < 20 ||
+       io.Read(handle, locator, 20, eocd_pos - 20) != 20 ||
+       Le32(locator) != 0x07064b50 ||
+       io.Read(handle, record, 56, Le64(locator + 8)) != 56 ||
+       Le32(record) != 0x06064b50)
+    {
+      return false;
+    }
+    entries = Le64(record + 32);
+    cd_size = Le64(record + 40);
+    cd_offset = Le64(record + 48);
+  }
+  if(cd_offset + cd_size > file_size)
+  {
+    return false;
+  }
+
+  std::vector<unsigned char> cd(cd_size);
+  if(cd_size > 0 && io.Read(handle, &cd[0], cd_size, cd_offset) != (ssize_t)cd_size)
+  {
+    return false;
+  }
+
+  size_t pos = 0;
+  for(uint64_t n = 0; n < entries; n++)
+  {
+    if(pos + 46 > cd.size() || Le32(&cd[pos]) != 0x02014b50)
+    {
+      return false;
+    }
+    const unsigned char* entry = &cd[pos];
+    uint16_t flags = Le16(entry + 8);
+    uint16_t method = Le16(entry + 10);
+    uint64_t csize = Le32(entry + 20);
+    uint64_t usize = Le32(entry + 24);
+    uint16_t name_len = Le16(entry + 28);
+    uint16_t extra_len = Le16(entry + 30);
+    uint16_t comment_len = Le16(entry + 32);
+    uint64_t local = Le32(entry + 42);
+    uint16_t made_by = Le16(entry + 4);
+    uint32_t external = Le32(entry + 38);
+
+    if(pos + 46 + name_len + extra_len + comment_len > cd.size())
+    {
+      return false;
+    }
+
+    /* Zip64 extra field, only the values saturated above are in it */
+    const unsigned char* extra = entry + 46 + name_len;
+    for(size_t e = 0; e + 4 <= extra_len; )
+    {
+      uint16_t id = Le16(extra + e);
+      uint16_t len = Le16(extra + e + 2);
+      if(e + 4 + len > extra_len)
+      {
+        break;
+      }
+      if(id == 0x0001)
+      {
+        const unsigned char* field = extra + e + 4;
+        const unsigned char* field_end = field + len;
+        if(usize == 0xFFFFFFFF && field + 8 <= field_end) { usize = Le64(field); field += 8; }
+        if(csize == 0xFFFFFFFF && field + 8 <= field_end) { csize = Le64(field); field += 8; }
+        if(local == 0xFFFFFFFF && field + 8 <= field_end) { local = Le64(field); }
+      }
+      e += 4 + len;
+    }
+
+    Member member;
+    member.name = CanonicalName(std::string((const char*)entry + 46, name_len));
+    member.type = (!member.name.empty() && member.name[member.name.size() - 1] == '/') ? 'd' : 'f';
+    /* Only archives made on Unix keep a mode, in the upper half of
+    the external attributes */
+    member.mode = (made_by >> 8) == 3 ? (external >> 16) & 07777 : 0;
+    member.size = usize;
+    pos += 46 + name_len + extra_len + comment_len;
+
+    unsigned char header[30];
+    if(io.Read(handle, header, 30, local) != 30 || Le32(header) != 0x04034b50)
+    {
+      return false;
+    }
+    uint64_t data = local + 30 + Le16(header + 26) + Le16(header + 28);
+    if(data + csize > file_size)
+    {
+      return false;
+    }
+
+    FileSource raw(io, handle, data, data + csize);
+    Sha256 sha;
+    bool ok;
+    if(flags & 1)
+    {
+      /* Encrypted, the stored bytes are all we can go by */
+      sha.Update("encrypted\n", 10);
+      ok = raw.Copy(csize, &sha);
+    }
+    else if(method == 0)
+    {
+      ok = raw.Copy(csize, &sha);
+    }
+    else if(method == 8)
+    {
+      InflateSource inflated(raw, -15);
+      ok = inflated.Copy(usize, &sha);
+    }
+    else
+    {
+      /* Methods zlib can not decode are compared as stored */
+      sha.Update(&method, sizeof(method));
+      ok = raw.Copy(csize, &sha);
+    }
+    if(!ok)
+    {
+      return false;
+    }
+    sha.Final(member.digest);
+    members.push_back(member);
+  }
+
+  Finish("zip", members, digest);
+  return true;
+}
+
+/*! Finish
+Hash the sorted list of members
+
+@param const char * kind
+Format the members came from
+@param std::vector<Member> & members
+@param Digest & digest
+*/
+void ArchiveNormalizer::Finish(const char* kind, std::vector<Member>& members, Digest& digest)
+{
+  Sha256 sha;
+  unsigned char fixed[13];
+
+  std::sort(members.begin(), members.end());
+  sha.Update(kind, strlen(kind));
+  sha.Update("\n", 1);
+  for(auto& member : members)
+  {
+    sha.Update(member.name.c_str(), member.name.size() + 1);
+    sha.Update(member.link.c_str(), member.link.size() + 1);
+    fixed[0] = member.type;
+    for(int i = 0; i < 4; i++)
+    {
+      fixed[1 + i] = (member.mode >> (8 * i)) & 0xFF;
+    }
+    for(int i = 0; i < 8; i++)
+    {
+      fixed[5 + i] = (member.size >> (8 * i)) & 0xFF;
+    }
+    sha.Update(fixed, sizeof(fixed));
+    sha.Update(member.digest.bytes, Digest::MAX_SIZE);
+  }
+  sha.Final(digest);
+}
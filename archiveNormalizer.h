@@ -0,0 +1,78 @@
+#ifndef ARCHIVE_NORMALIZER_H
+#define ARCHIVE_NORMALIZER_H
+/*!
+  @file archiveNormalizer.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "contentHash.h"
+#include "ioBackend.h"
+
+/*! Archive formats that can be normalized */
+enum ArchiveFormat
+{
+  ARCHIVE_GZIP = 1 << 0, /*!< Hash the decompressed data, not the header */
+  ARCHIVE_TAR  = 1 << 1, /*!< Hash the sorted members, not their times or owners */
+  ARCHIVE_ZIP  = 1 << 2  /*!< Same for zip, jar, war and wheel files */
+};
+
+/*!
+  Hashes a canonical form of an archive, so that archives holding the
+  same content are equal even when built at different times. gzip is
+  hashed decompressed, which drops the header mtime, name and
+  compression level. tar and zip archives are hashed as their list
+  of members sorted by name, each with its type, permissions, link
+  target and content digest; times, owners, extra fields and member
+  order are left out. A gzip'ed tar is normalized as the tar inside,
+  so it equals the same tar uncompressed.
+
+  Member content is streamed through the hash, memory only grows
+  with the number of members.
+
+  @brief Content digest of archives ignoring volatile metadata.
+ */
+class ArchiveNormalizer
+{
+public:
+  /*! Constructor */
+  ArchiveNormalizer(IoBackend& backend, unsigned int enabled_formats)
+    :io(backend), formats(enabled_formats) {}
+
+  bool Normalize(const std::string& path, Digest& digest);
+
+  static bool ParseFormats(const std::string& spec, unsigned int& formats);
+  static bool IsCandidate(const std::string& path);
+
+private:
+  /*! One member of a tar or zip archive */
+  struct Member
+  {
+    std::string name;
+    char type;
+    uint32_t mode;
+    std::string link;
+    uint64_t size;
+    Digest digest;
+    bool operator<(const Member& other) const
+    {
+      return name != other.name ? name < other.name : digest < other.digest;
+    }
+  };
+
+  class Source;
+  class FileSource;
+  class InflateSource;
+  bool NormalizeTar(Source& in, const unsigned char* first, Digest& digest);
+  bool NormalizeZip(int handle, uint64_t file_size, Digest& digest);
+  static void Finish(const char* kind, std::vector<Member>& members, Digest& digest);
+
+  IoBackend& io;
+  unsigned int formats;
+  /*! ArchiveFormat flags */
+};
+
+#endif /* ARCHIVE_NORMALIZER_H */
@@ -0,0 +1,331 @@
+/*!
+  @file blockHashDb.cpp
+  @author Charles Irick
+*/
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sqlite3.h>
+#include "contentHash.h"
+#include "blockHashDb.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/btrfs.h>) && __has_include(<linux/btrfs_tree.h>)
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#endif
+#endif
+
+const uint32_t BlockHashDb::BLOCK_SIZE;
+const int BlockHashDb::VERSION_MAJOR;
+const int BlockHashDb::VERSION_MINOR;
+
+/*! Tables as duperemove creates them */
+static const char* const SCHEMA =
+  "CREATE TABLE config(keyname TEXT PRIMARY KEY NOT NULL, keyval BLOB);"
+  "CREATE TABLE files(filename TEXT PRIMARY KEY NOT NULL, ino INTEGER, "
+  "subvol INTEGER, size INTEGER, blocks INTEGER, mtime INTEGER, "
+  "dedupe_seq INTEGER, digest BLOB, flags INTEGER, UNIQUE(ino, subvol));"
+  "CREATE TABLE extents(digest BLOB KEY NOT NULL, ino INTEGER, subvol INTEGER, "
+  "loff INTEGER, poff INTEGER, len INTEGER, flags INTEGER, "
+  "UNIQUE(ino, subvol, loff, len));"
+  "CREATE TABLE hashes(digest BLOB KEY NOT NULL, ino INTEGER, subvol INTEGER, "
+  "loff INTEGER, flags INTEGER, UNIQUE(ino, subvol, loff));";
+
+static const char* const INDEXES =
+  "CREATE INDEX idx_digest ON hashes(digest);"
+  "CREATE INDEX idx_hashes_inosub ON hashes(ino, subvol);"
+  "CREATE INDEX idx_inosub ON files(ino, subvol);";
+
+/*! Destructor
+A database never closed is left without its rows */
+BlockHashDb::~BlockHashDb()
+{
+  Finalize();
+}
+
+/*! Exec
+Run statements that return no rows
+
+@param const char * sql
+@return boolean
+*/
+bool BlockHashDb::Exec(const char* sql)
+{
+  char* error = NULL;
+
+  if(sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK)
+  {
+    std::cerr << "Block hash database: " << (error ? error : "unknown error") << std::endl;
+    sqlite3_free(error);
+    return false;
+  }
+  return true;
+}
+
+/*! Finalize
+Release the statements and the connection */
+void BlockHashDb::Finalize()
+{
+  sqlite3_finalize(insert_file);
+  sqlite3_finalize(insert_hash);
+  sqlite3_close(db);
+  insert_file = NULL;
+  insert_hash = NULL;
+  db = NULL;
+}
+
+/*! Open
+Create the database, replacing any file at the path, and start the
+transaction the rows go into
+
+@param const std::string & path
+@return boolean
+*/
+bool BlockHashDb::Open(const std::string& path)
+{
+  unlink(path.c_str());
+  if(sqlite3_open(path.c_str(), &db) != SQLITE_OK)
+  {
+    std::cerr << "Could not create block hash database: " << path << std::endl;
+    Finalize();
+    return false;
+  }
+
+  if(!Exec("PRAGMA synchronous = OFF; PRAGMA journal_mode = MEMORY;") ||
+     !Exec(SCHEMA) || !Exec("BEGIN TRANSACTION;") ||
+     sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO files(filename, ino, subvol, size, "
+                        "blocks, mtime, dedupe_seq, digest, flags) "
+                        "VALUES(?, ?, ?, ?, ?, ?, 0, NULL, 0);",
+                        -1, &insert_file, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO hashes(digest, ino, subvol, loff, flags) "
+                        "VALUES(?, ?, ?, ?, 0);",
+                        -1, &insert_hash, NULL) != SQLITE_OK)
+  {
+    std::cerr << "Could not create block hash database: " << path << std::endl;
+    Finalize();
+    unlink(path.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*! SubvolOf
+The btrfs subvolume of a file, the device number elsewhere. Every
+btrfs subvolume has a device number of its own, so one file per
+device is asked.
+
+@param const std::string & path
+@param uint64_t dev
+@return uint64_t
+*/
+uint64_t BlockHashDb::SubvolOf(const std::string& path, uint64_t dev)
+{
+  auto found = subvols.find(dev);
+  uint64_t subvol = dev;
+
+  if(found != subvols.end())
+  {
+    return found->second;
+  }
+
+#ifdef BTRFS_IOC_INO_LOOKUP
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd >= 0)
+  {
+    /* Tree 0 with the first free object id asks for the tree of the
+    file itself, which needs no privileges */
+    btrfs_ioctl_ino_lookup_args args;
+    memset(&args, 0, sizeof(args));
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+    if(ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) == 0)
+    {
+      subvol = args.treeid;
+    }
+    close(fd);
+  }
+#else
+  (void)path;
+#endif
+  subvols[dev] = subvol;
+  return subvol;
+}
+
+/*! BeginFile
+Get ready for the blocks of a file. A link to an inode some other
+path is hashing, or has written, is left out
+
+@param const std::string & path
+@param const FileIdentity & ident
+Taken before the file is read
+*/
+void BlockHashDb::BeginFile(const std::string& path, const FileIdentity& ident)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  OpenFile& file = open_files[path];
+
+  file.ident = ident;
+  file.subvol = SubvolOf(path, ident.dev);
+  file.blocks = 0;
+  file.owner = inodes.insert(std::make_pair(ident.ino, file.subvol)).second;
+}
+
+/*! Offer
+Hash the blocks of a buffer just read from a file begun with
+BeginFile(). The buffer is expected to start on a block boundary and
+to be cut short only at the end of the file, whose last block is
+hashed as far as it goes.
+
+@param const std::string & path
+@param uint64_t offset
+Where the buffer starts in the file
+@param const char * data
+@param size_t len
+*/
+void BlockHashDb::Offer(const std::string& path, uint64_t offset, const char* data, size_t len)
+{
+  std::vector<Digest> digests;
+
+  for(size_t pos = 0; pos < len; pos += BLOCK_SIZE)
+  {
+    Sha256 sha;
+    digests.push_back(Digest());
+    sha.Update(data + pos, std::min<size_t>(BLOCK_SIZE, len - pos));
+    sha.Final(digests.back());
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = open_files.find(path);
+  if(found == open_files.end() || !found->second.owner || db == NULL)
+  {
+    return;
+  }
+
+  OpenFile& file = found->second;
+  for(size_t i = 0; i < digests.size(); i++)
+  {
+    sqlite3_bind_blob(insert_hash, 1, digests[i].bytes, Digest::MAX_SIZE, SQLITE_STATIC);
+    sqlite3_bind_int64(insert_hash, 2, (sqlite3_int64)file.ident.ino);
+    sqlite3_bind_int64(insert_hash, 3, (sqlite3_int64)file.subvol);
+    sqlite3_bind_int64(insert_hash, 4, (sqlite3_int64)(offset + i * BLOCK_SIZE));
+    if(sqlite3_step(insert_hash) == SQLITE_DONE)
+    {
+      file.blocks++;
+      hashes++;
+    }
+    sqlite3_reset(insert_hash);
+  }
+}
+
+/*! EndFile
+Write the row of a file once all its blocks are in
+
+@param const std::string & path
+@param bool complete
+If the whole file was read, the blocks of a file that failed are
+taken out again and a later link to it may write them
+*/
+void BlockHashDb::EndFile(const std::string& path, bool complete)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = open_files.find(path);
+
+  if(found == open_files.end())
+  {
+    return;
+  }
+  OpenFile& file = found->second;
+  if(!file.owner)
+  {
+    /* Another link has the rows of this inode */
+  }
+  else if(!complete && db != NULL)
+  {
+    sqlite3_stmt* drop = NULL;
+    if(sqlite3_prepare_v2(db, "DELETE FROM hashes WHERE ino = ? AND subvol = ?;",
+                          -1, &drop, NULL) == SQLITE_OK)
+    {
+      sqlite3_bind_int64(drop, 1, (sqlite3_int64)file.ident.ino);
+      sqlite3_bind_int64(drop, 2, (sqlite3_int64)file.subvol);
+      if(sqlite3_step(drop) == SQLITE_DONE)
+      {
+        hashes -= file.blocks;
+      }
+    }
+    sqlite3_finalize(drop);
+    inodes.erase(std::make_pair(file.ident.ino, file.subvol));
+  }
+  else if(db != NULL)
+  {
+    /* duperemove keeps mtimes in nanoseconds */
+    int64_t mtime = file.ident.mtime_sec * 1000000000LL + file.ident.mtime_nsec;
+
+    sqlite3_bind_text(insert_file, 1, path.c_str(), path.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(insert_file, 2, (sqlite3_int64)file.ident.ino);
+    sqlite3_bind_int64(insert_file, 3, (sqlite3_int64)file.subvol);
+    sqlite3_bind_int64(insert_file, 4, (sqlite3_int64)file.ident.size);
+    sqlite3_bind_int64(insert_file, 5, (sqlite3_int64)file.blocks);
+    sqlite3_bind_int64(insert_file, 6, (sqlite3_int64)mtime);
+    if(sqlite3_step(insert_file) == SQLITE_DONE)
+    {
+      files++;
+    }
+    sqlite3_reset(insert_file);
+  }
+  if(file.owner)
+  {
+    written.insert(path);
+  }
+  open_files.erase(found);
+}
+
+/*! HasFile
+If a file was hashed already, or failed to, or another link to it
+has its rows
+
+@param const std::string & path
+@param const FileIdentity & ident
+@return boolean
+*/
+bool BlockHashDb::HasFile(const std::string& path, const FileIdentity& ident)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return written.count(path) > 0 ||
+         inodes.count(std::make_pair(ident.ino, SubvolOf(path, ident.dev))) > 0;
+}
+
+/*! Close
+Write the config, build the indexes and commit
+
+@return boolean
+If the database is complete
+*/
+bool BlockHashDb::Close()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  char config[512];
+
+  if(db == NULL)
+  {
+    return false;
+  }
+  snprintf(config, sizeof(config),
+           "INSERT INTO config VALUES('version_major', %d);"
+           "INSERT INTO config VALUES('version_minor', %d);"
+           "INSERT INTO config VALUES('hash_type', 'sha256');"
+           "INSERT INTO config VALUES('block_size', %u);"
+           "INSERT INTO config VALUES('num_files', %llu);"
+           "INSERT INTO config VALUES('num_hashes', %llu);"
+           "INSERT INTO config VALUES('dedupe_sequence', 0);",
+           VERSION_MAJOR, VERSION_MINOR, BLOCK_SIZE,
+           (unsigned long long)files, (unsigned long long)hashes);
+
+  bool ok = Exec(config) && Exec(INDEXES) && Exec("COMMIT;");
+  Finalize();
+  return ok;
+}
@@ -0,0 +1,95 @@
+#ifndef BLOCK_HASH_DB_H
+#define BLOCK_HASH_DB_H
+/*!
+  @file blockHashDb.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include "hashCache.h"
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+/*!
+  Writes the SHA-256 digest of every BLOCK_SIZE block of the scanned
+  files to an SQLite database laid out like the version 2 hashfile of
+  duperemove: a config table with the hash type and block size, a
+  files table with the path, inode, subvolume, size and mtime of each
+  file, and a hashes table with the digest of each block keyed on
+  inode, subvolume and offset. A dedup tool reading it can skip
+  hashing files whose size and mtime still match.
+
+  Blocks are hashed from the buffers of the scan as files are read,
+  see Offer(). The subvolume is the btrfs tree the file is in, asked
+  once per device; on other filesystems it is the device number, so
+  inodes of different filesystems never collide.
+
+  Hard links of one file share their inode, so only the first path
+  of an inode gets rows, later links are passed over.
+
+  Rows are written in one transaction, the indexes are built once at
+  Close(), so a half written database is never left behind.
+
+  @brief Block hash database of a scan.
+ */
+class BlockHashDb
+{
+public:
+  static const uint32_t BLOCK_SIZE = 128 * 1024;
+  static const int VERSION_MAJOR = 2;
+  static const int VERSION_MINOR = 0;
+
+  /*! Constructor */
+  BlockHashDb()
+    :db(NULL), insert_file(NULL), insert_hash(NULL), files(0), hashes(0) {}
+  ~BlockHashDb();
+
+  bool Open(const std::string& path);
+  void BeginFile(const std::string& path, const FileIdentity& ident);
+  void Offer(const std::string& path, uint64_t offset, const char* data, size_t len);
+  void EndFile(const std::string& path, bool complete);
+  bool HasFile(const std::string& path, const FileIdentity& ident);
+  bool Close();
+
+  uint64_t Files() const { return files; }
+  uint64_t Hashes() const { return hashes; }
+
+private:
+  /*! A file whose blocks are being hashed */
+  struct OpenFile
+  {
+    FileIdentity ident;
+    uint64_t subvol;
+    uint64_t blocks;
+    bool owner;
+    /*! If this path writes the rows of its inode, false for another link */
+  };
+
+  uint64_t SubvolOf(const std::string& path, uint64_t dev);
+  bool Exec(const char* sql);
+  void Finalize();
+
+  sqlite3* db;
+  sqlite3_stmt* insert_file;
+  sqlite3_stmt* insert_hash;
+  std::mutex lock;
+  /*! Protects everything below */
+  std::unordered_map<std::string,OpenFile> open_files;
+  std::unordered_set<std::string> written;
+  /*! Files whose rows are in the database */
+  std::set<std::pair<uint64_t,uint64_t> > inodes;
+  /*! Inode and subvolume of every file being hashed or written */
+  std::unordered_map<uint64_t,uint64_t> subvols;
+  /*! Subvolume of every device seen */
+  uint64_t files;
+  uint64_t hashes;
+};
+
+#endif /* BLOCK_HASH_DB_H */
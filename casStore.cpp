@@ -0,0 +1,383 @@
+/*!
+  @file casStore.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "boost/filesystem.hpp"
+#include "casStore.h"
+#include "treeCopier.h"
+#include "workQueue.h"
+
+/*! DEFAULT_MAP
+Name of the mapping written in the store unless another path is
+given */
+const char* CasStore::DEFAULT_MAP = "map.sha256";
+
+/*! LoadHashCache
+Reuse digests recorded by earlier imports for unchanged files. The
+cache is saved back after the import.
+
+@param const std::string & cache_path
+@return boolean
+If the cache could be loaded
+*/
+bool CasStore::LoadHashCache(const std::string& cache_path)
+{
+  hash_cache_path = cache_path;
+  use_cache = true;
+  return hash_cache.Load(cache_path);
+}
+
+/*! Import
+Hash every regular file under root, store each unique content once
+and write the mapping.
+
+@param const std::string & root
+@param const std::string & store
+@return boolean
+If every file was stored
+*/
+bool CasStore::Import(const std::string& root, const std::string& store)
+{
+  boost::system::error_code ec;
+  std::vector<std::string> files;
+
+  if(!boost::filesystem::is_directory(root, ec))
+  {
+    std::cerr << "Not a directory: " << root << std::endl;
+    return false;
+  }
+  store_root = HashCache::Key(store);
+  boost::filesystem::create_directories(
+    boost::filesystem::path(store_root) / "objects", ec);
+  if(ec)
+  {
+    std::cerr << "Could not create store: " << store << ": " << ec.message() << std::endl;
+    return false;
+  }
+  if(map_path.empty())
+  {
+    map_path = (boost::filesystem::path(store_root) / DEFAULT_MAP).string();
+  }
+
+  /* Never import the store into itself */
+  boost::filesystem::recursive_directory_iterator it(root, ec), end;
+  for(; it != end; it.increment(ec))
+  {
+    if(ec)
+    {
+      ec.clear();
+      continue;
+    }
+    if(it->symlink_status().type() == boost::filesystem::directory_file &&
+       HashCache::Key(it->path().string()) == store_root)
+    {
+      it.no_push();
+      continue;
+    }
+    if(it->symlink_status().type() == boost::filesystem::regular_file)
+    {
+      files.push_back(it->path().string());
+    }
+  }
+
+  std::vector<Digest> digests(files.size());
+  std::vector<bool> ok(files.size(), false);
+  std::vector<char> done(files.size(), 0);
+  WorkQueue<size_t> queue;
+  std::vector<std::thread> workers;
+
+  for(size_t i = 0; i < files.size(); i++)
+  {
+    queue.Push(i);
+  }
+  queue.Close();
+
+  for(unsigned int t = 0; t < threads; t++)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      size_t i;
+
+      while(queue.Pop(i))
+      {
+        FileIdentity ident;
+        bool cached = false;
+
+        if(!StatIdentity(files[i], ident))
+        {
+          continue;
+        }
+        if(use_cache)
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          cached = hash_cache.Lookup(files[i], ident, digests[i]);
+        }
+        std::string tmp = store_root + "/objects/import-" + std::to_string(getpid()) +
+                          "-" + std::to_string(i) + ".tmp";
+        done[i] = StoreObject(files[i], tmp, digests[i], cached, ident.size) ? 1 : 0;
+        if(use_cache && !cached && done[i])
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          hash_cache.Insert(files[i], ident, digests[i]);
+        }
+      }
+    }));
+  }
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+
+  for(size_t i = 0; i < files.size(); i++)
+  {
+    ok[i] = done[i] != 0;
+    if(!ok[i])
+    {
+      failed_files++;
+    }
+  }
+
+  if(use_cache)
+  {
+    hash_cache.Save(hash_cache_path);
+  }
+  bool written = WriteMap(root, files, digests, ok);
+  PrintStats(files.size());
+  return written && failed_files == 0;
+}
+
+/*! ObjectPath
+Where a content lives in the store. Two levels of 256 shards keep
+directories small for stores with millions of objects. */
+std::string CasStore::ObjectPath(const Digest& digest) const
+{
+  std::string hex = digest.ToHex();
+
+  return store_root + "/objects/" + hex.substr(0, 2) + "/" + hex.substr(2, 2) +
+         "/" + hex;
+}
+
+/*! Claim
+Take a digest for writing, or wait for the worker that took it to
+finish
+
+@param const Digest & digest
+@return ClaimResult
+*/
+CasStore::ClaimResult CasStore::Claim(const Digest& digest)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  auto found = claims.find(digest);
+
+  if(found == claims.end())
+  {
+    std::shared_ptr<ClaimState> state(new ClaimState());
+    struct stat st;
+
+    /* Objects of an earlier import are done already */
+    state->done = state->stored = stat(ObjectPath(digest).c_str(), &st) == 0;
+    claims[digest] = state;
+    return state->stored ? CLAIM_STORED : CLAIM_WRITE;
+  }
+
+  std::shared_ptr<ClaimState> state = found->second;
+  claim_done.wait(guard, [&]() { return state->done; });
+  return state->stored ? CLAIM_STORED : CLAIM_FAILED;
+}
+
+/*! Release
+Hand the result of writing a claimed object to the workers waiting
+for it. A failed digest is given up, a later file with the same
+content tries again.
+
+@param const Digest & digest
+@param bool stored
+*/
+void CasStore::Release(const Digest& digest, bool stored)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = claims.find(digest);
+
+  found->second->done = true;
+  found->second->stored = stored;
+  if(!stored)
+  {
+    claims.erase(found);
+  }
+  claim_done.notify_all();
+}
+
+/*! StoreObject
+Write a file's content into the store unless that content is there
+already. The file is hashed first, or its digest taken from the hash
+cache, and the digest claimed. Only the first worker to claim a
+digest copies its file, others with the same content wait for its
+result, and take the claim over when it failed. The copy is hashed
+as it is written and renamed into place only if it hashes the same
+as claimed.
+
+@param const std::string & file
+@param const std::string & tmp
+Temporary object the file is copied to
+@param Digest & digest
+Digest from the hash cache when cached, set here otherwise
+@param bool cached
+@param uint64_t size
+@return boolean
+If the content is in the store
+*/
+bool CasStore::StoreObject(const std::string& file, const std::string& tmp,
+                           Digest& digest, bool cached, uint64_t size)
+{
+  ClaimResult claim;
+
+  if(!cached && !TreeCopier::HashPath(file, digest))
+  {
+    return false;
+  }
+
+  /* The worker whose write failed gave its claim up, so trying
+  again either takes the claim or waits for another worker */
+  while((claim = Claim(digest)) == CLAIM_FAILED)
+  {
+  }
+  if(claim == CLAIM_STORED)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    dup_files++;
+    dup_bytes += size;
+    return true;
+  }
+
+  Digest copied;
+  int error = 0;
+  int in = open(file.c_str(), O_RDONLY);
+  int out = -1;
+
+  if(in < 0)
+  {
+    error = errno;
+  }
+  else if((out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0444)) < 0)
+  {
+    error = errno;
+  }
+  bool stored = out >= 0 && TreeCopier::StreamHashed(in, out, copied, error);
+
+  if(!stored)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::cerr << "Could not store: " << file << ": " << strerror(error) << std::endl;
+  }
+  if(in >= 0)
+  {
+    close(in);
+  }
+  if(out >= 0 && close(out) != 0)
+  {
+    stored = false;
+  }
+  if(stored && copied != digest)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::cerr << "Could not store: " << file << ": changed since it was hashed" << std::endl;
+    stored = false;
+  }
+
+  if(stored)
+  {
+    std::string object = ObjectPath(digest);
+    boost::system::error_code ec;
+
+    boost::filesystem::create_directories(
+      boost::filesystem::path(object).parent_path(), ec);
+    if(rename(tmp.c_str(), object.c_str()) != 0)
+    {
+      error = errno;
+      std::lock_guard<std::mutex> guard(lock);
+      std::cerr << "Could not store: " << object << ": " << strerror(error) << std::endl;
+      stored = false;
+    }
+  }
+  if(!stored)
+  {
+    unlink(tmp.c_str());
+  }
+  Release(digest, stored);
+
+  std::lock_guard<std::mutex> guard(lock);
+  if(stored)
+  {
+    new_objects++;
+    stored_bytes += size;
+  }
+  return stored;
+}
+
+/*! WriteMap
+Write "<sha256>  <path>" for every stored file, paths relative to
+the imported root. Names needing escapes use the coreutils
+convention. */
+bool CasStore::WriteMap(const std::string& root,
+                        const std::vector<std::string>& files,
+                        const std::vector<Digest>& digests,
+                        const std::vector<bool>& ok) const
+{
+  std::string tmp = map_path + ".tmp";
+  std::ofstream out(tmp.c_str());
+
+  if(!out)
+  {
+    std::cerr << "Could not write map: " << map_path << std::endl;
+    return false;
+  }
+  for(size_t i = 0; i < files.size(); i++)
+  {
+    if(!ok[i])
+    {
+      continue;
+    }
+    std::string rel = boost::filesystem::path(files[i]).lexically_relative(root).string();
+    std::string escaped = EscapePath(rel);
+    out << (escaped != rel ? "\\" : "") << digests[i].ToHex() << "  " << escaped << "\n";
+  }
+  out.close();
+  if(!out || rename(tmp.c_str(), map_path.c_str()) != 0)
+  {
+    std::cerr << "Could not write map: " << map_path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! PrintStats
+Report how much content was stored and how much was deduplicated */
+void CasStore::PrintStats(size_t files) const
+{
+  double to_mb = 1.0 / (double)(1 << 20);
+
+  std::cout << std::fixed << std::showpoint << std::setprecision(2)
+            << "-- Import Stats -- " << std::endl
+            << "Files imported:          " << files - failed_files << std::endl
+            << "Objects written:         " << new_objects << " ("
+            << stored_bytes * to_mb << "MB)" << std::endl
+            << "Already in store:        " << dup_files << " ("
+            << dup_bytes * to_mb << "MB)" << std::endl
+            << "Map written to:          " << map_path << std::endl;
+  if(failed_files > 0)
+  {
+    std::cout << "Files failed:            " << failed_files << std::endl;
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef CAS_STORE_H
+#define CAS_STORE_H
+/*!
+  @file casStore.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "contentHash.h"
+#include "hashCache.h"
+
+/*!
+  Imports a tree into a content-addressed store. Every file is hashed
+  by a pool of workers and each unique content is written once, to
+  objects/<aa>/<bb>/<sha256> under the store. The first worker to
+  claim a digest copies its file, hashing the data again as it goes,
+  and renames the copy into place only when that digest matches the
+  claim. Files with a digest already claimed wait for that write and
+  are never copied, so duplicates cost no writes.
+
+  The mapping from original path to content ID is written in
+  sha256sum format, paths relative to the imported root, so it can be
+  checked with sha256sum or fed back with --import-manifest.
+
+  @brief Content-addressed store export.
+ */
+class CasStore
+{
+public:
+  /*! Constructor */
+  CasStore()
+    :threads(1), use_cache(false), new_objects(0), stored_bytes(0),
+     dup_files(0), dup_bytes(0), failed_files(0) {}
+
+  void SetThreads(unsigned int count) { threads = count > 0 ? count : 1; }
+  void SetMapPath(const std::string& path) { map_path = path; }
+  bool LoadHashCache(const std::string& cache_path);
+  bool Import(const std::string& root, const std::string& store);
+
+  static const char* DEFAULT_MAP;
+
+private:
+  /*! Answer of Claim() */
+  enum ClaimResult
+  {
+    CLAIM_WRITE,  /*!< The caller writes the object */
+    CLAIM_STORED, /*!< The object is in the store */
+    CLAIM_FAILED  /*!< The worker writing the object failed */
+  };
+  /*! A digest some worker took for writing */
+  struct ClaimState
+  {
+    ClaimState() :done(false), stored(false) {}
+    bool done;
+    bool stored;
+  };
+
+  bool StoreObject(const std::string& file, const std::string& tmp,
+                   Digest& digest, bool cached, uint64_t size);
+  ClaimResult Claim(const Digest& digest);
+  void Release(const Digest& digest, bool stored);
+  std::string ObjectPath(const Digest& digest) const;
+  bool WriteMap(const std::string& root,
+                const std::vector<std::string>& files,
+                const std::vector<Digest>& digests,
+                const std::vector<bool>& ok) const;
+  void PrintStats(size_t files) const;
+
+  unsigned int threads;
+  std::string store_root;
+  std::string map_path;
+  /*! Where the path to content ID mapping is written */
+  HashCache hash_cache;
+  /*! Digests of files unchanged since an earlier run */
+  std::string hash_cache_path;
+  bool use_cache;
+  std::unordered_map<Digest,std::shared_ptr<ClaimState>,DigestHash> claims;
+  /*! Content already stored, or being stored by some worker */
+  std::mutex lock;
+  /*! Guards claims, the hash cache and the counters */
+  std::condition_variable claim_done;
+  /*! Signalled when a worker finishes writing a claimed object */
+  uint64_t new_objects;
+  uint64_t stored_bytes;
+  uint64_t dup_files;
+  uint64_t dup_bytes;
+  /*! Data that was not stored again */
+  uint64_t failed_files;
+};
+
+#endif /* CAS_STORE_H */
@@ -0,0 +1,292 @@
+/*!
+  @file compressEstimator.cpp
+  @author Charles Irick
+*/
+#include <algorithm>
+#include <functional>
+#include <zlib.h>
+#include "compressEstimator.h"
+
+const size_t CompressEstimator::BLOCK_SIZE;
+const size_t CompressEstimator::MAX_QUEUED;
+const int CompressEstimator::LEVEL;
+
+/*! Constructor
+Start the workers deflating picked blocks
+
+@param unsigned int threads
+Workers to start, one when 0
+@param unsigned int every
+One block in this many is sampled, every block when 0
+*/
+CompressEstimator::CompressEstimator(unsigned int threads, unsigned int every)
+  :sample_every(every > 0 ? every : 1), queued(0)
+{
+  for(unsigned int i = 0; i < (threads > 0 ? threads : 1); i++)
+  {
+    workers.push_back(std::thread(&CompressEstimator::Worker, this));
+  }
+}
+
+/*! Destructor */
+CompressEstimator::~CompressEstimator()
+{
+  Finish();
+}
+
+/*! Picked
+If a block of a file is in the sample
+
+@param const std::string & file
+@param uint64_t block
+Number of the block in the file
+@return boolean
+*/
+bool CompressEstimator::Picked(const std::string& file, uint64_t block) const
+{
+  uint64_t key = std::hash<std::string>()(file) ^ (block * 0x9E3779B97F4A7C15ULL);
+
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key % sample_every == 0;
+}
+
+/*! Compress
+Deflate one block and add the sizes to its file
+
+@param const Job & job
+@param std::vector<unsigned char> & out
+Scratch space, kept by the caller between blocks
+*/
+void CompressEstimator::Compress(const Job& job, std::vector<unsigned char>& out)
+{
+  uLongf packed = compressBound(job.data.size());
+
+  out.resize(packed);
+  if(compress2(&out[0], &packed, (const Bytef*)job.data.data(), job.data.size(), LEVEL) != Z_OK)
+  {
+    /* Can not happen with a bound sized buffer, count it as stored */
+    packed = job.data.size();
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  Sample& sample = samples[job.file];
+  sample.raw += job.data.size();
+  sample.packed += std::min<uint64_t>(packed, job.data.size());
+}
+
+/*! Submit
+Queue a picked block for the workers, or deflate it here when they
+are behind
+
+@param const std::string & file
+@param std::vector<char> & data
+Taken over by the job, left empty
+*/
+void CompressEstimator::Submit(const std::string& file, std::vector<char>& data)
+{
+  Job job;
+
+  job.file = file;
+  job.data.swap(data);
+  if(queued.fetch_add(1) >= MAX_QUEUED)
+  {
+    std::vector<unsigned char> out;
+    Compress(job, out);
+    queued--;
+    return;
+  }
+  queue.Push(job);
+}
+
+/*! Offer
+Take the picked blocks out of a buffer just read from a file. A block
+is put together from consecutive reads and handed to the workers once
+full, a read that starts past the end of what was put together so far
+leaves the block to SampleFile(). Blocks already handed over are
+skipped, so a file may be read more than once.
+
+@param const std::string & file
+@param uint64_t offset
+Where the buffer starts in the file
+@param const char * data
+@param size_t len
+*/
+void CompressEstimator::Offer(const std::string& file, uint64_t offset, const char* data,
+                              size_t len)
+{
+  std::vector<std::vector<char> > full;
+  uint64_t end = offset + len;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    Sample& sample = samples[file];
+
+    for(uint64_t block = offset / BLOCK_SIZE; block * BLOCK_SIZE < end; block++)
+    {
+      uint64_t start = block * BLOCK_SIZE;
+      uint64_t from = std::max(offset, start);
+      uint64_t to = std::min<uint64_t>(end, start + BLOCK_SIZE);
+
+      if(!Picked(file, block) || sample.done.count(block) > 0)
+      {
+        continue;
+      }
+      auto found = sample.partial.find(block);
+      size_t have = (found == sample.partial.end()) ? 0 : found->second.size();
+      if(from - start > have)
+      {
+        continue;
+      }
+
+      std::vector<char>& part = sample.partial[block];
+      part.resize(from - start);
+      part.insert(part.end(), data + (from - offset), data + (to - offset));
+      if(part.size() == BLOCK_SIZE)
+      {
+        full.push_back(std::vector<char>());
+        full.back().swap(part);
+        sample.partial.erase(block);
+        sample.done.insert(block);
+      }
+    }
+  }
+
+  /* Deflating in place takes the lock again */
+  for(auto& data : full)
+  {
+    Submit(file, data);
+  }
+}
+
+/*! EndFile
+A file was read to its end, hand over its last block when it is
+picked and shorter than BLOCK_SIZE
+
+@param const std::string & file
+@param uint64_t size
+*/
+void CompressEstimator::EndFile(const std::string& file, uint64_t size)
+{
+  std::vector<char> last;
+  uint64_t block = size / BLOCK_SIZE;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    Sample& sample = samples[file];
+    auto found = sample.partial.find(block);
+
+    if(found == sample.partial.end() || found->second.size() != size % BLOCK_SIZE)
+    {
+      return;
+    }
+    last.swap(found->second);
+    sample.partial.erase(found);
+    sample.done.insert(block);
+  }
+  Submit(file, last);
+}
+
+/*! SampleFile
+Read the picked blocks of a file that no earlier read handed over
+
+@param IoBackend & io
+@param const std::string & file
+@param uint64_t size
+@return boolean
+If the file could be read
+*/
+bool CompressEstimator::SampleFile(IoBackend& io, const std::string& file, uint64_t size)
+{
+  std::vector<uint64_t> missing;
+  int handle = -1;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    Sample& sample = samples[file];
+
+    for(uint64_t block = 0; block * BLOCK_SIZE < size; block++)
+    {
+      if(Picked(file, block) && sample.done.count(block) == 0)
+      {
+        missing.push_back(block);
+      }
+    }
+    sample.partial.clear();
+  }
+
+  for(auto block : missing)
+  {
+    std::vector<char> buffer(BLOCK_SIZE);
+
+    /* Most small files have no block picked and are never opened */
+    if(handle < 0 && (handle = io.Open(file)) < 0)
+    {
+      return false;
+    }
+
+    ssize_t got = io.Read(handle, &buffer[0], BLOCK_SIZE, block * BLOCK_SIZE);
+    if(got < 0)
+    {
+      io.Close(handle);
+      return false;
+    }
+    if(got > 0)
+    {
+      buffer.resize(got);
+      Submit(file, buffer);
+    }
+  }
+
+  if(handle >= 0)
+  {
+    io.Close(handle);
+  }
+  return true;
+}
+
+/*! Finish
+Wait for every queued block to be deflated */
+void CompressEstimator::Finish()
+{
+  queue.Close();
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+  workers.clear();
+}
+
+/*! Totals
+Add the sample sizes of a file, call after Finish()
+
+@param const std::string & file
+@param uint64_t & raw
+@param uint64_t & packed
+*/
+void CompressEstimator::Totals(const std::string& file, uint64_t& raw, uint64_t& packed)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = samples.find(file);
+
+  if(found != samples.end())
+  {
+    raw += found->second.raw;
+    packed += found->second.packed;
+  }
+}
+
+/*! Worker
+Deflate queued blocks until the queue is closed */
+void CompressEstimator::Worker()
+{
+  std::vector<unsigned char> out;
+  Job job;
+
+  while(queue.Pop(job))
+  {
+    Compress(job, out);
+    queued--;
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef COMPRESS_ESTIMATOR_H
+#define COMPRESS_ESTIMATOR_H
+/*!
+  @file compressEstimator.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ioBackend.h"
+#include "workQueue.h"
+
+/*!
+  Estimates how well the data of a scan would compress, from a sample
+  of its blocks. Every file is cut in BLOCK_SIZE blocks and one block
+  in sample_every is picked, from a hash of the path and the block
+  number, so the sample is spread evenly over the bytes and the same
+  in every run. The picked blocks are deflated at level 1 on worker
+  threads and the sizes summed per file, so the ratio can be taken
+  over the unique files only once the duplicates are known.
+
+  Files the scan reads, to hash or to compare them, hand their picked
+  blocks over from its buffers with Offer(). Reads may be of any size
+  and need not start on a block boundary, a picked block is put
+  together as consecutive reads cover it. SampleFile() then reads only
+  the picked blocks no earlier read covered.
+
+  When the workers fall behind the caller deflates the block itself,
+  so no more than MAX_QUEUED blocks wait in memory.
+
+  @brief Sampled compression ratio of scanned data.
+ */
+class CompressEstimator
+{
+public:
+  static const size_t BLOCK_SIZE = 1 << 16;
+  static const size_t MAX_QUEUED = 64;
+  static const int LEVEL = 1;
+
+  CompressEstimator(unsigned int threads, unsigned int every);
+  ~CompressEstimator();
+
+  void Offer(const std::string& file, uint64_t offset, const char* data, size_t len);
+  void EndFile(const std::string& file, uint64_t size);
+  bool SampleFile(IoBackend& io, const std::string& file, uint64_t size);
+  void Finish();
+  void Totals(const std::string& file, uint64_t& raw, uint64_t& packed);
+
+private:
+  /*! A picked block waiting to be deflated */
+  struct Job
+  {
+    std::string file;
+    std::vector<char> data;
+  };
+  /*! Sample sizes of a file and its picked blocks read so far */
+  struct Sample
+  {
+    Sample() :raw(0), packed(0) {}
+    uint64_t raw;
+    uint64_t packed;
+    std::set<uint64_t> done;
+    /*! Picked blocks handed to the workers */
+    std::map<uint64_t,std::vector<char> > partial;
+    /*! Start of picked blocks still being read */
+  };
+
+  bool Picked(const std::string& file, uint64_t block) const;
+  void Submit(const std::string& file, std::vector<char>& data);
+  void Compress(const Job& job, std::vector<unsigned char>& out);
+  void Worker();
+
+  unsigned int sample_every;
+  /*! One block in this many is sampled */
+  WorkQueue<Job> queue;
+  std::atomic<size_t> queued;
+  /*! Blocks pushed and not deflated yet */
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  /*! Protects samples */
+  std::unordered_map<std::string,Sample> samples;
+  /*! Every file sampled or offered, with its sample */
+};
+
+#endif /* COMPRESS_ESTIMATOR_H */
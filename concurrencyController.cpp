@@ -0,0 +1,201 @@
+/*!
+  @file concurrencyController.cpp
+  @author Charles Irick
+*/
+#include <algorithm>
+#include <iomanip>
+#include "concurrencyController.h"
+
+const unsigned int ConcurrencyController::WINDOW_MS;
+
+/*! ConcurrencyController
+Start at the minimum, the device has to show it can take more
+
+@param unsigned int min
+@param unsigned int max
+Bounds of the limit, equal bounds give a fixed limit
+*/
+ConcurrencyController::ConcurrencyController(unsigned int min, unsigned int max)
+  :min_limit(std::max(min, 1u)), max_limit(std::max(max, min_limit)),
+   limit(min_limit), peak_limit(min_limit), in_flight(0),
+   slow_start(true), window_start(Clock::now()), window_units(0),
+   window_ops(0), window_usec(0), last_rate(0), min_latency(0)
+{
+}
+
+/*! Acquire
+Wait for a slot under the current limit */
+void ConcurrencyController::Acquire()
+{
+  std::unique_lock<std::mutex> guard(lock);
+
+  while(in_flight >= limit)
+  {
+    slot_free.wait(guard);
+  }
+  in_flight++;
+}
+
+/*! Release
+Give a slot back and account for the work done while holding it
+
+@param uint64_t units
+Work done, bytes read or entries stat'ed
+@param double usec
+How long the operation took
+*/
+void ConcurrencyController::Release(uint64_t units, double usec)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  Clock::time_point now = Clock::now();
+
+  in_flight--;
+  window_units += units;
+  window_ops++;
+  window_usec += usec;
+
+  if(now - window_start >= std::chrono::milliseconds(WINDOW_MS))
+  {
+    Adjust(now);
+  }
+  slot_free.notify_all();
+}
+
+/*! Adjust
+Move the limit on what the window that just ended delivered
+
+@param Clock::time_point now
+End of the window
+*/
+void ConcurrencyController::Adjust(Clock::time_point now)
+{
+  double secs = std::chrono::duration<double>(now - window_start).count();
+  double rate = (double)window_units / secs;
+  double latency = window_usec / (double)window_ops;
+
+  if(min_latency == 0 || latency < min_latency)
+  {
+    min_latency = latency;
+  }
+
+  if(slow_start)
+  {
+    if(rate > last_rate * 1.10)
+    {
+      limit = std::min(limit * 2, max_limit);
+    }
+    else
+    {
+      /* The last doubling bought nothing, go back to where we were
+      and probe one slot at a time from there */
+      slow_start = false;
+      limit = std::max(limit / 2, min_limit);
+    }
+  }
+  else if(rate < last_rate * 0.90)
+  {
+    limit = std::max(std::min(limit * 3 / 4, limit - 1), min_limit);
+  }
+  else if(latency > 2 * min_latency && rate < last_rate * 1.05)
+  {
+    limit = std::max(limit - 1, min_limit);
+  }
+  else
+  {
+    limit = std::min(limit + 1, max_limit);
+  }
+  peak_limit = std::max(peak_limit, limit);
+
+  last_rate = rate;
+  window_start = now;
+  window_units = 0;
+  window_ops = 0;
+  window_usec = 0;
+}
+
+/*! Backoff
+Halve the limit for a reason throughput does not show, such as
+memory pressure. Probing resumes one slot at a time. */
+void ConcurrencyController::Backoff()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  slow_start = false;
+  limit = std::max(limit / 2, min_limit);
+}
+
+unsigned int ConcurrencyController::Limit() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return limit;
+}
+
+unsigned int ConcurrencyController::PeakLimit() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return peak_limit;
+}
+
+/*! Configure
+Set the bounds every device controller is created with
+
+@param unsigned int min
+@param unsigned int max
+*/
+void DeviceConcurrency::Configure(unsigned int min, unsigned int max)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  min_limit = std::max(min, 1u);
+  max_limit = std::max(max, min_limit);
+}
+
+/*! For
+Controller of a device, created on first use
+
+@param uint64_t dev
+@return ConcurrencyController &
+*/
+ConcurrencyController& DeviceConcurrency::For(uint64_t dev)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::unique_ptr<ConcurrencyController>& controller = devices[dev];
+
+  if(!controller)
+  {
+    controller.reset(new ConcurrencyController(min_limit, max_limit));
+  }
+  return *controller;
+}
+
+/*! Backoff
+Halve the limit of every device */
+void DeviceConcurrency::Backoff()
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  for(auto& x : devices)
+  {
+    x.second->Backoff();
+  }
+}
+
+/*! PrintStats
+Report the limit every device settled at
+
+@param std::ostream & out
+@param const char * label
+Start of every line, names the stage the limits were used for
+*/
+void DeviceConcurrency::PrintStats(std::ostream& out, const char* label) const
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  if(min_limit == max_limit)
+  {
+    return;
+  }
+  for(auto& x : devices)
+  {
+    out << label << "device " << std::hex << x.first << std::dec << " at "
+        << x.second->Limit() << " (peak " << x.second->PeakLimit() << ")\n";
+  }
+}
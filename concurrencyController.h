@@ -0,0 +1,100 @@
+#ifndef CONCURRENCY_CONTROLLER_H
+#define CONCURRENCY_CONTROLLER_H
+/*!
+  @file concurrencyController.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <condition_variable>
+
+/*!
+  Limits how many operations are in flight against one device and
+  adapts the limit to what the device turns out to deliver. Workers
+  take a slot with Acquire() and hand it back with Release(), saying
+  how much work was done and how long it took.
+
+  Every window the throughput is compared with the previous window.
+  The limit starts at the minimum and doubles while throughput keeps
+  improving (slow start), then moves additively: one more slot while
+  more concurrency still pays, a quarter less when throughput drops,
+  and one less when latency grows without any throughput to show for
+  it, which is requests queueing inside the device. A disk that seeks
+  settles at one or two, NVMe and network filesystems climb until
+  the round trips are covered.
+
+  @brief AIMD controller of per-device I/O concurrency.
+ */
+class ConcurrencyController
+{
+public:
+  /*! Constructor */
+  ConcurrencyController(unsigned int min, unsigned int max);
+
+  void Acquire();
+  void Release(uint64_t units, double usec);
+  void Backoff();
+  unsigned int Limit() const;
+  unsigned int PeakLimit() const;
+
+  static const unsigned int WINDOW_MS = 250;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  void Adjust(Clock::time_point now);
+
+  mutable std::mutex lock;
+  std::condition_variable slot_free;
+  unsigned int min_limit;
+  unsigned int max_limit;
+  unsigned int limit;
+  /*! Operations allowed in flight right now */
+  unsigned int peak_limit;
+  unsigned int in_flight;
+  bool slow_start;
+  /*! Informs if the limit still doubles every window */
+  Clock::time_point window_start;
+  uint64_t window_units;
+  uint64_t window_ops;
+  double window_usec;
+  /*! Summed latency of the operations completed this window */
+  double last_rate;
+  /*! Units per second of the previous window, 0 before the first */
+  double min_latency;
+  /*! Lowest average latency of any window, the unloaded device */
+};
+
+/*!
+  One ConcurrencyController per device, created on first use. A scan
+  spanning several filesystems gets a limit for each of them.
+
+  @brief Concurrency controllers keyed by device.
+ */
+class DeviceConcurrency
+{
+public:
+  /*! Constructor, one slot per device until Configure() */
+  DeviceConcurrency()
+    :min_limit(1), max_limit(1) {}
+
+  void Configure(unsigned int min, unsigned int max);
+  unsigned int MaxLimit() const { return max_limit; }
+  ConcurrencyController& For(uint64_t dev);
+  void Backoff();
+  void PrintStats(std::ostream& out, const char* label) const;
+
+private:
+  mutable std::mutex lock;
+  unsigned int min_limit;
+  unsigned int max_limit;
+  std::map<uint64_t,std::unique_ptr<ConcurrencyController> > devices;
+};
+
+#endif /* CONCURRENCY_CONTROLLER_H */
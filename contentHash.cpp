@@ -0,0 +1,425 @@
+/*!
+  @file contentHash.cpp
+  @author Charles Irick
+*/
+#include <cstring>
+#include <string>
+#include "contentHash.h"
+#include "cpuFeatures.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+/*! SHA256_K
+Round constants from FIPS 180-4 */
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t Rotr(uint32_t x, unsigned int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+/*! SizeOf
+Number of digest bytes produced by an algorithm
+
+@param unsigned char algorithm
+@return unsigned int
+Digest size in bytes, 0 for unknown algorithms
+*/
+unsigned int Digest::SizeOf(unsigned char algorithm)
+{
+  switch(algorithm)
+  {
+    case HASH_SHA256: return 32;
+    case HASH_MD5:    return 16;
+    case HASH_SHA1:   return 20;
+    case HASH_XXH3:   return 8;
+    case HASH_BLAKE3: return 32;
+    case HASH_CRC32C: return 4;
+    case HASH_VERITY_SHA256: return 32;
+    case HASH_VERITY_SHA512: return 32;
+  }
+  return 0;
+}
+
+/*! IsStrong
+Whether equal digests can be taken as equal content. Weak digests
+can only tell files apart, equal ones still have to be compared.
+MD5 and SHA-1 are weak here, colliding files can be made for both.
+
+@param unsigned char algorithm
+@return boolean
+*/
+bool Digest::IsStrong(unsigned char algorithm)
+{
+  return algorithm != HASH_XXH3 && algorithm != HASH_CRC32C &&
+         algorithm != HASH_MD5 && algorithm != HASH_SHA1 &&
+         SizeOf(algorithm) != 0;
+}
+
+/*! IsVerity
+Whether a digest is an fs-verity file digest. Those also depend on
+the verity parameters of the file, so they are only comparable with
+the digests of files that have the same parameters and are never
+kept beyond the run.
+
+@param unsigned char algorithm
+@return boolean
+*/
+bool Digest::IsVerity(unsigned char algorithm)
+{
+  return algorithm == HASH_VERITY_SHA256 || algorithm == HASH_VERITY_SHA512;
+}
+
+/*! Option names of the algorithms, in HashAlgorithm order */
+static const char* const ALGORITHM_NAMES[] = {
+  "", "sha256", "md5", "sha1", "xxh3", "blake3", "crc32c",
+  "verity-sha256", "verity-sha512"
+};
+
+/*! NameOf
+Name of an algorithm as given to --hash
+
+@param unsigned char algorithm
+@return const char *
+Empty for unknown algorithms
+*/
+const char* Digest::NameOf(unsigned char algorithm)
+{
+  return SizeOf(algorithm) != 0 ? ALGORITHM_NAMES[algorithm] : "";
+}
+
+/*! ParseAlgorithm
+Algorithm from its name, only the ones we can compute are accepted
+
+@param const std::string & name
+@param unsigned char & algorithm
+@return boolean
+If the name was known
+*/
+bool Digest::ParseAlgorithm(const std::string& name, unsigned char& algorithm)
+{
+  for(unsigned char i = HASH_SHA256; i <= HASH_CRC32C; i++)
+  {
+    if(i != HASH_MD5 && i != HASH_SHA1 && name == ALGORITHM_NAMES[i])
+    {
+      algorithm = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+/*! ToHex
+Lower case hex representation, as printed by sha256sum */
+std::string Digest::ToHex() const
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string hex(Size() * 2, '0');
+
+  for(unsigned int i = 0; i < Size(); i++)
+  {
+    hex[2 * i] = digits[bytes[i] >> 4];
+    hex[2 * i + 1] = digits[bytes[i] & 0xf];
+  }
+  return hex;
+}
+
+/*! Value of every hex digit, 0x10 for anything else */
+static const struct HexDigits
+{
+  unsigned char value[256];
+  HexDigits()
+  {
+    memset(value, 0x10, sizeof(value));
+    for(int c = 0; c < 10; c++) value['0' + c] = c;
+    for(int c = 0; c < 6; c++)  value['a' + c] = value['A' + c] = 10 + c;
+  }
+} hex_digits;
+
+/*! FromHex
+Parse a hex digest. The algorithm is taken from the length of the
+string, which is how checksum manifests tell them apart. Upper and
+lower case digits are accepted.
+
+@param const std::string & hex
+@param Digest & digest
+@return boolean
+If the string was a valid digest
+*/
+bool Digest::FromHex(const std::string& hex, Digest& digest)
+{
+  return FromHex(hex.data(), hex.size(), digest);
+}
+
+/*! FromHex
+Same as above for a digest that is part of a larger buffer, such as
+a line of a cache, without copying it out first */
+bool Digest::FromHex(const char* hex, size_t len, Digest& digest)
+{
+  switch(len)
+  {
+    case 64: return FromHex(hex, len, HASH_SHA256, digest);
+    case 32: return FromHex(hex, len, HASH_MD5, digest);
+    case 40: return FromHex(hex, len, HASH_SHA1, digest);
+  }
+  return false;
+}
+
+/*! FromHex
+Same as above when the algorithm is known from elsewhere, as in our
+own caches. BLAKE3 and SHA-256 digests have the same length.
+
+@param const char * hex
+@param size_t len
+@param unsigned char algorithm
+@param Digest & digest
+@return boolean
+If the string was a valid digest of that algorithm
+*/
+bool Digest::FromHex(const char* hex, size_t len, unsigned char algorithm, Digest& digest)
+{
+  if(SizeOf(algorithm) == 0 || len != 2 * SizeOf(algorithm))
+  {
+    return false;
+  }
+  digest.algorithm = algorithm;
+  memset(digest.bytes, 0, MAX_SIZE);
+
+  /* Table driven, caches and manifests parse millions of these. A
+  bad digit has bit 4 set and poisons the check */
+  unsigned char bad = 0;
+  for(size_t i = 0; i < len; i += 2)
+  {
+    unsigned char hi = hex_digits.value[(unsigned char)hex[i]];
+    unsigned char lo = hex_digits.value[(unsigned char)hex[i + 1]];
+    bad |= hi | lo;
+    digest.bytes[i / 2] = (unsigned char)((hi << 4) | (lo & 0x0f));
+  }
+  return (bad & 0x10) == 0;
+}
+
+/*! Reset
+Start a new hash */
+void Sha256::Reset()
+{
+  state[0] = 0x6a09e667;
+  state[1] = 0xbb67ae85;
+  state[2] = 0x3c6ef372;
+  state[3] = 0xa54ff53a;
+  state[4] = 0x510e527f;
+  state[5] = 0x9b05688c;
+  state[6] = 0x1f83d9ab;
+  state[7] = 0x5be0cd19;
+  total_len = 0;
+  buffer_len = 0;
+}
+
+/*! TransformPortable
+Run the compression function over 64 byte blocks
+
+@param uint32_t * state
+@param const unsigned char * block
+@param size_t count
+*/
+static void TransformPortable(uint32_t* state, const unsigned char* block, size_t count)
+{
+  for(; count > 0; count--, block += 64)
+  {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+
+    for(int i = 0; i < 16; i++)
+    {
+      w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+             ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+    }
+    for(int i = 16; i < 64; i++)
+    {
+      uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for(int i = 0; i < 64; i++)
+    {
+      uint32_t s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+      uint32_t s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+/*! TransformShaNi
+Same as TransformPortable with the SHA-NI instructions, which keep
+the state as ABEF and CDGH halves and do two rounds at a time
+
+@param uint32_t * state
+@param const unsigned char * blocks
+@param size_t count
+*/
+__attribute__((target("sha,sse4.1")))
+static void TransformShaNi(uint32_t* state, const unsigned char* blocks, size_t count)
+{
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+  for(; count > 0; count--, blocks += 64)
+  {
+    __m128i abef = state0, cdgh = state1;
+    __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks)), swap);
+    __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 16)), swap);
+    __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 32)), swap);
+    __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 48)), swap);
+
+    /* Four rounds per step. w0..w3 hold the last four groups of
+    message words, the loaded ones rotate through until the schedule
+    needs them and every later group is computed from them */
+    for(int i = 0; i < 16; i++)
+    {
+      __m128i w = w0;
+      if(i >= 4)
+      {
+        w = _mm_sha256msg1_epu32(w0, w1);
+        w = _mm_add_epi32(w, _mm_alignr_epi8(w3, w2, 4));
+        w = _mm_sha256msg2_epu32(w, w3);
+      }
+      w0 = w1; w1 = w2; w2 = w3; w3 = w;
+
+      __m128i msg = _mm_add_epi32(w, _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);
+  state1 = _mm_shuffle_epi32(state1, 0xb1);
+  _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+  _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+/*! Transform
+Run the compression function over whole blocks with the fastest
+kernel the CPU supports
+
+@param const unsigned char * blocks
+@param size_t count
+*/
+void Sha256::Transform(const unsigned char* blocks, size_t count)
+{
+  typedef void (*Kernel)(uint32_t*, const unsigned char*, size_t);
+#ifdef HAVE_X86_KERNELS
+  static const Kernel kernel = CpuFeatures::Get().sha ? TransformShaNi : TransformPortable;
+#else
+  static const Kernel kernel = TransformPortable;
+#endif
+  kernel(state, blocks, count);
+}
+
+/*! Update
+Feed more data into the hash
+
+@param const void * data
+@param size_t len
+*/
+void Sha256::Update(const void* data, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  total_len += len;
+
+  /* Finish off any partial block first */
+  if(buffer_len > 0)
+  {
+    size_t take = 64 - buffer_len;
+    if(take > len)
+    {
+      take = len;
+    }
+    memcpy(buffer + buffer_len, p, take);
+    buffer_len += take;
+    p += take;
+    len -= take;
+
+    if(buffer_len < 64)
+    {
+      return;
+    }
+    Transform(buffer, 1);
+    buffer_len = 0;
+  }
+
+  /* Hash full blocks straight out of the caller's buffer */
+  if(len >= 64)
+  {
+    Transform(p, len / 64);
+    p += len & ~(size_t)63;
+    len &= 63;
+  }
+
+  memcpy(buffer, p, len);
+  buffer_len = len;
+}
+
+/*! Final
+Pad the message and produce the digest. The object must be Reset()
+before it is used again.
+
+@param Digest & digest
+*/
+void Sha256::Final(Digest& digest)
+{
+  uint64_t bit_len = total_len * 8;
+  unsigned char pad[72];
+  size_t pad_len = (buffer_len < 56) ? (56 - buffer_len) : (120 - buffer_len);
+
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for(int i = 0; i < 8; i++)
+  {
+    pad[pad_len + i] = (unsigned char)(bit_len >> (56 - 8 * i));
+  }
+  Update(pad, pad_len + 8);
+
+  digest.algorithm = HASH_SHA256;
+  for(int i = 0; i < 8; i++)
+  {
+    digest.bytes[4 * i] = (unsigned char)(state[i] >> 24);
+    digest.bytes[4 * i + 1] = (unsigned char)(state[i] >> 16);
+    digest.bytes[4 * i + 2] = (unsigned char)(state[i] >> 8);
+    digest.bytes[4 * i + 3] = (unsigned char)(state[i]);
+  }
+}
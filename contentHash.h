@@ -0,0 +1,121 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+/*!
+  @file contentHash.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*! Hash algorithms a digest can come from. MD5 and SHA-1 are only
+recorded by checksum manifests we import, the others can be computed
+by the compare stages (see hashPolicy.h). */
+enum HashAlgorithm
+{
+  HASH_SHA256 = 1,
+  HASH_MD5    = 2,
+  HASH_SHA1   = 3,
+  HASH_XXH3   = 4, /*!< 64-bit XXH3, fast but not collision resistant */
+  HASH_BLAKE3 = 5,
+  HASH_CRC32C = 6, /*!< Castagnoli CRC, a filter only */
+  HASH_VERITY_SHA256 = 7, /*!< fs-verity file digest, see verityDigest.h */
+  HASH_VERITY_SHA512 = 8  /*!< Same, truncated to MAX_SIZE */
+};
+
+/*!
+  Content digest tagged with the algorithm that produced it. Digests
+  shorter than MAX_SIZE are zero padded, so digests are compared as raw
+  bytes and can be sorted, searched and stored on disk without any
+  conversion.
+
+  @brief Raw bytes of a full-content hash.
+ */
+struct Digest
+{
+  static const unsigned int MAX_SIZE = 32;
+  unsigned char algorithm;
+  unsigned char bytes[MAX_SIZE];
+
+  /*! Constructor */
+  Digest()
+    :algorithm(HASH_SHA256) { memset(bytes, 0, MAX_SIZE); }
+
+  bool operator==(const Digest& other) const
+  {
+    return algorithm == other.algorithm &&
+           memcmp(bytes, other.bytes, MAX_SIZE) == 0;
+  }
+  bool operator!=(const Digest& other) const
+  {
+    return !(*this == other);
+  }
+  bool operator<(const Digest& other) const
+  {
+    if(algorithm != other.algorithm)
+    {
+      return algorithm < other.algorithm;
+    }
+    return memcmp(bytes, other.bytes, MAX_SIZE) < 0;
+  }
+
+  unsigned int Size() const { return SizeOf(algorithm); }
+  std::string ToHex() const;
+
+  static unsigned int SizeOf(unsigned char algorithm);
+  static bool IsStrong(unsigned char algorithm);
+  static bool IsVerity(unsigned char algorithm);
+  static const char* NameOf(unsigned char algorithm);
+  static bool ParseAlgorithm(const std::string& name, unsigned char& algorithm);
+  static bool FromHex(const std::string& hex, Digest& digest);
+  static bool FromHex(const char* hex, size_t len, Digest& digest);
+  static bool FromHex(const char* hex, size_t len, unsigned char algorithm, Digest& digest);
+};
+
+/*!
+  Digests are already uniformly distributed, so the leading bytes
+  make a perfectly good bucket hash for unordered containers.
+ */
+struct DigestHash
+{
+  size_t operator()(const Digest& digest) const
+  {
+    size_t h;
+    memcpy(&h, digest.bytes, sizeof(h));
+    return h;
+  }
+};
+
+/*!
+  Streaming SHA-256 implementation. Data can be fed in blocks of any
+  size with Update() and the digest is produced by Final(). Blocks go
+  through the SHA-NI instructions when the CPU has them.
+
+  @brief SHA-256 used for full-content hashes.
+ */
+class Sha256
+{
+public:
+  /*! Constructor */
+  Sha256() { Reset(); }
+  void Reset();
+  void Update(const void* data, size_t len);
+  void Final(Digest& digest);
+
+private:
+  void Transform(const unsigned char* blocks, size_t count);
+
+  uint32_t state[8];
+  /*! Intermediate hash state */
+  uint64_t total_len;
+  /*! Number of bytes hashed so far */
+  unsigned char buffer[64];
+  /*! Partial block waiting for more data */
+  size_t buffer_len;
+  /*! Number of valid bytes in buffer */
+};
+
+#endif /* CONTENT_HASH_H */
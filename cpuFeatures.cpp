@@ -0,0 +1,77 @@
+/*!
+  @file cpuFeatures.cpp
+  @author Charles Irick
+*/
+#include <cstdint>
+#include "cpuFeatures.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+/*! Xgetbv
+Register state the OS saves, XCR0 */
+static uint64_t Xgetbv()
+{
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
+/*! CpuFeatures
+Ask cpuid, and XCR0 for the extensions that need the OS to save
+wider registers */
+CpuFeatures::CpuFeatures()
+  :sse41(false), sse42(false), avx2(false), avx512(false), sha(false)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+
+  if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    return;
+  }
+  sse41 = (ecx >> 19) & 1;
+  sse42 = (ecx >> 20) & 1;
+  bool osxsave = (ecx >> 27) & 1;
+  bool avx = (ecx >> 28) & 1;
+  uint64_t xcr0 = osxsave ? Xgetbv() : 0;
+
+  if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+  {
+    return;
+  }
+  sha = sse41 && ((ebx >> 29) & 1);
+  /* XMM and YMM state, then opmask and both halves of ZMM */
+  avx2 = avx && (xcr0 & 0x6) == 0x6 && ((ebx >> 5) & 1);
+  avx512 = avx2 && (xcr0 & 0xe0) == 0xe0 && ((ebx >> 16) & 1);
+#endif
+}
+
+/*! Get
+Features of the CPU we run on, detected on first use
+
+@return const CpuFeatures &
+*/
+const CpuFeatures& CpuFeatures::Get()
+{
+  static const CpuFeatures features;
+  return features;
+}
+
+/*! ToString
+Names of the extensions found, for statistics
+
+@return std::string
+"none" when there are none
+*/
+std::string CpuFeatures::ToString() const
+{
+  std::string names;
+
+  if(sse42)  names += " sse4.2";
+  if(avx2)   names += " avx2";
+  if(avx512) names += " avx512";
+  if(sha)    names += " sha-ni";
+  return names.empty() ? "none" : names.substr(1);
+}
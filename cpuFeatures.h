@@ -0,0 +1,38 @@
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+/*!
+  @file cpuFeatures.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <string>
+
+/*!
+  Instruction set extensions the hash kernels can use. An extension
+  only counts when the CPU has it and the kernel saves its registers
+  on a context switch, a CPU can have AVX-512 that the OS leaves off.
+  Detected once, every kernel is picked from the same answer.
+
+  @brief Runtime detection of SIMD and crypto extensions.
+ */
+struct CpuFeatures
+{
+  bool sse41;
+  bool sse42;
+  /*! Has the CRC32 instruction, used for CRC32C */
+  bool avx2;
+  bool avx512;
+  /*! AVX-512 Foundation, enough for 64-bit lane arithmetic */
+  bool sha;
+  /*! SHA-NI, the SHA-256 rounds and message schedule instructions */
+
+  static const CpuFeatures& Get();
+  std::string ToString() const;
+
+private:
+  /*! Constructor */
+  CpuFeatures();
+};
+
+#endif /* CPU_FEATURES_H */
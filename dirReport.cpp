@@ -0,0 +1,309 @@
+/*!
+  @file dirReport.cpp
+  @author Charles Irick
+*/
+#include <algorithm>
+#include <iomanip>
+#include <thread>
+#include "dirReport.h"
+
+const size_t DirReport::MAX_GROUP_DIRS;
+const uint64_t DirReport::PairMap::EMPTY;
+
+/*! Mix
+Spread keys of dense directory numbers over all bits */
+static uint64_t Mix(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+/*! ShardOf
+Shard of a pair key, from other bits than the slot in a table */
+static size_t ShardOf(uint64_t key, size_t shards)
+{
+  return (size_t)(Mix(key) & 0xffff) % shards;
+}
+
+/*! operator[]
+Sums of a pair, zero when first seen */
+DirReport::Shared& DirReport::PairMap::operator[](uint64_t key)
+{
+  if(2 * (used + 1) > slots.size())
+  {
+    Grow();
+  }
+
+  size_t mask = slots.size() - 1;
+  size_t i = (size_t)(Mix(key) >> 16) & mask;
+  while(slots[i].key != key)
+  {
+    if(slots[i].key == EMPTY)
+    {
+      slots[i].key = key;
+      used++;
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return slots[i].shared;
+}
+
+/*! Grow
+Double the table, at most half of it is ever used */
+void DirReport::PairMap::Grow()
+{
+  std::vector<Slot> old;
+  Slot empty;
+
+  empty.key = EMPTY;
+  old.swap(slots);
+  slots.assign(old.empty() ? 1024 : old.size() * 2, empty);
+  used = 0;
+  for(auto& slot : old)
+  {
+    if(slot.key != EMPTY)
+    {
+      (*this)[slot.key] = slot.shared;
+    }
+  }
+}
+
+/*! DirOf
+Number of the directory a path is in, numbering it on first sight
+
+@param const std::string & path
+@return uint32_t
+*/
+uint32_t DirReport::DirOf(const std::string& path)
+{
+  size_t slash = path.find_last_of('/');
+  std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+  auto found = dir_ids.find(dir);
+
+  if(found != dir_ids.end())
+  {
+    return found->second;
+  }
+  uint32_t id = dir_names.size();
+  dir_ids[dir] = id;
+  dir_names.push_back(dir);
+  dir_bytes.push_back(0);
+  return id;
+}
+
+/*! AddFile
+Count a scanned file towards the size of its directory
+
+@param const std::string & path
+@param uint64_t size
+*/
+void DirReport::AddFile(const std::string& path, uint64_t size)
+{
+  dir_bytes[DirOf(path)] += size;
+}
+
+/*! AddGroup
+Keep a confirmed group as the directories it is in, with the number
+of copies in each. Groups within one directory share nothing with
+another and are dropped, as are empty files.
+
+@param const std::vector<std::string> & group
+@param uint64_t size
+File size of the group
+*/
+void DirReport::AddGroup(const std::vector<std::string>& group, uint64_t size)
+{
+  std::vector<uint32_t> dirs;
+
+  if(size == 0)
+  {
+    return;
+  }
+  for(auto& file : group)
+  {
+    dirs.push_back(DirOf(file));
+  }
+  std::sort(dirs.begin(), dirs.end());
+
+  size_t start = member_dir.size();
+  for(size_t i = 0; i < dirs.size(); i++)
+  {
+    if(i > 0 && dirs[i] == dirs[i - 1])
+    {
+      member_count.back()++;
+      continue;
+    }
+    member_dir.push_back(dirs[i]);
+    member_count.push_back(1);
+  }
+
+  size_t distinct = member_dir.size() - start;
+  if(distinct < 2 || distinct > MAX_GROUP_DIRS)
+  {
+    skipped_groups += (distinct > MAX_GROUP_DIRS);
+    member_dir.resize(start);
+    member_count.resize(start);
+    return;
+  }
+  if(group_start.empty())
+  {
+    group_start.push_back(0);
+  }
+  group_start.push_back(member_dir.size());
+  group_size.push_back(size);
+}
+
+/*! Accumulate
+Sum the bytes every pair of directories shares over a slice of the
+groups
+
+@param size_t first
+@param size_t last
+Groups to sum, one past the end
+@param std::vector<PairMap> & shards
+Sums of this slice, split by ShardOf()
+*/
+void DirReport::Accumulate(size_t first, size_t last, std::vector<PairMap>& shards) const
+{
+  for(size_t g = first; g < last; g++)
+  {
+    for(size_t i = group_start[g]; i < group_start[g + 1]; i++)
+    {
+      for(size_t j = i + 1; j < group_start[g + 1]; j++)
+      {
+        /* Members are sorted, so member_dir[i] is the lower number */
+        uint64_t key = ((uint64_t)member_dir[i] << 32) | member_dir[j];
+        Shared& shared = shards[ShardOf(key, shards.size())][key];
+
+        shared.low += group_size[g] * member_count[i];
+        shared.high += group_size[g] * member_count[j];
+      }
+    }
+  }
+}
+
+/*! Compute
+Sum the shared bytes of every pair of directories
+
+@param unsigned int threads
+Workers to use, one when 0
+*/
+void DirReport::Compute(unsigned int threads)
+{
+  size_t groups = group_size.size();
+  size_t workers = std::max<size_t>(1, std::min<size_t>(threads, groups));
+  std::vector<std::vector<PairMap> > partial(workers, std::vector<PairMap>(workers));
+  std::vector<PairMap> merged(workers);
+  std::vector<std::thread> pool;
+
+  /* Each worker sums a slice of the groups into its own shards */
+  for(size_t w = 0; w < workers; w++)
+  {
+    pool.push_back(std::thread([this, w, workers, groups, &partial]()
+    {
+      Accumulate(groups * w / workers, groups * (w + 1) / workers, partial[w]);
+    }));
+  }
+  for(auto& worker : pool)
+  {
+    worker.join();
+  }
+  pool.clear();
+
+  /* Then merges one shard of every slice */
+  for(size_t s = 0; s < workers; s++)
+  {
+    pool.push_back(std::thread([s, workers, &partial, &merged]()
+    {
+      std::swap(merged[s], partial[0][s]);
+      for(size_t w = 1; w < workers; w++)
+      {
+        for(auto& slot : partial[w][s].slots)
+        {
+          if(slot.key != PairMap::EMPTY)
+          {
+            Shared& shared = merged[s][slot.key];
+            shared.low += slot.shared.low;
+            shared.high += slot.shared.high;
+          }
+        }
+        partial[w][s] = PairMap();
+      }
+    }));
+  }
+  for(auto& worker : pool)
+  {
+    worker.join();
+  }
+
+  pairs.clear();
+  for(auto& shard : merged)
+  {
+    for(auto& slot : shard.slots)
+    {
+      if(slot.key != PairMap::EMPTY)
+      {
+        pairs.push_back(slot);
+      }
+    }
+    shard = PairMap();
+  }
+}
+
+/*! Print
+List the pairs of directories sharing the most bytes, ranked on the
+larger of the two sides, i.e. the bytes deleting one of them would
+free at most
+
+@param std::ostream & out
+@param size_t top
+Pairs to list
+*/
+void DirReport::Print(std::ostream& out, size_t top) const
+{
+  std::vector<size_t> order(pairs.size());
+  double to_mb = 1.0 / (double)(1 << 20);
+
+  for(size_t i = 0; i < order.size(); i++)
+  {
+    order[i] = i;
+  }
+  top = std::min(top, order.size());
+  std::partial_sort(order.begin(), order.begin() + top, order.end(),
+    [this](size_t a, size_t b)
+    {
+      uint64_t bytes_a = std::max(pairs[a].shared.low, pairs[a].shared.high);
+      uint64_t bytes_b = std::max(pairs[b].shared.low, pairs[b].shared.high);
+      if(bytes_a != bytes_b)
+      {
+        return bytes_a > bytes_b;
+      }
+      return pairs[a].key < pairs[b].key;
+    });
+
+  out << "Directory Pairs: \n";
+  for(size_t i = 0; i < top; i++)
+  {
+    const PairMap::Slot& pair = pairs[order[i]];
+    uint32_t low = pair.key >> 32;
+    uint32_t high = pair.key & 0xffffffff;
+
+    out << std::fixed << std::showpoint << std::setprecision(2)
+        << "  " << dir_names[low] << " and " << dir_names[high] << " share "
+        << std::max(pair.shared.low, pair.shared.high) * to_mb << "MB: "
+        << std::noshowpoint << std::setprecision(0)
+        << 100.0 * pair.shared.low / std::max<uint64_t>(1, dir_bytes[low]) << "% of "
+        << dir_names[low] << ", "
+        << 100.0 * pair.shared.high / std::max<uint64_t>(1, dir_bytes[high]) << "% of "
+        << dir_names[high] << "\n";
+  }
+  if(skipped_groups > 0)
+  {
+    out << "  (" << skipped_groups << " groups spread over more than "
+        << MAX_GROUP_DIRS << " directories left out)\n";
+  }
+  out << std::endl;
+}
@@ -0,0 +1,97 @@
+#ifndef DIR_REPORT_H
+#define DIR_REPORT_H
+/*!
+  @file dirReport.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/*!
+  Finds the directory pairs that share the most duplicate bytes,
+  from the confirmed groups. Directories are numbered once, groups are
+  kept as arrays of directory numbers, and the bytes each pair shares
+  are summed in hash maps keyed on the two numbers, so memory grows
+  with the pairs that actually share content, never with a string per
+  pair.
+
+  The maps are open addressing tables of fixed size slots, so a pair
+  costs 24 bytes and no allocation of its own. The sums run on worker
+  threads over slices of the groups. Each
+  worker splits its pairs into shards by key, and each shard is then
+  merged by one worker, so no two threads touch the same map.
+
+  A group spread over more than MAX_GROUP_DIRS directories (an empty
+  file, a license in every package) says little about any one pair
+  and would add pairs quadratically, it is left out and counted.
+
+  @brief Directory co-occurrence of duplicates.
+ */
+class DirReport
+{
+public:
+  static const size_t MAX_GROUP_DIRS = 64;
+
+  /*! Constructor */
+  DirReport()
+    :skipped_groups(0) {}
+
+  void AddFile(const std::string& path, uint64_t size);
+  void AddGroup(const std::vector<std::string>& group, uint64_t size);
+  void Compute(unsigned int threads);
+  void Print(std::ostream& out, size_t top) const;
+
+private:
+  /*! Bytes of each directory of a pair that have a copy in the other */
+  struct Shared
+  {
+    Shared() :low(0), high(0) {}
+    uint64_t low;
+    /*!< Of the directory with the lower number */
+    uint64_t high;
+  };
+  /*! Sums per pair key, open addressing with linear probing */
+  struct PairMap
+  {
+    static const uint64_t EMPTY = ~0ULL;
+    /*!< Never a key, the lower number comes first */
+    struct Slot
+    {
+      uint64_t key;
+      Shared shared;
+    };
+
+    PairMap() :used(0) {}
+    Shared& operator[](uint64_t key);
+    void Grow();
+
+    std::vector<Slot> slots;
+    size_t used;
+  };
+
+  uint32_t DirOf(const std::string& path);
+  void Accumulate(size_t first, size_t last, std::vector<PairMap>& shards) const;
+
+  std::unordered_map<std::string,uint32_t> dir_ids;
+  std::vector<std::string> dir_names;
+  std::vector<uint64_t> dir_bytes;
+  /*! Bytes of all scanned files in each directory */
+  std::vector<size_t> group_start;
+  /*! Where the members of each group start, one past the end last */
+  std::vector<uint32_t> member_dir;
+  std::vector<uint32_t> member_count;
+  /*! Directories of each group with how many copies each holds */
+  std::vector<uint64_t> group_size;
+  /*! File size of each group */
+  std::vector<PairMap::Slot> pairs;
+  /*! Every pair sharing content, after Compute() */
+  uint64_t skipped_groups;
+  /*! Groups spread over too many directories */
+};
+
+#endif /* DIR_REPORT_H */
@@ -0,0 +1,510 @@
+/*!
+  @file dupRemover.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "boost/filesystem.hpp"
+#include "dupRemover.h"
+#include "workQueue.h"
+
+/*! Serializes error output from the workers */
+static std::mutex report_lock;
+
+/*! SetPolicy
+Parse a keep policy: "oldest", "shortest", "root:DIR" or
+"regex:PATTERN". Groups without a file matching a root or regex
+policy keep their oldest file.
+
+@param const std::string & spec
+@return boolean
+If the policy was understood
+*/
+bool DupRemover::SetPolicy(const std::string& spec)
+{
+  if(spec == "oldest")
+  {
+    policy = KEEP_OLDEST;
+  }
+  else if(spec == "shortest")
+  {
+    policy = KEEP_SHORTEST;
+  }
+  else if(spec.compare(0, 5, "root:") == 0 && spec.size() > 5)
+  {
+    policy = KEEP_ROOT;
+    keep_root = HashCache::Key(spec.substr(5));
+    if(keep_root.size() > 1 && keep_root[keep_root.size() - 1] == '/')
+    {
+      keep_root.erase(keep_root.size() - 1);
+    }
+  }
+  else if(spec.compare(0, 6, "regex:") == 0)
+  {
+    try
+    {
+      keep_regex = std::regex(spec.substr(6));
+    }
+    catch(const std::regex_error& e)
+    {
+      std::cerr << "Bad keep regex: " << e.what() << std::endl;
+      return false;
+    }
+    policy = KEEP_REGEX;
+  }
+  else
+  {
+    std::cerr << "Unknown keep policy: " << spec << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! SetRoot
+Directory the scan started at, empty directories above it are
+never removed */
+void DupRemover::SetRoot(const std::string& root)
+{
+  scan_root = HashCache::Key(root);
+}
+
+/*! Preferred
+Check a file against the root or regex policy */
+bool DupRemover::Preferred(const std::string& file) const
+{
+  if(policy == KEEP_ROOT)
+  {
+    std::string path = HashCache::Key(file);
+    return path.size() > keep_root.size() &&
+           path.compare(0, keep_root.size(), keep_root) == 0 &&
+           (path[keep_root.size()] == '/' || keep_root == "/");
+  }
+  if(policy == KEEP_REGEX)
+  {
+    return std::regex_search(file, keep_regex);
+  }
+  return false;
+}
+
+/*! PickKeeper
+Choose the file of a group that survives
+
+@return size_t
+Index of the file to keep
+*/
+size_t DupRemover::PickKeeper(const std::vector<std::string>& files,
+                              const std::vector<FileIdentity>& idents) const
+{
+  size_t keep = 0;
+
+  if(policy == KEEP_ROOT || policy == KEEP_REGEX)
+  {
+    for(size_t i = 0; i < files.size(); i++)
+    {
+      if(Preferred(files[i]))
+      {
+        return i;
+      }
+    }
+  }
+
+  for(size_t i = 1; i < files.size(); i++)
+  {
+    if(policy == KEEP_SHORTEST)
+    {
+      if(files[i].size() < files[keep].size() ||
+         (files[i].size() == files[keep].size() && files[i] < files[keep]))
+      {
+        keep = i;
+      }
+    }
+    else if(idents[i].mtime_sec < idents[keep].mtime_sec ||
+            (idents[i].mtime_sec == idents[keep].mtime_sec &&
+             idents[i].mtime_nsec < idents[keep].mtime_nsec))
+    {
+      keep = i;
+    }
+  }
+  return keep;
+}
+
+/*! LinkIdentity
+Stat a file without following a final symlink
+
+@param int dir_fd
+Directory a relative name is looked up in, AT_FDCWD for paths
+@param const char * name
+@param FileIdentity & ident
+@param bool & link
+Set when the name is a symlink
+@return boolean
+If the name is a regular file
+*/
+static bool LinkIdentity(int dir_fd, const char* name, FileIdentity& ident, bool& link)
+{
+  struct stat st;
+
+  link = false;
+  if(fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+  {
+    return false;
+  }
+  link = S_ISLNK(st.st_mode);
+  if(!S_ISREG(st.st_mode))
+  {
+    return false;
+  }
+
+  ident.size = st.st_size;
+#if defined(__APPLE__)
+  ident.mtime_sec = st.st_mtimespec.tv_sec;
+  ident.mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+  ident.mtime_sec = st.st_mtim.tv_sec;
+  ident.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+  ident.dev = st.st_dev;
+  ident.ino = st.st_ino;
+  return true;
+}
+
+/*! AddGroup
+Plan the deletion of every file of a group but the keeper. The scan
+follows symlinks, so a link and its target can land in one group:
+links are neither kept nor deleted, and no file sharing its inode
+with the keeper or a link of the group is planned. Before a real run
+every file is stat'ed again without following links, the group is
+left alone if the keeper changed or disappeared since the scan, and
+other files that changed are left out of the plan.
+
+@param const std::vector<std::string> & files
+@param const std::vector<FileIdentity> & idents
+Identity of each file as seen by the scan
+*/
+void DupRemover::AddGroup(const std::vector<std::string>& files,
+                          const std::vector<FileIdentity>& idents)
+{
+  std::set<std::pair<uint64_t,uint64_t> > survivors;
+  std::vector<std::string> real_files;
+  std::vector<FileIdentity> real_idents;
+
+  for(size_t i = 0; i < files.size(); i++)
+  {
+    FileIdentity current;
+    bool link;
+    bool found = LinkIdentity(AT_FDCWD, files[i].c_str(), current, link);
+
+    if(link)
+    {
+      /* Whatever a link points at stays */
+      survivors.insert(std::make_pair(idents[i].dev, idents[i].ino));
+    }
+    else if(found ? current == idents[i] : dry_run)
+    {
+      /* A dry run may be planning a scan of an image or a trace */
+      real_files.push_back(files[i]);
+      real_idents.push_back(idents[i]);
+    }
+    else
+    {
+      skipped_files++;
+    }
+  }
+
+  if(real_files.empty())
+  {
+    return;
+  }
+
+  size_t keep = PickKeeper(real_files, real_idents);
+  std::set<std::pair<uint64_t,uint64_t> > counted;
+
+  survivors.insert(std::make_pair(real_idents[keep].dev, real_idents[keep].ino));
+  for(size_t i = 0; i < real_files.size(); i++)
+  {
+    /* Hard links of a surviving file free nothing and are kept */
+    if(i == keep || survivors.count(std::make_pair(real_idents[i].dev, real_idents[i].ino)))
+    {
+      continue;
+    }
+
+    boost::filesystem::path path(real_files[i]);
+    std::string dir = path.parent_path().string();
+    Batch& batch = batches[dir.empty() ? "." : dir];
+    uint64_t bytes = 0;
+
+    /* Hard links of each other only free space once */
+    if(counted.insert(std::make_pair(real_idents[i].dev, real_idents[i].ino)).second)
+    {
+      bytes = real_idents[i].size;
+    }
+    batch.names.push_back(path.filename().string());
+    batch.paths.push_back(real_files[i]);
+    batch.idents.push_back(real_idents[i]);
+    batch.bytes.push_back(bytes);
+    planned_files++;
+    planned_bytes += bytes;
+  }
+}
+
+/*! Unchanged
+If a victim is still the regular file the scan saw, checked right
+before it is unlinked
+
+@param int dir_fd
+@param const std::string & name
+@param const FileIdentity & ident
+@return boolean
+*/
+static bool Unchanged(int dir_fd, const std::string& name, const FileIdentity& ident)
+{
+  FileIdentity current;
+  bool link;
+
+  return LinkIdentity(dir_fd, name.c_str(), current, link) && current == ident;
+}
+
+/*! RemoveBatch
+Unlink every file of one directory relative to a single directory
+descriptor. Up to RING_DEPTH unlinks are in flight at once when
+io_uring is usable, otherwise they are plain unlinkat calls. Files
+that changed since the scan are left alone.
+
+@param const std::string & dir
+@param const Batch & batch
+@param IoUring & ring
+Ring of the calling worker
+@param bool & use_ring
+Cleared when the kernel turns out not to support the ring
+@param uint64_t & removed
+@param uint64_t & freed
+*/
+void DupRemover::RemoveBatch(const std::string& dir, const Batch& batch,
+                             IoUring& ring, bool& use_ring,
+                             uint64_t& removed, uint64_t& freed)
+{
+  int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  std::vector<int> results(batch.names.size(), 0);
+  size_t next = 0;
+
+  if(dir_fd < 0)
+  {
+    std::lock_guard<std::mutex> lock(report_lock);
+    std::cerr << "Could not open directory " << dir << ": " << strerror(errno) << std::endl;
+    return;
+  }
+
+  while(next < batch.names.size())
+  {
+    std::vector<size_t> queued;
+
+    for(; use_ring && next < batch.names.size(); next++)
+    {
+      if(!Unchanged(dir_fd, batch.names[next], batch.idents[next]))
+      {
+        results[next] = CHANGED;
+      }
+      else if(ring.PrepUnlinkAt(dir_fd, batch.names[next].c_str(), next))
+      {
+        queued.push_back(next);
+      }
+      else
+      {
+        break;
+      }
+    }
+
+    if(!queued.empty() && ring.Submit(queued.size()) >= 0)
+    {
+      size_t reaped = 0;
+      while(reaped < queued.size())
+      {
+        uint64_t index;
+        int res;
+        if(!ring.Reap(index, res))
+        {
+          ring.Submit(1);
+          continue;
+        }
+        /* Kernels before 5.11 reject the opcode, redo it by hand */
+        if(res == -EINVAL)
+        {
+          use_ring = false;
+          res = (unlinkat(dir_fd, batch.names[index].c_str(), 0) == 0) ? 0 : -errno;
+        }
+        results[index] = res;
+        reaped++;
+      }
+      continue;
+    }
+
+    /* No ring, or it could not be submitted to */
+    use_ring = false;
+    for(size_t index : queued)
+    {
+      results[index] = (unlinkat(dir_fd, batch.names[index].c_str(), 0) == 0) ? 0 : -errno;
+    }
+    for(; next < batch.names.size(); next++)
+    {
+      if(!Unchanged(dir_fd, batch.names[next], batch.idents[next]))
+      {
+        results[next] = CHANGED;
+        continue;
+      }
+      results[next] = (unlinkat(dir_fd, batch.names[next].c_str(), 0) == 0) ? 0 : -errno;
+    }
+  }
+  close(dir_fd);
+
+  for(size_t i = 0; i < results.size(); i++)
+  {
+    if(results[i] == 0)
+    {
+      removed++;
+      freed += batch.bytes[i];
+    }
+    else
+    {
+      std::lock_guard<std::mutex> lock(report_lock);
+      if(results[i] == CHANGED)
+      {
+        std::cerr << "Not deleting " << batch.paths[i] << ", it changed since the scan"
+                  << std::endl;
+      }
+      else
+      {
+        std::cerr << "Could not delete " << batch.paths[i] << ": "
+                  << strerror(-results[i]) << std::endl;
+      }
+    }
+  }
+}
+
+/*! PruneDirs
+Remove directories that deletions left empty, deepest first, then
+their parents as long as those are inside the scan root and empty */
+void DupRemover::PruneDirs()
+{
+  std::set<std::pair<size_t,std::string> > candidates;
+  unsigned long pruned = 0;
+
+  for(auto& x : batches)
+  {
+    std::string dir = HashCache::Key(x.first);
+    candidates.insert(std::make_pair(std::count(dir.begin(), dir.end(), '/'), dir));
+  }
+
+  while(!candidates.empty())
+  {
+    /* Deepest directory first so children go before parents */
+    auto deepest = --candidates.end();
+    std::string dir = deepest->second;
+    candidates.erase(deepest);
+
+    if(dir == scan_root || rmdir(dir.c_str()) != 0)
+    {
+      continue;
+    }
+    pruned++;
+
+    std::string parent = boost::filesystem::path(dir).parent_path().string();
+    if(!scan_root.empty() && parent.size() > scan_root.size() &&
+       parent.compare(0, scan_root.size(), scan_root) == 0 &&
+       parent[scan_root.size()] == '/')
+    {
+      candidates.insert(std::make_pair(std::count(parent.begin(), parent.end(), '/'),
+                                       parent));
+    }
+  }
+
+  std::cout << "Removed " << pruned << " empty directories" << std::endl;
+}
+
+/*! Run
+Carry out the plan, or only report it for a dry run
+
+@return boolean
+If every planned file was deleted
+*/
+bool DupRemover::Run()
+{
+  double planned_mb = (double)planned_bytes / (double)(1 << 20);
+
+  std::cout << std::fixed << std::showpoint << std::setprecision(2);
+
+  if(skipped_files > 0)
+  {
+    std::cout << "Left " << skipped_files
+              << " files alone, they changed since the scan\n";
+  }
+
+  if(dry_run)
+  {
+    std::cout << "Delete Plan: \n";
+    for(auto& x : batches)
+    {
+      for(auto& path : x.second.paths)
+      {
+        std::cout << "  delete " << path << std::endl;
+      }
+    }
+    std::cout << "Would free " << planned_mb << "MB in " << planned_files
+              << " files" << std::endl;
+    return true;
+  }
+
+  WorkQueue<const std::pair<const std::string,Batch>*> queue;
+  std::vector<std::thread> workers;
+  std::mutex totals_lock;
+  uint64_t removed = 0, freed = 0;
+
+  for(auto& x : batches)
+  {
+    queue.Push(&x);
+  }
+  queue.Close();
+
+  for(unsigned int t = 0; t < threads; t++)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      const std::pair<const std::string,Batch>* batch;
+      uint64_t my_removed = 0, my_freed = 0;
+      IoUring ring;
+      bool use_ring = ring.Init(RING_DEPTH);
+
+      while(queue.Pop(batch))
+      {
+        RemoveBatch(batch->first, batch->second, ring, use_ring, my_removed, my_freed);
+      }
+
+      std::lock_guard<std::mutex> lock(totals_lock);
+      removed += my_removed;
+      freed += my_freed;
+    }));
+  }
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+
+  std::cout << "Deleted " << removed << " of " << planned_files << " files, freed "
+            << (double)freed / (double)(1 << 20) << "MB" << std::endl;
+
+  if(prune_dirs)
+  {
+    PruneDirs();
+  }
+  return removed == planned_files;
+}
@@ -0,0 +1,100 @@
+#ifndef DUP_REMOVER_H
+#define DUP_REMOVER_H
+/*!
+  @file dupRemover.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <regex>
+#include "hashCache.h"
+#include "ioUring.h"
+
+/*! Which file of a duplicate group survives */
+enum KeepPolicy
+{
+  KEEP_OLDEST,   /*!< Oldest modification time */
+  KEEP_SHORTEST, /*!< Shortest path */
+  KEEP_ROOT,     /*!< First file under a preferred root */
+  KEEP_REGEX     /*!< First file whose path matches a regex */
+};
+
+/*!
+  Deletes confirmed duplicates, keeping one file of every group. The
+  victims are batched per parent directory and each batch is removed
+  by a worker thread with unlinkat() relative to one directory
+  descriptor, submitted through io_uring where the kernel has it.
+  Directories left empty can be removed afterwards.
+
+  Symlinks are never deleted and never kept, and no file is deleted
+  whose inode survives under another name. Every victim is stat'ed
+  again right before its unlink and left alone unless it is still the
+  file the scan saw.
+
+  A dry run only reports what would be deleted and how many bytes
+  that frees.
+
+  @brief Parallel batched removal of duplicate files.
+ */
+class DupRemover
+{
+public:
+  /*! Constructor */
+  DupRemover()
+    :policy(KEEP_OLDEST), dry_run(false), prune_dirs(false), threads(1),
+     planned_files(0), planned_bytes(0), skipped_files(0) {}
+
+  bool SetPolicy(const std::string& spec);
+  void SetDryRun(bool enable) { dry_run = enable; }
+  void SetPruneDirs(bool enable) { prune_dirs = enable; }
+  void SetThreads(unsigned int count) { threads = count > 0 ? count : 1; }
+  void SetRoot(const std::string& root);
+
+  void AddGroup(const std::vector<std::string>& files,
+                const std::vector<FileIdentity>& idents);
+  bool Run();
+
+private:
+  struct Batch
+  {
+    std::vector<std::string> names;
+    std::vector<std::string> paths;
+    std::vector<FileIdentity> idents;
+    std::vector<uint64_t> bytes;
+  };
+
+  size_t PickKeeper(const std::vector<std::string>& files,
+                    const std::vector<FileIdentity>& idents) const;
+  bool Preferred(const std::string& file) const;
+  void RemoveBatch(const std::string& dir, const Batch& batch, IoUring& ring,
+                   bool& use_ring, uint64_t& removed, uint64_t& freed);
+  void PruneDirs();
+
+  static const unsigned int RING_DEPTH = 256;
+  static const int CHANGED = 1;
+  /*! Result of a victim left alone, errors are negative errno */
+
+  KeepPolicy policy;
+  std::string keep_root;
+  /*! Preferred root for KEEP_ROOT, normalized */
+  std::regex keep_regex;
+  /*! Pattern for KEEP_REGEX */
+  bool dry_run;
+  bool prune_dirs;
+  unsigned int threads;
+  std::string scan_root;
+  /*! Empty directories are never pruned above this */
+  std::map<std::string,Batch> batches;
+  /*! Files to delete keyed by parent directory */
+  uint64_t planned_files;
+  uint64_t planned_bytes;
+  /*! Bytes the plan frees */
+  uint64_t skipped_files;
+  /*! Files left alone because they changed since the scan */
+};
+
+#endif /* DUP_REMOVER_H */
@@ -0,0 +1,772 @@
+/*!
+  @file ext4Image.cpp
+  @author Charles Irick
+*/
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ext4Image.h"
+
+/* Superblock features that change where metadata is or what it means */
+static const uint32_t INCOMPAT_COMPRESSION = 0x1;
+static const uint32_t INCOMPAT_RECOVER     = 0x4;
+static const uint32_t INCOMPAT_JOURNAL_DEV = 0x8;
+static const uint32_t INCOMPAT_META_BG     = 0x10;
+static const uint32_t INCOMPAT_64BIT       = 0x80;
+static const uint32_t RO_COMPAT_GDT_CSUM      = 0x10;
+static const uint32_t RO_COMPAT_METADATA_CSUM = 0x400;
+
+/* Inode flags */
+static const uint32_t INODE_ENCRYPT     = 0x800;
+static const uint32_t INODE_EXTENTS     = 0x80000;
+static const uint32_t INODE_INLINE_DATA = 0x10000000;
+
+/* Group descriptor flags */
+static const uint16_t GROUP_INODE_UNINIT = 0x1;
+
+static const uint16_t EXTENT_MAGIC = 0xf30a;
+static const int MAX_EXTENT_DEPTH = 5;
+
+const uint32_t Ext4Image::ROOT_INO;
+
+static uint16_t Le16(const unsigned char* p) { return p[0] | (p[1] << 8); }
+static uint32_t Le32(const unsigned char* p) { return Le16(p) | ((uint32_t)Le16(p + 2) << 16); }
+
+Ext4Image::~Ext4Image()
+{
+  if(fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+/*! Load
+Open an ext4 filesystem and read all of its metadata: the superblock
+and group descriptors, every inode table in order, then the blocks of
+every directory sorted by their position
+
+@param const std::string & image_path
+Image file or block device, not mounted
+@return boolean
+If the filesystem could be read
+*/
+bool Ext4Image::Load(const std::string& image_path)
+{
+  unsigned char super[1024];
+  struct stat sb;
+
+  fd = open(image_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0 || fstat(fd, &sb) != 0)
+  {
+    std::cerr << "Could not open " << image_path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  /* Keep the top bit set so it never equals a real st_dev */
+  dev = (S_ISBLK(sb.st_mode) ? (uint64_t)sb.st_rdev : (uint64_t)sb.st_ino) | (1ULL << 63);
+
+  if(!ReadImage(super, sizeof(super), 1024) || Le16(super + 56) != 0xef53)
+  {
+    std::cerr << image_path << " is not an ext2/3/4 filesystem\n";
+    return false;
+  }
+
+  uint32_t inodes_count = Le32(super + 0);
+  uint32_t first_data_block = Le32(super + 20);
+  uint32_t log_block_size = Le32(super + 24);
+  bool dynamic = Le32(super + 76) > 0;
+  uint32_t desc_size = 32;
+
+  inodes_per_group = Le32(super + 40);
+  incompat = Le32(super + 96);
+  ro_compat = Le32(super + 100);
+  inode_size = dynamic ? Le16(super + 88) : 128;
+  first_ino = dynamic ? Le32(super + 84) : 11;
+  if((incompat & INCOMPAT_64BIT) && Le16(super + 254) > 32)
+  {
+    desc_size = Le16(super + 254);
+  }
+  if(log_block_size > 6 || inodes_per_group == 0 || inode_size < 128 ||
+     (inode_size & (inode_size - 1)) != 0)
+  {
+    std::cerr << image_path << " has a damaged superblock\n";
+    return false;
+  }
+  block_size = 1024u << log_block_size;
+
+  if(incompat & (INCOMPAT_COMPRESSION | INCOMPAT_JOURNAL_DEV | INCOMPAT_META_BG))
+  {
+    std::cerr << image_path << " uses filesystem features that are not"
+                 " supported (incompat 0x" << std::hex << incompat << std::dec << ")\n";
+    return false;
+  }
+  if(incompat & INCOMPAT_RECOVER)
+  {
+    std::cerr << "Warning: the journal of " << image_path << " was not replayed,"
+                 " recent changes may be missing\n";
+  }
+
+  uint32_t groups = (inodes_count + inodes_per_group - 1) / inodes_per_group;
+  std::vector<unsigned char> descriptors((size_t)groups * desc_size);
+
+  if(!ReadImage(&descriptors[0], descriptors.size(),
+                (uint64_t)(first_data_block + 1) * block_size) ||
+     !ReadInodeTables(descriptors, groups, desc_size) ||
+     !ReadDirectories())
+  {
+    std::cerr << "Could not read the metadata of " << image_path << std::endl;
+    return false;
+  }
+
+  auto root = inodes.find(ROOT_INO);
+  if(root == inodes.end() || TypeOf(root->second) != ENTRY_DIR)
+  {
+    std::cerr << image_path << " has no root directory\n";
+    return false;
+  }
+  return true;
+}
+
+/*! ReadImage
+Read a range of the image in full
+
+@return boolean
+If every byte was read
+*/
+bool Ext4Image::ReadImage(void* buffer, size_t len, uint64_t offset) const
+{
+  char* out = (char*)buffer;
+
+  while(len > 0)
+  {
+    ssize_t got = pread(fd, out, len, offset);
+    if(got < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if(got <= 0)
+    {
+      return false;
+    }
+    out += got;
+    len -= got;
+    offset += got;
+  }
+  return true;
+}
+
+/*! ReadInodeTables
+Read the used part of every inode table, in the order the tables lie
+on disk, and keep the inodes in use
+
+@param const std::vector<unsigned char> & descriptors
+Group descriptor table
+@param uint32_t groups
+@param uint32_t desc_size
+@return boolean
+*/
+bool Ext4Image::ReadInodeTables(const std::vector<unsigned char>& descriptors,
+                                uint32_t groups, uint32_t desc_size)
+{
+  std::vector<std::pair<uint64_t,uint32_t> > tables;
+  std::vector<unsigned char> chunk;
+  bool unused_known = (ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM)) != 0;
+
+  for(uint32_t g = 0; g < groups; g++)
+  {
+    const unsigned char* desc = &descriptors[(size_t)g * desc_size];
+    uint64_t table = Le32(desc + 8);
+
+    if(desc_size >= 64)
+    {
+      table |= (uint64_t)Le32(desc + 40) << 32;
+    }
+    tables.push_back(std::make_pair(table, g));
+  }
+  std::sort(tables.begin(), tables.end());
+
+  for(auto& table : tables)
+  {
+    const unsigned char* desc = &descriptors[(size_t)table.second * desc_size];
+    uint32_t used = inodes_per_group;
+
+    /* Inodes past the high water mark were never written */
+    if(unused_known)
+    {
+      uint32_t unused = Le16(desc + 28);
+      if(desc_size >= 64)
+      {
+        unused |= (uint32_t)Le16(desc + 50) << 16;
+      }
+      if((Le16(desc + 18) & GROUP_INODE_UNINIT) || unused >= inodes_per_group)
+      {
+        continue;
+      }
+      used -= unused;
+    }
+
+    uint32_t per_chunk = ITABLE_CHUNK / inode_size;
+    for(uint32_t i = 0; i < used; i += per_chunk)
+    {
+      uint32_t count = std::min(per_chunk, used - i);
+
+      chunk.resize((size_t)count * inode_size);
+      if(!ReadImage(&chunk[0], chunk.size(),
+                    table.first * block_size + (uint64_t)i * inode_size))
+      {
+        return false;
+      }
+      table_bytes += chunk.size();
+      for(uint32_t k = 0; k < count; k++)
+      {
+        ParseInode(table.second * inodes_per_group + i + k + 1, &chunk[(size_t)k * inode_size]);
+      }
+    }
+  }
+  return true;
+}
+
+/*! ParseInode
+Keep an inode that is in use, leaving out the reserved ones
+
+@param uint32_t ino
+@param const unsigned char * raw
+On disk inode of inode_size bytes
+*/
+void Ext4Image::ParseInode(uint32_t ino, const unsigned char* raw)
+{
+  Inode inode;
+
+  if(ino < first_ino && ino != ROOT_INO)
+  {
+    return;
+  }
+  inode.mode = Le16(raw);
+  if(inode.mode == 0 || Le16(raw + 26) == 0)
+  {
+    return;
+  }
+  inode.flags = Le32(raw + 32);
+  inode.size = Le32(raw + 4) | ((uint64_t)Le32(raw + 108) << 32);
+  inode.mtime_sec = (int32_t)Le32(raw + 16);
+  inode.mtime_nsec = 0;
+
+  /* Large inodes carry the nanoseconds and the epoch bits */
+  if(inode_size > 128 && 128 + (uint32_t)Le16(raw + 128) >= 140)
+  {
+    uint32_t extra = Le32(raw + 136);
+    inode.mtime_sec += (int64_t)(extra & 3) << 32;
+    inode.mtime_nsec = extra >> 2;
+  }
+  memcpy(inode.block, raw + 40, sizeof(inode.block));
+  inodes[ino] = inode;
+}
+
+/*! ReadDirectories
+Read the blocks of every directory, sorted by position so the pass
+over the disk only goes forward, and index the entries by name
+
+@return boolean
+*/
+bool Ext4Image::ReadDirectories()
+{
+  struct Run
+  {
+    uint64_t physical;
+    uint32_t len;
+    uint32_t dir;
+    bool operator<(const Run& other) const { return physical < other.physical; }
+  };
+  std::vector<Run> runs;
+  std::vector<Extent> extents;
+  std::vector<unsigned char> data;
+
+  for(auto& x : inodes)
+  {
+    if(TypeOf(x.second) != ENTRY_DIR)
+    {
+      continue;
+    }
+    /* Inline directories start with the parent inode number */
+    if(x.second.flags & INODE_INLINE_DATA)
+    {
+      ParseDirBlock(x.first, x.second.block + 4, sizeof(x.second.block) - 4);
+      continue;
+    }
+    extents.clear();
+    if(!MapBlocks(x.second, extents))
+    {
+      std::cerr << "Could not map directory inode " << x.first << std::endl;
+      continue;
+    }
+    for(auto& extent : extents)
+    {
+      if(!extent.uninit)
+      {
+        Run run = { extent.physical, extent.len, x.first };
+        runs.push_back(run);
+      }
+    }
+  }
+  std::sort(runs.begin(), runs.end());
+
+  uint32_t per_chunk = ITABLE_CHUNK / block_size;
+  for(auto& run : runs)
+  {
+    for(uint32_t b = 0; b < run.len; b += per_chunk)
+    {
+      uint32_t count = std::min(per_chunk, run.len - b);
+
+      data.resize((size_t)count * block_size);
+      if(!ReadImage(&data[0], data.size(), (run.physical + b) * block_size))
+      {
+        return false;
+      }
+      dir_bytes += data.size();
+      for(uint32_t k = 0; k < count; k++)
+      {
+        ParseDirBlock(run.dir, &data[(size_t)k * block_size], block_size);
+      }
+    }
+  }
+
+  for(auto& x : dirs)
+  {
+    std::sort(x.second.begin(), x.second.end(),
+              [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+  }
+  return true;
+}
+
+/*! ParseDirBlock
+Add the entries of one directory block. Hash tree nodes look like
+blocks of deleted entries and add nothing, the checksum tail has no
+inode either.
+
+@param uint32_t dir
+Inode of the directory
+@param const unsigned char * block
+@param size_t len
+*/
+void Ext4Image::ParseDirBlock(uint32_t dir, const unsigned char* block, size_t len)
+{
+  std::vector<DirEntry>& entries = dirs[dir];
+  size_t pos = 0;
+
+  while(pos + 8 <= len)
+  {
+    uint32_t ino = Le32(block + pos);
+    size_t rec_len = Le16(block + pos + 4);
+    size_t name_len = block[pos + 6];
+
+    if(rec_len == 0 || rec_len == 65535)
+    {
+      /* 64KB blocks store a full block as 0 or 65535 */
+      rec_len = len - pos;
+    }
+    if(rec_len < 8 || pos + rec_len > len)
+    {
+      break;
+    }
+    if(ino != 0 && name_len > 0 && 8 + name_len <= rec_len)
+    {
+      DirEntry entry;
+      auto found = inodes.find(ino);
+
+      entry.name.assign((const char*)block + pos + 8, name_len);
+      if(found != inodes.end() && entry.name != "." && entry.name != "..")
+      {
+        entry.ino = ino;
+        entry.type = TypeOf(found->second);
+        entries.push_back(entry);
+      }
+    }
+    pos += rec_len;
+  }
+}
+
+/*! MapBlocks
+Work out where the blocks of a file are, from its extent tree or its
+block map
+
+@param const Inode & inode
+@param std::vector<Extent> & extents
+Filled with the runs of blocks sorted by logical block, holes are
+left out
+@return boolean
+If every mapping block could be read
+*/
+bool Ext4Image::MapBlocks(const Inode& inode, std::vector<Extent>& extents) const
+{
+  if(inode.flags & INODE_EXTENTS)
+  {
+    if(!MapExtentNode(inode.block, sizeof(inode.block), -1, extents))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    uint64_t logical = 12;
+
+    for(unsigned int i = 0; i < 12; i++)
+    {
+      if(Le32(inode.block + 4 * i) != 0)
+      {
+        AddBlock(i, Le32(inode.block + 4 * i), extents);
+      }
+    }
+    for(int level = 1; level <= 3; level++)
+    {
+      if(!MapIndirect(Le32(inode.block + 4 * (11 + level)), level, logical, extents))
+      {
+        return false;
+      }
+    }
+  }
+  std::sort(extents.begin(), extents.end());
+  return true;
+}
+
+/*! MapExtentNode
+Add the extents under one node of an extent tree
+
+@param const unsigned char * node
+@param size_t len
+@param int depth
+Depth the node should have, -1 for the root in the inode
+@param std::vector<Extent> & extents
+@return boolean
+*/
+bool Ext4Image::MapExtentNode(const unsigned char* node, size_t len, int depth,
+                              std::vector<Extent>& extents) const
+{
+  uint16_t entries = Le16(node + 2);
+  int node_depth = Le16(node + 6);
+
+  if(Le16(node) != EXTENT_MAGIC || 12 + (size_t)entries * 12 > len ||
+     node_depth > MAX_EXTENT_DEPTH || (depth >= 0 && node_depth != depth))
+  {
+    return false;
+  }
+
+  for(uint16_t i = 0; i < entries; i++)
+  {
+    const unsigned char* entry = node + 12 + (size_t)i * 12;
+
+    if(node_depth == 0)
+    {
+      Extent extent;
+      uint32_t ee_len = Le16(entry + 4);
+
+      extent.logical = Le32(entry);
+      extent.physical = Le32(entry + 8) | ((uint64_t)Le16(entry + 6) << 32);
+      extent.uninit = ee_len > 32768;
+      extent.len = extent.uninit ? ee_len - 32768 : ee_len;
+      extents.push_back(extent);
+    }
+    else
+    {
+      uint64_t leaf = Le32(entry + 4) | ((uint64_t)Le16(entry + 8) << 32);
+      std::vector<unsigned char> child(block_size);
+
+      if(!ReadImage(&child[0], block_size, leaf * block_size) ||
+         !MapExtentNode(&child[0], block_size, node_depth - 1, extents))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*! MapIndirect
+Add the blocks under one indirect block of a block map
+
+@param uint64_t block
+Indirect block, 0 for a hole
+@param int level
+1 for a block of data block numbers, 2 and 3 for blocks of those
+@param uint64_t & logical
+Logical block the indirect block starts at, advanced past it
+@param std::vector<Extent> & extents
+@return boolean
+*/
+bool Ext4Image::MapIndirect(uint64_t block, int level, uint64_t& logical,
+                            std::vector<Extent>& extents) const
+{
+  uint32_t per_block = block_size / 4;
+
+  if(block == 0)
+  {
+    uint64_t span = 1;
+    for(int l = 0; l < level; l++)
+    {
+      span *= per_block;
+    }
+    logical += span;
+    return true;
+  }
+
+  std::vector<unsigned char> pointers(block_size);
+  if(!ReadImage(&pointers[0], block_size, block * block_size))
+  {
+    return false;
+  }
+  for(uint32_t i = 0; i < per_block; i++)
+  {
+    uint32_t target = Le32(&pointers[(size_t)i * 4]);
+
+    if(level > 1)
+    {
+      if(!MapIndirect(target, level - 1, logical, extents))
+      {
+        return false;
+      }
+      continue;
+    }
+    if(target != 0)
+    {
+      AddBlock(logical, target, extents);
+    }
+    logical++;
+  }
+  return true;
+}
+
+/*! AddBlock
+Add one mapped block, growing the last extent when it continues it */
+void Ext4Image::AddBlock(uint64_t logical, uint64_t physical,
+                         std::vector<Extent>& extents) const
+{
+  if(!extents.empty())
+  {
+    Extent& last = extents.back();
+    if(last.logical + last.len == logical && last.physical + last.len == physical &&
+       last.len < 32768)
+    {
+      last.len++;
+      return;
+    }
+  }
+  Extent extent = { logical, physical, 1, false };
+  extents.push_back(extent);
+}
+
+/*! Lookup
+Find the inode of an absolute path inside the filesystem
+
+@param const std::string & path
+@param uint32_t & ino
+@return boolean
+If every component was found
+*/
+bool Ext4Image::Lookup(const std::string& path, uint32_t& ino) const
+{
+  size_t pos = 0;
+
+  ino = ROOT_INO;
+  while(pos < path.size())
+  {
+    size_t end = path.find('/', pos);
+    if(end == std::string::npos)
+    {
+      end = path.size();
+    }
+
+    std::string name = path.substr(pos, end - pos);
+    pos = end + 1;
+    if(name.empty() || name == ".")
+    {
+      continue;
+    }
+
+    auto dir = dirs.find(ino);
+    if(dir == dirs.end())
+    {
+      return false;
+    }
+    const std::vector<DirEntry>& entries = dir->second;
+    auto found = std::lower_bound(entries.begin(), entries.end(), name,
+      [](const DirEntry& entry, const std::string& value) { return entry.name < value; });
+    if(found == entries.end() || found->name != name)
+    {
+      return false;
+    }
+    ino = found->ino;
+  }
+  return true;
+}
+
+/*! TypeOf
+Kind of an inode, symlinks are not followed */
+EntryType Ext4Image::TypeOf(const Inode& inode) const
+{
+  switch(inode.mode & 0xf000)
+  {
+    case 0x8000: return ENTRY_FILE;
+    case 0x4000: return ENTRY_DIR;
+  }
+  return ENTRY_OTHER;
+}
+
+int Ext4Image::Open(const std::string& path)
+{
+  std::vector<Extent> extents;
+  uint32_t ino;
+
+  if(!Lookup(path, ino))
+  {
+    return -1;
+  }
+  const Inode& inode = inodes.at(ino);
+  if(TypeOf(inode) != ENTRY_FILE || (inode.flags & INODE_ENCRYPT))
+  {
+    return -1;
+  }
+  /* The rest of larger inline files is in an extended attribute */
+  if((inode.flags & INODE_INLINE_DATA) ? inode.size > sizeof(inode.block)
+                                       : !MapBlocks(inode, extents))
+  {
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(open_lock);
+  open_files[next_handle].swap(extents);
+  open_inodes[next_handle] = ino;
+  return next_handle++;
+}
+
+/*! Read
+Read file content from the blocks its extents point at. Holes and
+unwritten extents read as zeros. */
+ssize_t Ext4Image::Read(int handle, void* buffer, size_t len, uint64_t offset)
+{
+  const std::vector<Extent>* extents;
+  const Inode* inode;
+  {
+    std::lock_guard<std::mutex> lock(open_lock);
+    auto found = open_files.find(handle);
+    if(found == open_files.end())
+    {
+      return -1;
+    }
+    extents = &found->second;
+    inode = &inodes.at(open_inodes[handle]);
+  }
+
+  if(offset >= inode->size)
+  {
+    return 0;
+  }
+  if(len > inode->size - offset)
+  {
+    len = inode->size - offset;
+  }
+  if(inode->flags & INODE_INLINE_DATA)
+  {
+    memcpy(buffer, inode->block + offset, len);
+    return len;
+  }
+
+  char* out = (char*)buffer;
+  size_t done = 0;
+  Extent probe = { 0, 0, 0, false };
+
+  while(done < len)
+  {
+    uint64_t pos = offset + done;
+    uint64_t block = pos / block_size;
+    uint64_t in_block = pos % block_size;
+    size_t count;
+
+    probe.logical = block;
+    auto next = std::upper_bound(extents->begin(), extents->end(), probe);
+    if(next != extents->begin() && block < (next - 1)->logical + (next - 1)->len)
+    {
+      const Extent& extent = *(next - 1);
+      uint64_t end = (extent.logical + extent.len) * block_size;
+
+      count = std::min<uint64_t>(len - done, end - pos);
+      if(extent.uninit)
+      {
+        memset(out + done, 0, count);
+      }
+      else if(!ReadImage(out + done, count,
+                         (extent.physical + block - extent.logical) * block_size + in_block))
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      /* A hole up to the next extent */
+      uint64_t end = (next == extents->end()) ? offset + len : next->logical * block_size;
+      count = std::min<uint64_t>(len - done, end - pos);
+      memset(out + done, 0, count);
+    }
+    done += count;
+  }
+  return len;
+}
+
+void Ext4Image::Close(int handle)
+{
+  std::lock_guard<std::mutex> lock(open_lock);
+  open_files.erase(handle);
+  open_inodes.erase(handle);
+}
+
+bool Ext4Image::Stat(const std::string& path, FileStat& st)
+{
+  uint32_t ino;
+
+  if(!Lookup(path, ino))
+  {
+    return false;
+  }
+  const Inode& inode = inodes.at(ino);
+  st.type = TypeOf(inode);
+  st.ident.size = inode.size;
+  st.ident.mtime_sec = inode.mtime_sec;
+  st.ident.mtime_nsec = inode.mtime_nsec;
+  st.ident.dev = dev;
+  st.ident.ino = ino;
+  return true;
+}
+
+bool Ext4Image::ListDir(const std::string& path, std::vector<DirEntry>& entries)
+{
+  uint32_t ino;
+
+  if(!Lookup(path, ino) || TypeOf(inodes.at(ino)) != ENTRY_DIR)
+  {
+    return false;
+  }
+  auto dir = dirs.find(ino);
+  if(dir == dirs.end())
+  {
+    entries.clear();
+  }
+  else
+  {
+    entries = dir->second;
+  }
+  return true;
+}
+
+/*! PrintStats
+Report how much metadata was loaded */
+void Ext4Image::PrintStats(std::ostream& out) const
+{
+  double to_mb = 1.0 / (double)(1 << 20);
+
+  out << std::fixed << std::showpoint << std::setprecision(2)
+      << "Image inodes in use:     " << inodes.size() << "\n"
+      << "Image metadata read:     " << table_bytes * to_mb << " MB inode tables, "
+      << dir_bytes * to_mb << " MB directories\n";
+}
@@ -0,0 +1,122 @@
+#ifndef EXT4_IMAGE_H
+#define EXT4_IMAGE_H
+/*!
+  @file ext4Image.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include "ioBackend.h"
+
+/*!
+  Serves a scan straight from an unmounted ext4 filesystem, in a block
+  device or an image file. Loading reads the group descriptors, then
+  every inode table front to back, then every directory block in
+  block order, so the whole tree with sizes, inode numbers and
+  extents is known after one sequential pass and the walk makes no
+  further system calls. Reads of file content follow the extents (or
+  block maps) of the inode.
+
+  Paths are absolute paths inside the filesystem. Symlinks are not
+  followed, since they may point outside of it. Encrypted files and
+  files with more inline data than fits in the inode can not be read.
+
+  @brief Backend reading an ext4 filesystem image.
+ */
+class Ext4Image : public IoBackend
+{
+public:
+  /*! Constructor, nothing is read until Load() */
+  Ext4Image()
+    :fd(-1), block_size(0), inode_size(0), inodes_per_group(0),
+     first_ino(0), incompat(0), ro_compat(0), dev(0), table_bytes(0),
+     dir_bytes(0), next_handle(0) {}
+  ~Ext4Image();
+
+  bool Load(const std::string& image_path);
+
+  int Open(const std::string& path);
+  ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset);
+  void Close(int handle);
+  bool Stat(const std::string& path, FileStat& st);
+  bool ListDir(const std::string& path, std::vector<DirEntry>& entries);
+  bool IsLocal() const { return false; }
+  void PrintStats(std::ostream& out) const;
+
+private:
+  static const uint32_t ROOT_INO = 2;
+  static const size_t ITABLE_CHUNK = 1 << 20;
+
+  /*! What is kept of an inode in use */
+  struct Inode
+  {
+    uint16_t mode;
+    uint32_t flags;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    unsigned char block[60];
+    /*!< i_block: extent tree root, block map or inline data */
+  };
+
+  /*! Run of logical blocks stored contiguously */
+  struct Extent
+  {
+    uint64_t logical;
+    uint64_t physical;
+    uint32_t len;
+    bool uninit;
+    /*!< Allocated but never written, reads as zeros */
+    bool operator<(const Extent& other) const { return logical < other.logical; }
+  };
+
+  bool ReadImage(void* buffer, size_t len, uint64_t offset) const;
+  bool ReadInodeTables(const std::vector<unsigned char>& descriptors,
+                       uint32_t groups, uint32_t desc_size);
+  void ParseInode(uint32_t ino, const unsigned char* raw);
+  bool ReadDirectories();
+  void ParseDirBlock(uint32_t dir, const unsigned char* block, size_t len);
+  bool MapBlocks(const Inode& inode, std::vector<Extent>& extents) const;
+  bool MapExtentNode(const unsigned char* node, size_t len, int depth,
+                     std::vector<Extent>& extents) const;
+  bool MapIndirect(uint64_t block, int level, uint64_t& logical,
+                   std::vector<Extent>& extents) const;
+  void AddBlock(uint64_t logical, uint64_t physical,
+                std::vector<Extent>& extents) const;
+  bool Lookup(const std::string& path, uint32_t& ino) const;
+  EntryType TypeOf(const Inode& inode) const;
+
+  int fd;
+  /*! Image file or block device */
+  uint32_t block_size;
+  uint32_t inode_size;
+  uint32_t inodes_per_group;
+  uint32_t first_ino;
+  /*! First inode not reserved by the filesystem */
+  uint32_t incompat;
+  uint32_t ro_compat;
+  /*! Feature flags of the superblock */
+  uint64_t dev;
+  /*! Device number reported for every file, made up from the image
+      so it does not clash with a mounted filesystem */
+  std::unordered_map<uint32_t,Inode> inodes;
+  /*! Every inode in use, by number */
+  std::unordered_map<uint32_t,std::vector<DirEntry> > dirs;
+  /*! Entries of every directory, sorted by name */
+  uint64_t table_bytes;
+  uint64_t dir_bytes;
+  /*! Inode table and directory data read while loading */
+  std::mutex open_lock;
+  /*! Protects the open files below */
+  std::unordered_map<int,std::vector<Extent> > open_files;
+  /*! Block mapping of every open file, data stays on the image */
+  std::unordered_map<int,uint32_t> open_inodes;
+  int next_handle;
+};
+
+#endif /* EXT4_IMAGE_H */
@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# ext4ImageCheck.sh
+# Author: Charles Irick
+#
+# Builds an ext4 image of a small tree with known duplicates using
+# mkfs.ext4 -d and checks that a scan of the image with --ext4-image
+# finds the same groups as a scan of the tree on disk.
+#
+# Usage: ext4ImageCheck.sh [path to file_utils]
+
+FILE_UTILS=${1:-./file_utils}
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+if ! command -v mkfs.ext4 >/dev/null 2>&1; then
+  echo "ext4 image check skipped, mkfs.ext4 not found"
+  exit 0
+fi
+
+TREE=$WORK/tree
+mkdir -p "$TREE/a/b" "$TREE/c" "$TREE/deep/1/2/3"
+
+# Same content in three places, past the first extent block
+head -c 3000000 /dev/urandom > "$TREE/a/big"
+cp "$TREE/a/big" "$TREE/c/big_copy"
+cp "$TREE/a/big" "$TREE/deep/1/2/3/big_again"
+# Same size, other content
+head -c 3000000 /dev/urandom > "$TREE/c/big_other"
+# Small files, inline sized and empty
+printf 'hello\n' > "$TREE/a/h1"
+printf 'hello\n' > "$TREE/c/h2"
+printf 'jello\n' > "$TREE/a/b/j"
+: > "$TREE/a/empty1"
+: > "$TREE/c/empty2"
+# A directory with enough entries for more than one block
+i=0
+while [ $i -lt 200 ]; do
+  printf 'entry %d\n' $i > "$TREE/deep/file_with_a_long_name_$i"
+  i=$((i + 1))
+done
+printf 'entry 7\n' > "$TREE/deep/1/seven"
+
+if ! mkfs.ext4 -q -F -d "$TREE" "$WORK/image" 16M >/dev/null 2>&1; then
+  echo "ext4 image check skipped, mkfs.ext4 does not support -d"
+  exit 0
+fi
+
+# Every group on one line with its paths sorted, relative to the root
+groups()
+{
+  sed -n '/^Matching Files:/,/^-- Stats --/p' |
+  sed -e 's/^\[ *//' -e 's/^ *//' -e 's/[],]* *$//' -e "s|^$1||" |
+  awk '/^-- Stats --/ { next }
+       /^Matching Files:/ { next }
+       /^$/ { if(group != "") print group; group = ""; next }
+       { group = (group == "" ? "" : group " ") $0 }
+       END { if(group != "") print group }' |
+  while read -r line; do
+    echo "$line" | tr ' ' '\n' | sort | tr '\n' ' '
+    echo
+  done | sort
+}
+
+"$FILE_UTILS" --ext4-image "$WORK/image" / > "$WORK/image.out" 2>&1 || {
+  echo "ext4 image check failed, scan of the image failed:"
+  cat "$WORK/image.out"
+  exit 1
+}
+"$FILE_UTILS" "$TREE" > "$WORK/tree.out" 2>&1 || {
+  echo "ext4 image check failed, scan of the tree failed:"
+  cat "$WORK/tree.out"
+  exit 1
+}
+
+groups "" < "$WORK/image.out" > "$WORK/image.groups"
+groups "$TREE" < "$WORK/tree.out" > "$WORK/tree.groups"
+
+if [ ! -s "$WORK/tree.groups" ] ||
+   ! diff -u "$WORK/tree.groups" "$WORK/image.groups"; then
+  echo "ext4 image check failed, groups differ"
+  exit 1
+fi
+if [ "$(grep 'Number of files scanned' "$WORK/image.out")" != \
+     "$(grep 'Number of files scanned' "$WORK/tree.out")" ]; then
+  echo "ext4 image check failed, file counts differ"
+  exit 1
+fi
+
+echo "ext4 image check passed, $(wc -l < "$WORK/tree.groups") groups"
@@ -0,0 +1,231 @@
+/*!
+  @file fileList.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "fileList.h"
+
+/*! ~FileList
+Close the list unless it is stdin */
+FileList::~FileList()
+{
+  if(in != NULL && in != stdin)
+  {
+    fclose(in);
+  }
+}
+
+/*! SetFields
+Set the columns that come before the path in every record
+
+@param const std::string & spec
+Comma separated list of size, ino, dev, mtime or skip
+@return boolean
+If every field name was recognised
+*/
+bool FileList::SetFields(const std::string& spec)
+{
+  std::istringstream names(spec);
+  std::string name;
+
+  fields.clear();
+  while(std::getline(names, name, ','))
+  {
+    if(name == "size")       fields.push_back(FIELD_SIZE);
+    else if(name == "ino")   fields.push_back(FIELD_INO);
+    else if(name == "dev")   fields.push_back(FIELD_DEV);
+    else if(name == "mtime") fields.push_back(FIELD_MTIME);
+    else if(name == "skip")  fields.push_back(FIELD_SKIP);
+    else if(name == "path" || name.empty())
+    {
+      /* The path is always last, allow it to be spelled out */
+      continue;
+    }
+    else
+    {
+      std::cerr << "Unknown file list field: " << name << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! Open
+Open a list for reading
+
+@param const std::string & list_path
+Path of the list, "-" for stdin
+@param char record_separator
+@return boolean
+If the list could be opened
+*/
+bool FileList::Open(const std::string& list_path, char record_separator)
+{
+  separator = record_separator;
+  in = (list_path == "-") ? stdin : fopen(list_path.c_str(), "rb");
+  if(in == NULL)
+  {
+    std::cerr << "Could not open file list: " << list_path << std::endl;
+    return false;
+  }
+  buffer.resize(READ_SIZE);
+  pos = len = 0;
+  return true;
+}
+
+/*! NextRecord
+Pull the next raw record out of the input buffer, refilling it as
+needed. A final record without a trailing separator is still
+returned.
+
+@param std::string & record
+@return boolean
+If a record was read
+*/
+bool FileList::NextRecord(std::string& record)
+{
+  record.clear();
+
+  for(;;)
+  {
+    const char* start = &buffer[0] + pos;
+    const char* end = (const char*)memchr(start, separator, len - pos);
+
+    if(end != NULL)
+    {
+      record.append(start, end - start);
+      pos = end - &buffer[0] + 1;
+      return true;
+    }
+
+    /* No separator left in this block, keep the tail and read more */
+    record.append(start, len - pos);
+    pos = 0;
+    len = fread(&buffer[0], 1, buffer.size(), in);
+    if(len == 0)
+    {
+      return !record.empty();
+    }
+  }
+}
+
+/*! ParseMtime
+Parse seconds with an optional fraction, as printed by find's %T@ */
+static bool ParseMtime(const std::string& text, FileIdentity& ident)
+{
+  char* end;
+
+  ident.mtime_sec = strtoll(text.c_str(), &end, 10);
+  ident.mtime_nsec = 0;
+  if(end == text.c_str())
+  {
+    return false;
+  }
+  if(*end == '.')
+  {
+    int64_t scale = 100000000;
+    for(end++; *end >= '0' && *end <= '9'; end++)
+    {
+      ident.mtime_nsec += (*end - '0') * scale;
+      scale /= 10;
+    }
+  }
+  return *end == '\0';
+}
+
+/*! ParseRecord
+Split a record into its columns and the path
+
+@param const std::string & text
+@param FileRecord & record
+@return boolean
+If the record had every expected column
+*/
+bool FileList::ParseRecord(const std::string& text, FileRecord& record)
+{
+  bool have_ino = false, have_dev = false, have_mtime = false;
+  size_t start = 0;
+
+  memset(&record.ident, 0, sizeof(record.ident));
+  record.have_size = false;
+
+  for(auto field : fields)
+  {
+    size_t tab = text.find('\t', start);
+    if(tab == std::string::npos)
+    {
+      return false;
+    }
+
+    std::string column = text.substr(start, tab - start);
+    const char* value = column.c_str();
+    char* end;
+    start = tab + 1;
+
+    switch(field)
+    {
+      case FIELD_SIZE:
+        record.ident.size = strtoull(value, &end, 10);
+        record.have_size = (*end == '\0' && end != value);
+        if(!record.have_size) return false;
+        break;
+      case FIELD_INO:
+        record.ident.ino = strtoull(value, &end, 10);
+        have_ino = (*end == '\0' && end != value);
+        if(!have_ino) return false;
+        break;
+      case FIELD_DEV:
+        record.ident.dev = strtoull(value, &end, 10);
+        have_dev = (*end == '\0' && end != value);
+        if(!have_dev) return false;
+        break;
+      case FIELD_MTIME:
+        have_mtime = ParseMtime(column, record.ident);
+        if(!have_mtime) return false;
+        break;
+      case FIELD_SKIP:
+        break;
+    }
+  }
+
+  record.path = text.substr(start);
+  record.have_ident = record.have_size && have_ino && have_dev && have_mtime;
+  return !record.path.empty();
+}
+
+/*! Next
+Read the next file from the list. Records that cannot be parsed
+are counted and skipped.
+
+@param FileRecord & record
+@return boolean
+If a record was read, false at the end of the list
+*/
+bool FileList::Next(FileRecord& record)
+{
+  std::string text;
+
+  while(NextRecord(text))
+  {
+    /* Tolerate lists written on Windows */
+    if(separator == '\n' && !text.empty() && text[text.size() - 1] == '\r')
+    {
+      text.erase(text.size() - 1);
+    }
+    if(text.empty())
+    {
+      continue;
+    }
+    if(ParseRecord(text, record))
+    {
+      return true;
+    }
+    bad_records++;
+  }
+  return false;
+}
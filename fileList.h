@@ -0,0 +1,88 @@
+#ifndef FILE_LIST_H
+#define FILE_LIST_H
+/*!
+  @file fileList.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "hashCache.h"
+
+/*! Columns that can precede the path in a file list record */
+enum ListField
+{
+  FIELD_SIZE,  /*!< File size in bytes */
+  FIELD_INO,   /*!< Inode number */
+  FIELD_DEV,   /*!< Device number */
+  FIELD_MTIME, /*!< Modification time, seconds with optional fraction */
+  FIELD_SKIP   /*!< Column present in the input but not used */
+};
+
+/*! One file read from a list */
+struct FileRecord
+{
+  std::string path;
+  FileIdentity ident;
+  bool have_size;
+  /*! Informs if ident.size came from the list */
+  bool have_ident;
+  /*! Informs if the full stat identity came from the list */
+};
+
+/*!
+  Reader for file inventories produced outside of file_utils, e.g.
+  find -printf, policy engine dumps or backup catalogs. Records are
+  separated by newlines or NULs and hold optional tab separated
+  columns (size, inode, device, mtime) followed by the path, so for
+  example
+
+    find ROOT -type f -printf '%s\t%i\t%D\t%T@\t%p\0'
+
+  matches the fields "size,ino,dev,mtime" with NUL separators. The
+  input is read in large blocks, not line by line.
+
+  @brief Bulk reader of pre-built file lists.
+ */
+class FileList
+{
+public:
+  /*! Constructor */
+  FileList()
+    :in(NULL), separator('\n'), pos(0), len(0), bad_records(0) {}
+  ~FileList();
+
+  bool SetFields(const std::string& spec);
+  bool Open(const std::string& list_path, char record_separator);
+  bool Next(FileRecord& record);
+  unsigned long BadRecords() const { return bad_records; }
+
+private:
+  /* Not copyable, we own the input stream */
+  FileList(const FileList&);
+  FileList& operator=(const FileList&);
+
+  bool NextRecord(std::string& record);
+  bool ParseRecord(const std::string& text, FileRecord& record);
+
+  static const unsigned int READ_SIZE = 1 << 20;
+
+  FILE* in;
+  /*! List being read, may be stdin */
+  char separator;
+  /*! Record separator, '\n' or '\0' */
+  std::vector<ListField> fields;
+  /*! Columns in front of the path, in input order */
+  std::vector<char> buffer;
+  /*! Block of raw input */
+  size_t pos;
+  /*! Start of the unconsumed input in buffer */
+  size_t len;
+  /*! Number of valid bytes in buffer */
+  unsigned long bad_records;
+  /*! Records that could not be parsed */
+};
+
+#endif /* FILE_LIST_H */
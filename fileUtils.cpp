@@ -5,13 +5,36 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
 #include <unordered_map>
 #include <iterator>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
 #include "boost/filesystem.hpp"
-#include "FileUtils.h"
+#include "fileUtils.h"
+#include "workQueue.h"
+#include "scanIndex.h"
+#include "xattrHash.h"
+#include "verityDigest.h"
+#include "dirReport.h"
+#include "memoryPressure.h"
+#include "archiveNormalizer.h"
+#include "textNormalizer.h"
+#include "hashPolicy.h"
+#include "cpuFeatures.h"
+
+/* Bytes read by the comparisons of the calling thread, the compare
+stage reports them to its concurrency controller */
+static thread_local uint64_t compare_bytes = 0;
 
 /*! BUFFER_SIZE
 This param is used to tweak the size of the buffer
@@ -30,215 +53,2103 @@ root directory provided
 @param const std::string & root
 The root directory to recursively search for dups under
 */
-void FileUtils::FindDups( const std::string& dir_path )
+void FileUtils::FindDups( const std::string& dir_path )
+{
+  /* Build a hashmap where we hash all files that are the 
+  same file size. We also build a set that contains all 
+  keys where there were more than one file. This set can be used
+  to access the hashmap to get all files that had matching sizes. 
+  
+  Comparing only files with matching sizes reduces the number of
+  comparisons done */
+  BuildFileMap(dir_path);
+  
+  if(remover)
+  {
+    remover->SetRoot(dir_path);
+  }
+  
+  FindDupsInMap();
+}
+
+/*! FindDupsFromList
+This function is used to find duplicate files in a list built
+outside of file_utils, instead of walking a root directory. Sizes
+given in the list are used as is, saving a stat per file.
+
+@param FileList & list
+Opened list of files to search for dups in
+*/
+void FileUtils::FindDupsFromList( FileList& list )
+{
+  BuildFileMapFromList(list);
+  
+  FindDupsInMap();
+}
+
+/*! WalkTree
+This function only walks the tree under a root directory, without
+looking for duplicates, e.g. to time the metadata phase on its own.
+
+@param const std::string & dir_path
+@param uintmax_t & files
+Regular files found
+@return boolean
+If the root could be walked
+*/
+bool FileUtils::WalkTree( const std::string& dir_path, uintmax_t& files )
+{
+  files = 0;
+  if ( !BuildFileMap(dir_path) )
+  {
+    return false;
+  }
+  for ( auto& x : file_map )
+  {
+    files += x.second.size();
+  }
+  return true;
+}
+
+/*! FindDupsInMap
+This function finds the duplicates among the files in the Hash
+Map, however the map was built.
+*/
+void FileUtils::FindDupsInMap()
+{
+  /* Blocks for the compression estimate are taken from the hashing
+  and comparing as they read, see HashFile() and CompareFiles() */
+  if(estimate_every > 0)
+  {
+    estimator.reset(new CompressEstimator(std::thread::hardware_concurrency(),
+                                          estimate_every));
+  }
+  
+  /* Block hashes are for a dedup tool working on the real files */
+  if(!block_db_path.empty() && io->IsLocal())
+  {
+    block_db.reset(new BlockHashDb());
+    if(!block_db->Open(block_db_path))
+    {
+      block_db.reset();
+    }
+  }
+  
+  /* Pick up digests recorded by earlier runs or imported manifests
+  for every file that has not changed since */
+  if(hash_cache.Size() > 0 || xattr_hashes)
+  {
+    LookupCachedDigests();
+  }
+  
+  /* Files protected by fs-verity come with a digest of their content
+  for free. The known table needs real SHA-256 digests and the fast
+  modes compare on other grounds, so only plain scans use them. Paths
+  of a replayed trace or an image are not on the local filesystem */
+  if(!known_loaded && quick_blocks == 0 && assume_fields == 0 && io->IsLocal())
+  {
+    MeasureVerity();
+  }
+  
+  /* Checking against the known table needs the digest of every file,
+  so hash everything once up front and reuse those digests to group
+  the duplicates instead of comparing pairs. Block hashes need every
+  file read whole too, they are taken from the same pass. Digests kept
+  on the files or asked for with SetHashAlgorithm() are taken the same
+  way, except in quick mode which is there to avoid full reads */
+  if(known_loaded || block_db ||
+     ((xattr_hashes || hash_selected) && quick_blocks == 0 && assume_fields == 0))
+  {
+    HashFiles();
+  }
+  
+  // Compare only files where keys (sizes) match 
+  if(assume_fields != 0)
+  {
+    AssumedMatchingKeys();
+  }
+  else if(quick_blocks > 0)
+  {
+    QuickMatchingKeys();
+  }
+  else
+  {
+    CompareMatchingKeys();
+  }
+  
+  if(normalize_formats != 0)
+  {
+    NormalizeArchives();
+  }
+  
+  if(normalize_text)
+  {
+    NormalizeText();
+  }
+  
+  if(find_truncated)
+  {
+    FindTruncatedCopies();
+  }
+  
+  if(known_loaded && known_action == KNOWN_REPORT)
+  {
+    PrintKnownFiles();
+  }
+  
+  if(dir_report > 0)
+  {
+    PrintDirReport();
+  }
+  
+  if(estimator)
+  {
+    EstimateCompression();
+  }
+  
+  if(block_db)
+  {
+    ExportBlockHashes();
+  }
+  
+  // Print stats about number of files scanned and total size of data
+  PrintMapStats();
+  
+  if(!hash_cache_path.empty())
+  {
+    hash_cache.Save(hash_cache_path);
+  }
+  
+  if(!scan_index_path.empty())
+  {
+    SaveScanIndex();
+  }
+  
+  if(remover)
+  {
+    RemoveDups();
+  }
+}
+
+/*! SetIoBackend
+This function replaces the storage backend every scan goes through,
+e.g. with a simulated tier or a replayed trace. The backend is
+owned by this object from now on.
+
+@param IoBackend * backend
+*/
+void FileUtils::SetIoBackend( IoBackend* backend )
+{
+  io.reset(backend);
+}
+
+/*! SetRemover
+This function enables deletion of confirmed duplicates once a scan
+is done, keeping one file of every group. The remover is owned by
+this object from now on.
+
+@param DupRemover * dup_remover
+*/
+void FileUtils::SetRemover( DupRemover* dup_remover )
+{
+  remover.reset(dup_remover);
+}
+
+/*! SetScanIndex
+This function saves every scanned file, with its identity and the
+content digest when one is known, as a ScanIndex once the scan is
+done. Saved scans can be compared with index-diff.
+
+@param const std::string & index_path
+*/
+void FileUtils::SetScanIndex( const std::string& index_path )
+{
+  scan_index_path = index_path;
+}
+
+/*! LoadKnownHashes
+This function maps a table of known content digests built with
+KnownHashes::Build(). Files whose content is in the table are
+reported, flagged or skipped depending on the action.
+
+@param const std::string & table_path
+@param KnownAction action
+@return boolean
+If the table could be loaded
+*/
+bool FileUtils::LoadKnownHashes( const std::string& table_path, KnownAction action )
+{
+  known_loaded = known_hashes.Open(table_path);
+  known_action = action;
+  return known_loaded;
+}
+
+/*! LoadHashCache
+This function loads the hash cache used to avoid reading files
+that have not changed since their digest was recorded. The cache
+is saved back, with any new digests, at the end of FindDups.
+
+@param const std::string & cache_path
+@return boolean
+If the cache could be loaded
+*/
+bool FileUtils::LoadHashCache( const std::string& cache_path )
+{
+  hash_cache_path = cache_path;
+  return hash_cache.Load(cache_path);
+}
+
+/*! ImportManifest
+This function seeds the hash cache from a SHA256SUMS / MD5SUMS
+style manifest. Files that are unchanged since the manifest was
+written are grouped on their recorded digests without reading them.
+
+@param const std::string & manifest_path
+@return boolean
+If the manifest could be read
+*/
+bool FileUtils::ImportManifest( const std::string& manifest_path )
+{
+  return hash_cache.ImportManifest(manifest_path);
+}
+
+/*! SetQuickMode
+This function switches FindDups to a probabilistic first pass. Only
+the head, the tail and a number of randomly placed blocks of each
+file are read, every file of a size is sampled at the same offsets.
+Matching groups are reported as probable duplicates.
+
+@param unsigned int blocks
+Number of random blocks sampled per file, 0 disables quick mode
+@param bool verify
+Fully verify each probable group on a background thread
+*/
+void FileUtils::SetQuickMode( unsigned int blocks, bool verify )
+{
+  quick_blocks = blocks;
+  quick_verify = verify;
+  quick_seed = std::random_device()();
+  quick_seed = (quick_seed << 32) | std::random_device()();
+}
+
+/*! SetAssumeSame
+This function switches FindDups to the metadata fast mode. Files of
+the same size that also match on the given fields are reported as
+probable duplicates before any content is read, then verified.
+
+@param const std::string & spec
+Comma separated list of name, size or mtime
+@return boolean
+If every field name was recognised
+*/
+bool FileUtils::SetAssumeSame( const std::string& spec )
+{
+  std::istringstream names(spec);
+  std::string name;
+  
+  /* Files are only ever compared within a size */
+  assume_fields = ASSUME_SIZE;
+  while(std::getline(names, name, ','))
+  {
+    if(name == "name")       assume_fields |= ASSUME_NAME;
+    else if(name == "size")  assume_fields |= ASSUME_SIZE;
+    else if(name == "mtime") assume_fields |= ASSUME_MTIME;
+    else
+    {
+      std::cerr << "Unknown metadata field: " << name << std::endl;
+      assume_fields = 0;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! SetHashAlgorithm
+This function makes FindDups group files on content digests of the
+given algorithm instead of comparing them byte by byte. Strong
+digests are trusted, weak ones only tell different files apart and
+files that share one are still compared. Digests read from extended
+attributes count as weak whatever their algorithm.
+
+@param const std::string & name
+sha256, blake3, xxh3 or crc32c
+@return boolean
+If the algorithm is one we can compute
+*/
+bool FileUtils::SetHashAlgorithm( const std::string& name )
+{
+  if(!Digest::ParseAlgorithm(name, hash_algorithm))
+  {
+    std::cerr << "Unknown hash algorithm: " << name << std::endl;
+    return false;
+  }
+  hash_selected = true;
+  return true;
+}
+
+/*! SetIoThreads
+This function sets how many operations the walk and the compare
+stage keep in flight on each device. By default the number adapts
+to what each device delivers, see ConcurrencyController.
+
+@param unsigned int threads
+Fixed number of operations in flight, 0 to adapt
+*/
+void FileUtils::SetIoThreads( unsigned int threads )
+{
+  if(threads == 0)
+  {
+    walk_limits.Configure(1, MAX_IO_THREADS);
+    compare_limits.Configure(1, MAX_IO_THREADS);
+  }
+  else
+  {
+    walk_limits.Configure(threads, threads);
+    compare_limits.Configure(threads, threads);
+  }
+}
+
+/*! LookupCachedDigests
+This function fills in the digest of every file the hash cache, or
+the extended attribute of the file, still has a valid entry for.
+Only files that will be hashed or compared are looked up, each
+lookup costs a stat unless the walk or the file list already gave
+us the identity, plus a getxattr when digests are kept on files.
+*/
+void FileUtils::LookupCachedDigests()
+{
+  for(auto& x : file_map)
+  {
+    if(!known_loaded && matching_keys.find(x.first) == matching_keys.end())
+    {
+      continue;
+    }
+    
+    for(auto& file : x.second)
+    {
+      FileIdentity ident;
+      Digest digest;
+      
+      if(!StatFile(file, ident))
+      {
+        continue;
+      }
+      
+      /* A digest kept on the file survives renames the cache does
+      not know about. It is not copied into the cache, the owner of
+      the file can write any digest there, so it only tells files
+      apart until the file is compared or hashed again */
+      if(xattr_hashes && XattrHash::Load(file, ident, digest))
+      {
+        file_digests[file] = digest;
+        xattr_digested.insert(file);
+        xattr_hits++;
+      }
+      else if(hash_cache.Lookup(file, ident, digest))
+      {
+        file_digests[file] = digest;
+        if(xattr_hashes)
+        {
+          XattrHash::Store(file, ident, digest);
+        }
+      }
+    }
+  }
+}
+
+/*! MeasureVerity
+This function takes the fs-verity digest of every file of a size
+as its content digest, when all of them have fs-verity enabled with
+the same algorithm, block size and salt. Their digests can then be
+grouped on without reading any data. A group with a file outside of
+fs-verity, or with other parameters, is compared as usual.
+*/
+void FileUtils::MeasureVerity()
+{
+  for(auto& x : matching_keys)
+  {
+    std::vector<std::string> &files = file_map[x];
+    std::vector<Digest> digests(files.size());
+    std::string first_params, params;
+    size_t i;
+    
+    for(i = 0; i < files.size(); i++)
+    {
+      FileIdentity ident;
+      
+      if(!StatFile(files[i], ident) || verity_unsupported.count(ident.dev) > 0)
+      {
+        break;
+      }
+      
+      VerityStatus status = VerityDigest::Measure(files[i], digests[i], params);
+      if(status == VERITY_UNSUPPORTED)
+      {
+        /* Do not ask again for every file on this filesystem */
+        verity_unsupported.insert(ident.dev);
+        break;
+      }
+      if(status != VERITY_ENABLED)
+      {
+        break;
+      }
+      if(i == 0)
+      {
+        first_params = params;
+      }
+      else if(params != first_params)
+      {
+        break;
+      }
+    }
+    
+    if(i < files.size())
+    {
+      continue;
+    }
+    for(i = 0; i < files.size(); i++)
+    {
+      file_digests[files[i]] = digests[i];
+    }
+    verity_hits += files.size();
+  }
+}
+
+/*! HashFiles
+This function hashes every file in the Hash Map that does not
+already have a digest of the selected algorithm, SHA-256 when a
+known hash table is loaded, and checks each digest against the
+known hash table. When known files are skipped they are removed
+from the Hash Map here, before any comparisons. Without a known
+table or a block hash database only files that have a size in common
+are hashed, so their digests can be kept on them.
+*/
+void FileUtils::HashFiles()
+{
+  for(auto& x : file_map)
+  {
+    if(!known_loaded && !block_db && matching_keys.find(x.first) == matching_keys.end())
+    {
+      continue;
+    }
+    
+    for(auto& file : x.second)
+    {
+      auto found = file_digests.find(file);
+      Digest digest;
+      
+      if(found != file_digests.end() &&
+         (found->second.algorithm == hash_algorithm || Digest::IsVerity(found->second.algorithm)))
+      {
+        digest = found->second;
+      }
+      else
+      {
+        /* Identity is taken before reading so a file modified while
+        we hash it is not cached under its new identity */
+        FileIdentity ident;
+        bool have_ident = StatFile(file, ident);
+        
+        if(!HashFile(file, digest))
+        {
+          continue;
+        }
+        file_digests[file] = digest;
+        xattr_digested.erase(file);
+        if(have_ident)
+        {
+          hash_cache.Insert(file, ident, digest);
+          if(xattr_hashes)
+          {
+            XattrHash::Store(file, ident, digest);
+          }
+        }
+      }
+      
+      if(known_hashes.Contains(digest))
+      {
+        known_files.insert(file);
+      }
+    }
+  }
+  
+  if(known_action != KNOWN_SKIP || known_files.empty())
+  {
+    return;
+  }
+  
+  /* Drop known files and rebuild the set of keys that still
+  have more than one entry */
+  matching_keys.clear();
+  for(auto& x : file_map)
+  {
+    std::vector<std::string> kept;
+    for(auto& file : x.second)
+    {
+      if(known_files.find(file) == known_files.end())
+      {
+        kept.push_back(file);
+      }
+    }
+    x.second.swap(kept);
+    
+    if(x.second.size() > 1)
+    {
+      matching_keys.insert(x.first);
+    }
+  }
+}
+
+/*!
+  Read loop of HashFile and SampleFile, instantiated once per hash
+  policy so the hash update is inlined into it. Hashes the whole
+  file, or one buffer at each of the given offsets.
+ */
+struct HashBlocks
+{
+  IoBackend& io;
+  int handle;
+  std::vector<char>& buffer;
+  const std::vector<uintmax_t>* offsets;
+  /*! Offsets of the blocks to hash, NULL for the whole file */
+  uintmax_t& bytes;
+  /*! Bytes read */
+  Digest& digest;
+  CompressEstimator* estimator;
+  /*! Takes sample blocks of whole files as they are read, or NULL */
+  BlockHashDb* block_db;
+  /*! Takes block hashes of whole files as they are read, or NULL */
+  const std::string* file;
+
+  template <class Policy> bool Run()
+  {
+    typename Policy::State state;
+    ssize_t got = 0;
+    
+    if(offsets == NULL)
+    {
+      uint64_t offset = 0;
+      while((got = io.Read(handle, &buffer[0], buffer.size(), offset)) > 0)
+      {
+        state.Update(&buffer[0], got);
+        if(estimator != NULL)
+        {
+          estimator->Offer(*file, offset, &buffer[0], got);
+        }
+        if(block_db != NULL)
+        {
+          block_db->Offer(*file, offset, &buffer[0], got);
+        }
+        bytes += got;
+        offset += got;
+      }
+    }
+    else
+    {
+      for(auto offset : *offsets)
+      {
+        got = io.Read(handle, &buffer[0], buffer.size(), offset);
+        if(got < 0)
+        {
+          break;
+        }
+        state.Update(&buffer[0], got);
+        bytes += got;
+      }
+    }
+    
+    if(got < 0)
+    {
+      return false;
+    }
+    state.Final(digest);
+    return true;
+  }
+};
+
+/*! HashFile
+This function computes the digest of a file's content with the
+selected algorithm, SHA-256 when a known hash table is loaded. The
+blocks read also go to the compression estimate and the block hash
+database when those are on.
+
+@param const std::string & file
+@param Digest & digest
+@return boolean
+If the file could be read
+*/
+bool FileUtils::HashFile(const std::string& file, Digest& digest)
+{
+  FileIdentity ident;
+  bool blocks = block_db && StatFile(file, ident);
+  int in = io->Open(file);
+  std::vector<char> block(HASH_BUFFER_SIZE);
+  uintmax_t bytes = 0;
+  HashBlocks loop = {*io, in, block, NULL, bytes, digest, estimator.get(), block_db.get(),
+                     &file};
+  
+  if(in < 0)
+  {
+    std::cout << "Could not open: " << file << std::endl;
+    return false;
+  }
+  
+  if(blocks)
+  {
+    block_db->BeginFile(file, ident);
+  }
+  bool read = WithHashPolicy(known_loaded ? (unsigned char)HASH_SHA256 : hash_algorithm, loop);
+  io->Close(in);
+  if(blocks)
+  {
+    block_db->EndFile(file, read);
+  }
+  if(estimator && read)
+  {
+    estimator->EndFile(file, bytes);
+  }
+  if(!read)
+  {
+    std::cout << "Could not read: " << file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! CompareFiles
+This function is used to compare two files to each other. The method
+is to open the file as a binary file and read in raw bytes for 
+comparison. We start with small buffer sizes and rapidly increase the
+buffer size used if the file continues to match.
+
+@param const std::string & file1
+@param const std::string & file2
+@param uintmax_t limit
+Bytes to compare from the start, the whole files by default
+@return boolean
+If files are the same or not
+*/
+bool FileUtils::CompareFiles(const std::string& file1, const std::string& file2,
+                             uintmax_t limit)
+{
+  /* Both files are read through the I/O backend with positional
+  reads, so several comparisons can share a backend across threads */
+  int if1 = io->Open(file1);
+  int if2 = io->Open(file2);
+  char *block1;
+  char *block2;
+  size_t got = 0;
+  unsigned int size = 0;
+  unsigned int pass = 0;
+  uint64_t offset = 0;
+  ssize_t got1, got2;
+  
+  if(if1 < 0)
+  {
+    std::cout << "Could not open: " << file1 << std::endl;
+    if(if2 >= 0)
+    {
+      io->Close(if2);
+    }
+    return false;
+  }
+  if(if2 < 0)
+  {
+    std::cout << "Could not open: " << file2 << std::endl;
+    io->Close(if1);
+    return false;
+  }
+  
+  /* Continue to compare files with increasing buffer sizes
+  until we reach the end of the file, or there is a difference
+  in the comparisons */
+  do {
+    if(pass < MAX_PASS)
+    {
+      size = BUFFER_SIZE[pass++];
+    }
+    
+    /* One pooled buffer holds both blocks. Under memory pressure
+    it may be smaller than asked for, we then read less at a time */
+    block1 = buffers.Get((size_t)size * 2, got);
+    block2 = block1 + got / 2;
+    size = got / 2;
+    if(limit - offset < size)
+    {
+      size = limit - offset;
+    }
+    
+    got1 = io->Read(if1, block1, size, offset);
+    got2 = io->Read(if2, block2, size, offset);
+    compare_bytes += (got1 > 0 ? got1 : 0) + (got2 > 0 ? got2 : 0);
+    
+    /* The compression estimate samples what the comparison reads */
+    if(estimator && got1 > 0)
+    {
+      estimator->Offer(file1, offset, block1, got1);
+    }
+    if(estimator && got2 > 0)
+    {
+      estimator->Offer(file2, offset, block2, got2);
+    }
+    if(estimator && got1 >= 0 && got1 < (ssize_t)size && got1 == got2)
+    {
+      estimator->EndFile(file1, offset + got1);
+      estimator->EndFile(file2, offset + got2);
+    }
+    offset += size;
+
+    /* compare binary blocks of data */
+    if (got1 < 0 || got1 != got2 || memcmp(block1, block2, got1) != 0)
+    {
+      buffers.Put(block1, got);
+      io->Close(if1);
+      io->Close(if2);
+      return false;
+    }
+    
+    buffers.Put(block1, got);
+  } while (got1 == (ssize_t)size && offset < limit);
+  
+  io->Close(if1);
+  io->Close(if2);
+  
+  return true;
+}
+
+/*! CompareMatchingKeys
+This function iterates through the Hash Map of files hashed
+based on size. It will attempt to compare files only if they
+have the same size, see GroupFiles for how each size is split
+into groups of identical files.
+
+Sizes are compared by a pool of workers, as many at once on each
+device as its concurrency controller allows. Groups are still
+printed in order of size, as each size is done.
+*/
+void FileUtils::CompareMatchingKeys()
+{
+  std::vector<uintmax_t> keys(matching_keys.begin(), matching_keys.end());
+  std::vector<std::vector<std::vector<std::string> > > results(keys.size());
+  std::vector<char> done(keys.size(), 0);
+  std::mutex done_lock;
+  std::condition_variable done_ready;
+  WorkQueue<size_t> queue;
+  std::vector<std::thread> workers;
+  
+  for(size_t i = 0; i < keys.size(); i++)
+  {
+    queue.Push(i);
+  }
+  queue.Close();
+  
+  size_t count = std::min<size_t>(compare_limits.MaxLimit(), keys.size());
+  for(size_t t = 0; t < count; t++)
+  {
+    workers.push_back(std::thread([&]()
+    {
+      size_t i;
+      
+      while(queue.Pop(i))
+      {
+        /* Compare the current vector of files with the same size */
+        const std::vector<std::string>& files = file_map.find(keys[i])->second;
+        FileIdentity ident;
+        uint64_t dev = StatFile(files[0], ident) ? ident.dev : 0;
+        ConcurrencyController& limit = compare_limits.For(dev);
+        
+        CheckMemory();
+        limit.Acquire();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        compare_bytes = 0;
+        std::vector<std::vector<std::string> > groups = GroupFiles(files);
+        limit.Release(compare_bytes, std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - start).count());
+        
+        std::lock_guard<std::mutex> lock(done_lock);
+        results[i].swap(groups);
+        done[i] = 1;
+        done_ready.notify_all();
+      }
+    }));
+  }
+  
+  std::cout << "Matching Files: \n";
+  
+  for(size_t i = 0; i < keys.size(); i++)
+  {
+    std::vector<std::vector<std::string> > groups;
+    {
+      std::unique_lock<std::mutex> lock(done_lock);
+      while(!done[i])
+      {
+        done_ready.wait(lock);
+      }
+      groups.swap(results[i]);
+    }
+    
+    for(auto& group : groups)
+    {
+      PrintGroup(group);
+      dup_groups.push_back(group);
+      dup_sizes.push_back(keys[i]);
+    }
+  }
+  
+  for(auto& worker : workers)
+  {
+    worker.join();
+  }
+}
+
+/*! GroupFiles
+This function splits files of the same size into groups with
+identical content. Files with a strong digest (hashed this run,
+cached or imported from a manifest) are first grouped on that
+digest, each group is then compared as a single unit so that
+files without a digest only need to be read against one member.
+Weak digests only spare the comparisons between files whose
+digests differ.
+Once units are found to be the same they are merged so that we
+do not compare two same files more than once as we permute
+through all possible matches.
+
+@param const std::vector<std::string> & files
+Files that all have the same size
+@return std::vector<std::vector<std::string> >
+Groups of two or more identical files
+*/
+std::vector<std::vector<std::string> > FileUtils::GroupFiles(const std::vector<std::string>& files)
+{
+  std::vector<std::vector<std::string> > units, groups;
+  std::vector<const Digest*> unit_digests;
+  std::unordered_map<Digest,size_t,DigestHash> index;
+  std::vector<bool> merged;
+  std::vector<std::string> group;
+  
+  /* Build the units to compare. Files sharing a strong digest go in
+  the same unit, every other file is a unit of its own */
+  for(auto& file : files)
+  {
+    auto digest = file_digests.find(file);
+    
+    if(digest == file_digests.end() || !Digest::IsStrong(digest->second.algorithm) ||
+       xattr_digested.count(file) > 0)
+    {
+      units.push_back(std::vector<std::string>(1, file));
+      unit_digests.push_back(digest == file_digests.end() ? NULL : &digest->second);
+      continue;
+    }
+    
+    auto found = index.find(digest->second);
+    if(found == index.end())
+    {
+      index[digest->second] = units.size();
+      units.push_back(std::vector<std::string>(1, file));
+      unit_digests.push_back(&digest->second);
+    }
+    else
+    {
+      units[found->second].push_back(file);
+    }
+  }
+  merged.assign(units.size(), false);
+  
+  /* Compare all units against the others */
+  for(size_t i = 0; i < units.size(); i++)
+  {
+    /* Skip anything we already have matched with */
+    if(merged[i])
+    {
+      continue;
+    }
+    group = units[i];
+    
+    for(size_t j = i + 1; j < units.size(); j++)
+    {
+      if(merged[j])
+      {
+        continue;
+      }
+      
+      /* Different digests from the same algorithm can never be
+      the same content, no need to read anything */
+      if(unit_digests[i] != NULL && unit_digests[j] != NULL &&
+         unit_digests[i]->algorithm == unit_digests[j]->algorithm &&
+         *unit_digests[i] != *unit_digests[j])
+      {
+        continue;
+      }
+      
+      /* Compare the two files here. Heart of work being done. */
+      if(CompareFiles(units[i][0], units[j][0]))
+      {
+        group.insert(group.end(), units[j].begin(), units[j].end());
+        merged[j] = true;
+      }
+    }
+    
+    /* If the current unit matched with anything, or already held
+    several files, it is a group of duplicates */
+    if(group.size() > 1)
+    {
+      groups.push_back(group);
+    }
+  } /* for(size_t i = 0; i < units.size(); i++) */
+  
+  return groups;
+}
+
+/*! QuickMatchingKeys
+This function is the quick mode counterpart of CompareMatchingKeys.
+Files of the same size are grouped on a digest of their sampled
+blocks and reported as probable duplicates. When verification is
+enabled each probable group is queued and fully compared on a
+background thread while sampling carries on.
+*/
+void FileUtils::QuickMatchingKeys()
+{
+  WorkQueue<std::vector<std::string> > verify_queue;
+  std::thread verifier;
+  
+  if(quick_verify)
+  {
+    verifier = std::thread(&FileUtils::VerifyProbable, this, std::ref(verify_queue));
+  }
+  
+  std::cout << "Probable Duplicates: \n";
+  
+  for(auto& x : matching_keys)
+  {
+    std::vector<std::string> &curr = file_map[x];
+    std::unordered_map<Digest,size_t,DigestHash> index;
+    std::vector<std::vector<std::string> > groups;
+    
+    for(auto& file : curr)
+    {
+      Digest digest;
+      
+      if(!SampleFile(file, x, digest))
+      {
+        continue;
+      }
+      
+      auto found = index.find(digest);
+      if(found == index.end())
+      {
+        index[digest] = groups.size();
+        groups.push_back(std::vector<std::string>(1, file));
+      }
+      else
+      {
+        groups[found->second].push_back(file);
+      }
+    }
+    
+    for(auto& group : groups)
+    {
+      if(group.size() > 1)
+      {
+        PrintGroup(group);
+        if(quick_verify)
+        {
+          verify_queue.Push(group);
+        }
+      }
+    }
+  }
+  
+  /* Let the verifier drain what is left before printing stats */
+  if(quick_verify)
+  {
+    verify_queue.Close();
+    verifier.join();
+  }
+}
+
+/*! AssumedMatchingKeys
+This function is the metadata fast mode. Files of the same size are
+grouped on the other fields asked for (name, modification time) and
+reported at once as probable duplicates, without reading anything.
+Each group is then verified in the background through GroupFiles,
+like every other group, so the report is confirmed or refuted while
+the user already looks at it. Only verified groups are kept as
+duplicates.
+*/
+void FileUtils::AssumedMatchingKeys()
+{
+  WorkQueue<std::vector<std::string> > verify_queue;
+  std::thread verifier(&FileUtils::VerifyProbable, this, std::ref(verify_queue));
+  
+  std::cout << "Probable Duplicates: \n";
+  
+  for(auto& x : matching_keys)
+  {
+    std::map<std::pair<std::string,std::pair<int64_t,int64_t> >,
+             std::vector<std::string> > groups;
+    
+    for(auto& file : file_map[x])
+    {
+      std::string name;
+      std::pair<int64_t,int64_t> mtime(0, 0);
+      
+      if(assume_fields & ASSUME_NAME)
+      {
+        name = file.substr(file.rfind('/') + 1);
+      }
+      if(assume_fields & ASSUME_MTIME)
+      {
+        FileIdentity ident;
+        if(!StatFile(file, ident))
+        {
+          continue;
+        }
+        mtime = std::make_pair(ident.mtime_sec, ident.mtime_nsec);
+      }
+      groups[std::make_pair(name, mtime)].push_back(file);
+    }
+    
+    for(auto& group : groups)
+    {
+      if(group.second.size() > 1)
+      {
+        PrintGroup(group.second, "assumed ");
+        verify_queue.Push(group.second);
+      }
+    }
+  }
+  
+  /* The first answer is out, let the verifier finish the report */
+  verify_queue.Close();
+  verifier.join();
+}
+
+/*! NormalizeArchives
+This function groups archives on their canonical digest, see
+ArchiveNormalizer, across all sizes. Archives equal only in that
+form differ in their bytes, so they are reported but never kept as
+duplicates to delete. Groups already found identical byte for byte
+are not repeated.
+*/
+void FileUtils::NormalizeArchives()
+{
+  ArchiveNormalizer normalizer(*io, normalize_formats);
+  std::unordered_map<std::string,Digest> canonical;
+  
+  for(auto& x : file_map)
+  {
+    for(auto& file : x.second)
+    {
+      Digest digest;
+      
+      if(ArchiveNormalizer::IsCandidate(file) && normalizer.Normalize(file, digest))
+      {
+        canonical[file] = digest;
+        normalized_files++;
+      }
+    }
+  }
+  
+  std::cout << "Normalized Archive Matches: \n";
+  PrintNormalizedGroups(canonical, "normalized ");
+}
+
+/*! NormalizeText
+This function groups text files on the digest of their content with
+line endings and trailing whitespace normalized, see TextNormalizer,
+across all sizes. Like archives, such files differ in their bytes
+and are reported but never kept as duplicates to delete. Binary files
+are recognized from their first block and skipped.
+*/
+void FileUtils::NormalizeText()
+{
+  TextNormalizer normalizer(*io, hash_algorithm);
+  std::unordered_map<std::string,Digest> canonical;
+  
+  for(auto& x : file_map)
+  {
+    /* Empty files are all equal already */
+    if(x.first == 0)
+    {
+      continue;
+    }
+    for(auto& file : x.second)
+    {
+      Digest digest;
+      bool binary;
+      
+      if(!normalizer.Normalize(file, digest, binary))
+      {
+        std::cout << "Could not read: " << file << std::endl;
+      }
+      else if(binary)
+      {
+        binary_files++;
+      }
+      else
+      {
+        canonical[file] = digest;
+        text_files++;
+      }
+    }
+  }
+  
+  std::cout << "Normalized Text Matches: \n";
+  PrintNormalizedGroups(canonical, "text ");
+}
+
+/*! PrintNormalizedGroups
+This function groups files on a canonical digest of their content
+and prints every group of two or more. Groups whose files are all in
+one group of byte for byte duplicates are not repeated.
+
+@param const std::unordered_map<std::string,Digest> & canonical
+Canonical digest of every file that has one
+@param const char * label
+*/
+void FileUtils::PrintNormalizedGroups(const std::unordered_map<std::string,Digest>& canonical,
+                                      const char* label)
+{
+  std::map<Digest,std::vector<std::string> > groups;
+  std::unordered_map<std::string,size_t> dup_of;
+  
+  for(size_t i = 0; i < dup_groups.size(); i++)
+  {
+    for(auto& file : dup_groups[i])
+    {
+      dup_of[file] = i;
+    }
+  }
+  
+  for(auto& x : canonical)
+  {
+    groups[x.second].push_back(x.first);
+  }
+  
+  for(auto& x : groups)
+  {
+    std::vector<std::string>& group = x.second;
+    if(group.size() < 2)
+    {
+      continue;
+    }
+    
+    auto first = dup_of.find(group[0]);
+    bool same_bytes = first != dup_of.end();
+    for(size_t i = 1; i < group.size() && same_bytes; i++)
+    {
+      auto other = dup_of.find(group[i]);
+      same_bytes = other != dup_of.end() && other->second == first->second;
+    }
+    
+    if(!same_bytes)
+    {
+      std::sort(group.begin(), group.end());
+      PrintGroup(group, label);
+    }
+  }
+}
+
+/*! HashLeadingBlock
+This function computes the digest of the first PREFIX_BLOCK_SIZE
+bytes of a file with the selected algorithm.
+
+@param const std::string & file
+@param Digest & digest
+@return boolean
+If the file could be read
+*/
+bool FileUtils::HashLeadingBlock(const std::string& file, Digest& digest)
+{
+  std::vector<uintmax_t> offsets(1, 0);
+  std::vector<char> buffer(PREFIX_BLOCK_SIZE);
+  int in = io->Open(file);
+  HashBlocks loop = {*io, in, buffer, &offsets, prefix_bytes, digest, NULL, NULL, NULL};
+  
+  if(in < 0)
+  {
+    std::cout << "Could not open: " << file << std::endl;
+    return false;
+  }
+  
+  bool read = WithHashPolicy(hash_algorithm, loop);
+  io->Close(in);
+  if(!read)
+  {
+    std::cout << "Could not read: " << file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! FindTruncatedCopies
+This function finds files whose whole content is the start of a
+larger file, as left behind by interrupted transfers. Sizes differ,
+so the Hash Map never puts them together. Every file of at least
+PREFIX_BLOCK_SIZE bytes is indexed on the digest of its leading
+block, and within each index entry a file is compared, over its own
+length only, with the larger files.
+
+Larger files are tried nearest in size first. Each file keeps the
+largest file it was found to start, its root; when a file does not
+start one member of a chain of prefixes it starts none of them, so
+only one file per root is ever tried. Files with a common header and
+different content still cost a comparison per root, at most
+MAX_PREFIX_TRIES of them.
+*/
+void FileUtils::FindTruncatedCopies()
+{
+  std::unordered_map<Digest,std::vector<std::pair<uintmax_t,const std::string*> >,
+                     DigestHash> index;
+  std::vector<std::pair<std::string,std::string> > found;
+  
+  for(auto& x : file_map)
+  {
+    if(x.first < PREFIX_BLOCK_SIZE)
+    {
+      continue;
+    }
+    for(auto& file : x.second)
+    {
+      Digest digest;
+      if(HashLeadingBlock(file, digest))
+      {
+        index[digest].push_back(std::make_pair(x.first, &file));
+      }
+    }
+  }
+  
+  for(auto& x : index)
+  {
+    auto& files = x.second;
+    if(files.size() < 2)
+    {
+      continue;
+    }
+    
+    /* Largest first, so the candidates of a file come before it.
+    Among equal sizes the first name is tried first */
+    std::sort(files.begin(), files.end(),
+      [](const std::pair<uintmax_t,const std::string*>& a,
+         const std::pair<uintmax_t,const std::string*>& b)
+      {
+        if(a.first != b.first)
+        {
+          return a.first > b.first;
+        }
+        return *a.second > *b.second;
+      });
+    
+    std::vector<size_t> root(files.size());
+    for(size_t i = 0; i < files.size(); i++)
+    {
+      std::set<size_t> tried;
+      
+      root[i] = i;
+      for(size_t j = i; j-- > 0 && tried.size() < MAX_PREFIX_TRIES;)
+      {
+        if(files[j].first == files[i].first || !tried.insert(root[j]).second)
+        {
+          continue;
+        }
+        if(CompareFiles(*files[i].second, *files[j].second, files[i].first))
+        {
+          root[i] = root[j];
+          break;
+        }
+      }
+      
+      if(root[i] != i)
+      {
+        found.push_back(std::make_pair(*files[i].second, *files[root[i]].second));
+      }
+    }
+  }
+  
+  std::sort(found.begin(), found.end());
+  truncated_files = found.size();
+  
+  std::cout << "Truncated Copies: \n";
+  for(auto& x : found)
+  {
+    std::cout << "  " << x.first << " is a truncated copy of " << x.second << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+/*! VerifyProbable
+This function fully compares every probable group pushed to the
+queue until it is closed, and reports each one as verified or
+refuted. Verified groups are kept as duplicates.
+
+@param WorkQueue<std::vector<std::string> > & queue
+*/
+void FileUtils::VerifyProbable(WorkQueue<std::vector<std::string> >& queue)
+{
+  std::vector<std::string> probable;
+  
+  while(queue.Pop(probable))
+  {
+    std::vector<std::vector<std::string> > groups = GroupFiles(probable);
+    
+    /* Anything short of a single group holding every file means
+    the guess was wrong for at least one file */
+    if(groups.size() != 1 || groups[0].size() != probable.size())
+    {
+      PrintGroup(probable, "refuted ");
+    }
+    FileIdentity ident;
+    if(!StatFile(probable[0], ident))
+    {
+      ident.size = 0;
+    }
+    for(auto& group : groups)
+    {
+      PrintGroup(group, "verified ");
+      std::lock_guard<std::mutex> lock(output_lock);
+      dup_groups.push_back(group);
+      dup_sizes.push_back(ident.size);
+    }
+  }
+}
+
+/*! SampleFile
+This function hashes the head, the tail and quick_blocks randomly
+placed blocks of a file. Offsets only depend on the run seed and
+the file size so every file in a size group is sampled at the same
+places. Files smaller than the sample are simply hashed whole.
+
+@param const std::string & file
+@param uintmax_t size
+@param Digest & digest
+@return boolean
+If the file could be read
+*/
+bool FileUtils::SampleFile(const std::string& file, uintmax_t size, Digest& digest)
+{
+  const uintmax_t block = QUICK_BLOCK_SIZE;
+  std::vector<uintmax_t> offsets;
+  std::vector<char> buffer(block);
+  
+  if(size <= block * (quick_blocks + 2))
+  {
+    offsets.push_back(0);
+    while(offsets.back() + block < size)
+    {
+      offsets.push_back(offsets.back() + block);
+    }
+  }
+  else
+  {
+    std::mt19937_64 rng(quick_seed ^ (size * 0x9E3779B97F4A7C15ULL));
+    
+    offsets.push_back(0);
+    offsets.push_back(size - block);
+    for(unsigned int i = 0; i < quick_blocks; i++)
+    {
+      offsets.push_back(rng() % (size - block + 1));
+    }
+    /* Read in file order so the disk only ever seeks forward */
+    std::sort(offsets.begin(), offsets.end());
+  }
+  
+  int in = io->Open(file);
+  HashBlocks loop = {*io, in, buffer, &offsets, quick_bytes, digest, NULL, NULL, NULL};
+  
+  if(in < 0)
+  {
+    std::cout << "Could not open: " << file << std::endl;
+    return false;
+  }
+  
+  bool read = WithHashPolicy(hash_algorithm, loop);
+  io->Close(in);
+  if(!read)
+  {
+    std::cout << "Could not read: " << file << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! PrintGroup
+This function prints one group of matching files. Known files
+are marked when the known action asks for it.
+
+@param const std::vector<std::string> & group
+@param const char * label
+Printed in front of the group, used to tag verification results
+*/
+void FileUtils::PrintGroup(const std::vector<std::string>& group, const char* label)
+{
+  std::lock_guard<std::mutex> lock(output_lock);
+  
+  for(size_t i = 0; i < group.size(); i++)
+  {
+    /* First entry prints the header, every other entry is
+    printed as a continuation of the group */
+    if(i == 0)
+    {
+      std::cout << label << "[ " << group[i];
+    }
+    else
+    {
+      std::cout << (i == 1 ? "," : ", ") << std::endl
+        << "  " << group[i];
+    }
+    
+    if(known_loaded && known_action == KNOWN_FLAG &&
+       known_files.find(group[i]) != known_files.end())
+    {
+      std::cout << " (known)";
+    }
+  }
+  std::cout << " ]" << std::endl << std::endl;
+}
+
+/*! PrintDirReport
+This function reports the directory pairs that share the most
+duplicate bytes, with the share of each directory's content that
+has a copy in the other.
+*/
+void FileUtils::PrintDirReport()
+{
+  DirReport report;
+  
+  for(auto& x : file_map)
+  {
+    for(auto& file : x.second)
+    {
+      report.AddFile(file, x.first);
+    }
+  }
+  for(size_t i = 0; i < dup_groups.size(); i++)
+  {
+    report.AddGroup(dup_groups[i], dup_sizes[i]);
+  }
+  report.Compute(std::thread::hardware_concurrency());
+  report.Print(std::cout, dir_report);
+}
+
+/*! EstimateCompression
+This function reads the sample blocks of the unique data that the
+hashing and comparing did not read already, and takes its compression
+ratio. Unique data is the files outside any duplicate group and the
+first file of each group.
+*/
+void FileUtils::EstimateCompression()
+{
+  std::unordered_set<std::string> copies;
+  
+  for(auto& group : dup_groups)
+  {
+    copies.insert(group.begin() + 1, group.end());
+  }
+  
+  for(auto& x : file_map)
+  {
+    for(auto& file : x.second)
+    {
+      if(copies.count(file) > 0)
+      {
+        continue;
+      }
+      if(!estimator->SampleFile(*io, file, x.first))
+      {
+        std::cout << "Could not read: " << file << std::endl;
+      }
+    }
+  }
+  estimator->Finish();
+  
+  for(auto& x : file_map)
+  {
+    for(auto& file : x.second)
+    {
+      if(copies.count(file) == 0)
+      {
+        unique_bytes += x.first;
+        estimator->Totals(file, sampled_raw, sampled_packed);
+      }
+    }
+  }
+  estimator.reset();
+}
+
+/*! ExportBlockHashes
+This function completes the block hash database. The hashing pass
+reads every file when it is on, so only files it took a digest of
+without reading, from the cache, an xattr or fs-verity, are read
+here for their blocks.
+*/
+void FileUtils::ExportBlockHashes()
+{
+  std::vector<char> buffer(HASH_BUFFER_SIZE);
+  
+  for(auto& x : file_map)
+  {
+    for(auto& file : x.second)
+    {
+      FileIdentity ident;
+      
+      if(!StatFile(file, ident) || block_db->HasFile(file, ident))
+      {
+        continue;
+      }
+      
+      int in = io->Open(file);
+      if(in < 0)
+      {
+        std::cout << "Could not open: " << file << std::endl;
+        continue;
+      }
+      
+      uint64_t offset = 0;
+      ssize_t got;
+      block_db->BeginFile(file, ident);
+      while((got = io->Read(in, &buffer[0], buffer.size(), offset)) > 0)
+      {
+        block_db->Offer(file, offset, &buffer[0], got);
+        offset += got;
+      }
+      io->Close(in);
+      block_db->EndFile(file, got == 0);
+      if(got < 0)
+      {
+        std::cout << "Could not read: " << file << std::endl;
+      }
+    }
+  }
+  
+  block_hash_files = block_db->Files();
+  block_hashes = block_db->Hashes();
+  if(!block_db->Close())
+  {
+    std::cout << "Could not write block hashes: " << block_db_path << std::endl;
+  }
+  block_db.reset();
+}
+
+/*! PrintKnownFiles
+This function lists every file whose content was found in the
+known hash table.
+*/
+void FileUtils::PrintKnownFiles()
+{
+  std::cout << "Known Files: \n";
+  for(auto& file : known_files)
+  {
+    std::cout << "  " << file << std::endl;
+  }
+  std::cout << std::endl;
+}
+
+/*! RemoveDups
+This function hands every confirmed group to the remover and
+deletes all but one file of each. Files that can no longer be
+stat'ed are left out of their group.
+*/
+void FileUtils::RemoveDups()
+{
+  for(auto& group : dup_groups)
+  {
+    std::vector<std::string> files;
+    std::vector<FileIdentity> idents;
+
+    for(auto& file : group)
+    {
+      FileIdentity ident;
+
+      if(StatFile(file, ident))
+      {
+        files.push_back(file);
+        idents.push_back(ident);
+      }
+    }
+    remover->AddGroup(files, idents);
+  }
+
+  remover->Run();
+}
+
+/*! SaveScanIndex
+This function writes the Hash Map, every file found by the scan, as
+a ScanIndex. Paths are stored absolute like hash cache keys so scans
+reached through different roots line up.
+
+@return boolean
+If the index was written
+*/
+bool FileUtils::SaveScanIndex()
 {
-  /* Build a hashmap where we hash all files that are the 
-  same file size. We also build a set that contains all 
-  keys where there were more than one file. This set can be used
-  to access the hashmap to get all files that had matching sizes. 
-  
-  Comparing only files with matching sizes reduces the number of
-  comparisons done */
-  BuildFileMap(dir_path);
+  std::vector<IndexEntry> entries;
   
-  // Compare only files where keys (sizes) match 
-  CompareMatchingKeys();
+  for(auto& x : file_map)
+  {
+    for(auto& file : x.second)
+    {
+      IndexEntry entry;
+      
+      if(!StatFile(file, entry.ident))
+      {
+        continue;
+      }
+      auto digest = file_digests.find(file);
+      if(digest != file_digests.end() && !Digest::IsVerity(digest->second.algorithm))
+      {
+        entry.digest = digest->second;
+        entry.hashed = true;
+      }
+      entry.path = HashCache::Key(file);
+      entries.push_back(entry);
+    }
+  }
   
-  // Print stats about number of files scanned and total size of data
-  PrintMapStats();
+  return ScanIndex::Write(scan_index_path, entries);
 }
 
-/*! CompareFiles
-This function is used to compare two files to each other. The method
-is to open the file as a binary file and read in raw bytes for 
-comparison. We start with small buffer sizes and rapidly increase the
-buffer size used if the file continues to match.
+/*! One unit of work of the walk */
+struct FileUtils::WalkItem
+{
+  std::string dir;
+  uint64_t dev;
+  /*!< Device the directory is on */
+  bool listed;
+  /*!< If entries hold (part of) its listing, to be stat'ed */
+  std::vector<DirEntry> entries;
+};
 
-@param const std::string & file1
-@param const std::string & file2
+/*! BuildFileMap
+This function walks the tree under a root directory and pushes
+every regular file into the Hash Map based on its size.
+
+The walk is done by a pool of workers. Listing a directory and
+stat'ing its entries, in batches of WALK_BATCH, are separate units
+of work, so a large flat directory is stat'ed in parallel too. Each
+unit holds a slot of its device's concurrency controller. Files of
+every size are sorted afterwards, so the outcome does not depend on
+which worker got there first.
+
+@param const std::string & dir_path
+Root directory to build the Hash Map from.
 @return boolean
-If files are the same or not
+If has map building succeeds or not. 
 */
-bool FileUtils::CompareFiles(const std::string& file1, const std::string& file2)
+bool FileUtils::BuildFileMap(const std::string& dir_path)
 {
-  /* raw C file pointers are much faster at reading in 
-  files than ifstream objects. */
-  FILE* if1 = fopen(file1.c_str(),"rb");
-  FILE* if2 = fopen(file2.c_str(),"rb");
-  char *block1;
-  char *block2;
-  unsigned int size = 0;
-  unsigned int pass = 0;
+  const boost::filesystem::path root(dir_path.c_str());
+  WorkQueue<WalkItem> queue;
+  std::atomic<size_t> pending(1);
+  std::vector<std::thread> workers;
+  WalkItem item;
+  FileStat st;
   
-  if(if1 == NULL)
+  // In case user inputs bad path and didn't check first themselves
+  if ( !io->Stat( dir_path, st ) ) 
   {
-    std::cout << "Could not open: " << file1 << std::endl;
+    std::cerr << "Root directory" << root << "does not exist\n";
     return false;
   }
-  if(if2 == NULL)
+  
+  if ( !io->ListDir( dir_path, item.entries ) )
   {
-    std::cout << "Could not open: " << file2 << std::endl;
+    std::cerr << "Could not read directory " << root << std::endl;
     return false;
   }
+  SortListing( item.entries );
+  item.dir = dir_path;
+  item.dev = st.ident.dev;
+  item.listed = true;
+  queue.Push(item);
   
-  /* Continue to compare files with increasing buffer sizes
-  until we reach the end of the file, or there is a difference
-  in the comparisons */
-  do {
-    if(pass < MAX_PASS)
-    {
-      size = BUFFER_SIZE[pass++];
-    }
-    
-    block1 = new char[size]();
-    block2 = new char[size]();
-    
-    fread(block1, 1, size,if1);
-    fread(block2, 1, size,if2);
-
-    /* compare binary blocks of data */
-    if (memcmp(block1, block2, size) != 0)
-    {
-      delete[] block1;
-      delete[] block2;
-      fclose(if1);
-      fclose(if2);
-      return false;
-    }
-    
-    delete[] block1;
-    delete[] block2;
-  } while ((feof(if1) == 0) && (feof(if2) == 0));
+  for ( unsigned int t = 0; t < walk_limits.MaxLimit(); t++ )
+  {
+    workers.push_back( std::thread( &FileUtils::WalkWorker, this,
+                                    std::ref( queue ), std::ref( pending ) ) );
+  }
+  for ( auto& worker : workers )
+  {
+    worker.join();
+  }
+  RestoreSpilled();
   
-  fclose(if1);
-  fclose(if2);
+  for ( auto& x : file_map )
+  {
+    std::sort( x.second.begin(), x.second.end() );
+  }
+  /* Flag that we have built the full map of all files */
+  map_built = true;
   
   return true;
 }
 
-/*! CompareMatchingKeys
-This function iterates through the Hash Map of files hashed
-based on size. It will attempt to compare files only if they
-have the same size. Each time two files are compared, if they
-are found to be the same size they are pushed into a set so
-that we do not compare two same files more than once as we
-permute through all possible matches 
+/*! SortListing
+This function puts a directory listing in the order its entries
+are stat'ed and descended in. On ext4 and XFS readdir returns names
+in hash order, which scatters the inode reads over the inode table;
+in inode order they move forward through it, and each batch of
+WALK_BATCH entries covers a narrow range of it.
+
+@param std::vector<DirEntry> & entries
 */
-void FileUtils::CompareMatchingKeys()
+void FileUtils::SortListing( std::vector<DirEntry>& entries ) const
 {
-  std::vector<std::string>::iterator i,j;
-  std::set<std::string> existing_matches;
-  bool first_match, match_found;
-  
-  std::cout << "Matching Files: \n";
+  if ( walk_order == WALK_INODE )
+  {
+    std::sort( entries.begin(), entries.end(),
+               []( const DirEntry& a, const DirEntry& b ) { return a.ino < b.ino; } );
+  }
+}
+
+/*! WalkWorker
+This function runs walk units until the walk is complete. The
+last unit to finish closes the queue.
+
+@param WorkQueue<WalkItem> & queue
+@param std::atomic<size_t> & pending
+Units pushed and not yet finished
+*/
+void FileUtils::WalkWorker(WorkQueue<WalkItem>& queue, std::atomic<size_t>& pending)
+{
+  WalkItem item;
   
-  /* Iterate of Hash Map */
-  for(auto& x : matching_keys)
+  while ( queue.Pop( item ) )
   {
-    /* Get the current vector of files with the same size */
-    std::vector<std::string> &curr = file_map[x];  
+    ConcurrencyController& limit = walk_limits.For( item.dev );
+    
+    limit.Acquire();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t units = Walk( item, queue, pending );
+    limit.Release( units, std::chrono::duration<double, std::micro>(
+                     std::chrono::steady_clock::now() - start ).count() );
     
-    /* Compare all files with the same size against the others */
-    for(i=curr.begin();i!=curr.end();i++)
+    if ( --pending == 0 )
     {
-      first_match = true;
-      match_found = false;
-      for(j=i+1;j!=curr.end();j++)
-      {
-        /* Check in the set if we are comparing against something
-        we already have matched with */
-        if(existing_matches.find(*i) != existing_matches.end())
-        {
-          continue;
-        }
-        
-        /* Compare the two files here. Heart of work being done. */
-        if(CompareFiles(*i,*j))
-        {
-          /* If this is the first match in this set, print header
-          info for match as well as match */
-          if(first_match)
-          {
-            std::cout << "[ " << *i << "," << std::endl
-                 << "  " << *j;
-            match_found = true;
-            first_match = false;
-          }
-          /* Else just print current match */
-          else
-          {
-            std::cout << ", " << std::endl
-              << "  "  << *j;
-          }
-          /* Insert current match to set */
-          existing_matches.insert(*j);
-        }
-      }
-      /* If the current iteration matched with anything push
-      it into the set */
-      if(match_found)
-      {
-        std::cout << " ]" << std::endl << std::endl; 
-        existing_matches.insert(*i); 
-      } /* if(match_found) */
-    } /* for(i=curr.begin();i!=curr.end();i++) */
-  } /* for(auto& x : matching_keys) */
+      queue.Close();
+    }
+  }
 }
 
-/*! BuildFileMap
-This function iterates through the Hash Map of files hashed
-based on size. It will attempt to compare files only if they
-have the same size. Each time two files are compared, if they
-are found to be the same size they are pushed into a set so
-that we do not compare two same files more than once as we
-permute through all possible matches
+/*! Walk
+This function does one unit of the walk. A directory to list is
+sorted (see SortListing) and split into batches of entries, entries
+are stat'ed, following
+symlinks since we need the size anyway. Directories found become
+new units, files go into the Hash Map.
 
-@param const boost::filesystem::path & dir_path
-Root directory to build the Hash Map from.
-@return boolean
-If has map building succeeds or not. 
+@param const WalkItem & item
+@param WorkQueue<WalkItem> & queue
+@param std::atomic<size_t> & pending
+@return uint64_t
+Operations done
 */
-bool FileUtils::BuildFileMap(const std::string& dir_path)
+uint64_t FileUtils::Walk(const WalkItem& item, WorkQueue<WalkItem>& queue,
+                         std::atomic<size_t>& pending)
 {
-  const boost::filesystem::path root(dir_path.c_str());
+  const boost::filesystem::path root(item.dir.c_str());
+  std::vector<DirEntry> entries;
+  FileStat st;
   
-  // In case user inputs bad path and didn't check first themselves
-  if ( !exists( root ) ) 
+  if ( !item.listed )
   {
-    std::cerr << "Root directory" << root << "does not exist\n";
-    return false;
+    if ( !io->ListDir( item.dir, entries ) )
+    {
+      std::cerr << "Could not read directory " << root << std::endl;
+      return 1;
+    }
+    SortListing( entries );
+  }
+  const std::vector<DirEntry>& listing = item.listed ? item.entries : entries;
+  
+  if ( !item.listed || listing.size() > WALK_BATCH )
+  {
+    for ( size_t i = 0; i < listing.size(); i += WALK_BATCH )
+    {
+      WalkItem batch;
+      batch.dir = item.dir;
+      batch.dev = item.dev;
+      batch.listed = true;
+      batch.entries.assign( listing.begin() + i,
+                            listing.begin() + std::min<size_t>( i + WALK_BATCH, listing.size() ) );
+      pending++;
+      queue.Push( batch );
+    }
+    return 1;
   }
   
-  boost::filesystem::directory_iterator end_itr; 
+  /* Keep the identity for the hash cache and the scan index,
+  saves a second stat */
+  bool keep_idents = !hash_cache_path.empty() || hash_cache.Size() > 0 ||
+                     !scan_index_path.empty() || xattr_hashes ||
+                     ( assume_fields & ASSUME_MTIME );
+  std::vector<std::pair<std::string,FileIdentity> > files;
   
-  for ( boost::filesystem::directory_iterator itr( root );
-        itr != end_itr;
-        ++itr )
+  for ( auto& entry : listing )
   {
+    const std::string path = (root / entry.name).string();
+    
+    if ( !io->Stat( path, st ) )
+    {
+      continue;
+    }
+    
     /* If current item is a directory iterate into directory to get files */
-    if ( is_directory(itr->status()) )
+    if ( st.type == ENTRY_DIR )
     {
-      BuildFileMap( itr->path().string() );
+      WalkItem dir;
+      dir.dir = path;
+      dir.dev = st.ident.dev;
+      dir.listed = false;
+      pending++;
+      queue.Push( dir );
     }
     /* If this is a file, read size and push to map */
-    else if ( is_regular_file(itr->status()) ) 
+    else if ( st.type == ENTRY_FILE ) 
+    {
+      files.push_back( std::make_pair( path, st.ident ) );
+    }
+  }
+  
+  std::lock_guard<std::mutex> lock( map_lock );
+  for ( auto& file : files )
+  {
+    if ( keep_idents )
     {
-      int size = file_size(itr->path());
+      file_idents[file.first] = file.second;
+    }
+    /* Push absolute path into the map based on filesize */
+    AddToMap( file.first, file.second.size );
+  }
+  return listing.size();
+}
+
+/*! BuildFileMapFromList
+This function builds the Hash Map from a file list instead of a
+directory walk. Files listed without a size are stat'ed, files
+listed with their full stat identity keep it so the hash cache
+can be checked without touching the file.
 
-      /* Push absolute path into the map based on filesize */
-      file_map[size].push_back(itr->path().string());
+@param FileList & list
+@return boolean
+If the list was read without errors
+*/
+bool FileUtils::BuildFileMapFromList(FileList& list)
+{
+  FileRecord record;
+  unsigned long missing = 0;
+  
+  while(list.Next(record))
+  {
+    if(!record.have_size)
+    {
+      FileStat st;
       
-      /* Check if we have already seen a file of this size
-         Push all Keys with multiple entries into vector */
-      if(file_map[size].size() > 1)
+      if(!io->Stat(record.path, st) || st.type != ENTRY_FILE)
       {
-        matching_keys.insert(size);
+        missing++;
+        continue;
       }
+      record.ident = st.ident;
+      record.have_ident = true;
     }
+    
+    if(record.have_ident)
+    {
+      file_idents[record.path] = record.ident;
+    }
+    AddToMap(record.path, record.ident.size);
+  }
+  
+  if(list.BadRecords() > 0 || missing > 0)
+  {
+    std::cerr << "Skipped " << list.BadRecords() << " malformed records and "
+              << missing << " missing or non-regular files\n";
   }
+  RestoreSpilled();
+  
   /* Flag that we have built the full map of all files */
   map_built = true;
   
+  return list.BadRecords() == 0;
+}
+
+/*! AddToMap
+This function pushes a file into the Hash Map based on its size
+and tracks keys that have more than one entry. Every SPILL_CHECK
+files memory pressure is checked, under pressure the map sheds
+what it can.
+
+@param const std::string & file
+@param uintmax_t size
+*/
+void FileUtils::AddToMap(const std::string& file, uintmax_t size)
+{
+  std::vector<std::string>& files = file_map[size];
+  
+  files.push_back(file);
+  
+  /* Check if we have already seen a file of this size
+     Push all Keys with multiple entries into vector */
+  if(files.size() > 1 ||
+     (!spilled_sizes.empty() && spilled_sizes.count(size) > 0))
+  {
+    matching_keys.insert(size);
+  }
+  
+  if(++map_adds % SPILL_CHECK == 0 && CheckMemory() != PRESSURE_NONE)
+  {
+    SpillMap();
+  }
+}
+
+/*! CheckMemory
+This function samples memory pressure, at most once per poll
+interval, and adapts to it: the comparison buffers get a quarter
+of our memory limit, less under pressure, and every device runs
+fewer operations at once while the pressure lasts.
+
+@return PressureLevel
+*/
+PressureLevel FileUtils::CheckMemory()
+{
+  bool fresh = false;
+  PressureLevel level = memory.Poll(fresh);
+  
+  if(!fresh)
+  {
+    return level;
+  }
+  
+  uint64_t budget = std::min<uint64_t>(BufferPool::DEFAULT_BUDGET, memory.Limit() / 4);
+  if(level == PRESSURE_SOME)
+  {
+    budget /= 8;
+  }
+  else if(level == PRESSURE_HIGH)
+  {
+    budget = 0;
+  }
+  buffers.SetBudget(std::max<uint64_t>(budget, BufferPool::MIN_BUFFER * 2));
+  
+  if(level != PRESSURE_NONE)
+  {
+    pressure_events++;
+    walk_limits.Backoff();
+    compare_limits.Backoff();
+  }
+  return level;
+}
+
+/*! SpillMap
+This function moves every size seen only once so far out of the
+Hash Map into a temporary file, along with the stat identity of
+the file. Most sizes never get a second file, RestoreSpilled()
+brings back the ones that did once the map is complete. Not done
+when every file is needed later, for the known table, the scan
+index, text normalization, the search for truncated copies, the
+compression estimate or the block hashes.
+*/
+void FileUtils::SpillMap()
+{
+  if(known_loaded || !scan_index_path.empty() || normalize_formats != 0 ||
+     normalize_text || find_truncated || estimate_every > 0 || !block_db_path.empty())
+  {
+    return;
+  }
+  if(spill_file == NULL && (spill_file = tmpfile()) == NULL)
+  {
+    return;
+  }
+  
+  for(auto x = file_map.begin(); x != file_map.end(); )
+  {
+    if(x->second.size() != 1 || matching_keys.count(x->first) > 0)
+    {
+      ++x;
+      continue;
+    }
+    
+    const std::string& file = x->second[0];
+    uint64_t size = x->first;
+    uint32_t len = file.size();
+    
+    if(fwrite(&size, sizeof(size), 1, spill_file) != 1 ||
+       fwrite(&len, sizeof(len), 1, spill_file) != 1 ||
+       fwrite(file.data(), 1, len, spill_file) != len)
+    {
+      break;
+    }
+    file_idents.erase(file);
+    spilled_sizes.insert(x->first);
+    x = file_map.erase(x);
+  }
+  fflush(spill_file);
+}
+
+/*! RestoreSpilled
+This function reads back the spilled files whose size was seen
+again, the others are only counted for the stats.
+*/
+void FileUtils::RestoreSpilled()
+{
+  uint64_t size;
+  uint32_t len;
+  std::string file;
+  
+  if(spill_file == NULL)
+  {
+    return;
+  }
+  
+  rewind(spill_file);
+  while(fread(&size, sizeof(size), 1, spill_file) == 1 &&
+        fread(&len, sizeof(len), 1, spill_file) == 1)
+  {
+    file.resize(len);
+    if(len > 0 && fread(&file[0], 1, len, spill_file) != len)
+    {
+      break;
+    }
+    if(matching_keys.count(size) > 0)
+    {
+      file_map[size].push_back(file);
+    }
+    else
+    {
+      spilled_files++;
+      spilled_bytes += size;
+    }
+  }
+  
+  fclose(spill_file);
+  spill_file = NULL;
+  spilled_sizes.clear();
+}
+
+/*! StatFile
+This function gets the stat identity of a regular file, from the
+walk or the file list when we already have it.
+
+@param const std::string & file
+@param FileIdentity & ident
+@return boolean
+If the file is a regular file that could be stat'ed
+*/
+bool FileUtils::StatFile(const std::string& file, FileIdentity& ident)
+{
+  auto known = file_idents.find(file);
+  FileStat st;
+  
+  if(known != file_idents.end())
+  {
+    ident = known->second;
+    return true;
+  }
+  if(!io->Stat(file, st) || st.type != ENTRY_FILE)
+  {
+    return false;
+  }
+  ident = st.ident;
   return true;
 }
 
@@ -272,8 +2183,8 @@ about the hashmap.
 */
 void FileUtils::PrintMapStats()
 {
-  int num_files = 0;
-  double total_size = 0;
+  uintmax_t num_files = spilled_files;
+  double total_size = (double)spilled_bytes/(double)(1<<20);
   
   for(auto& x : file_map)
   {
@@ -285,4 +2196,80 @@ void FileUtils::PrintMapStats()
        << "-- Stats -- \n"
        << "Number of files scanned: " << num_files << std::endl
        << "Total data compared:     " << total_size << "MB" << std::endl;
+  
+  io->PrintStats(std::cout);
+  walk_limits.PrintStats(std::cout, "Walk concurrency:        ");
+  compare_limits.PrintStats(std::cout, "Compare concurrency:     ");
+  
+  if(quick_blocks > 0)
+  {
+    std::cout << "Data sampled:            "
+              << (double)quick_bytes/(double)(1<<20) << "MB" << std::endl;
+  }
+  
+  if(known_loaded)
+  {
+    std::cout << "Known files found:       " << known_files.size() << std::endl;
+  }
+  
+  if(xattr_hashes)
+  {
+    std::cout << "Digests from xattrs:     " << xattr_hits << std::endl;
+  }
+  
+  if(verity_hits > 0)
+  {
+    std::cout << "Digests from fs-verity:  " << verity_hits << std::endl;
+  }
+  
+  if(normalize_formats != 0)
+  {
+    std::cout << "Archives normalized:     " << normalized_files << std::endl;
+  }
+  
+  if(normalize_text)
+  {
+    std::cout << "Text files normalized:   " << text_files
+              << " (" << binary_files << " binary skipped)" << std::endl;
+  }
+  
+  if(estimate_every > 0)
+  {
+    double ratio = sampled_raw > 0 ? (double)sampled_packed / (double)sampled_raw : 1.0;
+    double total = total_size * (double)(1 << 20);
+    double stored = (double)unique_bytes * ratio;
+    
+    std::cout << "Unique data:             "
+              << (double)unique_bytes/(double)(1<<20) << "MB, deflates to ~"
+              << stored/(double)(1<<20) << "MB ("
+              << (double)sampled_raw/(double)(1<<20) << "MB sampled)" << std::endl
+              << "Dedup and compression:   ~"
+              << (total - stored)/(double)(1<<20) << "MB saved, "
+              << (total > 0 ? 100.0 * (total - stored) / total : 0.0) << "%" << std::endl;
+  }
+  
+  if(!block_db_path.empty())
+  {
+    std::cout << "Block hashes written:    " << block_hashes << " blocks of "
+              << block_hash_files << " files to " << block_db_path << std::endl;
+  }
+  
+  if(find_truncated)
+  {
+    std::cout << "Truncated copies:        " << truncated_files << std::endl
+              << "Leading blocks read:     "
+              << (double)prefix_bytes/(double)(1<<20) << "MB" << std::endl;
+  }
+  
+  if(hash_selected || quick_blocks > 0)
+  {
+    std::cout << "Hash algorithm:          " << Digest::NameOf(hash_algorithm)
+              << " (cpu: " << CpuFeatures::Get().ToString() << ")" << std::endl;
+  }
+  
+  if(pressure_events > 0)
+  {
+    std::cout << "Memory pressure events:  " << pressure_events << std::endl
+              << "Files spilled to disk:   " << spilled_files << std::endl;
+  }
 }
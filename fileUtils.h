@@ -9,7 +9,48 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <unordered_set>
+#include <cstdio>
 #include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include "contentHash.h"
+#include "knownHashes.h"
+#include "hashCache.h"
+#include "fileList.h"
+#include "ioBackend.h"
+#include "dupRemover.h"
+#include "concurrencyController.h"
+#include "memoryPressure.h"
+#include "compressEstimator.h"
+#include "blockHashDb.h"
+
+/*! What to do with files whose content is in the known hash table */
+enum KnownAction
+{
+  KNOWN_REPORT, /*!< List known files after the duplicate groups */
+  KNOWN_FLAG,   /*!< Mark known files inside the duplicate groups */
+  KNOWN_SKIP    /*!< Leave known files out of duplicate detection */
+};
+
+/*! Metadata that makes files of the same size assumed duplicates */
+enum AssumeField
+{
+  ASSUME_NAME  = 1 << 0, /*!< Same file name, in any directory */
+  ASSUME_SIZE  = 1 << 1, /*!< Same size, always implied */
+  ASSUME_MTIME = 1 << 2  /*!< Same modification time */
+};
+
+/*! Order the entries of a directory are stat'ed and descended in */
+enum WalkOrder
+{
+  WALK_INODE,  /*!< By inode number, close to the inode table layout */
+  WALK_READDIR /*!< As readdir returns them, hash order on ext4 and XFS */
+};
+
+template <typename T> class WorkQueue;
 
 /*!
   This class is used to provide utitilies for searching, manipulating, 
@@ -25,26 +66,213 @@ class FileUtils
 public:
   /*! Constructor */
   FileUtils()
-    :map_built(false) {}
+    :map_built(false), known_loaded(false), known_action(KNOWN_REPORT),
+     xattr_hashes(false), xattr_hits(0), verity_hits(0), quick_blocks(0), quick_verify(false),
+     quick_seed(0), quick_bytes(0), assume_fields(0), map_adds(0),
+     spill_file(NULL), spilled_files(0), spilled_bytes(0), pressure_events(0),
+     normalize_formats(0), normalized_files(0), hash_algorithm(HASH_SHA256),
+     hash_selected(false), walk_order(WALK_INODE), dir_report(0),
+     find_truncated(false), truncated_files(0), prefix_bytes(0),
+     normalize_text(false), text_files(0), binary_files(0),
+     estimate_every(0), unique_bytes(0), sampled_raw(0), sampled_packed(0),
+     block_hash_files(0), block_hashes(0),
+     io(new PosixBackend())
+  {
+    SetIoThreads(0);
+  }
   void FindDups( const std::string& dir_path );
+  void FindDupsFromList( FileList& list );
+  bool LoadKnownHashes( const std::string& table_path, KnownAction action );
+  bool LoadHashCache( const std::string& cache_path );
+  bool ImportManifest( const std::string& manifest_path );
+  void SetQuickMode( unsigned int blocks, bool verify );
+  bool SetAssumeSame( const std::string& spec );
+  void SetNormalize( unsigned int formats ) { normalize_formats = formats; }
+  bool SetHashAlgorithm( const std::string& name );
+  void SetIoBackend( IoBackend* backend );
+  void SetRemover( DupRemover* dup_remover );
+  void SetScanIndex( const std::string& index_path );
+  void SetXattrHashes( bool enable ) { xattr_hashes = enable; }
+  void SetIoThreads( unsigned int threads );
+  void SetWalkOrder( WalkOrder order ) { walk_order = order; }
+  void SetDirReport( unsigned int top ) { dir_report = top; }
+  void SetFindTruncated( bool enable ) { find_truncated = enable; }
+  void SetNormalizeText( bool enable ) { normalize_text = enable; }
+  void SetEstimateCompression( unsigned int every ) { estimate_every = every; }
+  void SetBlockHashes( const std::string& db_path ) { block_db_path = db_path; }
+  bool WalkTree( const std::string& dir_path, uintmax_t& files );
   
 protected:
+  struct WalkItem;
   bool BuildFileMap(const std::string& dir_path);
+  void SortListing(std::vector<DirEntry>& entries) const;
+  void WalkWorker(WorkQueue<WalkItem>& queue, std::atomic<size_t>& pending);
+  uint64_t Walk(const WalkItem& item, WorkQueue<WalkItem>& queue,
+                std::atomic<size_t>& pending);
+  bool BuildFileMapFromList(FileList& list);
+  void AddToMap(const std::string& file, uintmax_t size);
+  PressureLevel CheckMemory();
+  void SpillMap();
+  void RestoreSpilled();
+  bool StatFile(const std::string& file, FileIdentity& ident);
+  void FindDupsInMap();
   void PrintMap();
   void PrintMapStats();
   void CompareMatchingKeys();
-  bool CompareFiles(const std::string& file1, const std::string& file2);
+  std::vector<std::vector<std::string> > GroupFiles(const std::vector<std::string>& files);
+  bool CompareFiles(const std::string& file1, const std::string& file2,
+                    uintmax_t limit = UINTMAX_MAX);
+  void QuickMatchingKeys();
+  bool SampleFile(const std::string& file, uintmax_t size, Digest& digest);
+  void AssumedMatchingKeys();
+  void NormalizeArchives();
+  void NormalizeText();
+  void PrintNormalizedGroups(const std::unordered_map<std::string,Digest>& canonical,
+                             const char* label);
+  void FindTruncatedCopies();
+  bool HashLeadingBlock(const std::string& file, Digest& digest);
+  void VerifyProbable(WorkQueue<std::vector<std::string> >& queue);
+  void LookupCachedDigests();
+  void MeasureVerity();
+  void HashFiles();
+  bool HashFile(const std::string& file, Digest& digest);
+  void PrintGroup(const std::vector<std::string>& group, const char* label = "");
+  void PrintKnownFiles();
+  void PrintDirReport();
+  void EstimateCompression();
+  void ExportBlockHashes();
+  void RemoveDups();
+  bool SaveScanIndex();
   
 private:
   static const unsigned char MAX_PASS = 6;
   static const unsigned int BUFFER_SIZE[MAX_PASS];
+  static const unsigned int HASH_BUFFER_SIZE = 1 << 20;
+  static const unsigned int QUICK_BLOCK_SIZE = 1 << 16;
+  static const unsigned int PREFIX_BLOCK_SIZE = 1 << 12;
+  static const unsigned int MAX_PREFIX_TRIES = 64;
+  static const unsigned int MAX_IO_THREADS = 64;
+  static const unsigned int WALK_BATCH = 64;
+  static const unsigned int SPILL_CHECK = 4096;
   
-  std::unordered_map<int,std::vector<std::string> > file_map;
+  std::unordered_map<uintmax_t,std::vector<std::string> > file_map;
   /*! Hash Map used to has files disovered based on filesize */
   bool map_built;
   /*! Informs if the Hash Map has been build or not for this instance */
-  std::set<int> matching_keys;
+  std::set<uintmax_t> matching_keys;
   /*! Set of Keys that have more than one entry in the Hash Map */
+  std::unordered_map<std::string,FileIdentity> file_idents;
+  /*! Stat identities from the walk or the file list, kept when
+      the hash cache needs them */
+  std::vector<std::vector<std::string> > dup_groups;
+  /*! Groups of files confirmed to have identical content */
+  std::vector<uintmax_t> dup_sizes;
+  /*! File size of each group in dup_groups */
+  std::unordered_map<std::string,Digest> file_digests;
+  /*! Content digest of every file hashed during this run */
+  KnownHashes known_hashes;
+  /*! Table of digests for content that is already known */
+  bool known_loaded;
+  /*! Informs if a known hash table was loaded */
+  KnownAction known_action;
+  /*! How known files are treated */
+  std::set<std::string> known_files;
+  /*! Files whose content was found in the known hash table */
+  HashCache hash_cache;
+  /*! Digests recorded for files by earlier runs or manifests */
+  std::string hash_cache_path;
+  /*! Where the hash cache is saved, empty to keep it in memory */
+  std::string scan_index_path;
+  /*! Where every scanned file is saved as a ScanIndex, empty for none */
+  bool xattr_hashes;
+  /*! Informs if digests are kept in extended attributes on the files */
+  unsigned long xattr_hits;
+  /*! Files whose digest was read from their extended attribute */
+  std::unordered_set<std::string> xattr_digested;
+  /*! Files whose digest came from an extended attribute, anyone who can write the file can set it */
+  unsigned long verity_hits;
+  /*! Files whose fs-verity digest was used */
+  std::unordered_set<uint64_t> verity_unsupported;
+  /*! Devices whose filesystem has no fs-verity */
+  unsigned int quick_blocks;
+  /*! Random blocks sampled per file in quick mode, 0 when disabled */
+  bool quick_verify;
+  /*! Informs if probable groups are fully verified in the background */
+  uint64_t quick_seed;
+  /*! Per run seed for the sampled block offsets */
+  uintmax_t quick_bytes;
+  /*! Bytes read while sampling */
+  unsigned int assume_fields;
+  /*! AssumeField flags of the metadata fast mode, 0 when disabled */
+  std::mutex output_lock;
+  /*! Serializes output from background verification */
+  std::mutex map_lock;
+  /*! Serializes walk workers adding files to the Hash Map */
+  DeviceConcurrency walk_limits;
+  /*! Directory listings and stats in flight per device */
+  DeviceConcurrency compare_limits;
+  /*! Size groups being compared at once per device */
+  MemoryMonitor memory;
+  /*! Memory pressure of the host and our cgroup */
+  BufferPool buffers;
+  /*! Read buffers of the comparisons */
+  uintmax_t map_adds;
+  /*! Files pushed into the Hash Map, paces the pressure checks */
+  FILE* spill_file;
+  /*! Sizes seen once, moved out of the Hash Map under pressure */
+  std::unordered_set<uintmax_t> spilled_sizes;
+  /*! Sizes that have a file in the spill file */
+  uintmax_t spilled_files;
+  uintmax_t spilled_bytes;
+  /*! Spilled files no other file had the size of */
+  std::atomic<unsigned long> pressure_events;
+  /*! Times memory pressure made us back off, counted by the compare workers */
+  unsigned int normalize_formats;
+  /*! ArchiveFormat flags of archives compared in canonical form */
+  unsigned long normalized_files;
+  /*! Archives a canonical digest was computed for */
+  unsigned char hash_algorithm;
+  /*! HashAlgorithm of the digests computed for comparisons */
+  bool hash_selected;
+  /*! Informs if files are grouped on digests instead of compared */
+  WalkOrder walk_order;
+  /*! Order each directory listing is stat'ed and descended in */
+  unsigned int dir_report;
+  /*! Directory pairs to report sharing the most duplicates, 0 for none */
+  bool find_truncated;
+  /*! Informs if files are matched against the start of larger files */
+  unsigned long truncated_files;
+  /*! Files found to be the start of a larger file */
+  uintmax_t prefix_bytes;
+  /*! Bytes read hashing leading blocks */
+  bool normalize_text;
+  /*! Informs if text files are also compared ignoring line endings
+      and trailing whitespace */
+  unsigned long text_files;
+  unsigned long binary_files;
+  /*! Files normalized as text, and left alone as binary */
+  unsigned int estimate_every;
+  /*! One block in this many is deflated to estimate compression, 0
+      when not estimated */
+  std::unique_ptr<CompressEstimator> estimator;
+  /*! Deflates the sampled blocks, during the scan only */
+  uintmax_t unique_bytes;
+  /*! Bytes of all files, counting each duplicate group once */
+  uintmax_t sampled_raw;
+  uintmax_t sampled_packed;
+  /*! Sampled bytes of the unique files, before and after deflate */
+  std::string block_db_path;
+  /*! Where the block hashes of every file are written, empty for none */
+  std::unique_ptr<BlockHashDb> block_db;
+  /*! Takes the block hashes of files as they are read, during the scan
+      only */
+  uint64_t block_hash_files;
+  uint64_t block_hashes;
+  /*! Rows written to the block hash database */
+  std::unique_ptr<IoBackend> io;
+  /*! Storage every open, read, stat and listing goes through */
+  std::unique_ptr<DupRemover> remover;
+  /*! Deletes the confirmed duplicates when set */
 };
 
 #endif /* FILE_UTILS_H */
\ No newline at end of file
@@ -0,0 +1,531 @@
+/*!
+  @file hashCache.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include "boost/filesystem.hpp"
+#include "hashCache.h"
+#include "scanIndex.h"
+
+static const char HASH_CACHE_HEADER[] = "# file_utils hash cache 1";
+
+/*! StatIdentity
+Stat a regular file and fill in its identity
+
+@param const std::string & path
+@param FileIdentity & ident
+@return boolean
+If the path is a regular file that could be stat'ed
+*/
+bool StatIdentity(const std::string& path, FileIdentity& ident)
+{
+  struct stat st;
+
+  if(stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    return false;
+  }
+
+  ident.size = st.st_size;
+#if defined(__APPLE__)
+  ident.mtime_sec = st.st_mtimespec.tv_sec;
+  ident.mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+  ident.mtime_sec = st.st_mtim.tv_sec;
+  ident.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+  ident.dev = st.st_dev;
+  ident.ino = st.st_ino;
+  return true;
+}
+
+/*! EscapePath
+Paths are the last field on a line, only newlines and backslashes
+need escaping. Same convention as sha256sum. */
+std::string EscapePath(const std::string& path)
+{
+  std::string out;
+
+  for(auto c : path)
+  {
+    if(c == '\\')      out += "\\\\";
+    else if(c == '\n') out += "\\n";
+    else               out += c;
+  }
+  return out;
+}
+
+/*! UnescapePath
+Reverse of EscapePath */
+std::string UnescapePath(const std::string& path)
+{
+  std::string out;
+
+  for(size_t i = 0; i < path.size(); i++)
+  {
+    if(path[i] == '\\' && i + 1 < path.size())
+    {
+      i++;
+      out += (path[i] == 'n') ? '\n' : path[i];
+    }
+    else
+    {
+      out += path[i];
+    }
+  }
+  return out;
+}
+
+/*! Key
+Cache keys are absolute and normalized so the same file is found no
+matter which root or manifest it was reached from.
+
+@param const std::string & path
+@return std::string
+*/
+std::string HashCache::Key(const std::string& path)
+{
+  return boost::filesystem::absolute(path).lexically_normal().string();
+}
+
+/*! ParseCacheLine
+Split one cache line into path, identity and digest. Fields are
+parsed by hand, caches of whole filesystems have millions of lines.
+
+@return boolean
+If the line was well formed
+*/
+static bool ParseCacheLine(const std::string& line, std::string& path,
+                           FileIdentity& ident, Digest& digest)
+{
+  const char* p = line.c_str();
+  char* end;
+  unsigned long algorithm = strtoul(p, &end, 10);
+
+  if(end == p)
+  {
+    return false;
+  }
+  ident.size = strtoull(p = end, &end, 10);
+  ident.mtime_sec = strtoll(p = end, &end, 10);
+  ident.mtime_nsec = strtoll(p = end, &end, 10);
+  ident.dev = strtoull(p = end, &end, 10);
+  ident.ino = strtoull(p = end, &end, 10);
+  if(end == p || *end != ' ')
+  {
+    return false;
+  }
+
+  /* Hex digest, then the path is the rest of the line after a single space */
+  const char* hex = end + 1;
+  const char* space = strchr(hex, ' ');
+  if(space == NULL || algorithm > 0xff ||
+     !Digest::FromHex(hex, space - hex, (unsigned char)algorithm, digest))
+  {
+    return false;
+  }
+
+  /* Most paths have nothing escaped */
+  const char* name = space + 1;
+  size_t name_len = line.size() - (name - line.c_str());
+  if(memchr(name, '\\', name_len) == NULL)
+  {
+    path.assign(name, name_len);
+  }
+  else
+  {
+    path = UnescapePath(std::string(name, name_len));
+  }
+  return true;
+}
+
+/*! HashCache
+Constructor, out of line so ScanIndex can stay a forward declaration */
+HashCache::HashCache()
+{
+}
+
+HashCache::~HashCache()
+{
+}
+
+/*! Size
+Number of cached digests, counting loaded and new ones */
+size_t HashCache::Size() const
+{
+  return entries.size() + (base ? base->Count() : 0);
+}
+
+/*! Load
+Open a cache written by Save(), or read one in the older text
+format. A missing cache file is not an error, it simply means nothing
+has been cached yet.
+
+@param const std::string & cache_path
+@return boolean
+If the cache could be read
+*/
+bool HashCache::Load(const std::string& cache_path)
+{
+  if(ScanIndex::IsIndex(cache_path))
+  {
+    base.reset(new ScanIndex());
+    if(!base->Open(cache_path))
+    {
+      base.reset();
+      return false;
+    }
+    return true;
+  }
+
+  std::ifstream in(cache_path.c_str());
+  std::string line, path;
+  unsigned long bad_lines = 0;
+
+  if(!in)
+  {
+    return !boost::filesystem::exists(cache_path);
+  }
+
+  if(!std::getline(in, line) || line != HASH_CACHE_HEADER)
+  {
+    std::cerr << "Not a hash cache: " << cache_path << std::endl;
+    return false;
+  }
+
+  while(std::getline(in, line))
+  {
+    Entry entry;
+
+    if(!ParseCacheLine(line, path, entry.ident, entry.digest))
+    {
+      bad_lines++;
+      continue;
+    }
+    entries[path] = entry;
+  }
+
+  if(bad_lines > 0)
+  {
+    std::cerr << "Ignored " << bad_lines << " bad lines in " << cache_path << std::endl;
+  }
+  return true;
+}
+
+/*! Save
+Write the cache out as a ScanIndex: the loaded index merged with the
+digests recorded since. The index is written next to the old one and
+renamed into place so an interrupted run never leaves a torn cache,
+and a loaded index stays valid while it is replaced.
+
+@param const std::string & cache_path
+@return boolean
+If the cache was written
+*/
+bool HashCache::Save(const std::string& cache_path) const
+{
+  std::vector<IndexEntry> out;
+  out.reserve(Size());
+
+  if(base)
+  {
+    IndexCursor cursor;
+    while(base->NextPath(cursor))
+    {
+      const IndexRecord& record = base->RecordOfPath(cursor.path_id - 1);
+      if(record.algorithm == 0 || entries.count(cursor.path) > 0)
+      {
+        continue;
+      }
+      out.push_back(IndexEntry());
+      out.back().path = cursor.path;
+      out.back().hashed = true;
+      ScanIndex::ToEntry(record, out.back().ident, out.back().digest);
+    }
+  }
+  for(auto& x : entries)
+  {
+    out.push_back(IndexEntry());
+    out.back().path = x.first;
+    out.back().ident = x.second.ident;
+    out.back().digest = x.second.digest;
+    out.back().hashed = true;
+  }
+
+  if(!ScanIndex::Write(cache_path, out))
+  {
+    std::cerr << "Could not write hash cache: " << cache_path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! Lookup
+Find the cached digest of a file. Misses when the file is not cached
+or its identity changed since the digest was recorded.
+
+@param const std::string & path
+@param const FileIdentity & ident
+Current identity of the file
+@param Digest & digest
+@return boolean
+If a digest that is still valid was found
+*/
+bool HashCache::Lookup(const std::string& path, const FileIdentity& ident,
+                       Digest& digest) const
+{
+  std::string key = Key(path);
+  auto found = entries.find(key);
+  uint64_t path_id;
+
+  if(found != entries.end())
+  {
+    if(found->second.ident != ident)
+    {
+      return false;
+    }
+    digest = found->second.digest;
+    return true;
+  }
+
+  if(!base || !base->FindPath(key, path_id))
+  {
+    return false;
+  }
+
+  const IndexRecord& record = base->RecordOfPath(path_id);
+  FileIdentity cached;
+  ScanIndex::ToEntry(record, cached, digest);
+  return record.algorithm != 0 && cached == ident;
+}
+
+/*! Insert
+Record the digest of a file, replacing whatever was cached for it
+
+@param const std::string & path
+@param const FileIdentity & ident
+Identity of the file taken before it was read
+@param const Digest & digest
+*/
+void HashCache::Insert(const std::string& path, const FileIdentity& ident,
+                       const Digest& digest)
+{
+  Entry& entry = entries[Key(path)];
+  entry.ident = ident;
+  entry.digest = digest;
+}
+
+/*! ParseManifestLine
+Split one manifest line into digest and path. Both the coreutils
+format ("<hex>  <path>", "<hex> *<path>", with a leading backslash
+when the name is escaped) and the BSD tag format
+("SHA256 (<path>) = <hex>") are understood.
+
+@return boolean
+If the line held a digest we recognise
+*/
+static bool ParseManifestLine(std::string line, Digest& digest, std::string& path)
+{
+  bool escaped = false;
+  size_t open, close;
+
+  if(!line.empty() && line[line.size() - 1] == '\r')
+  {
+    line.erase(line.size() - 1);
+  }
+  if(line.empty() || line[0] == '#')
+  {
+    return false;
+  }
+
+  /* BSD tag format */
+  open = line.find(" (");
+  close = line.rfind(") = ");
+  if(open != std::string::npos && close != std::string::npos && open < close &&
+     line.find(' ') == open)
+  {
+    path = line.substr(open + 2, close - open - 2);
+    return Digest::FromHex(line.substr(close + 4), digest);
+  }
+
+  /* coreutils format */
+  if(line[0] == '\\')
+  {
+    escaped = true;
+    line.erase(0, 1);
+  }
+  size_t space = line.find(' ');
+  if(space == std::string::npos || space + 2 > line.size() ||
+     (line[space + 1] != ' ' && line[space + 1] != '*'))
+  {
+    return false;
+  }
+  path = line.substr(space + 2);
+  if(escaped)
+  {
+    path = UnescapePath(path);
+  }
+  return Digest::FromHex(line.substr(0, space), digest);
+}
+
+/*! ImportManifest
+Seed the cache from a checksum manifest. Relative paths are taken
+relative to the manifest's directory. Only files that have not been
+modified since the manifest was written are imported, they are
+recorded with their current identity so later runs can trust them.
+
+@param const std::string & manifest_path
+@return boolean
+If the manifest could be read
+*/
+bool HashCache::ImportManifest(const std::string& manifest_path)
+{
+  std::ifstream in(manifest_path.c_str());
+  FileIdentity manifest_ident;
+  std::string line;
+  unsigned long imported = 0, changed = 0, missing = 0;
+
+  if(!in || !StatIdentity(manifest_path, manifest_ident))
+  {
+    std::cerr << "Could not open manifest: " << manifest_path << std::endl;
+    return false;
+  }
+
+  const boost::filesystem::path base =
+    boost::filesystem::path(manifest_path).parent_path();
+
+  while(std::getline(in, line))
+  {
+    FileIdentity ident;
+    Digest digest;
+    std::string path;
+
+    if(!ParseManifestLine(line, digest, path))
+    {
+      continue;
+    }
+
+    boost::filesystem::path file(path);
+    if(file.is_relative())
+    {
+      file = base / file;
+    }
+
+    if(!StatIdentity(file.string(), ident))
+    {
+      missing++;
+      continue;
+    }
+
+    /* Anything written after the manifest may not match it */
+    if(ident.mtime_sec > manifest_ident.mtime_sec ||
+       (ident.mtime_sec == manifest_ident.mtime_sec &&
+        ident.mtime_nsec > manifest_ident.mtime_nsec))
+    {
+      changed++;
+      continue;
+    }
+
+    Insert(file.string(), ident, digest);
+    imported++;
+  }
+
+  std::cout << "Imported " << imported << " digests from " << manifest_path;
+  if(changed > 0 || missing > 0)
+  {
+    std::cout << " (" << changed << " modified since, " << missing << " missing)";
+  }
+  std::cout << std::endl;
+  return true;
+}
+
+/*! HashCacheReader
+Constructor, out of line so ScanIndex can stay a forward declaration */
+HashCacheReader::HashCacheReader()
+  :entries(0), bad_lines(0), unsorted(false)
+{
+}
+
+HashCacheReader::~HashCacheReader()
+{
+}
+
+/*! Open
+Start reading a cache written by HashCache::Save(), or a scan index
+
+@param const std::string & cache_path
+@return boolean
+If the file is a hash cache
+*/
+bool HashCacheReader::Open(const std::string& cache_path)
+{
+  path = cache_path;
+  if(ScanIndex::IsIndex(cache_path))
+  {
+    index.reset(new ScanIndex());
+    cursor.reset(new IndexCursor());
+    return index->Open(cache_path);
+  }
+
+  in.open(cache_path.c_str());
+  if(!in || !std::getline(in, line) || line != HASH_CACHE_HEADER)
+  {
+    std::cerr << "Not a hash cache: " << cache_path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! Next
+Read the next entry. Entries must come in path order, a text cache
+that is not sorted stops the reader. Files of a scan index that were
+never hashed come back with a digest algorithm of 0.
+
+@param std::string & file
+@param FileIdentity & ident
+@param Digest & digest
+@return boolean
+If an entry was read, false at the end or on an unsorted cache
+*/
+bool HashCacheReader::Next(std::string& file, FileIdentity& ident, Digest& digest)
+{
+  if(index)
+  {
+    if(!index->NextPath(*cursor))
+    {
+      return false;
+    }
+    file = cursor->path;
+    ScanIndex::ToEntry(index->RecordOfPath(cursor->path_id - 1), ident, digest);
+    return true;
+  }
+
+  while(std::getline(in, line))
+  {
+    if(!ParseCacheLine(line, file, ident, digest))
+    {
+      bad_lines++;
+      continue;
+    }
+    if(entries > 0 && file <= last_path)
+    {
+      std::cerr << "Hash cache is not sorted by path: " << path
+                << " (saving it again sorts it)" << std::endl;
+      unsorted = true;
+      return false;
+    }
+    last_path.assign(file);
+    entries++;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,130 @@
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+/*!
+  @file hashCache.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include "contentHash.h"
+
+/*!
+  Stat identity of a file. If any of these change the content may
+  have changed and a cached digest can no longer be trusted.
+ */
+struct FileIdentity
+{
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t dev;
+  uint64_t ino;
+
+  bool operator==(const FileIdentity& other) const
+  {
+    return size == other.size && mtime_sec == other.mtime_sec &&
+           mtime_nsec == other.mtime_nsec && dev == other.dev &&
+           ino == other.ino;
+  }
+  bool operator!=(const FileIdentity& other) const
+  {
+    return !(*this == other);
+  }
+};
+
+bool StatIdentity(const std::string& path, FileIdentity& ident);
+std::string EscapePath(const std::string& path);
+std::string UnescapePath(const std::string& path);
+
+class ScanIndex;
+struct IndexCursor;
+
+/*!
+  Content digests keyed by absolute path plus stat identity. A digest
+  is only handed back when the file still has the identity it had when
+  the digest was recorded, so unchanged files never have to be read.
+
+  The cache can be seeded from the SHA256SUMS / MD5SUMS style manifests
+  that archives already ship with.
+
+  It is saved as a ScanIndex. A loaded index is used in place from
+  mmap, only digests recorded during the run are held in memory.
+  Caches in the older text format are still read.
+
+  @brief Persistent path to digest cache.
+ */
+class HashCache
+{
+public:
+  HashCache();
+  ~HashCache();
+
+  bool Load(const std::string& cache_path);
+  bool Save(const std::string& cache_path) const;
+  bool ImportManifest(const std::string& manifest_path);
+
+  bool Lookup(const std::string& path, const FileIdentity& ident,
+              Digest& digest) const;
+  void Insert(const std::string& path, const FileIdentity& ident,
+              const Digest& digest);
+  size_t Size() const;
+
+  static std::string Key(const std::string& path);
+
+private:
+  /* Not copyable, we may own a mapped index */
+  HashCache(const HashCache&);
+  HashCache& operator=(const HashCache&);
+
+  struct Entry
+  {
+    FileIdentity ident;
+    Digest digest;
+  };
+
+  std::unique_ptr<ScanIndex> base;
+  /*! Index the cache was loaded from, if it was one */
+  std::unordered_map<std::string,Entry> entries;
+  /*! Digests recorded since, or loaded from a text cache, keyed by
+      absolute, normalized path. These win over the base index. */
+};
+
+/*!
+  Reads a saved hash cache or scan index one entry at a time, in path
+  order, without loading the whole file. Text caches must have been
+  saved sorted; indexes always are.
+
+  @brief Streaming reader for saved hash caches.
+ */
+class HashCacheReader
+{
+public:
+  HashCacheReader();
+  ~HashCacheReader();
+
+  bool Open(const std::string& cache_path);
+  bool Next(std::string& file, FileIdentity& ident, Digest& digest);
+  bool Unsorted() const { return unsorted; }
+  unsigned long BadLines() const { return bad_lines; }
+
+private:
+  std::string path;
+  std::unique_ptr<ScanIndex> index;
+  std::unique_ptr<IndexCursor> cursor;
+  /*! Set when reading an index instead of a text cache */
+  std::ifstream in;
+  std::string line;
+  /*! Reused for every line to avoid allocations */
+  std::string last_path;
+  /*! Path of the previous entry, to check the order */
+  uint64_t entries;
+  unsigned long bad_lines;
+  bool unsorted;
+};
+
+#endif /* HASH_CACHE_H */
@@ -0,0 +1,769 @@
+/*!
+  @file hashKernels.cpp
+  @author Charles Irick
+*/
+#include <cstring>
+#include "cpuFeatures.h"
+#include "hashKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+static inline uint32_t Read32(const unsigned char* p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t Read64(const unsigned char* p)
+{
+  return (uint64_t)Read32(p) | ((uint64_t)Read32(p + 4) << 32);
+}
+
+/*! StoreBigEndian
+Digest bytes of an integer hash, most significant first */
+static void StoreBigEndian(uint64_t value, unsigned int size, Digest& digest)
+{
+  memset(digest.bytes, 0, Digest::MAX_SIZE);
+  for(unsigned int i = 0; i < size; i++)
+  {
+    digest.bytes[i] = (unsigned char)(value >> (8 * (size - 1 - i)));
+  }
+}
+
+/*! Slicing by eight tables of the reflected Castagnoli polynomial */
+static const struct Crc32cTables
+{
+  uint32_t table[8][256];
+  Crc32cTables()
+  {
+    for(uint32_t n = 0; n < 256; n++)
+    {
+      uint32_t crc = n;
+      for(int k = 0; k < 8; k++)
+      {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+      table[0][n] = crc;
+    }
+    for(uint32_t n = 0; n < 256; n++)
+    {
+      for(int k = 1; k < 8; k++)
+      {
+        table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xff];
+      }
+    }
+  }
+} crc32c_tables;
+
+/*! Crc32cPortable
+Eight bytes per step through the tables
+
+@param uint32_t crc
+@param const unsigned char * p
+@param size_t len
+@return uint32_t
+*/
+static uint32_t Crc32cPortable(uint32_t crc, const unsigned char* p, size_t len)
+{
+  const uint32_t (*t)[256] = crc32c_tables.table;
+
+  for(; len >= 8; len -= 8, p += 8)
+  {
+    uint32_t lo = Read32(p) ^ crc;
+    uint32_t hi = Read32(p + 4);
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+          t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+          t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for(; len > 0; len--, p++)
+  {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+  }
+  return crc;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*! Crc32cSse42
+Same as Crc32cPortable with the CRC32 instruction */
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(uint32_t crc, const unsigned char* p, size_t len)
+{
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for(; len >= 8; len -= 8, p += 8)
+  {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+#endif
+  for(; len >= 4; len -= 4, p += 4)
+  {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+  }
+  for(; len > 0; len--, p++)
+  {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+/*! Update
+Feed more data into the CRC
+
+@param const void * data
+@param size_t len
+*/
+void Crc32c::Update(const void* data, size_t len)
+{
+  typedef uint32_t (*Kernel)(uint32_t, const unsigned char*, size_t);
+#ifdef HAVE_X86_KERNELS
+  static const Kernel kernel = CpuFeatures::Get().sse42 ? Crc32cSse42 : Crc32cPortable;
+#else
+  static const Kernel kernel = Crc32cPortable;
+#endif
+  crc = kernel(crc, (const unsigned char*)data, len);
+}
+
+/*! Final
+Produce the digest, the object must be Reset() before it is used again
+
+@param Digest & digest
+*/
+void Crc32c::Final(Digest& digest)
+{
+  digest.algorithm = HASH_CRC32C;
+  StoreBigEndian(crc ^ 0xffffffff, 4, digest);
+}
+
+static const uint64_t PRIME32_1 = 0x9e3779b1;
+static const uint64_t PRIME32_2 = 0x85ebca77;
+static const uint64_t PRIME32_3 = 0xc2b2ae3d;
+static const uint64_t PRIME64_1 = 0x9e3779b185ebca87ULL;
+static const uint64_t PRIME64_2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t PRIME64_3 = 0x165667b19e3779f9ULL;
+static const uint64_t PRIME64_4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t PRIME64_5 = 0x27d4eb2f165667c5ULL;
+static const uint64_t PRIME_MX1 = 0x165667919e3779f9ULL;
+static const uint64_t PRIME_MX2 = 0x9fb21c651e98df25ULL;
+
+/*! XXH3_SECRET
+Default secret of XXH3 */
+static const unsigned char XXH3_SECRET[Xxh3::SECRET_SIZE] = {
+  0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+  0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+  0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+  0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+  0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+  0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+  0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+  0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+  0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+  0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+  0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+  0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static inline uint64_t Rotl64(uint64_t x, unsigned int n)
+{
+  return (x << n) | (x >> (64 - n));
+}
+
+/*! Mul128Fold64
+Full 64x64 bit product with its halves xor'ed together */
+static inline uint64_t Mul128Fold64(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 product = (unsigned __int128)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+  uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+  uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+  uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & 0xffffffff);
+  return lower ^ upper;
+#endif
+}
+
+static inline uint64_t Xxh64Avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  return h ^ (h >> 32);
+}
+
+static inline uint64_t Xxh3Avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= PRIME_MX1;
+  return h ^ (h >> 32);
+}
+
+static inline uint64_t Mix16(const unsigned char* input, const unsigned char* secret)
+{
+  return Mul128Fold64(Read64(input) ^ Read64(secret),
+                      Read64(input + 8) ^ Read64(secret + 8));
+}
+
+/*! Xxh3AccumulatePortable
+Accumulate whole stripes, stripe n is keyed with the secret at 8 * n
+
+@param uint64_t * acc
+@param const unsigned char * input
+@param const unsigned char * secret
+@param size_t stripes
+*/
+static void Xxh3AccumulatePortable(uint64_t* acc, const unsigned char* input,
+                                   const unsigned char* secret, size_t stripes)
+{
+  for(; stripes > 0; stripes--, input += Xxh3::STRIPE_LEN, secret += 8)
+  {
+    for(int i = 0; i < 8; i++)
+    {
+      uint64_t data = Read64(input + 8 * i);
+      uint64_t key = data ^ Read64(secret + 8 * i);
+      acc[i ^ 1] += data;
+      acc[i] += (key & 0xffffffff) * (key >> 32);
+    }
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+/*! Xxh3AccumulateAvx2
+Same as Xxh3AccumulatePortable, half a stripe per register */
+__attribute__((target("avx2")))
+static void Xxh3AccumulateAvx2(uint64_t* acc, const unsigned char* input,
+                               const unsigned char* secret, size_t stripes)
+{
+  __m256i lanes[2];
+  lanes[0] = _mm256_loadu_si256((const __m256i*)acc);
+  lanes[1] = _mm256_loadu_si256((const __m256i*)(acc + 4));
+
+  for(; stripes > 0; stripes--, input += Xxh3::STRIPE_LEN, secret += 8)
+  {
+    for(int i = 0; i < 2; i++)
+    {
+      __m256i data = _mm256_loadu_si256((const __m256i*)(input + 32 * i));
+      __m256i key = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i*)(secret + 32 * i)));
+      __m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+      __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+      lanes[i] = _mm256_add_epi64(lanes[i], _mm256_add_epi64(product, swapped));
+    }
+  }
+
+  _mm256_storeu_si256((__m256i*)acc, lanes[0]);
+  _mm256_storeu_si256((__m256i*)(acc + 4), lanes[1]);
+}
+
+/* Older GCC headers leave the pass-through operand of unmasked
+AVX-512 intrinsics undefined and warn about it */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+/*! Xxh3AccumulateAvx512
+Same as Xxh3AccumulatePortable, a whole stripe per register */
+__attribute__((target("avx512f")))
+static void Xxh3AccumulateAvx512(uint64_t* acc, const unsigned char* input,
+                                 const unsigned char* secret, size_t stripes)
+{
+  __m512i lanes = _mm512_loadu_si512(acc);
+
+  for(; stripes > 0; stripes--, input += Xxh3::STRIPE_LEN, secret += 8)
+  {
+    __m512i data = _mm512_loadu_si512(input);
+    __m512i key = _mm512_xor_si512(data, _mm512_loadu_si512(secret));
+    __m512i product = _mm512_mul_epu32(key, _mm512_srli_epi64(key, 32));
+    __m512i swapped = _mm512_shuffle_epi32(data, (_MM_PERM_ENUM)_MM_SHUFFLE(1, 0, 3, 2));
+    lanes = _mm512_add_epi64(lanes, _mm512_add_epi64(product, swapped));
+  }
+
+  _mm512_storeu_si512(acc, lanes);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+/*! Xxh3Accumulate
+Accumulate with the widest kernel the CPU supports */
+static void Xxh3Accumulate(uint64_t* acc, const unsigned char* input,
+                           const unsigned char* secret, size_t stripes)
+{
+  typedef void (*Kernel)(uint64_t*, const unsigned char*, const unsigned char*, size_t);
+#ifdef HAVE_X86_KERNELS
+  static const Kernel kernel = CpuFeatures::Get().avx512 ? Xxh3AccumulateAvx512 :
+                               CpuFeatures::Get().avx2 ? Xxh3AccumulateAvx2 :
+                               Xxh3AccumulatePortable;
+#else
+  static const Kernel kernel = Xxh3AccumulatePortable;
+#endif
+  kernel(acc, input, secret, stripes);
+}
+
+/*! Reset
+Start a new hash */
+void Xxh3::Reset()
+{
+  acc[0] = PRIME32_3;
+  acc[1] = PRIME64_1;
+  acc[2] = PRIME64_2;
+  acc[3] = PRIME64_3;
+  acc[4] = PRIME64_4;
+  acc[5] = PRIME32_2;
+  acc[6] = PRIME64_5;
+  acc[7] = PRIME32_1;
+  total_len = 0;
+  stripes_in_block = 0;
+  buffer_len = 0;
+}
+
+/*! Consume
+Accumulate stripes that are known not to be the last, scrambling the
+accumulators at the end of every block
+
+@param const unsigned char * stripes
+@param size_t count
+*/
+void Xxh3::Consume(const unsigned char* stripes, size_t count)
+{
+  const unsigned char* scramble_key = XXH3_SECRET + SECRET_SIZE - STRIPE_LEN;
+
+  while(count > 0)
+  {
+    size_t take = STRIPES_PER_BLOCK - stripes_in_block;
+    if(take > count)
+    {
+      take = count;
+    }
+    Xxh3Accumulate(acc, stripes, XXH3_SECRET + 8 * stripes_in_block, take);
+    stripes += take * STRIPE_LEN;
+    count -= take;
+    stripes_in_block += take;
+
+    if(stripes_in_block == STRIPES_PER_BLOCK)
+    {
+      for(int i = 0; i < 8; i++)
+      {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= Read64(scramble_key + 8 * i);
+        acc[i] *= PRIME32_1;
+      }
+      stripes_in_block = 0;
+    }
+  }
+}
+
+/*! Update
+Feed more data into the hash
+
+@param const void * data
+@param size_t len
+*/
+void Xxh3::Update(const void* data, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  total_len += len;
+
+  if(buffer_len + len <= BUFFER_SIZE)
+  {
+    memcpy(buffer + buffer_len, p, len);
+    buffer_len += len;
+    return;
+  }
+
+  /* More data follows the buffer, so all of it can be accumulated */
+  if(buffer_len > 0)
+  {
+    size_t take = BUFFER_SIZE - buffer_len;
+    memcpy(buffer + buffer_len, p, take);
+    p += take;
+    len -= take;
+    Consume(buffer, BUFFER_SIZE / STRIPE_LEN);
+  }
+
+  /* Accumulate straight out of the caller's buffer, keeping at least
+  one byte back and a copy of the last stripe for Final() */
+  if(len > BUFFER_SIZE)
+  {
+    size_t stripes = (len - 1) / STRIPE_LEN;
+    Consume(p, stripes);
+    p += stripes * STRIPE_LEN;
+    len -= stripes * STRIPE_LEN;
+    memcpy(buffer + BUFFER_SIZE - STRIPE_LEN, p - STRIPE_LEN, STRIPE_LEN);
+  }
+
+  memcpy(buffer, p, len);
+  buffer_len = len;
+}
+
+/*! HashShort
+One shot XXH3 of inputs up to MIDSIZE_MAX bytes
+
+@param const unsigned char * input
+@param size_t len
+@return uint64_t
+*/
+uint64_t Xxh3::HashShort(const unsigned char* input, size_t len)
+{
+  const unsigned char* secret = XXH3_SECRET;
+
+  if(len == 0)
+  {
+    return Xxh64Avalanche(Read64(secret + 56) ^ Read64(secret + 64));
+  }
+  if(len <= 3)
+  {
+    uint32_t combined = ((uint32_t)input[0] << 16) | ((uint32_t)input[len >> 1] << 24) |
+                        (uint32_t)input[len - 1] | ((uint32_t)len << 8);
+    return Xxh64Avalanche(combined ^ (uint64_t)(Read32(secret) ^ Read32(secret + 4)));
+  }
+  if(len <= 8)
+  {
+    uint64_t keyed = (Read32(input + len - 4) + ((uint64_t)Read32(input) << 32)) ^
+                     (Read64(secret + 8) ^ Read64(secret + 16));
+    keyed ^= Rotl64(keyed, 49) ^ Rotl64(keyed, 24);
+    keyed *= PRIME_MX2;
+    keyed ^= (keyed >> 35) + len;
+    keyed *= PRIME_MX2;
+    return keyed ^ (keyed >> 28);
+  }
+  if(len <= 16)
+  {
+    uint64_t lo = Read64(input) ^ (Read64(secret + 24) ^ Read64(secret + 32));
+    uint64_t hi = Read64(input + len - 8) ^ (Read64(secret + 40) ^ Read64(secret + 48));
+    return Xxh3Avalanche(len + __builtin_bswap64(lo) + hi + Mul128Fold64(lo, hi));
+  }
+
+  uint64_t acc = len * PRIME64_1;
+  if(len <= 128)
+  {
+    /* Pairs of 16 byte lanes from both ends, meeting in the middle */
+    for(size_t i = 0; 32 * i < len; i++)
+    {
+      acc += Mix16(input + 16 * i, secret + 32 * i);
+      acc += Mix16(input + len - 16 * (i + 1), secret + 32 * i + 16);
+    }
+    return Xxh3Avalanche(acc);
+  }
+
+  size_t rounds = len / 16;
+  for(size_t i = 0; i < 8; i++)
+  {
+    acc += Mix16(input + 16 * i, secret + 16 * i);
+  }
+  acc = Xxh3Avalanche(acc);
+  for(size_t i = 8; i < rounds; i++)
+  {
+    acc += Mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+  }
+  acc += Mix16(input + len - 16, secret + 136 - 17);
+  return Xxh3Avalanche(acc);
+}
+
+/*! Final
+Produce the digest, the object must be Reset() before it is used again
+
+@param Digest & digest
+*/
+void Xxh3::Final(Digest& digest)
+{
+  uint64_t hash;
+
+  if(total_len <= MIDSIZE_MAX)
+  {
+    hash = HashShort(buffer, (size_t)total_len);
+  }
+  else
+  {
+    unsigned char last[STRIPE_LEN];
+    const unsigned char* last_stripe = last;
+
+    if(buffer_len >= STRIPE_LEN)
+    {
+      Consume(buffer, (buffer_len - 1) / STRIPE_LEN);
+      last_stripe = buffer + buffer_len - STRIPE_LEN;
+    }
+    else
+    {
+      /* The rest of the last stripe was accumulated already */
+      size_t catch_up = STRIPE_LEN - buffer_len;
+      memcpy(last, buffer + BUFFER_SIZE - catch_up, catch_up);
+      memcpy(last + catch_up, buffer, buffer_len);
+    }
+    Xxh3Accumulate(acc, last_stripe, XXH3_SECRET + SECRET_SIZE - STRIPE_LEN - 7, 1);
+
+    hash = total_len * PRIME64_1;
+    for(int i = 0; i < 4; i++)
+    {
+      hash += Mul128Fold64(acc[2 * i] ^ Read64(XXH3_SECRET + 11 + 16 * i),
+                           acc[2 * i + 1] ^ Read64(XXH3_SECRET + 11 + 16 * i + 8));
+    }
+    hash = Xxh3Avalanche(hash);
+  }
+
+  digest.algorithm = HASH_XXH3;
+  StoreBigEndian(hash, 8, digest);
+}
+
+/*! BLAKE3_IV
+Same as the SHA-256 initial hash value */
+static const uint32_t BLAKE3_IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/*! Domain flags of a compression */
+enum Blake3Flags
+{
+  BLAKE3_CHUNK_START = 1 << 0,
+  BLAKE3_CHUNK_END   = 1 << 1,
+  BLAKE3_PARENT      = 1 << 2,
+  BLAKE3_ROOT        = 1 << 3
+};
+
+/*! BLAKE3_SCHEDULE
+Message word order of every round, the permutation applied again
+and again */
+static const unsigned char BLAKE3_SCHEDULE[7][16] = {
+  {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+  {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+  {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+  {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+  {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+  {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+  {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+};
+
+static inline uint32_t Rotr32(uint32_t x, unsigned int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline void Blake3G(uint32_t* v, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+  v[a] = v[a] + v[b] + x;
+  v[d] = Rotr32(v[d] ^ v[a], 16);
+  v[c] = v[c] + v[d];
+  v[b] = Rotr32(v[b] ^ v[c], 12);
+  v[a] = v[a] + v[b] + y;
+  v[d] = Rotr32(v[d] ^ v[a], 8);
+  v[c] = v[c] + v[d];
+  v[b] = Rotr32(v[b] ^ v[c], 7);
+}
+
+/*! Blake3Compress
+Compress one block into a new chaining value
+
+@param uint32_t * cv
+Chaining value in, the new one out
+@param const unsigned char * block
+64 bytes, zero padded past len
+@param size_t len
+@param uint64_t counter
+Chunk number, 0 for parents
+@param uint32_t flags
+*/
+static void Blake3Compress(uint32_t* cv, const unsigned char* block, size_t len,
+                           uint64_t counter, uint32_t flags)
+{
+  uint32_t m[16], v[16];
+
+  for(int i = 0; i < 16; i++)
+  {
+    m[i] = Read32(block + 4 * i);
+  }
+  memcpy(v, cv, 8 * sizeof(uint32_t));
+  memcpy(v + 8, BLAKE3_IV, 4 * sizeof(uint32_t));
+  v[12] = (uint32_t)counter;
+  v[13] = (uint32_t)(counter >> 32);
+  v[14] = (uint32_t)len;
+  v[15] = flags;
+
+  for(int r = 0; r < 7; r++)
+  {
+    const unsigned char* s = BLAKE3_SCHEDULE[r];
+    Blake3G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+    Blake3G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+    Blake3G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+    Blake3G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+    Blake3G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+    Blake3G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    Blake3G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+    Blake3G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+  }
+
+  for(int i = 0; i < 8; i++)
+  {
+    cv[i] = v[i] ^ v[i + 8];
+  }
+}
+
+/*! Blake3Parent
+Chaining value of a parent node from those of its children */
+static void Blake3Parent(const uint32_t* left, const uint32_t* right, uint32_t* cv, uint32_t flags)
+{
+  unsigned char block[Blake3::BLOCK_LEN];
+
+  for(int i = 0; i < 8; i++)
+  {
+    for(int b = 0; b < 4; b++)
+    {
+      block[4 * i + b] = (unsigned char)(left[i] >> (8 * b));
+      block[32 + 4 * i + b] = (unsigned char)(right[i] >> (8 * b));
+    }
+  }
+  memcpy(cv, BLAKE3_IV, sizeof(BLAKE3_IV));
+  Blake3Compress(cv, block, Blake3::BLOCK_LEN, 0, BLAKE3_PARENT | flags);
+}
+
+/*! Reset
+Start a new hash */
+void Blake3::Reset()
+{
+  memcpy(chunk_cv, BLAKE3_IV, sizeof(BLAKE3_IV));
+  chunk_counter = 0;
+  blocks_compressed = 0;
+  block_len = 0;
+  stack_len = 0;
+}
+
+/*! CompressBlock
+Compress the buffered block into the chunk's chaining value
+
+@param uint32_t flags
+Flags besides CHUNK_START, which is set for the first block
+*/
+void Blake3::CompressBlock(uint32_t flags)
+{
+  if(blocks_compressed == 0)
+  {
+    flags |= BLAKE3_CHUNK_START;
+  }
+  Blake3Compress(chunk_cv, block, block_len, chunk_counter, flags);
+  blocks_compressed++;
+  block_len = 0;
+}
+
+/*! PushChunk
+Add a finished chunk to the tree. Every completed pair of subtrees
+is merged into its parent, as many times as the chunk count has
+trailing zero bits.
+
+@param const uint32_t * cv
+*/
+void Blake3::PushChunk(const uint32_t* cv)
+{
+  uint32_t merged[8];
+  uint64_t chunks = chunk_counter + 1;
+
+  memcpy(merged, cv, sizeof(merged));
+  while((chunks & 1) == 0)
+  {
+    stack_len--;
+    Blake3Parent(stack[stack_len], merged, merged, 0);
+    chunks >>= 1;
+  }
+  memcpy(stack[stack_len++], merged, sizeof(merged));
+}
+
+/*! Update
+Feed more data into the hash
+
+@param const void * data
+@param size_t len
+*/
+void Blake3::Update(const void* data, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)data;
+
+  while(len > 0)
+  {
+    /* A chunk or a block is only finished once more data arrives,
+    the last one of the input is compressed with other flags */
+    if(block_len == BLOCK_LEN)
+    {
+      if(blocks_compressed == CHUNK_LEN / BLOCK_LEN - 1)
+      {
+        CompressBlock(BLAKE3_CHUNK_END);
+        PushChunk(chunk_cv);
+        memcpy(chunk_cv, BLAKE3_IV, sizeof(BLAKE3_IV));
+        chunk_counter++;
+        blocks_compressed = 0;
+      }
+      else
+      {
+        CompressBlock(0);
+      }
+    }
+
+    size_t take = BLOCK_LEN - block_len;
+    if(take > len)
+    {
+      take = len;
+    }
+    memcpy(block + block_len, p, take);
+    block_len += take;
+    p += take;
+    len -= take;
+  }
+}
+
+/*! Final
+Produce the digest, the object must be Reset() before it is used again
+
+@param Digest & digest
+*/
+void Blake3::Final(Digest& digest)
+{
+  uint32_t flags = BLAKE3_CHUNK_END;
+  uint32_t cv[8];
+
+  memset(block + block_len, 0, BLOCK_LEN - block_len);
+  if(blocks_compressed == 0)
+  {
+    flags |= BLAKE3_CHUNK_START;
+  }
+
+  if(stack_len == 0)
+  {
+    /* A single chunk is the root */
+    memcpy(cv, chunk_cv, sizeof(cv));
+    Blake3Compress(cv, block, block_len, chunk_counter, flags | BLAKE3_ROOT);
+  }
+  else
+  {
+    /* Fold the stack from the right, the last parent is the root */
+    memcpy(cv, chunk_cv, sizeof(cv));
+    Blake3Compress(cv, block, block_len, chunk_counter, flags);
+    while(stack_len > 0)
+    {
+      stack_len--;
+      Blake3Parent(stack[stack_len], cv, cv, stack_len == 0 ? BLAKE3_ROOT : 0);
+    }
+  }
+
+  digest.algorithm = HASH_BLAKE3;
+  for(int i = 0; i < 8; i++)
+  {
+    for(int b = 0; b < 4; b++)
+    {
+      digest.bytes[4 * i + b] = (unsigned char)(cv[i] >> (8 * b));
+    }
+  }
+}
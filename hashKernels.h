@@ -0,0 +1,114 @@
+#ifndef HASH_KERNELS_H
+#define HASH_KERNELS_H
+/*!
+  @file hashKernels.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include "contentHash.h"
+
+/*!
+  Streaming CRC32C (Castagnoli), as computed by iSCSI, ext4 and
+  btrfs. Uses the SSE4.2 CRC32 instruction when the CPU has it and
+  slicing by eight otherwise. The digest is the CRC in big endian, so
+  it prints the way crc32c tools print it.
+
+  @brief CRC32C for cheap content filtering.
+ */
+class Crc32c
+{
+public:
+  /*! Constructor */
+  Crc32c() { Reset(); }
+  void Reset() { crc = 0xffffffff; }
+  void Update(const void* data, size_t len);
+  void Final(Digest& digest);
+
+private:
+  uint32_t crc;
+  /*! Running CRC, inverted */
+};
+
+/*!
+  Streaming 64-bit XXH3 with the default secret and seed, the same
+  value xxhsum -H3 prints. The 64 byte stripes of long inputs are
+  accumulated with AVX-512, AVX2 or plain 64-bit arithmetic, whichever
+  the CPU supports. The digest is the hash in big endian.
+
+  Inputs up to MIDSIZE_MAX bytes are hashed by a different function
+  at Final(), so they are kept whole in the buffer, and the last
+  stripe of every input is hashed with its own secret, so stripes are
+  only accumulated once more data is known to follow them.
+
+  @brief XXH3 for fast content filtering.
+ */
+class Xxh3
+{
+public:
+  /*! Constructor */
+  Xxh3() { Reset(); }
+  void Reset();
+  void Update(const void* data, size_t len);
+  void Final(Digest& digest);
+
+  static const size_t STRIPE_LEN = 64;
+  static const size_t SECRET_SIZE = 192;
+  static const size_t STRIPES_PER_BLOCK = (SECRET_SIZE - STRIPE_LEN) / 8;
+  static const size_t BUFFER_SIZE = 256;
+  static const size_t MIDSIZE_MAX = 240;
+
+private:
+  void Consume(const unsigned char* stripes, size_t count);
+  static uint64_t HashShort(const unsigned char* input, size_t len);
+
+  uint64_t acc[8];
+  /*! Accumulators of the long hash */
+  uint64_t total_len;
+  size_t stripes_in_block;
+  /*! Stripes accumulated since the last scramble */
+  unsigned char buffer[BUFFER_SIZE];
+  /*! Input not accumulated yet. Its tail still holds the last stripe
+  accumulated from it, Final() may need part of it again. */
+  size_t buffer_len;
+};
+
+/*!
+  Streaming BLAKE3 with the default 32 byte output, the value b3sum
+  prints. Chunks of 1024 bytes are compressed one block at a time and
+  merged into the tree with a stack of chaining values, one per level.
+
+  @brief BLAKE3 for fast collision resistant digests.
+ */
+class Blake3
+{
+public:
+  /*! Constructor */
+  Blake3() { Reset(); }
+  void Reset();
+  void Update(const void* data, size_t len);
+  void Final(Digest& digest);
+
+  static const size_t BLOCK_LEN = 64;
+  static const size_t CHUNK_LEN = 1024;
+  static const unsigned int MAX_DEPTH = 54;
+
+private:
+  void CompressBlock(uint32_t flags);
+  void PushChunk(const uint32_t* cv);
+
+  uint32_t chunk_cv[8];
+  /*! Chaining value of the chunk being hashed */
+  uint64_t chunk_counter;
+  unsigned int blocks_compressed;
+  /*! Blocks of the current chunk already compressed */
+  unsigned char block[BLOCK_LEN];
+  size_t block_len;
+  uint32_t stack[MAX_DEPTH][8];
+  /*! Chaining values of the subtrees still waiting for a sibling */
+  unsigned int stack_len;
+};
+
+#endif /* HASH_KERNELS_H */
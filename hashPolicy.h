@@ -0,0 +1,68 @@
+#ifndef HASH_POLICY_H
+#define HASH_POLICY_H
+/*!
+  @file hashPolicy.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include "contentHash.h"
+#include "hashKernels.h"
+
+/*!
+  Hash policies name the streaming state behind an algorithm. Loops
+  that hash file content are templates on a policy, so each algorithm
+  gets its own copy of the loop with the Update() call resolved at
+  compile time. The SIMD kernel inside Update() is picked once at run
+  time from the CPU features.
+
+  Policies can be chosen at run time with WithHashPolicy(), which
+  calls Run<Policy>() on an action for the algorithm asked for.
+ */
+struct Sha256Policy
+{
+  typedef Sha256 State;
+  static const unsigned char ALGORITHM = HASH_SHA256;
+};
+
+struct Blake3Policy
+{
+  typedef Blake3 State;
+  static const unsigned char ALGORITHM = HASH_BLAKE3;
+};
+
+struct Xxh3Policy
+{
+  typedef Xxh3 State;
+  static const unsigned char ALGORITHM = HASH_XXH3;
+};
+
+struct Crc32cPolicy
+{
+  typedef Crc32c State;
+  static const unsigned char ALGORITHM = HASH_CRC32C;
+};
+
+/*! WithHashPolicy
+Run an action with the policy of an algorithm
+
+@param unsigned char algorithm
+One that ParseAlgorithm() accepts, anything else runs SHA-256
+@param Action & action
+Has a template <class Policy> bool Run() member
+@return boolean
+What the action returned
+*/
+template <class Action>
+bool WithHashPolicy(unsigned char algorithm, Action& action)
+{
+  switch(algorithm)
+  {
+    case HASH_BLAKE3: return action.template Run<Blake3Policy>();
+    case HASH_XXH3:   return action.template Run<Xxh3Policy>();
+    case HASH_CRC32C: return action.template Run<Crc32cPolicy>();
+  }
+  return action.template Run<Sha256Policy>();
+}
+
+#endif /* HASH_POLICY_H */
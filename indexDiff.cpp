@@ -0,0 +1,305 @@
+/*!
+  @file indexDiff.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "indexDiff.h"
+#include "scanIndex.h"
+
+/*! Orders records of one size against a digest, as ScanIndex sorts them */
+struct DigestOrder
+{
+  bool operator()(const IndexRecord& record, const Digest& digest) const
+  {
+    if(record.algorithm != digest.algorithm)
+    {
+      return record.algorithm < digest.algorithm;
+    }
+    return memcmp(record.digest, digest.bytes, Digest::MAX_SIZE) < 0;
+  }
+  bool operator()(const Digest& digest, const IndexRecord& record) const
+  {
+    if(record.algorithm != digest.algorithm)
+    {
+      return digest.algorithm < record.algorithm;
+    }
+    return memcmp(digest.bytes, record.digest, Digest::MAX_SIZE) < 0;
+  }
+};
+
+/*! Run
+Compare two saved caches or scan indexes and print what changed
+between them
+
+@param const std::string & old_path
+@param const std::string & new_path
+@return boolean
+If both indexes could be read
+*/
+bool IndexDiff::Run(const std::string& old_path, const std::string& new_path)
+{
+  if(!Merge(old_path, new_path))
+  {
+    return false;
+  }
+  MatchMoves();
+
+  /* Only content involved in a change can have gained or lost copies */
+  for(auto& change : added)
+  {
+    Touch(change.digest, change.size);
+  }
+  for(auto& change : removed)
+  {
+    Touch(change.digest, change.size);
+  }
+  for(auto& change : modified)
+  {
+    Touch(change.first.digest, change.first.size);
+    Touch(change.second.digest, change.second.size);
+  }
+  if(!touched.empty() &&
+     (!CountTouched(old_path, true) || !CountTouched(new_path, false)))
+  {
+    return false;
+  }
+
+  PrintReport();
+  return true;
+}
+
+/*! Merge
+Walk both indexes in path order. A path only in the old index was
+removed, only in the new one added, and in both with another digest
+modified.
+
+@return boolean
+If both indexes could be read in order
+*/
+bool IndexDiff::Merge(const std::string& old_path, const std::string& new_path)
+{
+  HashCacheReader old_index, new_index;
+  Change old_entry, new_entry;
+  FileIdentity old_ident, new_ident;
+
+  if(!old_index.Open(old_path) || !new_index.Open(new_path))
+  {
+    return false;
+  }
+
+  bool have_old = old_index.Next(old_entry.path, old_ident, old_entry.digest);
+  bool have_new = new_index.Next(new_entry.path, new_ident, new_entry.digest);
+
+  while(have_old || have_new)
+  {
+    old_entry.size = old_ident.size;
+    new_entry.size = new_ident.size;
+
+    if(have_old && (!have_new || old_entry.path < new_entry.path))
+    {
+      removed.push_back(old_entry);
+      have_old = old_index.Next(old_entry.path, old_ident, old_entry.digest);
+    }
+    else if(have_new && (!have_old || new_entry.path < old_entry.path))
+    {
+      added.push_back(new_entry);
+      have_new = new_index.Next(new_entry.path, new_ident, new_entry.digest);
+    }
+    else
+    {
+      /* A digest from another algorithm, e.g. imported from a
+      manifest, says nothing new about a file that did not change.
+      Without a digest on both sides only the identity can tell */
+      bool hashed = old_entry.digest.algorithm != 0 && new_entry.digest.algorithm != 0;
+      if(hashed ? (old_entry.digest != new_entry.digest &&
+                   (old_entry.digest.algorithm == new_entry.digest.algorithm ||
+                    old_ident != new_ident))
+                : old_ident != new_ident)
+      {
+        modified.push_back(std::make_pair(old_entry, new_entry));
+      }
+      have_old = old_index.Next(old_entry.path, old_ident, old_entry.digest);
+      have_new = new_index.Next(new_entry.path, new_ident, new_entry.digest);
+    }
+  }
+
+  return !old_index.Unsorted() && !new_index.Unsorted();
+}
+
+/*! MatchMoves
+Pair removed and added entries with the same content. Each pair is
+one file moved (or renamed) rather than one removed and one added. */
+void IndexDiff::MatchMoves()
+{
+  std::unordered_map<Digest,std::vector<size_t>,DigestHash> gone;
+  std::vector<bool> matched(removed.size(), false);
+  std::vector<Change> still_added;
+
+  for(size_t i = removed.size(); i-- > 0; )
+  {
+    if(removed[i].digest.algorithm != 0)
+    {
+      gone[removed[i].digest].push_back(i);
+    }
+  }
+
+  for(auto& change : added)
+  {
+    auto found = gone.find(change.digest);
+    if(found == gone.end() || found->second.empty())
+    {
+      still_added.push_back(change);
+      continue;
+    }
+    size_t i = found->second.back();
+    found->second.pop_back();
+    matched[i] = true;
+    moved.push_back(std::make_pair(removed[i], change));
+  }
+
+  std::vector<Change> still_removed;
+  for(size_t i = 0; i < removed.size(); i++)
+  {
+    if(!matched[i])
+    {
+      still_removed.push_back(removed[i]);
+    }
+  }
+  added.swap(still_added);
+  removed.swap(still_removed);
+}
+
+/*! Touch
+Remember a content whose number of copies has to be counted */
+void IndexDiff::Touch(const Digest& digest, uint64_t size)
+{
+  /* Files that were never hashed cannot be counted as copies */
+  if(digest.algorithm != 0)
+  {
+    touched[digest].size = size;
+  }
+}
+
+/*! CountTouched
+Count the copies of every touched content in one index
+
+@param const std::string & path
+@param bool old_side
+If this is the old index
+@return boolean
+If the index could be read
+*/
+bool IndexDiff::CountTouched(const std::string& path, bool old_side)
+{
+  HashCacheReader index;
+  std::string file;
+  FileIdentity ident;
+  Digest digest;
+
+  /* Records of an index are sorted by size and digest, each count is
+  a pair of binary searches instead of a pass over the file */
+  if(ScanIndex::IsIndex(path))
+  {
+    ScanIndex scan;
+    if(!scan.Open(path))
+    {
+      return false;
+    }
+    for(auto& x : touched)
+    {
+      uint64_t first, end;
+      if(!scan.FindSize(x.second.size, first, end))
+      {
+        continue;
+      }
+      const IndexRecord* low = &scan.Record(0) + first;
+      const IndexRecord* high = &scan.Record(0) + end;
+      auto run = std::equal_range(low, high, x.first, DigestOrder());
+      (old_side ? x.second.old_count : x.second.new_count) += run.second - run.first;
+    }
+    return true;
+  }
+
+  if(!index.Open(path))
+  {
+    return false;
+  }
+  while(index.Next(file, ident, digest))
+  {
+    auto found = touched.find(digest);
+    if(found != touched.end())
+    {
+      (old_side ? found->second.old_count : found->second.new_count)++;
+    }
+  }
+  return !index.Unsorted();
+}
+
+/*! PrintReport
+List the changes when asked to, then summarize them */
+void IndexDiff::PrintReport() const
+{
+  double to_mb = 1.0 / (double)(1 << 20);
+  uint64_t added_bytes = 0, removed_bytes = 0, modified_bytes = 0, moved_bytes = 0;
+  double dup_change = 0;
+
+  for(auto& change : added)
+  {
+    added_bytes += change.size;
+    if(list_changes)
+    {
+      std::cout << "added    " << change.path << "\n";
+    }
+  }
+  for(auto& change : removed)
+  {
+    removed_bytes += change.size;
+    if(list_changes)
+    {
+      std::cout << "removed  " << change.path << "\n";
+    }
+  }
+  for(auto& change : modified)
+  {
+    modified_bytes += change.second.size;
+    if(list_changes)
+    {
+      std::cout << "modified " << change.second.path << "\n";
+    }
+  }
+  for(auto& change : moved)
+  {
+    moved_bytes += change.second.size;
+    if(list_changes)
+    {
+      std::cout << "moved    " << change.first.path << " -> "
+                << change.second.path << "\n";
+    }
+  }
+
+  /* Every copy beyond the first is duplicate data */
+  for(auto& x : touched)
+  {
+    const Counts& counts = x.second;
+    double old_dups = counts.old_count > 0 ? (double)(counts.old_count - 1) : 0;
+    double new_dups = counts.new_count > 0 ? (double)(counts.new_count - 1) : 0;
+    dup_change += (new_dups - old_dups) * (double)counts.size;
+  }
+
+  std::cout << std::fixed << std::showpoint << std::setprecision(2)
+            << "-- Index Diff -- " << std::endl
+            << "Added:                   " << added.size() << " files ("
+            << added_bytes * to_mb << "MB)" << std::endl
+            << "Removed:                 " << removed.size() << " files ("
+            << removed_bytes * to_mb << "MB)" << std::endl
+            << "Modified:                " << modified.size() << " files ("
+            << modified_bytes * to_mb << "MB)" << std::endl
+            << "Moved:                   " << moved.size() << " files ("
+            << moved_bytes * to_mb << "MB)" << std::endl
+            << "Duplicate data change:   " << std::showpos << dup_change * to_mb
+            << std::noshowpos << "MB" << std::endl;
+}
@@ -0,0 +1,73 @@
+#ifndef INDEX_DIFF_H
+#define INDEX_DIFF_H
+/*!
+  @file indexDiff.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "contentHash.h"
+#include "hashCache.h"
+
+/*!
+  Compares two saved indexes (hash caches) without touching the
+  filesystem. Both are read as a streaming merge on their sorted
+  paths, so only the changes are held in memory. Content removed at
+  one path and added at another is reported as moved.
+
+  A second pass counts how often each content touched by a change
+  occurs in either index, which gives the change in duplicate bytes
+  without counting every digest. On a scan index each count is a
+  binary search on its records.
+
+  @brief Churn and dedup drift between two scans.
+ */
+class IndexDiff
+{
+public:
+  /*! Constructor */
+  IndexDiff()
+    :list_changes(false) {}
+
+  void SetListChanges(bool enable) { list_changes = enable; }
+  bool Run(const std::string& old_path, const std::string& new_path);
+
+private:
+  struct Change
+  {
+    std::string path;
+    Digest digest;
+    uint64_t size;
+  };
+
+  /*! Times a content occurs in the old and new index */
+  struct Counts
+  {
+    uint64_t old_count;
+    uint64_t new_count;
+    uint64_t size;
+    Counts() :old_count(0), new_count(0), size(0) {}
+  };
+
+  bool Merge(const std::string& old_path, const std::string& new_path);
+  void MatchMoves();
+  bool CountTouched(const std::string& path, bool old_side);
+  void Touch(const Digest& digest, uint64_t size);
+  void PrintReport() const;
+
+  bool list_changes;
+  std::vector<Change> added;
+  std::vector<Change> removed;
+  std::vector<std::pair<Change,Change> > modified;
+  /*! Same path, old and new content */
+  std::vector<std::pair<Change,Change> > moved;
+  /*! Same content, old and new path */
+  std::unordered_map<Digest,Counts,DigestHash> touched;
+  /*! Content whose number of copies may have changed */
+};
+
+#endif /* INDEX_DIFF_H */
@@ -0,0 +1,356 @@
+/*!
+  @file ioBackend.cpp
+  @author Charles Irick
+*/
+#include <string>
+#include <vector>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ioBackend.h"
+
+/*! Mix
+splitmix64 finalizer, used for checksums and synthetic content */
+static inline uint64_t Mix(uint64_t x)
+{
+  x += 0x9E3779B97F4A7C15ULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+/*! BlockChecksum
+Cheap 64 bit checksum of a block, good enough to tell recorded
+blocks apart. Not a content hash.
+
+@param const void * data
+@param size_t len
+@return uint64_t
+*/
+uint64_t BlockChecksum(const void* data, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  uint64_t h = Mix(len);
+  size_t i = 0;
+
+  for(; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    h = Mix(h ^ word);
+  }
+  for(; i < len; i++)
+  {
+    h = Mix(h ^ p[i]);
+  }
+  return h;
+}
+
+/*! Open
+@param const std::string & path
+@return int
+File descriptor or -1
+*/
+int PosixBackend::Open(const std::string& path)
+{
+  return open(path.c_str(), O_RDONLY);
+}
+
+/*! Read
+Positional read, retried until len bytes or end of file */
+ssize_t PosixBackend::Read(int handle, void* buffer, size_t len, uint64_t offset)
+{
+  size_t total = 0;
+
+  while(total < len)
+  {
+    ssize_t got = pread(handle, (char*)buffer + total, len - total, offset + total);
+    if(got < 0)
+    {
+      return -1;
+    }
+    if(got == 0)
+    {
+      break;
+    }
+    total += got;
+  }
+  return total;
+}
+
+/*! Close */
+void PosixBackend::Close(int handle)
+{
+  close(handle);
+}
+
+/*! FillStat
+Convert a struct stat */
+static void FillStat(const struct stat& sb, FileStat& st)
+{
+  if(S_ISREG(sb.st_mode))      st.type = ENTRY_FILE;
+  else if(S_ISDIR(sb.st_mode)) st.type = ENTRY_DIR;
+  else                         st.type = ENTRY_OTHER;
+
+  st.ident.size = sb.st_size;
+#if defined(__APPLE__)
+  st.ident.mtime_sec = sb.st_mtimespec.tv_sec;
+  st.ident.mtime_nsec = sb.st_mtimespec.tv_nsec;
+#else
+  st.ident.mtime_sec = sb.st_mtim.tv_sec;
+  st.ident.mtime_nsec = sb.st_mtim.tv_nsec;
+#endif
+  st.ident.dev = sb.st_dev;
+  st.ident.ino = sb.st_ino;
+}
+
+/*! Stat
+Stat a path, following symlinks */
+bool PosixBackend::Stat(const std::string& path, FileStat& st)
+{
+  struct stat sb;
+
+  if(stat(path.c_str(), &sb) != 0)
+  {
+    return false;
+  }
+  FillStat(sb, st);
+  return true;
+}
+
+/*! ListDir
+List a directory in readdir order, without "." and "..". The type
+comes from d_type and is ENTRY_UNKNOWN for symlinks and on
+filesystems that do not fill it in.
+*/
+bool PosixBackend::ListDir(const std::string& path, std::vector<DirEntry>& entries)
+{
+  DIR* dir = opendir(path.c_str());
+  struct dirent* ent;
+
+  entries.clear();
+  if(dir == NULL)
+  {
+    return false;
+  }
+
+  while((ent = readdir(dir)) != NULL)
+  {
+    DirEntry entry;
+
+    if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+    {
+      continue;
+    }
+    entry.name = ent->d_name;
+    entry.ino = ent->d_ino;
+    switch(ent->d_type)
+    {
+      case DT_REG: entry.type = ENTRY_FILE;    break;
+      case DT_DIR: entry.type = ENTRY_DIR;     break;
+      case DT_LNK:
+      case DT_UNKNOWN: entry.type = ENTRY_UNKNOWN; break;
+      default:     entry.type = ENTRY_OTHER;   break;
+    }
+    entries.push_back(entry);
+  }
+  closedir(dir);
+  return true;
+}
+
+/*! Delay
+Sleep for a recorded duration when replaying timing */
+void MemoryBackend::Delay(uint64_t usec) const
+{
+  if(replay_timing && usec > 0)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(usec));
+  }
+}
+
+/*! AddDir
+Record the listing of a directory */
+void MemoryBackend::AddDir(const std::string& path,
+                           const std::vector<DirEntry>& entries, uint64_t usec)
+{
+  Node& node = nodes[path];
+  node.have_listing = true;
+  node.entries = entries;
+  node.list_usec = usec;
+}
+
+/*! AddStat
+Record the stat result of a path */
+void MemoryBackend::AddStat(const std::string& path, const FileStat& st,
+                            uint64_t usec)
+{
+  Node& node = nodes[path];
+  node.have_stat = true;
+  node.st = st;
+  node.stat_usec = usec;
+}
+
+/*! AddExtent
+Record a read of a file. Reads of the same range that were recorded
+with the same seed return the same bytes. */
+void MemoryBackend::AddExtent(const std::string& path, uint64_t offset,
+                              size_t len, uint64_t seed, uint64_t usec)
+{
+  Extent extent;
+  extent.len = len;
+  extent.seed = seed;
+  extent.usec = usec;
+  nodes[path].extents[offset] = extent;
+}
+
+/*! Open
+Files are opened as long as they were stat'ed or read in the trace */
+int MemoryBackend::Open(const std::string& path)
+{
+  auto found = nodes.find(path);
+
+  if(found == nodes.end() ||
+     (found->second.have_stat && found->second.st.type != ENTRY_FILE))
+  {
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> lock(open_lock);
+  open_files[next_handle] = &found->second;
+  return next_handle++;
+}
+
+/*! Read
+Fill the buffer with the pattern of the recorded extents. Ranges that
+were never recorded get a pattern unique to the file, so they never
+compare equal to another file by accident. */
+ssize_t MemoryBackend::Read(int handle, void* buffer, size_t len, uint64_t offset)
+{
+  const Node* node;
+  {
+    std::lock_guard<std::mutex> lock(open_lock);
+    auto found = open_files.find(handle);
+    if(found == open_files.end())
+    {
+      return -1;
+    }
+    node = found->second;
+  }
+
+  /* Clamp to the recorded size. A file never stat'ed in the trace
+  ends with its last recorded extent, or read loops would never see
+  the end of it */
+  uint64_t size = 0;
+  if(node->have_stat)
+  {
+    size = node->st.ident.size;
+  }
+  else if(!node->extents.empty())
+  {
+    size = node->extents.rbegin()->first + node->extents.rbegin()->second.len;
+  }
+  if(offset >= size)
+  {
+    return 0;
+  }
+  if(len > size - offset)
+  {
+    len = size - offset;
+  }
+
+  unsigned char* out = (unsigned char*)buffer;
+  uint64_t fallback = BlockChecksum(&node, sizeof(node));
+  uint64_t usec = 0;
+
+  for(size_t i = 0; i < len; )
+  {
+    uint64_t pos = offset + i;
+    uint64_t start = 0, seed = fallback;
+    size_t run = len - i;
+    bool recorded = false;
+
+    /* Find the extent covering this position, if any */
+    auto ext = node->extents.upper_bound(pos);
+    if(ext != node->extents.begin())
+    {
+      --ext;
+      if(pos < ext->first + ext->second.len)
+      {
+        recorded = true;
+        start = ext->first;
+        seed = ext->second.seed;
+        usec += ext->second.usec;
+        if(run > ext->first + ext->second.len - pos)
+        {
+          run = ext->first + ext->second.len - pos;
+        }
+      }
+    }
+    if(!recorded)
+    {
+      /* Stop at the next recorded extent */
+      auto next = node->extents.upper_bound(pos);
+      if(next != node->extents.end() && run > next->first - pos)
+      {
+        run = next->first - pos;
+      }
+    }
+
+    /* Pattern words only depend on the seed and the position inside
+    the extent */
+    uint64_t word = 0, word_index = UINT64_MAX;
+    for(size_t j = 0; j < run; j++)
+    {
+      uint64_t rel = pos + j - start;
+      if(rel / 8 != word_index)
+      {
+        word_index = rel / 8;
+        word = Mix(seed + word_index);
+      }
+      out[i + j] = (unsigned char)(word >> (8 * (rel % 8)));
+    }
+    i += run;
+  }
+
+  Delay(usec);
+  return len;
+}
+
+/*! Close */
+void MemoryBackend::Close(int handle)
+{
+  std::lock_guard<std::mutex> lock(open_lock);
+  open_files.erase(handle);
+}
+
+/*! Stat */
+bool MemoryBackend::Stat(const std::string& path, FileStat& st)
+{
+  auto found = nodes.find(path);
+
+  if(found == nodes.end() || !found->second.have_stat)
+  {
+    return false;
+  }
+  Delay(found->second.stat_usec);
+  st = found->second.st;
+  return true;
+}
+
+/*! ListDir */
+bool MemoryBackend::ListDir(const std::string& path, std::vector<DirEntry>& entries)
+{
+  auto found = nodes.find(path);
+
+  if(found == nodes.end() || !found->second.have_listing)
+  {
+    return false;
+  }
+  Delay(found->second.list_usec);
+  entries = found->second.entries;
+  return true;
+}
@@ -0,0 +1,156 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+/*!
+  @file ioBackend.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sys/types.h>
+#include "hashCache.h"
+
+/*! Kind of a directory entry or stat'ed path */
+enum EntryType
+{
+  ENTRY_UNKNOWN = 0, /*!< Type not known without a stat */
+  ENTRY_FILE    = 1,
+  ENTRY_DIR     = 2,
+  ENTRY_OTHER   = 3  /*!< Devices, sockets, fifos */
+};
+
+/*! One entry returned when listing a directory */
+struct DirEntry
+{
+  std::string name;
+  uint64_t ino;
+  EntryType type;
+};
+
+/*! Result of a stat. Symlinks are followed */
+struct FileStat
+{
+  EntryType type;
+  FileIdentity ident;
+};
+
+/*!
+  Every open, read, stat and directory listing done while scanning
+  goes through this interface, so the storage underneath can be the
+  real filesystem, an in-memory tree, a replayed trace or a model of
+  slower storage. Implementations must be safe to call from several
+  threads at once.
+
+  @brief Storage access used by the scan.
+ */
+class IoBackend
+{
+public:
+  virtual ~IoBackend() {}
+
+  /* Open a file for reading, returns a handle or -1 */
+  virtual int Open(const std::string& path) = 0;
+  /* Positional read, returns bytes read, 0 at end of file, -1 on error */
+  virtual ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset) = 0;
+  virtual void Close(int handle) = 0;
+  virtual bool Stat(const std::string& path, FileStat& st) = 0;
+  virtual bool ListDir(const std::string& path, std::vector<DirEntry>& entries) = 0;
+  /* Report anything the backend measured, nothing by default */
+  virtual void PrintStats(std::ostream& out) const { (void)out; }
+  /* If paths are those of the local filesystem, so other system calls
+  on them (xattrs, fs-verity) see the same files */
+  virtual bool IsLocal() const { return true; }
+};
+
+/*!
+  Straight POSIX calls against the local filesystem.
+
+  @brief Default backend.
+ */
+class PosixBackend : public IoBackend
+{
+public:
+  int Open(const std::string& path);
+  ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset);
+  void Close(int handle);
+  bool Stat(const std::string& path, FileStat& st);
+  bool ListDir(const std::string& path, std::vector<DirEntry>& entries);
+};
+
+/*!
+  Tree of directories and files held in memory. File content is not
+  stored, each read extent is described by a seed and filled with a
+  pseudo random pattern, so extents recorded with the same checksum
+  read back identical and anything else differs. Optionally every
+  operation takes as long as it did when it was recorded.
+
+  Trees are normally loaded from a trace written by TraceRecorder,
+  a hand written trace works just as well for synthetic trees.
+
+  @brief In-memory tree for replaying traces.
+ */
+class MemoryBackend : public IoBackend
+{
+public:
+  /*! Constructor */
+  MemoryBackend()
+    :replay_timing(false), next_handle(0) {}
+
+  bool LoadTrace(const std::string& trace_path);
+  void SetReplayTiming(bool enable) { replay_timing = enable; }
+
+  void AddDir(const std::string& path, const std::vector<DirEntry>& entries,
+              uint64_t usec);
+  void AddStat(const std::string& path, const FileStat& st, uint64_t usec);
+  void AddExtent(const std::string& path, uint64_t offset, size_t len,
+                 uint64_t seed, uint64_t usec);
+
+  int Open(const std::string& path);
+  ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset);
+  void Close(int handle);
+  bool Stat(const std::string& path, FileStat& st);
+  bool ListDir(const std::string& path, std::vector<DirEntry>& entries);
+  bool IsLocal() const { return false; }
+
+private:
+  struct Extent
+  {
+    size_t len;
+    uint64_t seed;
+    uint64_t usec;
+  };
+  struct Node
+  {
+    Node()
+      :have_stat(false), stat_usec(0), have_listing(false), list_usec(0) {}
+    bool have_stat;
+    FileStat st;
+    uint64_t stat_usec;
+    bool have_listing;
+    std::vector<DirEntry> entries;
+    uint64_t list_usec;
+    std::map<uint64_t,Extent> extents;
+  };
+
+  void Delay(uint64_t usec) const;
+
+  std::unordered_map<std::string,Node> nodes;
+  /*! Every path seen, read only once loaded */
+  bool replay_timing;
+  /*! Sleep for the recorded duration of each operation */
+  std::mutex open_lock;
+  std::unordered_map<int,const Node*> open_files;
+  /*! Nodes of files currently open, keyed by handle */
+  int next_handle;
+};
+
+uint64_t BlockChecksum(const void* data, size_t len);
+
+#endif /* IO_BACKEND_H */
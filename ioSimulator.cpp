@@ -0,0 +1,175 @@
+/*!
+  @file ioSimulator.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include "ioSimulator.h"
+
+/*! Parse
+Parse a storage model. Either a preset name (hdd, nfs, ssd), or a
+comma separated list of seek=MS, rtt=MS, bw=MB/s and scale=X, which
+can also follow a preset to adjust it, e.g. "nfs,rtt=2,scale=0.1".
+
+@param const std::string & spec
+@return boolean
+If the model was understood
+*/
+bool StorageModel::Parse(const std::string& spec)
+{
+  std::istringstream items(spec);
+  std::string item;
+
+  while(std::getline(items, item, ','))
+  {
+    size_t eq = item.find('=');
+    std::string name = item.substr(0, eq);
+    double value = (eq == std::string::npos) ? 0 : atof(item.c_str() + eq + 1);
+
+    if(name == "hdd")
+    {
+      /* 7200rpm SATA disk */
+      seek_ms = 8.5; rtt_ms = 0; bandwidth_mbps = 150;
+    }
+    else if(name == "nfs")
+    {
+      /* NFS server over gigabit ethernet */
+      seek_ms = 0; rtt_ms = 0.5; bandwidth_mbps = 110;
+    }
+    else if(name == "ssd")
+    {
+      seek_ms = 0; rtt_ms = 0.08; bandwidth_mbps = 500;
+    }
+    else if(name == "seek" && eq != std::string::npos)  seek_ms = value;
+    else if(name == "rtt" && eq != std::string::npos)   rtt_ms = value;
+    else if(name == "bw" && eq != std::string::npos)    bandwidth_mbps = value;
+    else if(name == "scale" && eq != std::string::npos && value > 0) time_scale = value;
+    else
+    {
+      std::cerr << "Unknown storage model setting: " << item << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! Simulate
+Work out when an operation would complete on the simulated tier and
+sleep until then. Time already spent in the inner backend counts
+towards the delay.
+
+@param Clock::time_point start
+When the operation was issued
+@param int handle
+File being read, INODE_TABLE for stats, -1 for other metadata
+operations
+@param uint64_t offset
+@param size_t len
+Bytes transferred
+*/
+void SimulatedBackend::Simulate(Clock::time_point start, int handle,
+                                uint64_t offset, size_t len)
+{
+  double rtt_us = model.rtt_ms * 1000.0 * model.time_scale;
+  double service_us = 0;
+  Clock::time_point arrive = start +
+    std::chrono::microseconds((long long)rtt_us);
+  Clock::time_point done;
+
+  {
+    std::lock_guard<std::mutex> lock(device_lock);
+
+    bool sequential = handle >= 0 && handle == head_handle && offset == head_pos;
+    
+    /* Inode table blocks read ahead with the last stat */
+    if(handle == INODE_TABLE && head_handle == INODE_TABLE)
+    {
+      sequential = offset >= head_pos && offset - head_pos < INODE_READAHEAD;
+    }
+    if(!sequential)
+    {
+      service_us += model.seek_ms * 1000.0;
+      seeks++;
+    }
+    if(model.bandwidth_mbps > 0)
+    {
+      service_us += (double)len / model.bandwidth_mbps;
+    }
+    service_us *= model.time_scale;
+
+    /* The device serves one request at a time */
+    Clock::time_point begin = (device_free > arrive) ? device_free : arrive;
+    done = begin + std::chrono::microseconds((long long)service_us);
+    device_free = done;
+
+    wait_us += std::chrono::duration<double, std::micro>(begin - arrive).count();
+    busy_us += service_us;
+    head_handle = handle;
+    head_pos = offset + len;
+    ops++;
+    bytes += len;
+  }
+
+  std::this_thread::sleep_until(done);
+}
+
+int SimulatedBackend::Open(const std::string& path)
+{
+  Clock::time_point start = Clock::now();
+  int handle = inner->Open(path);
+  Simulate(start, -1, 0, 0);
+  return handle;
+}
+
+ssize_t SimulatedBackend::Read(int handle, void* buffer, size_t len, uint64_t offset)
+{
+  Clock::time_point start = Clock::now();
+  ssize_t got = inner->Read(handle, buffer, len, offset);
+  Simulate(start, handle, offset, got > 0 ? got : 0);
+  return got;
+}
+
+void SimulatedBackend::Close(int handle)
+{
+  inner->Close(handle);
+}
+
+bool SimulatedBackend::Stat(const std::string& path, FileStat& st)
+{
+  Clock::time_point start = Clock::now();
+  bool ok = inner->Stat(path, st);
+  if(ok)
+  {
+    Simulate(start, INODE_TABLE, st.ident.ino * INODE_SIZE, 0);
+  }
+  else
+  {
+    Simulate(start, -1, 0, 0);
+  }
+  return ok;
+}
+
+bool SimulatedBackend::ListDir(const std::string& path, std::vector<DirEntry>& entries)
+{
+  Clock::time_point start = Clock::now();
+  bool ok = inner->ListDir(path, entries);
+  Simulate(start, -1, 0, 0);
+  return ok;
+}
+
+/*! PrintStats
+Report what the simulated device did */
+void SimulatedBackend::PrintStats(std::ostream& out) const
+{
+  std::lock_guard<std::mutex> lock(device_lock);
+
+  inner->PrintStats(out);
+  out << std::fixed << std::showpoint << std::setprecision(2)
+      << "Simulated operations:    " << ops << " (" << seeks << " seeks)\n"
+      << "Simulated device busy:   " << busy_us / 1e6 << "s\n"
+      << "Simulated queue wait:    " << wait_us / 1e6 << "s\n";
+}
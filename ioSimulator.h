@@ -0,0 +1,98 @@
+#ifndef IO_SIMULATOR_H
+#define IO_SIMULATOR_H
+/*!
+  @file ioSimulator.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "ioBackend.h"
+
+/*!
+  Cost model of a storage tier. Every operation pays the round trip,
+  then waits for the device, which serves one request at a time: a
+  seek whenever the request does not continue where the last one
+  stopped, plus the transfer at the bandwidth cap. A stat is a read
+  of the inode table at the position of the inode, and is sequential
+  when it falls within the readahead of the last one.
+
+  @brief Latency and bandwidth of simulated storage.
+ */
+struct StorageModel
+{
+  /*! Constructor, models nothing until parsed */
+  StorageModel()
+    :seek_ms(0), rtt_ms(0), bandwidth_mbps(0), time_scale(1) {}
+
+  bool Parse(const std::string& spec);
+
+  double seek_ms;
+  /*! Head movement, paid on every non sequential access */
+  double rtt_ms;
+  /*! Network round trip, paid by every operation in parallel */
+  double bandwidth_mbps;
+  /*! Transfer rate in MB/s, 0 for unlimited */
+  double time_scale;
+  /*! Multiplier on every delay, < 1 runs faster than real time */
+};
+
+/*!
+  Wraps another backend (the real tree, or a replayed trace) and
+  delays every operation as the storage model says it would take on
+  the simulated tier. Threads wait on a shared device timeline, so
+  queue depth and scheduling effects show up the way they would on
+  the real hardware.
+
+  @brief Backend that simulates slow storage.
+ */
+class SimulatedBackend : public IoBackend
+{
+public:
+  /*! Constructor, takes ownership of the inner backend */
+  SimulatedBackend(IoBackend* inner_backend, const StorageModel& storage)
+    :inner(inner_backend), model(storage), device_free(),
+     head_handle(-1), head_pos(0), ops(0), seeks(0), bytes(0),
+     busy_us(0), wait_us(0) {}
+
+  int Open(const std::string& path);
+  ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset);
+  void Close(int handle);
+  bool Stat(const std::string& path, FileStat& st);
+  bool ListDir(const std::string& path, std::vector<DirEntry>& entries);
+  void PrintStats(std::ostream& out) const;
+  bool IsLocal() const { return inner->IsLocal(); }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+  static const int INODE_TABLE = -2;
+  static const uint64_t INODE_SIZE = 256;
+  static const uint64_t INODE_READAHEAD = 32 * 4096;
+
+  void Simulate(Clock::time_point start, int handle, uint64_t offset, size_t len);
+
+  std::unique_ptr<IoBackend> inner;
+  /*! Backend doing the real work */
+  StorageModel model;
+  mutable std::mutex device_lock;
+  /*! Protects the device state below */
+  Clock::time_point device_free;
+  /*! When the device finishes the requests already queued */
+  int head_handle;
+  /*! File the head was last positioned in, -1 for metadata,
+      INODE_TABLE for stats */
+  uint64_t head_pos;
+  /*! Offset the next sequential read would start at */
+  uint64_t ops;
+  uint64_t seeks;
+  uint64_t bytes;
+  double busy_us;
+  /*! Simulated device service time */
+  double wait_us;
+  /*! Simulated time requests spent queued behind others */
+};
+
+#endif /* IO_SIMULATOR_H */
@@ -0,0 +1,292 @@
+/*!
+  @file ioTrace.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cinttypes>
+#include "ioTrace.h"
+
+static const char IO_TRACE_HEADER[] = "# file_utils io trace 1";
+
+/*! Elapsed
+Microseconds since start */
+static uint64_t Elapsed(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+/*! ~TraceRecorder
+Flush and close the trace */
+TraceRecorder::~TraceRecorder()
+{
+  if(out != NULL)
+  {
+    fclose(out);
+  }
+}
+
+/*! Start
+Create the trace file
+
+@param const std::string & trace_path
+@return boolean
+If the trace could be created
+*/
+bool TraceRecorder::Start(const std::string& trace_path)
+{
+  out = fopen(trace_path.c_str(), "w");
+  if(out == NULL)
+  {
+    std::cerr << "Could not create I/O trace: " << trace_path << std::endl;
+    return false;
+  }
+  fprintf(out, "%s\n", IO_TRACE_HEADER);
+  return true;
+}
+
+int TraceRecorder::Open(const std::string& path)
+{
+  auto start = std::chrono::steady_clock::now();
+  int handle = inner->Open(path);
+  uint64_t usec = Elapsed(start);
+
+  std::lock_guard<std::mutex> lock(out_lock);
+  int id = next_id++;
+  fprintf(out, "open\t%" PRIu64 "\t%d\t%d\t%s\n", usec, id, handle >= 0,
+          EscapePath(path).c_str());
+  if(handle < 0)
+  {
+    return -1;
+  }
+  handles[id] = handle;
+  return id;
+}
+
+ssize_t TraceRecorder::Read(int handle, void* buffer, size_t len, uint64_t offset)
+{
+  int inner_handle;
+  {
+    std::lock_guard<std::mutex> lock(out_lock);
+    auto found = handles.find(handle);
+    if(found == handles.end())
+    {
+      return -1;
+    }
+    inner_handle = found->second;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  ssize_t got = inner->Read(inner_handle, buffer, len, offset);
+  uint64_t usec = Elapsed(start);
+  uint64_t checksum = (got > 0) ? BlockChecksum(buffer, got) : 0;
+
+  std::lock_guard<std::mutex> lock(out_lock);
+  fprintf(out, "read\t%" PRIu64 "\t%d\t%" PRIu64 "\t%zd\t%" PRIu64 "\n",
+          usec, handle, offset, got, checksum);
+  return got;
+}
+
+void TraceRecorder::Close(int handle)
+{
+  std::lock_guard<std::mutex> lock(out_lock);
+  auto found = handles.find(handle);
+
+  if(found != handles.end())
+  {
+    inner->Close(found->second);
+    handles.erase(found);
+    fprintf(out, "close\t%d\n", handle);
+  }
+}
+
+bool TraceRecorder::Stat(const std::string& path, FileStat& st)
+{
+  auto start = std::chrono::steady_clock::now();
+  bool ok = inner->Stat(path, st);
+  uint64_t usec = Elapsed(start);
+
+  std::lock_guard<std::mutex> lock(out_lock);
+  if(ok)
+  {
+    fprintf(out, "stat\t%" PRIu64 "\t1\t%d\t%" PRIu64 "\t%" PRId64 "\t%" PRId64
+                 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+            usec, (int)st.type, st.ident.size, st.ident.mtime_sec,
+            st.ident.mtime_nsec, st.ident.dev, st.ident.ino,
+            EscapePath(path).c_str());
+  }
+  else
+  {
+    fprintf(out, "stat\t%" PRIu64 "\t0\t0\t0\t0\t0\t0\t0\t%s\n", usec,
+            EscapePath(path).c_str());
+  }
+  return ok;
+}
+
+bool TraceRecorder::ListDir(const std::string& path, std::vector<DirEntry>& entries)
+{
+  auto start = std::chrono::steady_clock::now();
+  bool ok = inner->ListDir(path, entries);
+  uint64_t usec = Elapsed(start);
+
+  std::lock_guard<std::mutex> lock(out_lock);
+  fprintf(out, "list\t%" PRIu64 "\t%d\t%zu\t%s\n", usec, ok,
+          ok ? entries.size() : 0, EscapePath(path).c_str());
+  for(size_t i = 0; ok && i < entries.size(); i++)
+  {
+    fprintf(out, "entry\t%d\t%" PRIu64 "\t%s\n", (int)entries[i].type,
+            entries[i].ino, EscapePath(entries[i].name).c_str());
+  }
+  return ok;
+}
+
+/*! SplitFields
+Split a tab separated trace line. The last field keeps any tabs. */
+static std::vector<std::string> SplitFields(const std::string& line, size_t count)
+{
+  std::vector<std::string> fields;
+  size_t start = 0;
+
+  while(fields.size() + 1 < count)
+  {
+    size_t tab = line.find('\t', start);
+    if(tab == std::string::npos)
+    {
+      break;
+    }
+    fields.push_back(line.substr(start, tab - start));
+    start = tab + 1;
+  }
+  fields.push_back(line.substr(start));
+  return fields;
+}
+
+/*! LoadTrace
+Build the in-memory tree from a trace written by TraceRecorder.
+Failed operations are left out, so they fail again on replay.
+
+@param const std::string & trace_path
+@return boolean
+If the trace could be read
+*/
+bool MemoryBackend::LoadTrace(const std::string& trace_path)
+{
+  std::ifstream in(trace_path.c_str());
+  std::unordered_map<int,std::string> open_paths;
+  std::string line;
+  unsigned long bad_lines = 0;
+
+  if(!in || !std::getline(in, line) || line != IO_TRACE_HEADER)
+  {
+    std::cerr << "Not an I/O trace: " << trace_path << std::endl;
+    return false;
+  }
+
+  while(std::getline(in, line))
+  {
+    std::string op = line.substr(0, line.find('\t'));
+
+    if(op == "list")
+    {
+      std::vector<std::string> f = SplitFields(line, 5);
+      std::vector<DirEntry> entries;
+      if(f.size() != 5)
+      {
+        bad_lines++;
+        continue;
+      }
+      unsigned long count = strtoul(f[3].c_str(), NULL, 10);
+      for(unsigned long i = 0; i < count && std::getline(in, line); i++)
+      {
+        std::vector<std::string> e = SplitFields(line, 4);
+        DirEntry entry;
+        if(e.size() != 4 || e[0] != "entry")
+        {
+          bad_lines++;
+          continue;
+        }
+        entry.type = (EntryType)atoi(e[1].c_str());
+        entry.ino = strtoull(e[2].c_str(), NULL, 10);
+        entry.name = UnescapePath(e[3]);
+        entries.push_back(entry);
+      }
+      if(f[2] == "1")
+      {
+        AddDir(UnescapePath(f[4]), entries, strtoull(f[1].c_str(), NULL, 10));
+      }
+    }
+    else if(op == "stat")
+    {
+      std::vector<std::string> f = SplitFields(line, 10);
+      FileStat st;
+      if(f.size() != 10)
+      {
+        bad_lines++;
+        continue;
+      }
+      if(f[2] != "1")
+      {
+        continue;
+      }
+      st.type = (EntryType)atoi(f[3].c_str());
+      st.ident.size = strtoull(f[4].c_str(), NULL, 10);
+      st.ident.mtime_sec = strtoll(f[5].c_str(), NULL, 10);
+      st.ident.mtime_nsec = strtoll(f[6].c_str(), NULL, 10);
+      st.ident.dev = strtoull(f[7].c_str(), NULL, 10);
+      st.ident.ino = strtoull(f[8].c_str(), NULL, 10);
+      AddStat(UnescapePath(f[9]), st, strtoull(f[1].c_str(), NULL, 10));
+    }
+    else if(op == "open")
+    {
+      std::vector<std::string> f = SplitFields(line, 5);
+      if(f.size() != 5)
+      {
+        bad_lines++;
+        continue;
+      }
+      if(f[3] == "1")
+      {
+        std::string path = UnescapePath(f[4]);
+        open_paths[atoi(f[2].c_str())] = path;
+        /* Make sure the file exists even if it was never stat'ed */
+        nodes[path];
+      }
+    }
+    else if(op == "read")
+    {
+      std::vector<std::string> f = SplitFields(line, 6);
+      if(f.size() != 6)
+      {
+        bad_lines++;
+        continue;
+      }
+      auto path = open_paths.find(atoi(f[2].c_str()));
+      long long got = strtoll(f[4].c_str(), NULL, 10);
+      if(path != open_paths.end() && got > 0)
+      {
+        AddExtent(path->second, strtoull(f[3].c_str(), NULL, 10), got,
+                  strtoull(f[5].c_str(), NULL, 10),
+                  strtoull(f[1].c_str(), NULL, 10));
+      }
+    }
+    else if(op == "close")
+    {
+      open_paths.erase(atoi(line.c_str() + 6));
+    }
+    else if(!line.empty())
+    {
+      bad_lines++;
+    }
+  }
+
+  if(bad_lines > 0)
+  {
+    std::cerr << "Ignored " << bad_lines << " bad lines in " << trace_path << std::endl;
+  }
+  return true;
+}
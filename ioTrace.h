@@ -0,0 +1,65 @@
+#ifndef IO_TRACE_H
+#define IO_TRACE_H
+/*!
+  @file ioTrace.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdio>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "ioBackend.h"
+
+/*!
+  Records every operation passed through to another backend, with
+  its result and how long it took, in a text trace that
+  MemoryBackend::LoadTrace() can replay. Reads are recorded with a
+  checksum of the data instead of the data itself, which is enough
+  for a replay to reproduce which blocks match.
+
+  Trace lines are tab separated with the path last:
+
+    list  <usec> <ok> <count> <dir>     followed by count lines of
+    entry <type> <ino> <name>
+    stat  <usec> <ok> <type> <size> <mtime_sec> <mtime_nsec> <dev> <ino> <path>
+    open  <usec> <id> <ok> <path>
+    read  <usec> <id> <offset> <bytes> <checksum>
+    close <id>
+
+  @brief I/O trace recorder.
+ */
+class TraceRecorder : public IoBackend
+{
+public:
+  /*! Constructor, takes ownership of the inner backend */
+  TraceRecorder(IoBackend* inner_backend)
+    :inner(inner_backend), out(NULL), next_id(0) {}
+  ~TraceRecorder();
+
+  bool Start(const std::string& trace_path);
+
+  int Open(const std::string& path);
+  ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset);
+  void Close(int handle);
+  bool Stat(const std::string& path, FileStat& st);
+  bool ListDir(const std::string& path, std::vector<DirEntry>& entries);
+  void PrintStats(std::ostream& stats) const { inner->PrintStats(stats); }
+  bool IsLocal() const { return inner->IsLocal(); }
+
+private:
+  std::unique_ptr<IoBackend> inner;
+  /*! Backend doing the real work */
+  FILE* out;
+  /*! Trace being written */
+  std::mutex out_lock;
+  /*! Keeps trace lines from different threads whole and ordered */
+  std::unordered_map<int,int> handles;
+  /*! Inner handle of every open trace id */
+  int next_id;
+  /*! Trace ids are never reused, unlike file descriptors */
+};
+
+#endif /* IO_TRACE_H */
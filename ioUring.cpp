@@ -0,0 +1,203 @@
+/*!
+  @file ioUring.cpp
+  @author Charles Irick
+*/
+#include <cerrno>
+#include <cstring>
+#include "ioUring.h"
+
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*! ~IoUring
+Unmap the rings and close the ring descriptor */
+IoUring::~IoUring()
+{
+  if(sqes != NULL)
+  {
+    munmap(sqes, sqes_len);
+  }
+  if(cq_ptr != NULL && cq_ptr != sq_ptr)
+  {
+    munmap(cq_ptr, cq_len);
+  }
+  if(sq_ptr != NULL)
+  {
+    munmap(sq_ptr, sq_len);
+  }
+  if(ring_fd >= 0)
+  {
+    close(ring_fd);
+  }
+}
+
+/*! Init
+Create the ring and map the queues
+
+@param unsigned int queue_depth
+Number of submission entries, rounded up by the kernel
+@return boolean
+If io_uring is available
+*/
+bool IoUring::Init(unsigned int queue_depth)
+{
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+  if(ring_fd < 0)
+  {
+    return false;
+  }
+
+  sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+  }
+
+  sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQ_RING);
+  if(sq_ptr == MAP_FAILED)
+  {
+    sq_ptr = NULL;
+    return false;
+  }
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    cq_ptr = sq_ptr;
+  }
+  else
+  {
+    cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_CQ_RING);
+    if(cq_ptr == MAP_FAILED)
+    {
+      cq_ptr = NULL;
+      return false;
+    }
+  }
+
+  sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring_fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED)
+  {
+    sqes = NULL;
+    return false;
+  }
+
+  char* sq = (char*)sq_ptr;
+  char* cq = (char*)cq_ptr;
+  sq_head = (unsigned int*)(sq + params.sq_off.head);
+  sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+  sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  sq_array = (unsigned int*)(sq + params.sq_off.array);
+  cq_head = (unsigned int*)(cq + params.cq_off.head);
+  cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+  cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  cqes = cq + params.cq_off.cqes;
+  entries = params.sq_entries;
+  return true;
+}
+
+/*! NextSqe
+Claim the next free submission entry, NULL when the queue is full */
+void* IoUring::NextSqe()
+{
+  unsigned int head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *sq_tail;
+
+  if(tail - head >= entries)
+  {
+    return NULL;
+  }
+
+  unsigned int index = tail & *sq_mask;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*)sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  return sqe;
+}
+
+/*! PrepUnlinkAt
+Queue an unlinkat(dir_fd, name, 0). The name must stay valid until
+the completion is reaped. */
+bool IoUring::PrepUnlinkAt(int dir_fd, const char* name, uint64_t user_data)
+{
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*)NextSqe();
+
+  if(sqe == NULL)
+  {
+    return false;
+  }
+  sqe->opcode = IORING_OP_UNLINKAT;
+  sqe->fd = dir_fd;
+  sqe->addr = (uint64_t)(uintptr_t)name;
+  sqe->user_data = user_data;
+
+  __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+  pending++;
+  return true;
+}
+
+/*! Submit
+Hand prepared entries to the kernel and optionally wait
+
+@param unsigned int wait_for
+Number of completions to wait for
+@return int
+Entries submitted, or -errno
+*/
+int IoUring::Submit(unsigned int wait_for)
+{
+  int ret = syscall(__NR_io_uring_enter, ring_fd, pending, wait_for,
+                    wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if(ret < 0)
+  {
+    return -errno;
+  }
+  pending -= ret;
+  return ret;
+}
+
+/*! Reap
+Pop one completion without waiting
+
+@param uint64_t & user_data
+@param int & result
+Syscall result, -errno on failure
+@return boolean
+If a completion was available
+*/
+bool IoUring::Reap(uint64_t& user_data, int& result)
+{
+  unsigned int head = *cq_head;
+  unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+  if(head == tail)
+  {
+    return false;
+  }
+
+  struct io_uring_cqe* cqe = (struct io_uring_cqe*)cqes + (head & *cq_mask);
+  user_data = cqe->user_data;
+  result = cqe->res;
+  __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+#else /* HAVE_IO_URING */
+
+IoUring::~IoUring() {}
+bool IoUring::Init(unsigned int) { return false; }
+void* IoUring::NextSqe() { return NULL; }
+bool IoUring::PrepUnlinkAt(int, const char*, uint64_t) { return false; }
+int IoUring::Submit(unsigned int) { return -1; }
+bool IoUring::Reap(uint64_t&, int&) { return false; }
+
+#endif /* HAVE_IO_URING */
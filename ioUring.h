@@ -0,0 +1,72 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+/*!
+  @file ioUring.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+/*!
+  Minimal io_uring submission/completion queue pair talking to the
+  kernel with raw syscalls, so no liburing is needed. Only the
+  operations file_utils batches are wrapped. One ring per thread,
+  the object itself is not thread safe.
+
+  On systems without io_uring Init() fails and callers fall back to
+  plain syscalls.
+
+  @brief Batched asynchronous syscalls on Linux.
+ */
+class IoUring
+{
+public:
+  /*! Constructor */
+  IoUring()
+    :ring_fd(-1), entries(0), pending(0), sq_ptr(NULL), sq_len(0),
+     cq_ptr(NULL), cq_len(0), sqes(NULL), sqes_len(0) {}
+  ~IoUring();
+
+  bool Init(unsigned int queue_depth);
+
+  bool PrepUnlinkAt(int dir_fd, const char* name, uint64_t user_data);
+  int Submit(unsigned int wait_for);
+  bool Reap(uint64_t& user_data, int& result);
+
+private:
+  /* Not copyable, we own the ring */
+  IoUring(const IoUring&);
+  IoUring& operator=(const IoUring&);
+
+  void* NextSqe();
+
+  int ring_fd;
+  unsigned int entries;
+  /*! Submission queue size */
+  unsigned int pending;
+  /*! Prepared entries not yet handed to the kernel */
+  void* sq_ptr;
+  size_t sq_len;
+  void* cq_ptr;
+  size_t cq_len;
+  void* sqes;
+  size_t sqes_len;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_mask;
+  unsigned int* sq_array;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int* cq_mask;
+  void* cqes;
+};
+
+#endif /* IO_URING_H */
@@ -0,0 +1,429 @@
+/*!
+  @file ioWatchdog.cpp
+  @author Charles Irick
+*/
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include "ioWatchdog.h"
+#include "workQueue.h"
+
+/*! One operation handed to a worker */
+struct WatchdogBackend::Job
+{
+  std::function<void()> work;
+  /*!< The call into the inner backend */
+  std::function<void()> cleanup;
+  /*!< Undoes the work if it finishes after the deadline */
+  std::mutex lock;
+  std::condition_variable finished;
+  bool done;
+  bool abandoned;
+  /*!< The caller stopped waiting */
+  Device device;
+  std::vector<char> data;
+  /*!< Read buffer, kept with the job when it is reused */
+  int handle;
+  ssize_t got;
+  bool ok;
+  FileStat st;
+  std::vector<DirEntry> entries;
+};
+
+/*! Workers and what the hung ones block */
+struct WatchdogBackend::Pool
+{
+  Pool() :idle(0) {}
+  static const size_t MAX_SPARE = 64;
+
+  WorkQueue<std::shared_ptr<Job> > queue;
+  std::mutex lock;
+  /*! Protects the members below */
+  unsigned int idle;
+  /*! Workers waiting for a job */
+  std::unordered_map<uint64_t,unsigned int> hung;
+  /*! Abandoned operations still blocked, by device */
+  std::vector<std::shared_ptr<Job> > spare;
+  /*! Finished jobs, reused with their buffers */
+};
+
+WatchdogBackend::WatchdogBackend(IoBackend* inner_backend, double timeout_sec)
+  :inner(inner_backend),
+   timeout(std::chrono::microseconds((long long)(timeout_sec * 1e6))),
+   pool(new Pool()), timeouts(0), refused(0)
+{
+}
+
+/*! Destructor
+Idle workers exit, hung ones when their operation returns */
+WatchdogBackend::~WatchdogBackend()
+{
+  pool->queue.Close();
+}
+
+/*! NewJob
+A fresh or reused job for an operation on a device */
+std::shared_ptr<WatchdogBackend::Job> WatchdogBackend::NewJob(const Device& device)
+{
+  std::shared_ptr<Job> job;
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if(!pool->spare.empty())
+    {
+      job = pool->spare.back();
+      pool->spare.pop_back();
+    }
+  }
+  if(!job)
+  {
+    job = std::make_shared<Job>();
+  }
+  job->work = nullptr;
+  job->cleanup = nullptr;
+  job->done = false;
+  job->abandoned = false;
+  job->device = device;
+  return job;
+}
+
+/*! Release
+Give a job that finished in time back for reuse */
+void WatchdogBackend::Release(const std::shared_ptr<Job>& job)
+{
+  std::lock_guard<std::mutex> lock(pool->lock);
+  job->work = nullptr;
+  job->entries.clear();
+  if(pool->spare.size() < Pool::MAX_SPARE)
+  {
+    pool->spare.push_back(job);
+  }
+}
+
+/*! Submit
+Hand a job to a worker. Workers are started when none is idle, so a
+hung worker is replaced. */
+void WatchdogBackend::Submit(const std::shared_ptr<Job>& job)
+{
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if(pool->idle == 0)
+    {
+      std::thread(Worker, pool).detach();
+    }
+    else
+    {
+      pool->idle--;
+    }
+  }
+  pool->queue.Push(job);
+}
+
+/*! Run
+Submit a job and wait for it until the deadline
+
+@param const std::shared_ptr<Job> & job
+@param const std::string & path
+@param const char * op
+@return boolean
+If the job finished in time, it can then be reused
+*/
+bool WatchdogBackend::Run(const std::shared_ptr<Job>& job, const std::string& path,
+                          const char* op)
+{
+  Submit(job);
+  {
+    std::unique_lock<std::mutex> lock(job->lock);
+    if(!job->finished.wait_for(lock, timeout, [&job]() { return job->done; }))
+    {
+      job->abandoned = true;
+      if(job->device.known)
+      {
+        std::lock_guard<std::mutex> pool_lock(pool->lock);
+        pool->hung[job->device.dev]++;
+      }
+    }
+  }
+
+  if(job->abandoned)
+  {
+    std::lock_guard<std::mutex> lock(state_lock);
+    timeouts++;
+    quarantined.insert(std::make_pair(path, std::string(op)));
+    std::cerr << "Timed out after " << timeout.count() / 1e6 << "s: "
+              << op << " " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/*! Refuse
+Fail an operation at once when its device has a hung operation
+
+@return boolean
+If the operation was refused
+*/
+bool WatchdogBackend::Refuse(const Device& device, const std::string& path, const char* op)
+{
+  if(!device.known)
+  {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    if(pool->hung.count(device.dev) == 0)
+    {
+      return false;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(state_lock);
+  refused++;
+  quarantined.insert(std::make_pair(path, std::string(op) + " on hung device"));
+  return true;
+}
+
+/*! DeviceOf
+Device of a directory, if it was stat'ed */
+WatchdogBackend::Device WatchdogBackend::DeviceOf(const std::string& dir) const
+{
+  Device device;
+  std::lock_guard<std::mutex> lock(state_lock);
+  auto found = dir_devs.find(dir);
+
+  if(found != dir_devs.end())
+  {
+    device.known = true;
+    device.dev = found->second;
+  }
+  return device;
+}
+
+/*! Parent
+Directory part of a path */
+std::string WatchdogBackend::Parent(const std::string& path)
+{
+  size_t slash = path.find_last_of('/');
+
+  if(slash == std::string::npos)
+  {
+    return ".";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+int WatchdogBackend::Open(const std::string& path)
+{
+  Device device = DeviceOf(Parent(path));
+  std::shared_ptr<IoBackend> backend = inner;
+
+  if(Refuse(device, path, "open"))
+  {
+    return -1;
+  }
+
+  std::shared_ptr<Job> job = NewJob(device);
+  Job* raw = job.get();
+  job->work = [backend, path, raw]() { raw->handle = backend->Open(path); };
+  /* An open that succeeds too late would leak its handle */
+  job->cleanup = [backend, raw]() { if(raw->handle >= 0) backend->Close(raw->handle); };
+  if(!Run(job, path, "open"))
+  {
+    return -1;
+  }
+
+  int handle = job->handle;
+  Release(job);
+  if(handle >= 0)
+  {
+    std::lock_guard<std::mutex> lock(state_lock);
+    OpenFile& file = open_files[handle];
+    file.path = path;
+    file.device = device;
+  }
+  return handle;
+}
+
+ssize_t WatchdogBackend::Read(int handle, void* buffer, size_t len, uint64_t offset)
+{
+  OpenFile file;
+  std::shared_ptr<IoBackend> backend = inner;
+  {
+    std::lock_guard<std::mutex> lock(state_lock);
+    auto found = open_files.find(handle);
+    if(found == open_files.end())
+    {
+      return -1;
+    }
+    file = found->second;
+  }
+  if(Refuse(file.device, file.path, "read"))
+  {
+    return -1;
+  }
+
+  std::shared_ptr<Job> job = NewJob(file.device);
+  Job* raw = job.get();
+  if(job->data.size() < len)
+  {
+    job->data.resize(len);
+  }
+  job->work = [backend, raw, handle, len, offset]()
+  {
+    raw->got = backend->Read(handle, &raw->data[0], len, offset);
+  };
+  if(!Run(job, file.path, "read"))
+  {
+    return -1;
+  }
+
+  ssize_t got = job->got;
+  if(got > 0)
+  {
+    memcpy(buffer, &job->data[0], got);
+  }
+  Release(job);
+  return got;
+}
+
+void WatchdogBackend::Close(int handle)
+{
+  OpenFile file;
+  std::shared_ptr<IoBackend> backend = inner;
+  {
+    std::lock_guard<std::mutex> lock(state_lock);
+    auto found = open_files.find(handle);
+    if(found != open_files.end())
+    {
+      file = found->second;
+      open_files.erase(found);
+    }
+  }
+
+  /* Nothing waits for a close, one on a hung device stays behind
+  with the other operations there */
+  std::shared_ptr<Job> job = NewJob(file.device);
+  job->work = [backend, handle]() { backend->Close(handle); };
+  Submit(job);
+}
+
+bool WatchdogBackend::Stat(const std::string& path, FileStat& st)
+{
+  Device device = DeviceOf(Parent(path));
+  std::shared_ptr<IoBackend> backend = inner;
+
+  if(Refuse(device, path, "stat"))
+  {
+    return false;
+  }
+
+  std::shared_ptr<Job> job = NewJob(device);
+  Job* raw = job.get();
+  job->work = [backend, path, raw]() { raw->ok = backend->Stat(path, raw->st); };
+  if(!Run(job, path, "stat"))
+  {
+    return false;
+  }
+
+  bool ok = job->ok;
+  st = job->st;
+  Release(job);
+  if(ok && st.type == ENTRY_DIR)
+  {
+    std::lock_guard<std::mutex> lock(state_lock);
+    dir_devs[path] = st.ident.dev;
+  }
+  return ok;
+}
+
+bool WatchdogBackend::ListDir(const std::string& path, std::vector<DirEntry>& entries)
+{
+  Device device = DeviceOf(path);
+  std::shared_ptr<IoBackend> backend = inner;
+
+  entries.clear();
+  if(Refuse(device, path, "list"))
+  {
+    return false;
+  }
+
+  std::shared_ptr<Job> job = NewJob(device);
+  Job* raw = job.get();
+  job->work = [backend, path, raw]() { raw->ok = backend->ListDir(path, raw->entries); };
+  if(!Run(job, path, "list"))
+  {
+    return false;
+  }
+
+  bool ok = job->ok;
+  entries.swap(job->entries);
+  Release(job);
+  return ok;
+}
+
+/*! PrintStats
+Report the timeouts and every quarantined path */
+void WatchdogBackend::PrintStats(std::ostream& out) const
+{
+  inner->PrintStats(out);
+
+  std::lock_guard<std::mutex> lock(state_lock);
+  out << std::fixed << std::showpoint << std::setprecision(2)
+      << "I/O timeouts:            " << timeouts << " (deadline "
+      << timeout.count() / 1e6 << "s), " << refused
+      << " refused on hung devices\n";
+  for(auto& x : quarantined)
+  {
+    out << "Quarantined:             " << x.first << " (" << x.second << ")\n";
+  }
+}
+
+/*! Worker
+Run jobs until the queue is closed. A job whose caller gave up is
+cleaned up here when it finally returns, and its device counts one
+hung operation less.
+
+@param std::shared_ptr<Pool> pool
+*/
+void WatchdogBackend::Worker(std::shared_ptr<Pool> pool)
+{
+  std::shared_ptr<Job> job;
+
+  while(pool->queue.Pop(job))
+  {
+    bool abandoned;
+
+    job->work();
+    {
+      std::lock_guard<std::mutex> lock(job->lock);
+      abandoned = job->abandoned;
+      /* Count as idle before the caller wakes up and submits again */
+      if(!abandoned)
+      {
+        std::lock_guard<std::mutex> pool_lock(pool->lock);
+        pool->idle++;
+      }
+      job->done = true;
+      job->finished.notify_all();
+    }
+
+    if(abandoned)
+    {
+      if(job->cleanup)
+      {
+        job->cleanup();
+      }
+
+      std::lock_guard<std::mutex> lock(pool->lock);
+      if(job->device.known && --pool->hung[job->device.dev] == 0)
+      {
+        pool->hung.erase(job->device.dev);
+      }
+      pool->idle++;
+    }
+    job.reset();
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef IO_WATCHDOG_H
+#define IO_WATCHDOG_H
+/*!
+  @file ioWatchdog.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "ioBackend.h"
+
+/*!
+  Wraps another backend and gives every operation a deadline. The
+  operation runs on a worker thread while the caller waits; when the
+  deadline passes the caller gets an error, the path is quarantined
+  and the worker is left behind, blocked in the system call, with a
+  new worker taking its place. A hung operation can not be cancelled,
+  but it no longer holds up the scan.
+
+  Devices are known from the directories stat'ed on the way down. A
+  device with an operation still hung fails further operations at
+  once, so files on a dead NFS server are quarantined without waiting
+  out the deadline for each; the scan keeps going on other devices,
+  and the device is used again once its hung operations return.
+
+  Reads go through buffers owned by the workers, so a read that
+  finishes after its deadline never writes to the caller's memory.
+
+  @brief Backend with per-operation deadlines.
+ */
+class WatchdogBackend : public IoBackend
+{
+public:
+  WatchdogBackend(IoBackend* inner_backend, double timeout_sec);
+  ~WatchdogBackend();
+
+  int Open(const std::string& path);
+  ssize_t Read(int handle, void* buffer, size_t len, uint64_t offset);
+  void Close(int handle);
+  bool Stat(const std::string& path, FileStat& st);
+  bool ListDir(const std::string& path, std::vector<DirEntry>& entries);
+  void PrintStats(std::ostream& out) const;
+  bool IsLocal() const { return inner->IsLocal(); }
+
+private:
+  struct Job;
+  struct Pool;
+
+  /*! Device of a path, when one of its directories was stat'ed */
+  struct Device
+  {
+    Device() :known(false), dev(0) {}
+    bool known;
+    uint64_t dev;
+  };
+
+  /*! An open file */
+  struct OpenFile
+  {
+    std::string path;
+    Device device;
+  };
+
+  static void Worker(std::shared_ptr<Pool> pool);
+  std::shared_ptr<Job> NewJob(const Device& device);
+  void Release(const std::shared_ptr<Job>& job);
+  void Submit(const std::shared_ptr<Job>& job);
+  bool Run(const std::shared_ptr<Job>& job, const std::string& path, const char* op);
+  bool Refuse(const Device& device, const std::string& path, const char* op);
+  Device DeviceOf(const std::string& dir) const;
+  static std::string Parent(const std::string& path);
+
+  std::shared_ptr<IoBackend> inner;
+  /*! Backend doing the real work, shared with workers that outlive us */
+  std::chrono::microseconds timeout;
+  /*! Deadline of every operation */
+  std::shared_ptr<Pool> pool;
+  /*! Workers and the hung operations of each device */
+  mutable std::mutex state_lock;
+  /*! Protects the members below */
+  std::unordered_map<std::string,uint64_t> dir_devs;
+  /*! Device of every directory stat'ed or listed */
+  std::unordered_map<int,OpenFile> open_files;
+  std::map<std::string,std::string> quarantined;
+  /*! Paths whose operations timed out or were refused, with the first
+      operation that failed */
+  uint64_t timeouts;
+  uint64_t refused;
+  /*! Operations refused because their device was hung */
+};
+
+#endif /* IO_WATCHDOG_H */
@@ -0,0 +1,251 @@
+/*!
+  @file knownHashes.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "knownHashes.h"
+
+/*! KnownHashesHeader
+On disk header. Integers are stored in host byte order, tables are
+meant to be built on the machine (or architecture) that uses them. */
+struct KnownHashesHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t digest_size;
+  uint64_t count;
+  uint64_t reserved;
+};
+
+static const char KNOWN_HASHES_MAGIC[8] = {'F','U','K','N','O','W','N','\0'};
+static const uint32_t KNOWN_HASHES_VERSION = 1;
+
+/*! ~KnownHashes
+Unmap the table if one was opened */
+KnownHashes::~KnownHashes()
+{
+  Close();
+}
+
+/*! Close
+Release the current mapping */
+void KnownHashes::Close()
+{
+  if(map_base != NULL)
+  {
+    munmap(map_base, map_len);
+  }
+  map_base = NULL;
+  map_len = 0;
+  entries = NULL;
+  count = 0;
+}
+
+/*! Open
+Map a table produced by Build(). Nothing is read up front, pages of
+the table are faulted in as lookups touch them.
+
+@param const std::string & table_path
+@return boolean
+If the table was mapped and looks valid
+*/
+bool KnownHashes::Open(const std::string& table_path)
+{
+  struct stat st;
+  int fd;
+
+  Close();
+
+  fd = open(table_path.c_str(), O_RDONLY);
+  if(fd < 0)
+  {
+    std::cerr << "Could not open known hash table: " << table_path << std::endl;
+    return false;
+  }
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(KnownHashesHeader))
+  {
+    std::cerr << "Known hash table is truncated: " << table_path << std::endl;
+    close(fd);
+    return false;
+  }
+
+  map_len = st.st_size;
+  map_base = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map_base == MAP_FAILED)
+  {
+    map_base = NULL;
+    std::cerr << "Could not map known hash table: " << table_path << std::endl;
+    return false;
+  }
+
+  const KnownHashesHeader* header = (const KnownHashesHeader*)map_base;
+  if(memcmp(header->magic, KNOWN_HASHES_MAGIC, sizeof(header->magic)) != 0 ||
+     header->version != KNOWN_HASHES_VERSION ||
+     header->digest_size != ENTRY_SIZE ||
+     map_len != sizeof(KnownHashesHeader) + header->count * ENTRY_SIZE)
+  {
+    std::cerr << "Not a valid known hash table: " << table_path << std::endl;
+    Close();
+    return false;
+  }
+
+  count = header->count;
+  entries = (const unsigned char*)map_base + sizeof(KnownHashesHeader);
+
+  /* Lookups are random, don't let the kernel read ahead */
+  madvise(map_base, map_len, MADV_RANDOM);
+  return true;
+}
+
+/*! Contains
+Search the Eytzinger ordered table. Node k has children 2k and 2k+1,
+so the descent is branch free and the grandchildren of the current
+node are contiguous, which lets us prefetch several levels ahead.
+
+@param const Digest & digest
+@return boolean
+If the digest is in the table
+*/
+bool KnownHashes::Contains(const Digest& digest) const
+{
+  uint64_t k = 1;
+
+  if(digest.algorithm != HASH_SHA256)
+  {
+    return false;
+  }
+
+  while(k <= count)
+  {
+#if defined(__GNUC__)
+    /* Nodes 16k..16k+15 are the next four levels under k */
+    if(16 * k <= count)
+    {
+      __builtin_prefetch(Entry(16 * k));
+    }
+#endif
+    k = 2 * k + (memcmp(Entry(k), digest.bytes, ENTRY_SIZE) < 0);
+  }
+
+  /* Undo the trailing right turns to land on the lower bound */
+  k >>= __builtin_ffsll(~k);
+
+  return k != 0 && memcmp(Entry(k), digest.bytes, ENTRY_SIZE) == 0;
+}
+
+/*! FillEytzinger
+Recursively place the sorted digests into BFS order with an in order
+walk of the implicit tree.
+
+@return size_t
+Index of the next sorted digest to place
+*/
+static size_t FillEytzinger(const std::vector<Digest>& sorted,
+                            std::vector<Digest>& out, size_t i, size_t k)
+{
+  if(k <= sorted.size())
+  {
+    i = FillEytzinger(sorted, out, i, 2 * k);
+    out[k - 1] = sorted[i++];
+    i = FillEytzinger(sorted, out, i, 2 * k + 1);
+  }
+  return i;
+}
+
+/*! Build
+Convert a text list of hex digests into a table for Open(). The first
+field on each line is used, so the output of sha256sum as well as bare
+hash lists work as input. Blank lines and lines starting with '#' are
+ignored.
+
+@param const std::string & list_path
+@param const std::string & table_path
+@return boolean
+If the table was written
+*/
+bool KnownHashes::Build(const std::string& list_path, const std::string& table_path)
+{
+  std::ifstream list(list_path.c_str());
+  std::vector<Digest> sorted;
+  std::string line;
+  unsigned long bad_lines = 0;
+
+  if(!list)
+  {
+    std::cerr << "Could not open hash list: " << list_path << std::endl;
+    return false;
+  }
+
+  while(std::getline(list, line))
+  {
+    std::istringstream fields(line);
+    std::string hex;
+    Digest digest;
+
+    if(!(fields >> hex) || hex[0] == '#')
+    {
+      continue;
+    }
+    /* sha256sum marks binary mode entries with a leading backslash
+    when the file name needed escaping */
+    if(hex[0] == '\\')
+    {
+      hex.erase(0, 1);
+    }
+    if(!Digest::FromHex(hex, digest) || digest.algorithm != HASH_SHA256)
+    {
+      bad_lines++;
+      continue;
+    }
+    sorted.push_back(digest);
+  }
+
+  if(bad_lines > 0)
+  {
+    std::cerr << "Skipped " << bad_lines << " lines without a SHA-256 digest\n";
+  }
+
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  std::vector<Digest> layout(sorted.size());
+  FillEytzinger(sorted, layout, 0, 1);
+
+  KnownHashesHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KNOWN_HASHES_MAGIC, sizeof(header.magic));
+  header.version = KNOWN_HASHES_VERSION;
+  header.digest_size = ENTRY_SIZE;
+  header.count = layout.size();
+
+  FILE* out = fopen(table_path.c_str(), "wb");
+  if(out == NULL)
+  {
+    std::cerr << "Could not create known hash table: " << table_path << std::endl;
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+  for(size_t i = 0; ok && i < layout.size(); i++)
+  {
+    ok = fwrite(layout[i].bytes, ENTRY_SIZE, 1, out) == 1;
+  }
+  if(fclose(out) != 0 || !ok)
+  {
+    std::cerr << "Failed writing known hash table: " << table_path << std::endl;
+    return false;
+  }
+
+  std::cout << "Wrote " << layout.size() << " digests to " << table_path << std::endl;
+  return true;
+}
@@ -0,0 +1,64 @@
+#ifndef KNOWN_HASHES_H
+#define KNOWN_HASHES_H
+/*!
+  @file knownHashes.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "contentHash.h"
+
+/*!
+  Read-only table of content digests for files that are already known
+  (vendor packages, OS images, previously archived data). The table is
+  mapped straight from disk and stored in Eytzinger (BFS) order so that
+  a lookup walks down an implicit binary tree where the next few levels
+  can be prefetched, instead of bouncing around a sorted array.
+
+  Tables hold SHA-256 digests and are produced from plain hash lists
+  with Build().
+
+  @brief mmap'ed set of known content digests.
+ */
+class KnownHashes
+{
+public:
+  /*! Constructor */
+  KnownHashes()
+    :map_base(NULL), map_len(0), entries(NULL), count(0) {}
+  ~KnownHashes();
+
+  bool Open(const std::string& table_path);
+  bool Contains(const Digest& digest) const;
+  size_t Size() const { return count; }
+
+  static bool Build(const std::string& list_path, const std::string& table_path);
+
+private:
+  /* Not copyable, we own the mapping */
+  KnownHashes(const KnownHashes&);
+  KnownHashes& operator=(const KnownHashes&);
+
+  void Close();
+  const unsigned char* Entry(uint64_t k) const
+  {
+    return entries + (k - 1) * ENTRY_SIZE;
+  }
+
+  static const unsigned int ENTRY_SIZE = 32;
+
+  void* map_base;
+  /*! Start of the mapped table file */
+  size_t map_len;
+  /*! Length of the mapping */
+  const unsigned char* entries;
+  /*! SHA-256 digests in Eytzinger order, node k starts at
+      entries[(k-1)*ENTRY_SIZE] */
+  uint64_t count;
+  /*! Number of digests in the table */
+};
+
+#endif /* KNOWN_HASHES_H */
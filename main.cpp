@@ -1,19 +1,736 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstdlib>
+#include <thread>
 #include "fileUtils.h"
+#include "knownHashes.h"
+#include "ioBackend.h"
+#include "ioSimulator.h"
+#include "ioTrace.h"
+#include "ioWatchdog.h"
+#include "dupRemover.h"
+#include "treeCopier.h"
+#include "casStore.h"
+#include "indexDiff.h"
+#include "scanIndex.h"
+#include "archiveNormalizer.h"
+#include "walkBench.h"
+#include "ext4Image.h"
+
+/* Print the command line help */
+static void Usage()
+{
+  std::cerr << "Usage: file_utils [options] <root_directory>\n"
+            << "       file_utils [options] --files-from FILE\n"
+            << "       file_utils build-known-hashes <hash_list> <table>\n"
+            << "       file_utils copy [--link=MODE] [--index FILE] <src> <dst>\n"
+            << "       file_utils cas-import [--threads N] [--map FILE]"
+               " [--hash-cache FILE] <root> <store>\n"
+            << "       file_utils index-diff [--list] <old_index> <new_index>\n"
+            << "       file_utils index-verify <index>\n"
+            << "       file_utils walk-bench [--runs N] [--io-model MODEL]"
+               " [--threads N] <root>\n"
+            << "Options:\n"
+            << "  --files-from FILE      Read the files to check from a list"
+               " (- for stdin)\n"
+            << "  --from0                List records are NUL separated\n"
+            << "  --files-fields LIST    Tab separated columns before the path:"
+               " size,ino,dev,mtime,skip\n"
+            << "  --known-hashes FILE    Table of known content digests\n"
+            << "  --known-action ACTION  report, flag or skip known files"
+               " (default report)\n"
+            << "  --hash ALGO            Group files on sha256, blake3, xxh3 or"
+               " crc32c digests\n"
+            << "  --hash-cache FILE      Reuse digests of unchanged files"
+               " between runs\n"
+            << "  --xattr-hashes         Keep digests in a user.fileutils.hash"
+               " xattr on each file\n"
+            << "  --save-index FILE      Save every scanned file as an index\n"
+            << "  --block-hashes FILE    Write 128KB block hashes to a duperemove"
+               " style SQLite hashfile\n"
+            << "  --import-manifest FILE Seed digests from a SHA256SUMS/MD5SUMS"
+               " manifest\n"
+            << "  --quick=N              Sample N random blocks plus head and"
+               " tail per file\n"
+            << "  --quick-verify         Fully verify quick mode groups in the"
+               " background\n"
+            << "  --assume-same-if LIST  Report files matching on name,size,mtime"
+               " at once, verify in the background\n"
+            << "  --dir-report[=N]       List the N directory pairs sharing the"
+               " most duplicate bytes (default 20)\n"
+            << "  --estimate-compression[=N]\n"
+            << "                         Deflate 1 block in N (default 16) to"
+               " estimate dedup and compression savings\n"
+            << "  --normalize-text       Also match text files ignoring line"
+               " endings and trailing whitespace\n"
+            << "  --truncated            Also report files that are the start of"
+               " a larger file\n"
+            << "  --normalize LIST       Also match gzip, tar and zip archives"
+               " ignoring times and member order\n"
+            << "  --walk-order ORDER     Stat directory entries in inode or"
+               " readdir order (default inode)\n"
+            << "  --io-model MODEL       Simulate storage: hdd, nfs, ssd and/or"
+               " seek=MS,rtt=MS,bw=MB/s,scale=X\n"
+            << "  --io-record FILE       Record a trace of every I/O operation\n"
+            << "  --io-replay FILE       Serve all I/O from a recorded trace\n"
+            << "  --io-timeout SECONDS   Deadline of every I/O operation, files"
+               " that miss it are quarantined\n"
+            << "  --ext4-image IMAGE     Scan an unmounted ext4 image or device,"
+               " root is a path inside it\n"
+            << "  --delete               Delete all but one file of every"
+               " duplicate group\n"
+            << "  --keep=POLICY          File to keep: oldest, shortest,"
+               " root:DIR or regex:RE (default oldest)\n"
+            << "  --dry-run              Only report what --delete would remove\n"
+            << "  --prune-empty-dirs     Remove directories left empty by"
+               " --delete\n"
+            << "  --threads N            Operations in flight per device for the"
+               " scan (default adaptive)\n"
+            << "                         and worker threads for --delete"
+               " (default one per CPU)\n"
+            << "Copy options:\n"
+            << "  --link=MODE            reflink, hardlink or none for content"
+               " already in dst (default reflink)\n"
+            << "  --index FILE           Content index of dst (default"
+               " dst/" << TreeCopier::DEFAULT_INDEX << ")\n"
+            << "cas-import options:\n"
+            << "  --map FILE             Path to content ID mapping (default"
+               " store/" << CasStore::DEFAULT_MAP << ")\n";
+}
+
+/* Match an option given either as "--name value" or "--name=value".
+On a match value is filled in and i is advanced past any value
+argument. */
+static bool OptionValue(int argc, char *argv[], int& i,
+                        const std::string& name, std::string& value)
+{
+  std::string arg(argv[i]);
+
+  if(arg == name && i + 1 < argc)
+  {
+    value = argv[++i];
+    return true;
+  }
+  if(arg.compare(0, name.size() + 1, name + "=") == 0)
+  {
+    value = arg.substr(name.size() + 1);
+    return true;
+  }
+  return false;
+}
 
 int main(int argc, char *argv[])
 {
   FileUtils tools;
-  std::string root(argv[1]);
-  
-  if(argc != 2)
+  std::string root;
+  std::string known_table;
+  KnownAction known_action = KNOWN_REPORT;
+  std::string hash_cache;
+  std::string hash_name;
+  std::string save_index;
+  std::vector<std::string> manifests;
+  std::string files_from;
+  std::string files_fields;
+  bool from0 = false;
+  bool xattr_hashes = false;
+  unsigned long quick_blocks = 0;
+  bool quick_verify = false;
+  std::string assume_same;
+  unsigned int normalize = 0;
+  std::string io_model, io_record, io_replay, ext4_image;
+  std::string block_hashes;
+  double io_timeout = 0;
+  bool delete_dups = false, dry_run = false, prune_dirs = false;
+  std::string keep_policy = "oldest";
+  unsigned long threads = std::thread::hardware_concurrency();
+
+  if(argc < 2)
   {
-    std::cerr << "Usage: file_utils <root_directory>\n";
+    Usage();
     return 1;
   }
-  
+
+  // Convert a hash list into a known hash table
+  if(std::string(argv[1]) == "build-known-hashes")
+  {
+    if(argc != 4)
+    {
+      Usage();
+      return 1;
+    }
+    return KnownHashes::Build(argv[2], argv[3]) ? 0 : 1;
+  }
+
+  // Check every checksum of a saved index
+  if(std::string(argv[1]) == "index-verify")
+  {
+    ScanIndex index;
+
+    if(argc != 3)
+    {
+      Usage();
+      return 1;
+    }
+    if(!index.Open(argv[2]) || !index.Verify())
+    {
+      return 1;
+    }
+    std::cout << "Index is intact: " << index.Count() << " files" << std::endl;
+    return 0;
+  }
+
+  // Copy a tree, linking content the destination already has
+  if(std::string(argv[1]) == "copy")
+  {
+    TreeCopier copier;
+    std::vector<std::string> paths;
+
+    for(int i = 2; i < argc; i++)
+    {
+      std::string value;
+
+      if(OptionValue(argc, argv, i, "--link", value))
+      {
+        if(value == "reflink")       copier.SetLinkMode(LINK_REFLINK);
+        else if(value == "hardlink") copier.SetLinkMode(LINK_HARDLINK);
+        else if(value == "none")     copier.SetLinkMode(LINK_NONE);
+        else
+        {
+          std::cerr << "Unknown link mode: " << value << std::endl;
+          return 1;
+        }
+      }
+      else if(OptionValue(argc, argv, i, "--index", value))
+      {
+        copier.SetIndexPath(value);
+      }
+      else if(argv[i][0] == '-')
+      {
+        Usage();
+        return 1;
+      }
+      else
+      {
+        paths.push_back(argv[i]);
+      }
+    }
+    if(paths.size() != 2)
+    {
+      Usage();
+      return 1;
+    }
+    return copier.Copy(paths[0], paths[1]) ? 0 : 1;
+  }
+
+  // Store every unique content of a tree once, by digest
+  if(std::string(argv[1]) == "cas-import")
+  {
+    CasStore store;
+    std::vector<std::string> paths;
+
+    store.SetThreads(std::thread::hardware_concurrency());
+    for(int i = 2; i < argc; i++)
+    {
+      std::string value;
+
+      if(OptionValue(argc, argv, i, "--threads", value))
+      {
+        store.SetThreads(strtoul(value.c_str(), NULL, 10));
+      }
+      else if(OptionValue(argc, argv, i, "--map", value))
+      {
+        store.SetMapPath(value);
+      }
+      else if(OptionValue(argc, argv, i, "--hash-cache", value))
+      {
+        if(!store.LoadHashCache(value))
+        {
+          return 1;
+        }
+      }
+      else if(argv[i][0] == '-')
+      {
+        Usage();
+        return 1;
+      }
+      else
+      {
+        paths.push_back(argv[i]);
+      }
+    }
+    if(paths.size() != 2)
+    {
+      Usage();
+      return 1;
+    }
+    return store.Import(paths[0], paths[1]) ? 0 : 1;
+  }
+
+  // Compare two saved hash caches
+  if(std::string(argv[1]) == "index-diff")
+  {
+    IndexDiff diff;
+    std::vector<std::string> paths;
+
+    for(int i = 2; i < argc; i++)
+    {
+      if(std::string(argv[i]) == "--list")
+      {
+        diff.SetListChanges(true);
+      }
+      else if(argv[i][0] == '-')
+      {
+        Usage();
+        return 1;
+      }
+      else
+      {
+        paths.push_back(argv[i]);
+      }
+    }
+    if(paths.size() != 2)
+    {
+      Usage();
+      return 1;
+    }
+    return diff.Run(paths[0], paths[1]) ? 0 : 1;
+  }
+
+  // Time the walk in readdir and inode order
+  if(std::string(argv[1]) == "walk-bench")
+  {
+    WalkBench bench;
+    std::vector<std::string> paths;
+
+    for(int i = 2; i < argc; i++)
+    {
+      std::string value;
+
+      if(OptionValue(argc, argv, i, "--runs", value))
+      {
+        bench.SetRuns(strtoul(value.c_str(), NULL, 10));
+      }
+      else if(OptionValue(argc, argv, i, "--io-model", value))
+      {
+        bench.SetIoModel(value);
+      }
+      else if(OptionValue(argc, argv, i, "--threads", value))
+      {
+        bench.SetThreads(strtoul(value.c_str(), NULL, 10));
+      }
+      else if(argv[i][0] == '-')
+      {
+        Usage();
+        return 1;
+      }
+      else
+      {
+        paths.push_back(argv[i]);
+      }
+    }
+    if(paths.size() != 1)
+    {
+      Usage();
+      return 1;
+    }
+    return bench.Run(paths[0]) ? 0 : 1;
+  }
+
+  for(int i = 1; i < argc; i++)
+  {
+    std::string value;
+
+    if(OptionValue(argc, argv, i, "--files-from", value))
+    {
+      files_from = value;
+    }
+    else if(OptionValue(argc, argv, i, "--files-fields", value))
+    {
+      files_fields = value;
+    }
+    else if(std::string(argv[i]) == "--from0")
+    {
+      from0 = true;
+    }
+    else if(OptionValue(argc, argv, i, "--known-hashes", value))
+    {
+      known_table = value;
+    }
+    else if(OptionValue(argc, argv, i, "--known-action", value))
+    {
+      if(value == "report")    known_action = KNOWN_REPORT;
+      else if(value == "flag") known_action = KNOWN_FLAG;
+      else if(value == "skip") known_action = KNOWN_SKIP;
+      else
+      {
+        std::cerr << "Unknown known action: " << value << std::endl;
+        return 1;
+      }
+    }
+    else if(OptionValue(argc, argv, i, "--hash-cache", value))
+    {
+      hash_cache = value;
+    }
+    else if(OptionValue(argc, argv, i, "--hash", value))
+    {
+      hash_name = value;
+    }
+    else if(std::string(argv[i]) == "--xattr-hashes")
+    {
+      xattr_hashes = true;
+    }
+    else if(OptionValue(argc, argv, i, "--block-hashes", value))
+    {
+      block_hashes = value;
+    }
+    else if(OptionValue(argc, argv, i, "--save-index", value))
+    {
+      save_index = value;
+    }
+    else if(OptionValue(argc, argv, i, "--import-manifest", value))
+    {
+      manifests.push_back(value);
+    }
+    else if(OptionValue(argc, argv, i, "--quick", value))
+    {
+      quick_blocks = strtoul(value.c_str(), NULL, 10);
+      if(quick_blocks == 0)
+      {
+        std::cerr << "--quick needs a number of blocks\n";
+        return 1;
+      }
+    }
+    else if(std::string(argv[i]) == "--quick-verify")
+    {
+      quick_verify = true;
+    }
+    else if(OptionValue(argc, argv, i, "--assume-same-if", value))
+    {
+      assume_same = value;
+    }
+    else if(std::string(argv[i]) == "--dir-report")
+    {
+      tools.SetDirReport(20);
+    }
+    else if(std::string(argv[i]).compare(0, 13, "--dir-report=") == 0)
+    {
+      unsigned long top = strtoul(argv[i] + 13, NULL, 10);
+      if(top == 0)
+      {
+        std::cerr << "--dir-report needs a number of pairs\n";
+        return 1;
+      }
+      tools.SetDirReport(top);
+    }
+    else if(std::string(argv[i]) == "--estimate-compression")
+    {
+      tools.SetEstimateCompression(16);
+    }
+    else if(std::string(argv[i]).compare(0, 23, "--estimate-compression=") == 0)
+    {
+      unsigned long every = strtoul(argv[i] + 23, NULL, 10);
+      if(every == 0)
+      {
+        std::cerr << "--estimate-compression needs a number of blocks\n";
+        return 1;
+      }
+      tools.SetEstimateCompression(every);
+    }
+    else if(std::string(argv[i]) == "--normalize-text")
+    {
+      tools.SetNormalizeText(true);
+    }
+    else if(std::string(argv[i]) == "--truncated")
+    {
+      tools.SetFindTruncated(true);
+    }
+    else if(OptionValue(argc, argv, i, "--normalize", value))
+    {
+      if(!ArchiveNormalizer::ParseFormats(value, normalize))
+      {
+        std::cerr << "Unknown archive formats: " << value << std::endl;
+        return 1;
+      }
+    }
+    else if(OptionValue(argc, argv, i, "--walk-order", value))
+    {
+      if(value == "inode")        tools.SetWalkOrder(WALK_INODE);
+      else if(value == "readdir") tools.SetWalkOrder(WALK_READDIR);
+      else
+      {
+        std::cerr << "Unknown walk order: " << value << std::endl;
+        return 1;
+      }
+    }
+    else if(OptionValue(argc, argv, i, "--io-model", value))
+    {
+      io_model = value;
+    }
+    else if(OptionValue(argc, argv, i, "--io-record", value))
+    {
+      io_record = value;
+    }
+    else if(OptionValue(argc, argv, i, "--io-replay", value))
+    {
+      io_replay = value;
+    }
+    else if(OptionValue(argc, argv, i, "--io-timeout", value))
+    {
+      io_timeout = atof(value.c_str());
+      if(io_timeout <= 0)
+      {
+        std::cerr << "--io-timeout needs a number of seconds\n";
+        return 1;
+      }
+    }
+    else if(OptionValue(argc, argv, i, "--ext4-image", value))
+    {
+      ext4_image = value;
+    }
+    else if(std::string(argv[i]) == "--delete")
+    {
+      delete_dups = true;
+    }
+    else if(OptionValue(argc, argv, i, "--keep", value))
+    {
+      keep_policy = value;
+    }
+    else if(std::string(argv[i]) == "--dry-run")
+    {
+      dry_run = true;
+    }
+    else if(std::string(argv[i]) == "--prune-empty-dirs")
+    {
+      prune_dirs = true;
+    }
+    else if(OptionValue(argc, argv, i, "--threads", value))
+    {
+      threads = strtoul(value.c_str(), NULL, 10);
+      if(threads == 0)
+      {
+        std::cerr << "--threads needs a number of threads\n";
+        return 1;
+      }
+      tools.SetIoThreads(threads);
+    }
+    else if(argv[i][0] == '-' || !root.empty())
+    {
+      Usage();
+      return 1;
+    }
+    else
+    {
+      root = argv[i];
+    }
+  }
+
+  /* Exactly one of a root directory or a file list */
+  if(root.empty() == files_from.empty())
+  {
+    Usage();
+    return 1;
+  }
+
+  /* Files in an image have no extended attributes we could reach */
+  if(xattr_hashes && !ext4_image.empty())
+  {
+    std::cerr << "--xattr-hashes can not be used with --ext4-image\n";
+    return 1;
+  }
+
+  /* Block hashes are keyed on inodes a dedup tool opens in place */
+  if(!block_hashes.empty() && (!ext4_image.empty() || !io_replay.empty()))
+  {
+    std::cerr << "--block-hashes needs files on a mounted filesystem\n";
+    return 1;
+  }
+
+  /* Stack the I/O backends: the data source and its watchdog, then
+  the storage model, then the recorder so traces hold what the scan
+  actually saw */
+  if(!io_model.empty() || !io_record.empty() || !io_replay.empty() ||
+     !ext4_image.empty() || io_timeout > 0)
+  {
+    IoBackend* backend;
+    
+    if(!io_replay.empty() && !ext4_image.empty())
+    {
+      std::cerr << "--io-replay and --ext4-image are both a source of the"
+                   " scan, give one\n";
+      return 1;
+    }
+    if(!ext4_image.empty())
+    {
+      Ext4Image* image = new Ext4Image();
+      if(!image->Load(ext4_image))
+      {
+        delete image;
+        return 1;
+      }
+      backend = image;
+    }
+    else if(!io_replay.empty())
+    {
+      MemoryBackend* memory = new MemoryBackend();
+      if(!memory->LoadTrace(io_replay))
+      {
+        delete memory;
+        return 1;
+      }
+      /* Without a model replay runs at the recorded speed */
+      memory->SetReplayTiming(io_model.empty());
+      backend = memory;
+    }
+    else
+    {
+      backend = new PosixBackend();
+    }
+    
+    if(io_timeout > 0)
+    {
+      backend = new WatchdogBackend(backend, io_timeout);
+    }
+    
+    if(!io_model.empty())
+    {
+      StorageModel model;
+      if(!model.Parse(io_model))
+      {
+        delete backend;
+        return 1;
+      }
+      backend = new SimulatedBackend(backend, model);
+    }
+    
+    if(!io_record.empty())
+    {
+      TraceRecorder* recorder = new TraceRecorder(backend);
+      if(!recorder->Start(io_record))
+      {
+        delete recorder;
+        return 1;
+      }
+      backend = recorder;
+    }
+    
+    tools.SetIoBackend(backend);
+  }
+
+  if(!hash_name.empty())
+  {
+    /* Known hash tables hold SHA-256 digests only */
+    if(!known_table.empty() && hash_name != "sha256")
+    {
+      std::cerr << "--known-hashes needs --hash sha256\n";
+      return 1;
+    }
+    if(!tools.SetHashAlgorithm(hash_name))
+    {
+      return 1;
+    }
+  }
+
+  if(!known_table.empty() && !tools.LoadKnownHashes(known_table, known_action))
+  {
+    return 1;
+  }
+
+  if(!hash_cache.empty() && !tools.LoadHashCache(hash_cache))
+  {
+    return 1;
+  }
+  for(auto& manifest : manifests)
+  {
+    if(!tools.ImportManifest(manifest))
+    {
+      return 1;
+    }
+  }
+
+  if(!save_index.empty())
+  {
+    tools.SetScanIndex(save_index);
+  }
+  tools.SetXattrHashes(xattr_hashes);
+  if(!block_hashes.empty())
+  {
+    tools.SetBlockHashes(block_hashes);
+  }
+  tools.SetNormalize(normalize);
+
+  if(quick_blocks > 0)
+  {
+    tools.SetQuickMode(quick_blocks, quick_verify);
+  }
+  else if(quick_verify)
+  {
+    std::cerr << "--quick-verify needs --quick\n";
+    return 1;
+  }
+
+  if(!assume_same.empty())
+  {
+    if(quick_blocks > 0)
+    {
+      std::cerr << "--assume-same-if and --quick can not be combined\n";
+      return 1;
+    }
+    if(!tools.SetAssumeSame(assume_same))
+    {
+      return 1;
+    }
+  }
+
+  if(delete_dups)
+  {
+    DupRemover* remover = new DupRemover();
+    
+    /* Sampled groups are only probable, and replayed traces are not
+    the files on disk, neither may decide what gets deleted */
+    if(quick_blocks > 0 && !quick_verify)
+    {
+      std::cerr << "--delete with --quick needs --quick-verify\n";
+      delete remover;
+      return 1;
+    }
+    if((!io_replay.empty() || !ext4_image.empty()) && !dry_run)
+    {
+      std::cerr << "--delete with --io-replay or --ext4-image needs --dry-run\n";
+      delete remover;
+      return 1;
+    }
+    if(!remover->SetPolicy(keep_policy))
+    {
+      delete remover;
+      return 1;
+    }
+    remover->SetDryRun(dry_run);
+    remover->SetPruneDirs(prune_dirs);
+    remover->SetThreads(threads);
+    tools.SetRemover(remover);
+  }
+  else if(dry_run || prune_dirs)
+  {
+    std::cerr << "--dry-run and --prune-empty-dirs need --delete\n";
+    return 1;
+  }
+
+  // Find all duplicate files in the list
+  if(!files_from.empty())
+  {
+    FileList list;
+    
+    if(!list.SetFields(files_fields) ||
+       !list.Open(files_from, from0 ? '\0' : '\n'))
+    {
+      return 1;
+    }
+    tools.FindDupsFromList(list);
+    return 0;
+  }
+
   // Find all duplicate files start at root directory
   tools.FindDups(root);
-  
-}
\ No newline at end of file
+
+}
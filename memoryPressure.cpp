@@ -0,0 +1,344 @@
+/*!
+  @file memoryPressure.cpp
+  @author Charles Irick
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include "memoryPressure.h"
+
+const unsigned int MemoryMonitor::POLL_MS;
+const size_t BufferPool::MIN_BUFFER;
+const size_t BufferPool::DEFAULT_BUDGET;
+
+/*! MemoryMonitor
+Find the memory cgroup we run in and the limit that applies to us */
+MemoryMonitor::MemoryMonitor()
+  :level(PRESSURE_NONE), last_poll(), cgroup_v2(false), limit(0)
+{
+  std::ifstream cgroups("/proc/self/cgroup");
+  std::string line;
+
+  /* Lines are id:controllers:path, v2 has id 0 and no controllers */
+  while(std::getline(cgroups, line))
+  {
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    if(first == std::string::npos || second == std::string::npos)
+    {
+      continue;
+    }
+    std::string controllers = line.substr(first + 1, second - first - 1);
+    std::string path = line.substr(second + 1);
+
+    if(controllers.empty() &&
+       access(("/sys/fs/cgroup" + path + "/memory.max").c_str(), R_OK) == 0)
+    {
+      cgroup_dir = "/sys/fs/cgroup" + path;
+      cgroup_v2 = true;
+      break;
+    }
+    std::istringstream names(controllers);
+    std::string name;
+    while(std::getline(names, name, ','))
+    {
+      if(name != "memory")
+      {
+        continue;
+      }
+      /* Inside a cgroup namespace the mount already is our group */
+      cgroup_dir = "/sys/fs/cgroup/memory" + path;
+      if(access((cgroup_dir + "/memory.limit_in_bytes").c_str(), R_OK) != 0)
+      {
+        cgroup_dir = "/sys/fs/cgroup/memory";
+      }
+    }
+  }
+
+  uint64_t value;
+  if(!cgroup_dir.empty() &&
+     ReadNumber(cgroup_dir + (cgroup_v2 ? "/memory.max" : "/memory.limit_in_bytes"), value) &&
+     value < ((uint64_t)1 << 60))
+  {
+    limit = value;
+  }
+  else
+  {
+    /* No limit of our own, the host is the limit */
+    cgroup_dir.clear();
+    if(ReadStat("/proc/meminfo", "MemTotal:", value))
+    {
+      limit = value * 1024;
+    }
+  }
+}
+
+/*! Poll
+Level of memory pressure, sampled again once POLL_MS have passed
+
+@param bool & fresh
+Set when the level was sampled by this call
+@return PressureLevel
+*/
+PressureLevel MemoryMonitor::Poll(bool& fresh)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  Clock::time_point now = Clock::now();
+
+  fresh = false;
+  if(last_poll == Clock::time_point() ||
+     now - last_poll >= std::chrono::milliseconds(POLL_MS))
+  {
+    level = Sample();
+    last_poll = now;
+    fresh = true;
+  }
+  return level;
+}
+
+PressureLevel MemoryMonitor::Level() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return level;
+}
+
+/*! Sample
+Read every source and take the worst of them
+
+@return PressureLevel
+*/
+PressureLevel MemoryMonitor::Sample()
+{
+  PressureLevel worst = PRESSURE_NONE;
+  double some = 0, full = 0;
+  uint64_t usage, inactive, total, available;
+
+  /* Share of time tasks stalled on memory over the last 10s. The
+  cgroup's own pressure is the one that matters if it has one */
+  if((cgroup_v2 && ReadPsi(cgroup_dir + "/memory.pressure", some, full)) ||
+     ReadPsi("/proc/pressure/memory", some, full))
+  {
+    if(full >= 5.0)
+    {
+      worst = PRESSURE_HIGH;
+    }
+    else if(some >= 10.0)
+    {
+      worst = PRESSURE_SOME;
+    }
+  }
+
+  if(!cgroup_dir.empty() && limit > 0 &&
+     ReadNumber(cgroup_dir + (cgroup_v2 ? "/memory.current" : "/memory.usage_in_bytes"), usage))
+  {
+    if(ReadStat(cgroup_dir + "/memory.stat",
+                cgroup_v2 ? "inactive_file" : "total_inactive_file", inactive) &&
+       inactive < usage)
+    {
+      usage -= inactive;
+    }
+    double used = (double)usage / (double)limit;
+    if(used >= 0.95)
+    {
+      worst = PRESSURE_HIGH;
+    }
+    else if(used >= 0.85 && worst < PRESSURE_SOME)
+    {
+      worst = PRESSURE_SOME;
+    }
+  }
+
+  if(ReadStat("/proc/meminfo", "MemTotal:", total) &&
+     ReadStat("/proc/meminfo", "MemAvailable:", available) && total > 0)
+  {
+    double free = (double)available / (double)total;
+    if(free < 0.05)
+    {
+      worst = PRESSURE_HIGH;
+    }
+    else if(free < 0.10 && worst < PRESSURE_SOME)
+    {
+      worst = PRESSURE_SOME;
+    }
+  }
+
+  return worst;
+}
+
+/*! ReadNumber
+Read a file holding a single number
+
+@param const std::string & path
+@param uint64_t & value
+@return boolean
+If the file holds a number, "max" is not one
+*/
+bool MemoryMonitor::ReadNumber(const std::string& path, uint64_t& value)
+{
+  std::ifstream in(path.c_str());
+  return (bool)(in >> value);
+}
+
+/*! ReadStat
+Find a "key value" line, as in memory.stat or /proc/meminfo
+
+@param const std::string & path
+@param const char * key
+@param uint64_t & value
+@return boolean
+If the key was found
+*/
+bool MemoryMonitor::ReadStat(const std::string& path, const char* key, uint64_t& value)
+{
+  std::ifstream in(path.c_str());
+  std::string name;
+
+  while(in >> name)
+  {
+    if(name == key)
+    {
+      return (bool)(in >> value);
+    }
+    in.ignore(1 << 16, '\n');
+  }
+  return false;
+}
+
+/*! ReadPsi
+Read the 10 second averages of a pressure file
+
+@param const std::string & path
+@param double & some
+Share of time some task stalled on memory, in percent
+@param double & full
+Share of time all tasks stalled on memory, in percent
+@return boolean
+If the file exists and holds a "some" line
+*/
+bool MemoryMonitor::ReadPsi(const std::string& path, double& some, double& full)
+{
+  std::ifstream in(path.c_str());
+  std::string line;
+  bool found = false;
+
+  while(std::getline(in, line))
+  {
+    size_t avg = line.find("avg10=");
+    if(avg == std::string::npos)
+    {
+      continue;
+    }
+    double value = atof(line.c_str() + avg + 6);
+    if(line.compare(0, 4, "some") == 0)
+    {
+      some = value;
+      found = true;
+    }
+    else if(line.compare(0, 4, "full") == 0)
+    {
+      full = value;
+    }
+  }
+  return found;
+}
+
+BufferPool::~BufferPool()
+{
+  for(auto& x : free_buffers)
+  {
+    delete[] x.second;
+  }
+}
+
+/*! Get
+Hand out a buffer of the size asked for, or smaller when the budget
+does not allow it. Contents are not cleared.
+
+@param size_t want
+@param size_t & got
+Size of the buffer returned
+@return char *
+*/
+char* BufferPool::Get(size_t want, size_t& got)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  size_t available = budget > in_use ? budget - in_use : 0;
+
+  got = want;
+  if(got > available && got > MIN_BUFFER)
+  {
+    got = MIN_BUFFER;
+    while(got * 2 <= available && got * 2 <= want)
+    {
+      got *= 2;
+    }
+  }
+  in_use += got;
+
+  auto found = free_buffers.find(got);
+  if(found != free_buffers.end())
+  {
+    char* buffer = found->second;
+    idle -= got;
+    free_buffers.erase(found);
+    return buffer;
+  }
+  return new char[got];
+}
+
+/*! Put
+Take a buffer back, it is kept for reuse while the budget allows
+
+@param char * buffer
+@param size_t size
+Size it was handed out with
+*/
+void BufferPool::Put(char* buffer, size_t size)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  in_use -= size;
+  if(in_use + idle + size <= budget)
+  {
+    free_buffers.insert(std::make_pair(size, buffer));
+    idle += size;
+  }
+  else
+  {
+    delete[] buffer;
+  }
+}
+
+/*! SetBudget
+Change the budget, idle buffers beyond it are freed
+
+@param size_t bytes
+*/
+void BufferPool::SetBudget(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  budget = bytes;
+  Trim();
+}
+
+size_t BufferPool::Budget() const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return budget;
+}
+
+/*! Trim
+Free idle buffers, largest first, until we are within the budget */
+void BufferPool::Trim()
+{
+  while(!free_buffers.empty() && in_use + idle > budget)
+  {
+    auto largest = --free_buffers.end();
+    idle -= largest->first;
+    delete[] largest->second;
+    free_buffers.erase(largest);
+  }
+}
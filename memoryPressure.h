@@ -0,0 +1,109 @@
+#ifndef MEMORY_PRESSURE_H
+#define MEMORY_PRESSURE_H
+/*!
+  @file memoryPressure.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*! How hard the host or our cgroup is pressed for memory */
+enum PressureLevel
+{
+  PRESSURE_NONE = 0, /*!< Nothing to do */
+  PRESSURE_SOME = 1, /*!< Tasks stall on memory, or the cgroup is near its limit */
+  PRESSURE_HIGH = 2  /*!< All tasks stall, or the cgroup is about to OOM */
+};
+
+/*!
+  Watches the memory limit of our cgroup (v2 memory.max, or the v1
+  memory controller) and the kernel pressure stall information in
+  /proc/pressure/memory. Usage is counted as the working set, without
+  inactive page cache, since reading files fills the cache and the
+  kernel drops it before anything is killed.
+
+  Sources the kernel does not provide are ignored. Reading them costs
+  a few small file reads, Poll() does it at most once per interval
+  and returns the last level in between.
+
+  @brief Memory pressure of the host and our cgroup.
+ */
+class MemoryMonitor
+{
+public:
+  /*! Constructor */
+  MemoryMonitor();
+
+  PressureLevel Poll(bool& fresh);
+  PressureLevel Level() const;
+  uint64_t Limit() const { return limit; }
+
+  static const unsigned int POLL_MS = 1000;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  PressureLevel Sample();
+  static bool ReadNumber(const std::string& path, uint64_t& value);
+  static bool ReadStat(const std::string& path, const char* key, uint64_t& value);
+  static bool ReadPsi(const std::string& path, double& some, double& full);
+
+  mutable std::mutex lock;
+  PressureLevel level;
+  Clock::time_point last_poll;
+  std::string cgroup_dir;
+  /*! Directory of our memory cgroup, empty when not found */
+  bool cgroup_v2;
+  uint64_t limit;
+  /*! Memory limit of the cgroup, or of the host when it has none */
+};
+
+/*!
+  Buffers for the comparisons, recycled instead of allocated and
+  zeroed for every block read. Everything handed out counts against
+  a budget, a request that does not fit is given a smaller buffer,
+  never less than MIN_BUFFER so comparisons always make progress.
+  Shrinking the budget frees the idle buffers beyond it.
+
+  @brief Size bounded pool of read buffers.
+ */
+class BufferPool
+{
+public:
+  /*! Constructor */
+  BufferPool()
+    :budget(DEFAULT_BUDGET), in_use(0), idle(0) {}
+  ~BufferPool();
+
+  char* Get(size_t want, size_t& got);
+  void Put(char* buffer, size_t size);
+  void SetBudget(size_t bytes);
+  size_t Budget() const;
+
+  static const size_t MIN_BUFFER = 1 << 17;
+  static const size_t DEFAULT_BUDGET = (size_t)1 << 30;
+
+private:
+  /* Not copyable, we own the buffers */
+  BufferPool(const BufferPool&);
+  BufferPool& operator=(const BufferPool&);
+
+  void Trim();
+
+  mutable std::mutex lock;
+  size_t budget;
+  size_t in_use;
+  /*! Bytes handed out */
+  size_t idle;
+  /*! Bytes kept for reuse */
+  std::multimap<size_t,char*> free_buffers;
+};
+
+#endif /* MEMORY_PRESSURE_H */
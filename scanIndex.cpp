@@ -0,0 +1,606 @@
+/*!
+  @file scanIndex.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scanIndex.h"
+#include "ioBackend.h"
+
+static const char INDEX_MAGIC[8] = { 'F', 'U', 'I', 'N', 'D', 'E', 'X', '\0' };
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+static_assert(sizeof(IndexRecord) == 80, "IndexRecord must stay 80 bytes");
+static_assert(sizeof(IndexHeader) == 128, "IndexHeader must stay 128 bytes");
+
+/*! Align8
+Round an offset up to 8 bytes so every array is naturally aligned */
+static uint64_t Align8(uint64_t offset)
+{
+  return (offset + 7) & ~(uint64_t)7;
+}
+
+/*! PutVarint
+Append a LEB128 varint */
+static void PutVarint(std::vector<unsigned char>& out, uint64_t value)
+{
+  while(value >= 0x80)
+  {
+    out.push_back((unsigned char)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((unsigned char)value);
+}
+
+/*! GetVarint
+Read a LEB128 varint, false if it runs past end */
+static bool GetVarint(const unsigned char* data, uint64_t end, uint64_t& pos,
+                      uint64_t& value)
+{
+  value = 0;
+  for(unsigned int shift = 0; pos < end && shift < 64; shift += 7)
+  {
+    unsigned char byte = data[pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if((byte & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*! HeaderChecksum
+Checksum of a header with its checksum field zeroed */
+static uint64_t HeaderChecksum(const IndexHeader& header)
+{
+  IndexHeader copy = header;
+  copy.header_checksum = 0;
+  return BlockChecksum(&copy, sizeof(copy));
+}
+
+/*! ~ScanIndex
+Unmap the index */
+ScanIndex::~ScanIndex()
+{
+  Close();
+}
+
+/*! Close
+Unmap the index, records and paths handed out before are invalid */
+void ScanIndex::Close()
+{
+  if(base != NULL)
+  {
+    munmap(base, length);
+  }
+  base = NULL;
+  length = 0;
+  header = NULL;
+  records = NULL;
+  by_path = NULL;
+  blocks = NULL;
+  paths = NULL;
+}
+
+/*! IsIndex
+Check if a file starts with the index magic, to tell it apart from
+the text formats it replaces */
+bool ScanIndex::IsIndex(const std::string& index_path)
+{
+  char magic[sizeof(INDEX_MAGIC)];
+  FILE* in = fopen(index_path.c_str(), "rb");
+  bool is_index = false;
+
+  if(in != NULL)
+  {
+    is_index = fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+               memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0;
+    fclose(in);
+  }
+  return is_index;
+}
+
+/*! Open
+Map an index. Only the header is checked: its checksum, and that
+every section lies inside the file. The rest is paged in as used.
+
+@param const std::string & index_path
+@return boolean
+If the file is an index this version can use
+*/
+bool ScanIndex::Open(const std::string& index_path)
+{
+  struct stat st;
+  int fd = open(index_path.c_str(), O_RDONLY);
+
+  Close();
+  if(fd < 0)
+  {
+    std::cerr << "Could not open index: " << index_path << std::endl;
+    return false;
+  }
+  if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(IndexHeader))
+  {
+    std::cerr << "Not an index: " << index_path << std::endl;
+    close(fd);
+    return false;
+  }
+
+  length = st.st_size;
+  base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+  {
+    base = NULL;
+    std::cerr << "Could not map index: " << index_path << std::endl;
+    return false;
+  }
+
+  header = (const IndexHeader*)base;
+  const IndexHeader& h = *header;
+  uint64_t body = h.checksums_offset - sizeof(IndexHeader);
+  uint64_t chunks = (h.checksum_chunk == 0) ? 0 :
+                    (body + h.checksum_chunk - 1) / h.checksum_chunk;
+
+  if(memcmp(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+     h.version != VERSION || h.byte_order != BYTE_ORDER_MARK ||
+     h.header_checksum != HeaderChecksum(h))
+  {
+    std::cerr << "Not an index this version can read: " << index_path << std::endl;
+    Close();
+    return false;
+  }
+  if(h.records_offset != sizeof(IndexHeader) ||
+     h.by_path_offset != h.records_offset + h.record_count * sizeof(IndexRecord) ||
+     h.blocks_offset < h.by_path_offset + h.record_count * sizeof(uint32_t) ||
+     h.paths_offset != h.blocks_offset + h.block_count * sizeof(uint64_t) ||
+     h.checksums_offset < h.paths_offset + h.paths_size ||
+     h.paths_per_block == 0 || h.checksum_chunk == 0 ||
+     h.block_count != (h.record_count + h.paths_per_block - 1) / h.paths_per_block ||
+     length != h.checksums_offset + chunks * sizeof(uint64_t) ||
+     h.blocks_offset % 8 != 0 || h.checksums_offset % 8 != 0)
+  {
+    std::cerr << "Index is truncated or damaged: " << index_path << std::endl;
+    Close();
+    return false;
+  }
+
+  const char* start = (const char*)base;
+  records = (const IndexRecord*)(start + h.records_offset);
+  by_path = (const uint32_t*)(start + h.by_path_offset);
+  blocks = (const uint64_t*)(start + h.blocks_offset);
+  paths = (const unsigned char*)(start + h.paths_offset);
+  return true;
+}
+
+/*! Verify
+Check every chunk against its checksum, and that the path and record
+tables point inside the index. Reads the whole file.
+
+@return boolean
+If the index is intact
+*/
+bool ScanIndex::Verify() const
+{
+  const unsigned char* start = (const unsigned char*)base;
+  const uint64_t* sums = (const uint64_t*)(start + header->checksums_offset);
+  uint64_t chunk = 0;
+
+  for(uint64_t pos = sizeof(IndexHeader); pos < header->checksums_offset;
+      pos += header->checksum_chunk, chunk++)
+  {
+    uint64_t len = std::min<uint64_t>(header->checksum_chunk,
+                                      header->checksums_offset - pos);
+    if(BlockChecksum(start + pos, len) != sums[chunk])
+    {
+      std::cerr << "Checksum mismatch in chunk " << chunk << " at offset "
+                << pos << std::endl;
+      return false;
+    }
+  }
+
+  for(uint64_t i = 0; i < Count(); i++)
+  {
+    if(by_path[i] >= Count() || records[i].path_id >= Count() ||
+       records[by_path[records[i].path_id]].path_id != records[i].path_id)
+    {
+      std::cerr << "Path table does not match record " << i << std::endl;
+      return false;
+    }
+  }
+  for(uint64_t b = 0; b < header->block_count; b++)
+  {
+    if(blocks[b] >= header->paths_size)
+    {
+      std::cerr << "Path block " << b << " is out of range" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! DecodePath
+Decode one front-coded path. On entry path holds the previous path
+of the block, which the new one shares a prefix with.
+
+@param uint64_t & pos
+Position in the path table, advanced past the entry
+@param std::string & path
+@return boolean
+If the entry was well formed
+*/
+bool ScanIndex::DecodePath(uint64_t& pos, std::string& path) const
+{
+  uint64_t shared, suffix;
+
+  if(!GetVarint(paths, header->paths_size, pos, shared) ||
+     !GetVarint(paths, header->paths_size, pos, suffix) ||
+     shared > path.size() || suffix > header->paths_size - pos)
+  {
+    return false;
+  }
+  path.resize(shared);
+  path.append((const char*)paths + pos, suffix);
+  pos += suffix;
+  return true;
+}
+
+/*! Path
+Decode the path with the given id
+
+@param uint64_t path_id
+@return std::string
+Empty if the id is out of range
+*/
+std::string ScanIndex::Path(uint64_t path_id) const
+{
+  IndexCursor cursor;
+
+  if(path_id >= Count())
+  {
+    return std::string();
+  }
+  cursor.path_id = path_id - path_id % header->paths_per_block;
+  cursor.pos = blocks[cursor.path_id / header->paths_per_block];
+  while(cursor.path_id <= path_id)
+  {
+    if(!NextPath(cursor))
+    {
+      return std::string();
+    }
+  }
+  return cursor.path;
+}
+
+/*! NextPath
+Decode the path at the cursor and move it to the next one. A default
+constructed cursor walks every path in sorted order.
+
+@param IndexCursor & cursor
+@return boolean
+If there was another path
+*/
+bool ScanIndex::NextPath(IndexCursor& cursor) const
+{
+  if(cursor.path_id >= Count())
+  {
+    return false;
+  }
+  if(cursor.path_id % header->paths_per_block == 0)
+  {
+    cursor.pos = blocks[cursor.path_id / header->paths_per_block];
+    cursor.path.clear();
+  }
+  if(!DecodePath(cursor.pos, cursor.path))
+  {
+    return false;
+  }
+  cursor.path_id++;
+  return true;
+}
+
+/*! FindPath
+Binary search the first path of every block, then scan the block
+
+@param const std::string & path
+@param uint64_t & path_id
+@return boolean
+If the path is in the index
+*/
+bool ScanIndex::FindPath(const std::string& path, uint64_t& path_id) const
+{
+  uint64_t low = 0, high = header ? header->block_count : 0;
+  std::string first;
+
+  /* Find the last block whose first path is <= path */
+  while(low < high)
+  {
+    uint64_t mid = low + (high - low) / 2;
+    uint64_t pos = blocks[mid];
+
+    first.clear();
+    if(!DecodePath(pos, first))
+    {
+      return false;
+    }
+    if(first <= path)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  if(low == 0)
+  {
+    return false;
+  }
+
+  IndexCursor cursor;
+  cursor.path_id = (low - 1) * header->paths_per_block;
+  uint64_t end = std::min<uint64_t>(cursor.path_id + header->paths_per_block, Count());
+  while(cursor.path_id < end && NextPath(cursor))
+  {
+    if(cursor.path == path)
+    {
+      path_id = cursor.path_id - 1;
+      return true;
+    }
+    if(cursor.path > path)
+    {
+      break;
+    }
+  }
+  return false;
+}
+
+/*! FindSize
+Find the run of records with a given size
+
+@param uint64_t size
+@param uint64_t & first
+@param uint64_t & end
+One past the last record of the run
+@return boolean
+If any record has that size
+*/
+bool ScanIndex::FindSize(uint64_t size, uint64_t& first, uint64_t& end) const
+{
+  const IndexRecord* last = records + Count();
+  const IndexRecord* low = std::lower_bound(records, last, size,
+    [](const IndexRecord& record, uint64_t value) { return record.size < value; });
+  const IndexRecord* high = std::upper_bound(low, last, size,
+    [](uint64_t value, const IndexRecord& record) { return value < record.size; });
+
+  first = low - records;
+  end = high - records;
+  return first < end;
+}
+
+/*! ToEntry
+Unpack the identity and digest of a record */
+void ScanIndex::ToEntry(const IndexRecord& record, FileIdentity& ident,
+                        Digest& digest)
+{
+  ident.size = record.size;
+  ident.mtime_sec = record.mtime_sec;
+  ident.mtime_nsec = record.mtime_nsec;
+  ident.dev = record.dev;
+  ident.ino = record.ino;
+  digest.algorithm = record.algorithm;
+  memcpy(digest.bytes, record.digest, Digest::MAX_SIZE);
+}
+
+/*! ChunkWriter
+Writes the index body and checksums it in CHECKSUM_CHUNK pieces on
+the way out, so the file is never held in memory twice */
+class ChunkWriter
+{
+public:
+  ChunkWriter(FILE* out_file, uint32_t chunk_size)
+    :out(out_file), chunk(chunk_size), ok(true) { buffer.reserve(chunk); }
+
+  void Put(const void* data, size_t len)
+  {
+    const unsigned char* p = (const unsigned char*)data;
+    while(len > 0)
+    {
+      size_t take = std::min<size_t>(len, chunk - buffer.size());
+      buffer.insert(buffer.end(), p, p + take);
+      p += take;
+      len -= take;
+      if(buffer.size() == chunk)
+      {
+        Flush();
+      }
+    }
+  }
+
+  void Pad(uint64_t offset, uint64_t to)
+  {
+    static const unsigned char zeros[8] = { 0 };
+    Put(zeros, to - offset);
+  }
+
+  void Flush()
+  {
+    if(buffer.empty())
+    {
+      return;
+    }
+    sums.push_back(BlockChecksum(&buffer[0], buffer.size()));
+    ok = ok && fwrite(&buffer[0], 1, buffer.size(), out) == buffer.size();
+    buffer.clear();
+  }
+
+  FILE* out;
+  size_t chunk;
+  bool ok;
+  std::vector<unsigned char> buffer;
+  std::vector<uint64_t> sums;
+};
+
+/*! Write
+Write entries as an index. Entries are sorted in place by path; a
+path given twice keeps its last entry. The file is written next to
+the destination and renamed into place.
+
+@param const std::string & index_path
+@param std::vector<IndexEntry> & entries
+@return boolean
+If the index was written
+*/
+bool ScanIndex::Write(const std::string& index_path, std::vector<IndexEntry>& entries)
+{
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+
+  /* Keep the last of equal paths */
+  size_t kept = 0;
+  for(size_t i = 0; i < entries.size(); i++)
+  {
+    if(i + 1 < entries.size() && entries[i + 1].path == entries[i].path)
+    {
+      continue;
+    }
+    if(kept != i)
+    {
+      entries[kept] = entries[i];
+    }
+    kept++;
+  }
+  entries.resize(kept);
+
+  if(entries.size() > UINT32_MAX)
+  {
+    std::cerr << "Too many files for one index: " << entries.size() << std::endl;
+    return false;
+  }
+
+  /* Front-coded path table, path ids are the sorted order */
+  std::vector<unsigned char> path_data;
+  std::vector<uint64_t> block_starts;
+  for(size_t i = 0; i < entries.size(); i++)
+  {
+    const std::string& path = entries[i].path;
+    size_t shared = 0;
+
+    if(i % PATHS_PER_BLOCK == 0)
+    {
+      block_starts.push_back(path_data.size());
+    }
+    else
+    {
+      const std::string& prev = entries[i - 1].path;
+      while(shared < prev.size() && shared < path.size() && prev[shared] == path[shared])
+      {
+        shared++;
+      }
+    }
+    PutVarint(path_data, shared);
+    PutVarint(path_data, path.size() - shared);
+    path_data.insert(path_data.end(), path.begin() + shared, path.end());
+  }
+
+  /* Records sorted by size, then digest */
+  std::vector<IndexRecord> table(entries.size());
+  for(size_t i = 0; i < entries.size(); i++)
+  {
+    IndexRecord& record = table[i];
+    const IndexEntry& entry = entries[i];
+
+    memset(&record, 0, sizeof(record));
+    record.size = entry.ident.size;
+    record.mtime_sec = entry.ident.mtime_sec;
+    record.mtime_nsec = (uint32_t)entry.ident.mtime_nsec;
+    record.dev = entry.ident.dev;
+    record.ino = entry.ident.ino;
+    record.path_id = (uint32_t)i;
+    if(entry.hashed)
+    {
+      record.algorithm = entry.digest.algorithm;
+      memcpy(record.digest, entry.digest.bytes, Digest::MAX_SIZE);
+    }
+  }
+  std::sort(table.begin(), table.end(),
+            [](const IndexRecord& a, const IndexRecord& b)
+            {
+              if(a.size != b.size) return a.size < b.size;
+              if(a.algorithm != b.algorithm) return a.algorithm < b.algorithm;
+              int order = memcmp(a.digest, b.digest, Digest::MAX_SIZE);
+              if(order != 0) return order < 0;
+              return a.path_id < b.path_id;
+            });
+  std::vector<uint32_t> path_records(entries.size());
+  for(size_t i = 0; i < table.size(); i++)
+  {
+    path_records[table[i].path_id] = (uint32_t)i;
+  }
+
+  IndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  h.version = VERSION;
+  h.byte_order = BYTE_ORDER_MARK;
+  h.record_count = entries.size();
+  h.records_offset = sizeof(IndexHeader);
+  h.by_path_offset = h.records_offset + table.size() * sizeof(IndexRecord);
+  h.blocks_offset = Align8(h.by_path_offset + path_records.size() * sizeof(uint32_t));
+  h.block_count = block_starts.size();
+  h.paths_offset = h.blocks_offset + block_starts.size() * sizeof(uint64_t);
+  h.paths_size = path_data.size();
+  h.checksums_offset = Align8(h.paths_offset + h.paths_size);
+  h.checksum_chunk = CHECKSUM_CHUNK;
+  h.paths_per_block = PATHS_PER_BLOCK;
+  h.header_checksum = HeaderChecksum(h);
+
+  std::string tmp_path = index_path + ".tmp";
+  FILE* out = fopen(tmp_path.c_str(), "wb");
+  if(out == NULL)
+  {
+    std::cerr << "Could not write index: " << tmp_path << std::endl;
+    return false;
+  }
+
+  bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+  ChunkWriter body(out, CHECKSUM_CHUNK);
+  if(!table.empty())
+  {
+    body.Put(&table[0], table.size() * sizeof(IndexRecord));
+    body.Put(&path_records[0], path_records.size() * sizeof(uint32_t));
+  }
+  body.Pad(h.by_path_offset + path_records.size() * sizeof(uint32_t), h.blocks_offset);
+  if(!block_starts.empty())
+  {
+    body.Put(&block_starts[0], block_starts.size() * sizeof(uint64_t));
+    body.Put(&path_data[0], path_data.size());
+  }
+  body.Pad(h.paths_offset + h.paths_size, h.checksums_offset);
+  body.Flush();
+
+  ok = ok && body.ok;
+  if(!body.sums.empty())
+  {
+    ok = ok && fwrite(&body.sums[0], sizeof(uint64_t), body.sums.size(), out) ==
+               body.sums.size();
+  }
+  ok = (fclose(out) == 0) && ok;
+
+  if(!ok || rename(tmp_path.c_str(), index_path.c_str()) != 0)
+  {
+    std::cerr << "Could not write index: " << index_path << std::endl;
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,151 @@
+#ifndef SCAN_INDEX_H
+#define SCAN_INDEX_H
+/*!
+  @file scanIndex.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "contentHash.h"
+#include "hashCache.h"
+
+/*! One file as it is written to an index */
+struct IndexEntry
+{
+  std::string path;
+  FileIdentity ident;
+  Digest digest;
+  bool hashed;
+  /*!< If digest holds the content digest */
+
+  /*! Constructor */
+  IndexEntry()
+    :hashed(false) { memset(&ident, 0, sizeof(ident)); }
+};
+
+/*!
+  Fixed width record of one file. Records are sorted by size, then
+  digest, so every group of files the duplicate search compares is
+  one contiguous run.
+ */
+struct IndexRecord
+{
+  uint64_t size;
+  unsigned char digest[Digest::MAX_SIZE];
+  int64_t mtime_sec;
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t mtime_nsec;
+  uint32_t path_id;
+  /*!< Rank of the path in the path table */
+  unsigned char algorithm;
+  /*!< Digest algorithm, 0 when the content was never hashed */
+  unsigned char reserved[7];
+};
+
+/*! File header, everything after it is located through these offsets */
+struct IndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  /*!< 0x01020304 as written, files are native endian */
+  uint64_t record_count;
+  uint64_t records_offset;
+  /*!< IndexRecord[record_count] sorted by size and digest */
+  uint64_t by_path_offset;
+  /*!< uint32_t[record_count], record of every path id */
+  uint64_t blocks_offset;
+  /*!< uint64_t[block_count], start of each path block in the path table */
+  uint64_t block_count;
+  uint64_t paths_offset;
+  /*!< Front-coded path table, sorted */
+  uint64_t paths_size;
+  uint64_t checksums_offset;
+  /*!< uint64_t per checksum chunk of everything between header and here */
+  uint32_t checksum_chunk;
+  uint32_t paths_per_block;
+  uint64_t header_checksum;
+  /*!< BlockChecksum of the header with this field zeroed */
+  char reserved[32];
+};
+
+/*! Position of a walk over the paths of an index in sorted order */
+struct IndexCursor
+{
+  uint64_t path_id;
+  uint64_t pos;
+  std::string path;
+  /*!< Path decoded last */
+  IndexCursor() :path_id(0), pos(0) {}
+};
+
+/*!
+  Versioned binary index of a set of files, used straight from mmap.
+  Nothing is parsed on load: records are fixed width, paths are
+  front-coded in blocks of PATHS_PER_BLOCK with a block offset table
+  for binary search, and every structure is located by the header.
+  Opening an index of any size costs a header check and page faults
+  as it is used.
+
+  Every checksum chunk of the file has a checksum, Verify() checks
+  them all when the index has to be trusted in full.
+
+  @brief Zero-parse on-disk file index.
+ */
+class ScanIndex
+{
+public:
+  /*! Constructor */
+  ScanIndex()
+    :base(NULL), length(0), header(NULL), records(NULL), by_path(NULL),
+     blocks(NULL), paths(NULL) {}
+  ~ScanIndex();
+
+  bool Open(const std::string& index_path);
+  void Close();
+  bool IsOpen() const { return base != NULL; }
+  bool Verify() const;
+
+  uint64_t Count() const { return header ? header->record_count : 0; }
+  const IndexRecord& Record(uint64_t i) const { return records[i]; }
+  const IndexRecord& RecordOfPath(uint64_t path_id) const
+  {
+    return records[by_path[path_id]];
+  }
+  std::string Path(uint64_t path_id) const;
+  bool FindPath(const std::string& path, uint64_t& path_id) const;
+  bool FindSize(uint64_t size, uint64_t& first, uint64_t& end) const;
+  bool NextPath(IndexCursor& cursor) const;
+
+  static void ToEntry(const IndexRecord& record, FileIdentity& ident,
+                      Digest& digest);
+  static bool IsIndex(const std::string& index_path);
+  static bool Write(const std::string& index_path,
+                    std::vector<IndexEntry>& entries);
+
+  static const uint32_t VERSION = 1;
+  static const uint32_t PATHS_PER_BLOCK = 16;
+  static const uint32_t CHECKSUM_CHUNK = 1 << 20;
+
+private:
+  /* Not copyable, we own the mapping */
+  ScanIndex(const ScanIndex&);
+  ScanIndex& operator=(const ScanIndex&);
+
+  bool DecodePath(uint64_t& pos, std::string& path) const;
+
+  void* base;
+  size_t length;
+  const IndexHeader* header;
+  const IndexRecord* records;
+  const uint32_t* by_path;
+  const uint64_t* blocks;
+  const unsigned char* paths;
+};
+
+#endif /* SCAN_INDEX_H */
@@ -0,0 +1,305 @@
+/*!
+  @file textNormalizer.cpp
+  @author Charles Irick
+*/
+#include <cstring>
+#include "cpuFeatures.h"
+#include "hashPolicy.h"
+#include "textNormalizer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+const size_t TextNormalizer::BINARY_CHECK;
+const size_t TextNormalizer::FIRST_READ;
+const size_t TextNormalizer::BUFFER_SIZE;
+
+/*! FindLineBreakPortable
+Eight bytes per step, a byte is a break when it equals '\n' or '\r'
+
+@param const unsigned char * p
+@param size_t len
+@return size_t
+Offset of the first break, len when there is none
+*/
+static size_t FindLineBreakPortable(const unsigned char* p, size_t len)
+{
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  size_t i = 0;
+
+  for(; i + 8 <= len; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, p + i, 8);
+    uint64_t lf = word ^ (ones * '\n');
+    uint64_t cr = word ^ (ones * '\r');
+    /* Nonzero when a byte of either word is zero, the byte loop
+    below finds which */
+    if((((lf - ones) & ~lf) | ((cr - ones) & ~cr)) & highs)
+    {
+      break;
+    }
+  }
+  for(; i < len; i++)
+  {
+    if(p[i] == '\n' || p[i] == '\r')
+    {
+      return i;
+    }
+  }
+  return len;
+}
+
+#ifdef HAVE_X86_KERNELS
+/*! FindLineBreakSse2
+Same as FindLineBreakPortable, sixteen bytes per compare */
+__attribute__((target("sse2")))
+static size_t FindLineBreakSse2(const unsigned char* p, size_t len)
+{
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  size_t i = 0;
+
+  for(; i + 16 <= len; i += 16)
+  {
+    __m128i data = _mm_loadu_si128((const __m128i*)(p + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(data, lf),
+                                              _mm_cmpeq_epi8(data, cr)));
+    if(mask != 0)
+    {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + FindLineBreakPortable(p + i, len - i);
+}
+
+/*! FindLineBreakAvx2
+Same as FindLineBreakPortable, thirty-two bytes per compare */
+__attribute__((target("avx2")))
+static size_t FindLineBreakAvx2(const unsigned char* p, size_t len)
+{
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  size_t i = 0;
+
+  for(; i + 32 <= len; i += 32)
+  {
+    __m256i data = _mm256_loadu_si256((const __m256i*)(p + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(data, lf),
+                                                             _mm256_cmpeq_epi8(data, cr)));
+    if(mask != 0)
+    {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + FindLineBreakPortable(p + i, len - i);
+}
+#endif
+
+/*! FindLineBreak
+Find the next '\n' or '\r' with the widest kernel the CPU supports
+
+@param const char * data
+@param size_t len
+@return size_t
+Offset of the first break, len when there is none
+*/
+size_t TextNormalizer::FindLineBreak(const char* data, size_t len)
+{
+  typedef size_t (*Kernel)(const unsigned char*, size_t);
+#ifdef HAVE_X86_KERNELS
+  /* Every CPU with SSE4.1 has SSE2, a 32-bit one may have neither */
+  static const Kernel kernel = CpuFeatures::Get().avx2 ? FindLineBreakAvx2 :
+                               CpuFeatures::Get().sse41 ? FindLineBreakSse2 :
+                               FindLineBreakPortable;
+#else
+  static const Kernel kernel = FindLineBreakPortable;
+#endif
+  return kernel((const unsigned char*)data, len);
+}
+
+/*! IsBinary
+A NUL byte in the first BINARY_CHECK bytes makes a file binary
+
+@param const char * data
+@param size_t len
+Bytes at the start of the file
+@return boolean
+*/
+bool TextNormalizer::IsBinary(const char* data, size_t len)
+{
+  return memchr(data, 0, len < BINARY_CHECK ? len : BINARY_CHECK) != NULL;
+}
+
+/*! Reset
+Start a new file */
+void TextNormalizer::Reset()
+{
+  pending.clear();
+  line_open = false;
+}
+
+/*! Segment
+Write a run of text without line breaks. Its trailing whitespace is
+held back, whitespace held back before it is written when the run
+has text after it.
+
+@param const char * data
+@param size_t len
+@param std::vector<char> & out
+*/
+void TextNormalizer::Segment(const char* data, size_t len, std::vector<char>& out)
+{
+  size_t text = len;
+
+  while(text > 0 && (data[text - 1] == ' ' || data[text - 1] == '\t'))
+  {
+    text--;
+  }
+  if(text > 0)
+  {
+    out.insert(out.end(), pending.begin(), pending.end());
+    out.insert(out.end(), data, data + text);
+    pending.clear();
+    line_open = true;
+  }
+  pending.append(data + text, len - text);
+}
+
+/*! Update
+Normalize the next part of a file
+
+@param const char * data
+@param size_t len
+@param std::vector<char> & out
+Normalized text is appended here
+*/
+void TextNormalizer::Update(const char* data, size_t len, std::vector<char>& out)
+{
+  size_t pos = 0;
+
+  while(pos < len)
+  {
+    size_t brk = pos + FindLineBreak(data + pos, len - pos);
+
+    Segment(data + pos, brk - pos, out);
+    if(brk == len)
+    {
+      break;
+    }
+
+    /* A carriage return is trailing when only whitespace and the
+    end of the line follow it */
+    if(data[brk] == '\n')
+    {
+      pending.clear();
+      out.push_back('\n');
+      line_open = false;
+    }
+    else
+    {
+      pending.push_back('\r');
+    }
+    pos = brk + 1;
+  }
+}
+
+/*! Final
+Drop trailing whitespace at the end of the file and end the last
+line
+
+@param std::vector<char> & out
+*/
+void TextNormalizer::Final(std::vector<char>& out)
+{
+  pending.clear();
+  if(line_open)
+  {
+    out.push_back('\n');
+    line_open = false;
+  }
+}
+
+/*!
+  Read loop of Normalize(), instantiated once per hash policy
+ */
+struct TextNormalizer::HashLoop
+{
+  TextNormalizer& text;
+  int handle;
+  Digest& digest;
+  bool& binary;
+
+  template <class Policy> bool Run()
+  {
+    typename Policy::State state;
+    std::vector<char> buffer(BUFFER_SIZE);
+    std::vector<char> out;
+    uint64_t offset = 0;
+    ssize_t got;
+
+    /* The first read is just enough to tell binary files apart */
+    out.reserve(BUFFER_SIZE);
+    while((got = text.io.Read(handle, &buffer[0], offset == 0 ? FIRST_READ : buffer.size(),
+                              offset)) > 0)
+    {
+      if(offset == 0 && IsBinary(&buffer[0], got))
+      {
+        binary = true;
+        return true;
+      }
+      offset += got;
+
+      out.clear();
+      text.Update(&buffer[0], got, out);
+      if(!out.empty())
+      {
+        state.Update(&out[0], out.size());
+      }
+    }
+    if(got < 0)
+    {
+      return false;
+    }
+
+    out.clear();
+    text.Final(out);
+    if(!out.empty())
+    {
+      state.Update(&out[0], out.size());
+    }
+    state.Final(digest);
+    return true;
+  }
+};
+
+/*! Normalize
+Digest of the normalized text of a file
+
+@param const std::string & path
+@param Digest & digest
+Set for text files only
+@param bool & binary
+Set when the file is binary
+@return boolean
+If the file could be read
+*/
+bool TextNormalizer::Normalize(const std::string& path, Digest& digest, bool& binary)
+{
+  int handle = io.Open(path);
+  HashLoop loop = {*this, handle, digest, binary};
+
+  binary = false;
+  if(handle < 0)
+  {
+    return false;
+  }
+
+  Reset();
+  bool read = WithHashPolicy(algorithm, loop);
+  io.Close(handle);
+  return read;
+}
@@ -0,0 +1,68 @@
+#ifndef TEXT_NORMALIZER_H
+#define TEXT_NORMALIZER_H
+/*!
+  @file textNormalizer.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "contentHash.h"
+#include "ioBackend.h"
+
+/*!
+  Hashes a canonical form of a text file, so that copies differing
+  only in line endings or trailing whitespace are equal. CRLF becomes
+  LF, spaces, tabs and carriage returns before the end of a line or
+  of the file are dropped, and a missing newline at the end of the
+  file is added. A carriage return followed by more text is kept.
+
+  Text is streamed from one line break to the next, the breaks are
+  found 32 or 16 bytes at a time with AVX2 or SSE2, whichever the CPU
+  supports. Whitespace that may still turn out to be trailing is held
+  back until the next byte shows whether it is, so files are never
+  read whole.
+
+  A file with a NUL byte in its first BINARY_CHECK bytes is binary,
+  as git and diff decide it. Binary files are left after the first
+  read and keep being compared byte for byte.
+
+  @brief Content digest of text ignoring line endings and trailing
+  whitespace.
+ */
+class TextNormalizer
+{
+public:
+  /*! Constructor */
+  TextNormalizer(IoBackend& backend, unsigned char hash_algorithm)
+    :io(backend), algorithm(hash_algorithm), line_open(false) {}
+
+  bool Normalize(const std::string& path, Digest& digest, bool& binary);
+
+  void Reset();
+  void Update(const char* data, size_t len, std::vector<char>& out);
+  void Final(std::vector<char>& out);
+
+  static bool IsBinary(const char* data, size_t len);
+  static size_t FindLineBreak(const char* data, size_t len);
+
+  static const size_t BINARY_CHECK = 8000;
+  static const size_t FIRST_READ = 1 << 13;
+  static const size_t BUFFER_SIZE = 1 << 18;
+
+private:
+  struct HashLoop;
+  void Segment(const char* data, size_t len, std::vector<char>& out);
+
+  IoBackend& io;
+  unsigned char algorithm;
+  /*! HashAlgorithm of the digests */
+  std::string pending;
+  /*! Whitespace and carriage returns not known to be trailing yet */
+  bool line_open;
+  /*! Informs if text was written since the last newline */
+};
+
+#endif /* TEXT_NORMALIZER_H */
@@ -0,0 +1,483 @@
+/*!
+  @file treeCopier.cpp
+  @author Charles Irick
+*/
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+#include "boost/filesystem.hpp"
+#include "treeCopier.h"
+
+/*! DEFAULT_INDEX
+Name of the index kept in the destination root unless another
+path is given */
+const char* TreeCopier::DEFAULT_INDEX = ".file_utils_index";
+
+/*! Copy
+Copy the tree under src into dst. Directories and symlinks are
+recreated, regular files are linked to a destination file with the
+same content when there is one and copied otherwise. A file already
+at its destination path with the same content is left alone.
+
+@param const std::string & src
+@param const std::string & dst
+@return boolean
+If every file was copied
+*/
+bool TreeCopier::Copy(const std::string& src, const std::string& dst)
+{
+  boost::system::error_code ec;
+  std::string dst_root = HashCache::Key(dst);
+
+  if(!boost::filesystem::is_directory(src, ec))
+  {
+    std::cerr << "Not a directory: " << src << std::endl;
+    return false;
+  }
+  boost::filesystem::create_directories(dst_root, ec);
+  if(!boost::filesystem::is_directory(dst_root, ec))
+  {
+    std::cerr << "Could not create: " << dst << std::endl;
+    return false;
+  }
+
+  if(index_path.empty())
+  {
+    index_path = (boost::filesystem::path(dst_root) / DEFAULT_INDEX).string();
+  }
+  index_path = HashCache::Key(index_path);
+  if(!old_index.Load(index_path))
+  {
+    return false;
+  }
+
+  /* Learn what the destination already holds, reading only files
+  that changed since the last run */
+  IndexDestination(dst_root);
+
+  boost::filesystem::recursive_directory_iterator it(src, ec), end;
+  for(; it != end; it.increment(ec))
+  {
+    if(ec)
+    {
+      std::cerr << "Could not read: " << it->path().string() << std::endl;
+      ec.clear();
+      continue;
+    }
+
+    std::string from = it->path().string();
+    std::string rel = it->path().lexically_relative(src).string();
+    std::string to = (boost::filesystem::path(dst_root) / rel).string();
+    struct stat st;
+
+    if(HashCache::Key(from) == index_path || lstat(from.c_str(), &st) != 0)
+    {
+      continue;
+    }
+
+    /* Never copy the destination into itself */
+    if(S_ISDIR(st.st_mode) && HashCache::Key(from) == dst_root)
+    {
+      it.no_push();
+      continue;
+    }
+    if(S_ISDIR(st.st_mode))
+    {
+      boost::filesystem::create_directory(to, ec);
+      ec.clear();
+      continue;
+    }
+    if(S_ISLNK(st.st_mode))
+    {
+      boost::filesystem::path target = boost::filesystem::read_symlink(from, ec);
+      if(boost::filesystem::is_symlink(boost::filesystem::symlink_status(to)))
+      {
+        boost::filesystem::remove(to, ec);
+      }
+      boost::filesystem::create_symlink(target, to, ec);
+      if(ec)
+      {
+        std::cerr << "Could not link: " << to << ": " << ec.message() << std::endl;
+        failed_files++;
+        ec.clear();
+      }
+      continue;
+    }
+    if(!S_ISREG(st.st_mode))
+    {
+      std::cout << "Skipping special file: " << from << std::endl;
+      continue;
+    }
+
+    /* A file with a size no destination file has can be neither
+    unchanged nor linked, it is hashed as it is copied. Others are
+    hashed first to find out */
+    Digest digest;
+    bool hashed = content_sizes.count(st.st_size) > 0;
+    if(hashed && !HashPath(from, digest))
+    {
+      failed_files++;
+      continue;
+    }
+
+    auto current = dst_digests.find(to);
+    if(hashed && current != dst_digests.end() && current->second == digest)
+    {
+      unchanged_files++;
+      continue;
+    }
+
+    auto found = hashed ? content.find(digest) : content.end();
+    bool ok = false;
+
+    if(found != content.end() && link_mode != LINK_NONE &&
+       LinkFile(found->second, to, st))
+    {
+      linked_files++;
+      linked_bytes += st.st_size;
+      ok = true;
+    }
+    else if(CopyFile(from, to, st, digest))
+    {
+      copied_files++;
+      copied_bytes += st.st_size;
+      ok = true;
+    }
+
+    if(!ok)
+    {
+      failed_files++;
+      continue;
+    }
+
+    /* The old content of a replaced file is gone, so it can no
+    longer be the copy others are linked to */
+    if(current != dst_digests.end())
+    {
+      auto old = content.find(current->second);
+      if(old != content.end() && old->second == to)
+      {
+        content.erase(old);
+      }
+    }
+
+    FileIdentity ident;
+    dst_digests[to] = digest;
+    content.insert(std::make_pair(digest, to));
+    content_sizes.insert(st.st_size);
+    if(StatIdentity(to, ident))
+    {
+      index.Insert(to, ident, digest);
+    }
+  }
+
+  index.Save(index_path);
+  PrintStats();
+  return failed_files == 0;
+}
+
+/*! IndexDestination
+Record the content of every regular file already in the destination.
+Digests from the previous run's index are reused for files that have
+not changed since.
+
+@param const std::string & dst
+*/
+void TreeCopier::IndexDestination(const std::string& dst)
+{
+  boost::system::error_code ec;
+  boost::filesystem::recursive_directory_iterator it(dst, ec), end;
+
+  for(; it != end; it.increment(ec))
+  {
+    if(ec)
+    {
+      ec.clear();
+      continue;
+    }
+
+    std::string path = it->path().string();
+    FileIdentity ident;
+    Digest digest;
+
+    if(path == index_path || it->symlink_status().type() != boost::filesystem::regular_file ||
+       !StatIdentity(path, ident))
+    {
+      continue;
+    }
+    if(!old_index.Lookup(path, ident, digest) && !HashPath(path, digest))
+    {
+      continue;
+    }
+
+    index.Insert(path, ident, digest);
+    dst_digests[path] = digest;
+    content.insert(std::make_pair(digest, path));
+    content_sizes.insert(ident.size);
+  }
+}
+
+/*! MakeTemp
+Create a file with a unique name next to a destination, so that no
+file of the tree is ever overwritten by a temporary one
+
+@param const std::string & to
+@param std::string & tmp
+Name of the file created
+@return int
+Descriptor of the file, -1 on failure
+*/
+static int MakeTemp(const std::string& to, std::string& tmp)
+{
+  std::string dir = boost::filesystem::path(to).parent_path().string();
+  std::string name = (dir.empty() ? "." : dir) + "/.fu-tmp-XXXXXX";
+  std::vector<char> buffer(name.begin(), name.end());
+
+  buffer.push_back('\0');
+  int fd = mkstemp(&buffer[0]);
+  tmp = &buffer[0];
+  return fd;
+}
+
+/*! LinkFile
+Make a file share the data of an existing destination file, by
+reflink or hard link depending on the link mode. Failure is quiet,
+the caller copies the data instead.
+
+@param const std::string & existing
+Destination file with the same content
+@param const std::string & to
+@param const struct stat & st
+Stat of the source file, for its mode and times
+@return boolean
+If the file was linked
+*/
+bool TreeCopier::LinkFile(const std::string& existing, const std::string& to,
+                          const struct stat& st)
+{
+  std::string tmp;
+  int out = MakeTemp(to, tmp);
+
+  if(out < 0)
+  {
+    return false;
+  }
+  if(link_mode == LINK_HARDLINK)
+  {
+    /* The name stays ours only as long as nothing else takes it,
+    link() fails rather than replace a file that did */
+    close(out);
+    unlink(tmp.c_str());
+    return link(existing.c_str(), tmp.c_str()) == 0 && Install(tmp, to);
+  }
+
+#if defined(FICLONE)
+  int in = open(existing.c_str(), O_RDONLY);
+  if(in < 0)
+  {
+    close(out);
+    unlink(tmp.c_str());
+    return false;
+  }
+
+  bool ok = ioctl(out, FICLONE, in) == 0 && CopyMetadata(out, st);
+  close(in);
+  close(out);
+  if(!ok)
+  {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return Install(tmp, to);
+#else
+  (void)existing;
+  (void)st;
+  close(out);
+  unlink(tmp.c_str());
+  return false;
+#endif
+}
+
+/*! CopyFile
+Copy the data of a file next to its destination, hashing it on the
+way, and rename it into place once complete.
+
+@param const std::string & from
+@param const std::string & to
+@param const struct stat & st
+@param Digest & digest
+Set to the SHA-256 of the data copied
+@return boolean
+If the file was copied
+*/
+bool TreeCopier::CopyFile(const std::string& from, const std::string& to,
+                          const struct stat& st, Digest& digest)
+{
+  std::string tmp;
+  int in = open(from.c_str(), O_RDONLY);
+  int error = 0;
+
+  if(in < 0)
+  {
+    std::cerr << "Could not open: " << from << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  int out = MakeTemp(to, tmp);
+  if(out < 0)
+  {
+    std::cerr << "Could not create: " << tmp << ": " << strerror(errno) << std::endl;
+    close(in);
+    return false;
+  }
+
+  bool ok = StreamHashed(in, out, digest, error);
+  if(ok && !CopyMetadata(out, st))
+  {
+    error = errno;
+    ok = false;
+  }
+  if(!ok)
+  {
+    std::cerr << "Could not copy: " << from << ": " << strerror(error) << std::endl;
+  }
+  close(in);
+  if(close(out) != 0)
+  {
+    ok = false;
+  }
+  if(!ok)
+  {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return Install(tmp, to);
+}
+
+/*! Install
+Rename a finished temporary file over its destination */
+bool TreeCopier::Install(const std::string& tmp, const std::string& to)
+{
+  if(rename(tmp.c_str(), to.c_str()) != 0)
+  {
+    std::cerr << "Could not replace: " << to << ": " << strerror(errno) << std::endl;
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*! StreamHashed
+Copy a descriptor to its end and hash what was copied. The data
+passes through user space to be hashed, so unlike copy_file_range()
+no filesystem can offload the copy, but the source is read once.
+
+@param int in
+@param int out
+@param Digest & digest
+SHA-256 of the bytes written
+@param int & error
+errno of the call that failed
+@return boolean
+If all data was copied
+*/
+bool TreeCopier::StreamHashed(int in, int out, Digest& digest, int& error)
+{
+  std::vector<char> buffer(COPY_BUFFER_SIZE);
+  Sha256 sha;
+  ssize_t got;
+
+  while((got = read(in, &buffer[0], buffer.size())) > 0)
+  {
+    sha.Update(&buffer[0], got);
+    for(ssize_t put = 0; put < got; )
+    {
+      ssize_t wrote = write(out, &buffer[put], got - put);
+      if(wrote < 0)
+      {
+        error = errno;
+        return false;
+      }
+      put += wrote;
+    }
+  }
+  if(got < 0)
+  {
+    error = errno;
+    return false;
+  }
+  sha.Final(digest);
+  return true;
+}
+
+/*! CopyMetadata
+Give a copied file the permissions and times of its source */
+bool TreeCopier::CopyMetadata(int fd, const struct stat& st)
+{
+  struct timespec times[2];
+
+#if defined(__APPLE__)
+  times[0] = st.st_atimespec;
+  times[1] = st.st_mtimespec;
+#else
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+#endif
+  return fchmod(fd, st.st_mode & 07777) == 0 && futimens(fd, times) == 0;
+}
+
+/*! HashPath
+Compute the SHA-256 digest of a file's content */
+bool TreeCopier::HashPath(const std::string& path, Digest& digest)
+{
+  std::vector<char> buffer(COPY_BUFFER_SIZE);
+  int in = open(path.c_str(), O_RDONLY);
+  Sha256 sha;
+  ssize_t got;
+
+  if(in < 0)
+  {
+    std::cerr << "Could not open: " << path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  while((got = read(in, &buffer[0], buffer.size())) > 0)
+  {
+    sha.Update(&buffer[0], got);
+  }
+  close(in);
+  if(got < 0)
+  {
+    std::cerr << "Could not read: " << path << std::endl;
+    return false;
+  }
+  sha.Final(digest);
+  return true;
+}
+
+/*! PrintStats
+Report how much data was written and how much was linked instead */
+void TreeCopier::PrintStats() const
+{
+  double to_mb = 1.0 / (double)(1 << 20);
+
+  std::cout << std::fixed << std::showpoint << std::setprecision(2)
+            << "-- Copy Stats -- " << std::endl
+            << "Files copied:            " << copied_files << " ("
+            << copied_bytes * to_mb << "MB)" << std::endl
+            << "Files linked:            " << linked_files << " ("
+            << linked_bytes * to_mb << "MB)" << std::endl
+            << "Files unchanged:         " << unchanged_files << std::endl;
+  if(failed_files > 0)
+  {
+    std::cout << "Files failed:            " << failed_files << std::endl;
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef TREE_COPIER_H
+#define TREE_COPIER_H
+/*!
+  @file treeCopier.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/stat.h>
+#include "contentHash.h"
+#include "hashCache.h"
+
+/*! How a file whose content is already in the destination is made */
+enum LinkMode
+{
+  LINK_REFLINK,  /*!< Share the extents of the existing copy */
+  LINK_HARDLINK, /*!< Hard link the existing copy */
+  LINK_NONE      /*!< Always copy the data */
+};
+
+/*!
+  Copies a tree into a destination while keeping a content index of
+  the destination. Files whose content is already in the destination,
+  or was copied earlier in the same run, are reflinked or hard linked
+  to that copy instead of being written again. Everything else is
+  copied and hashed in the same read. Only files with the size of a
+  destination file are hashed before, to find out if they need
+  copying at all.
+
+  The index is a hash cache saved in the destination, so later runs
+  only read destination files that changed since.
+
+  @brief Dedup-aware tree copy.
+ */
+class TreeCopier
+{
+public:
+  /*! Constructor */
+  TreeCopier()
+    :link_mode(LINK_REFLINK), copied_files(0), copied_bytes(0),
+     linked_files(0), linked_bytes(0), unchanged_files(0), failed_files(0) {}
+
+  void SetLinkMode(LinkMode mode) { link_mode = mode; }
+  void SetIndexPath(const std::string& path) { index_path = path; }
+  bool Copy(const std::string& src, const std::string& dst);
+
+  static const char* DEFAULT_INDEX;
+
+  static bool HashPath(const std::string& path, Digest& digest);
+  static bool StreamHashed(int in, int out, Digest& digest, int& error);
+  static bool CopyMetadata(int fd, const struct stat& st);
+
+private:
+  void IndexDestination(const std::string& dst);
+  bool CopyFile(const std::string& from, const std::string& to,
+                const struct stat& st, Digest& digest);
+  bool LinkFile(const std::string& existing, const std::string& to,
+                const struct stat& st);
+  bool Install(const std::string& tmp, const std::string& to);
+  void PrintStats() const;
+
+  static const unsigned int COPY_BUFFER_SIZE = 1 << 20;
+
+  LinkMode link_mode;
+  std::string index_path;
+  /*! Where the destination index is kept */
+  HashCache old_index;
+  /*! Index left by the previous run */
+  HashCache index;
+  /*! Index of the destination as it is after this run */
+  std::unordered_map<Digest,std::string,DigestHash> content;
+  /*! A destination file holding each known content */
+  std::unordered_map<std::string,Digest> dst_digests;
+  /*! Content of each destination file, keyed by its path */
+  std::unordered_set<uint64_t> content_sizes;
+  /*! Size of every content in the destination */
+  uint64_t copied_files;
+  uint64_t copied_bytes;
+  uint64_t linked_files;
+  uint64_t linked_bytes;
+  /*! Data that did not have to be written again */
+  uint64_t unchanged_files;
+  uint64_t failed_files;
+};
+
+#endif /* TREE_COPIER_H */
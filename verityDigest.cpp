@@ -0,0 +1,91 @@
+/*!
+  @file verityDigest.cpp
+  @author Charles Irick
+*/
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "verityDigest.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/fsverity.h>)
+#include <linux/fsverity.h>
+#endif
+#endif
+
+/*! Measure
+Read the fs-verity digest of a file, and the parameters it depends
+on from the verity descriptor
+
+@param const std::string & path
+@param Digest & digest
+@param std::string & params
+Hash algorithm, block size and salt, equal for files whose digests
+can be compared
+@return VerityStatus
+VERITY_ENABLED only when both were read
+*/
+VerityStatus VerityDigest::Measure(const std::string& path, Digest& digest,
+                                   std::string& params)
+{
+#ifdef FS_IOC_READ_VERITY_METADATA
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  uint64_t buffer[(sizeof(fsverity_digest) + 64) / sizeof(uint64_t) + 1];
+  fsverity_digest* measured = (fsverity_digest*)buffer;
+  fsverity_descriptor descriptor;
+  fsverity_read_metadata_arg arg;
+
+  if(fd < 0)
+  {
+    return VERITY_DISABLED;
+  }
+
+  measured->digest_size = 64;
+  if(ioctl(fd, FS_IOC_MEASURE_VERITY, measured) != 0)
+  {
+    /* ENODATA is a verity capable filesystem, anything else is not */
+    VerityStatus status = errno == ENODATA ? VERITY_DISABLED : VERITY_UNSUPPORTED;
+    close(fd);
+    return status;
+  }
+
+  /* Without the descriptor (before Linux 5.12) the parameters are
+  unknown and the digest can not be compared */
+  memset(&arg, 0, sizeof(arg));
+  arg.metadata_type = FS_VERITY_METADATA_TYPE_DESCRIPTOR;
+  arg.length = sizeof(descriptor);
+  arg.buf_ptr = (uintptr_t)&descriptor;
+  ssize_t got = ioctl(fd, FS_IOC_READ_VERITY_METADATA, &arg);
+  close(fd);
+  if(got < (ssize_t)offsetof(fsverity_descriptor, salt) ||
+     descriptor.salt_size > sizeof(descriptor.salt) ||
+     descriptor.hash_algorithm != measured->digest_algorithm)
+  {
+    return VERITY_DISABLED;
+  }
+
+  switch(measured->digest_algorithm)
+  {
+    case FS_VERITY_HASH_ALG_SHA256: digest.algorithm = HASH_VERITY_SHA256; break;
+    case FS_VERITY_HASH_ALG_SHA512: digest.algorithm = HASH_VERITY_SHA512; break;
+    default: return VERITY_DISABLED;
+  }
+  memset(digest.bytes, 0, Digest::MAX_SIZE);
+  memcpy(digest.bytes, measured->digest,
+         measured->digest_size < Digest::MAX_SIZE ? measured->digest_size : Digest::MAX_SIZE);
+
+  params.assign(1, (char)descriptor.hash_algorithm);
+  params.append(1, (char)descriptor.log_blocksize);
+  params.append((const char*)descriptor.salt, descriptor.salt_size);
+  return VERITY_ENABLED;
+#else
+  (void)path;
+  (void)digest;
+  (void)params;
+  return VERITY_UNSUPPORTED;
+#endif
+}
@@ -0,0 +1,40 @@
+#ifndef VERITY_DIGEST_H
+#define VERITY_DIGEST_H
+/*!
+  @file verityDigest.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <string>
+#include "contentHash.h"
+
+/*! What a file told us about fs-verity */
+enum VerityStatus
+{
+  VERITY_ENABLED,    /*!< The digest and parameters were read */
+  VERITY_DISABLED,   /*!< The filesystem has fs-verity, the file does not use it */
+  VERITY_UNSUPPORTED /*!< The filesystem or kernel has no fs-verity */
+};
+
+/*!
+  Reads the fs-verity file digest the kernel keeps for files that have
+  fs-verity enabled (ext4, f2fs, btrfs), without reading any data. The
+  file digest is a hash of the Merkle tree root together with the
+  hash algorithm, block size and salt, so files with the same content
+  only have the same digest when those parameters are the same too.
+  They are returned as an opaque string to check that first.
+
+  SHA-512 file digests are truncated to Digest::MAX_SIZE, which keeps
+  256 bits of collision resistance.
+
+  @brief Content digests from fs-verity.
+ */
+class VerityDigest
+{
+public:
+  static VerityStatus Measure(const std::string& path, Digest& digest,
+                              std::string& params);
+};
+
+#endif /* VERITY_DIGEST_H */
@@ -0,0 +1,126 @@
+/*!
+  @file walkBench.cpp
+  @author Charles Irick
+*/
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <unistd.h>
+#include "walkBench.h"
+#include "ioBackend.h"
+#include "ioSimulator.h"
+
+/*! Run
+Walk the tree the given number of times in each order, alternating
+which order goes first, and report the best time of each
+
+@param const std::string & root
+@return boolean
+If every walk succeeded
+*/
+bool WalkBench::Run(const std::string& root)
+{
+  const WalkOrder orders[2] = { WALK_READDIR, WALK_INODE };
+  const char* names[2] = { "readdir", "inode" };
+  double best[2] = { 0, 0 };
+  bool cold = true;
+
+  std::cout << std::fixed << std::showpoint << std::setprecision(3);
+  for(unsigned int r = 0; r < runs; r++)
+  {
+    for(unsigned int k = 0; k < 2; k++)
+    {
+      unsigned int o = (r + k) % 2;
+      double seconds;
+      uintmax_t files;
+
+      if(io_model.empty() && !DropCaches())
+      {
+        cold = false;
+      }
+      if(!WalkOnce(root, orders[o], seconds, files))
+      {
+        return false;
+      }
+      if(best[o] == 0 || seconds < best[o])
+      {
+        best[o] = seconds;
+      }
+      std::cout << "Run " << r + 1 << " " << std::left << std::setw(8) << names[o]
+                << std::right << seconds << "s  " << files << " files\n";
+    }
+  }
+
+  if(!cold)
+  {
+    std::cerr << "Could not drop the page cache (needs root), timings are"
+                 " of a warm cache\n";
+  }
+  std::cout << "Best readdir order:      " << best[0] << "s\n"
+            << "Best inode order:        " << best[1] << "s\n";
+  if(best[1] > 0)
+  {
+    std::cout << std::setprecision(2)
+              << "Speedup:                 " << best[0] / best[1] << "x\n";
+  }
+  return true;
+}
+
+/*! DropCaches
+Write back dirty data and drop the page, dentry and inode caches
+
+@return boolean
+If the caches were dropped
+*/
+bool WalkBench::DropCaches()
+{
+  FILE* control;
+
+  sync();
+  control = fopen("/proc/sys/vm/drop_caches", "w");
+  if(control == NULL)
+  {
+    return false;
+  }
+  bool ok = fputs("3\n", control) >= 0;
+  return fclose(control) == 0 && ok;
+}
+
+/*! WalkOnce
+Time one walk of the tree in one order, on a fresh scanner
+
+@param const std::string & root
+@param WalkOrder order
+@param double & seconds
+@param uintmax_t & files
+Regular files found
+@return boolean
+If the walk succeeded
+*/
+bool WalkBench::WalkOnce(const std::string& root, WalkOrder order,
+                         double& seconds, uintmax_t& files)
+{
+  FileUtils tools;
+
+  if(!io_model.empty())
+  {
+    StorageModel model;
+    if(!model.Parse(io_model))
+    {
+      return false;
+    }
+    tools.SetIoBackend(new SimulatedBackend(new PosixBackend(), model));
+  }
+  if(threads > 0)
+  {
+    tools.SetIoThreads(threads);
+  }
+  tools.SetWalkOrder(order);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bool ok = tools.WalkTree(root, files);
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return ok;
+}
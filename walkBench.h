@@ -0,0 +1,47 @@
+#ifndef WALK_BENCH_H
+#define WALK_BENCH_H
+/*!
+  @file walkBench.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include "fileUtils.h"
+
+/*!
+  Times the directory walk alone, with each directory stat'ed in
+  readdir order and in inode order. The page cache is dropped before
+  every walk so both start cold, which needs root; otherwise the
+  timings are of a warm cache and say so. With a storage model the
+  walks go through a SimulatedBackend instead of the real device.
+
+  @brief Benchmark of the walk orders.
+ */
+class WalkBench
+{
+public:
+  /*! Constructor */
+  WalkBench()
+    :runs(3), threads(0) {}
+
+  void SetIoModel(const std::string& spec) { io_model = spec; }
+  void SetRuns(unsigned int count) { runs = count; }
+  void SetThreads(unsigned int count) { threads = count; }
+  bool Run(const std::string& root);
+
+private:
+  bool DropCaches();
+  bool WalkOnce(const std::string& root, WalkOrder order,
+                double& seconds, uintmax_t& files);
+
+  std::string io_model;
+  /*! StorageModel spec, empty to walk the real device */
+  unsigned int runs;
+  /*! Walks in each order */
+  unsigned int threads;
+  /*! Fixed operations in flight per device, 0 for adaptive */
+};
+
+#endif /* WALK_BENCH_H */
@@ -0,0 +1,68 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+/*!
+  @file workQueue.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/*!
+  Unbounded queue used to hand work from the scanning thread to
+  background workers. Close() wakes every waiting worker once the
+  producer is done, Pop() then drains what is left and returns false.
+
+  @brief Blocking multi-producer, multi-consumer queue.
+ */
+template <typename T>
+class WorkQueue
+{
+public:
+  /*! Constructor */
+  WorkQueue()
+    :closed(false) {}
+
+  void Push(const T& item)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    items.push_back(item);
+    ready.notify_one();
+  }
+
+  /* Wait for an item. Returns false once the queue is closed and empty */
+  bool Pop(T& item)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(items.empty() && !closed)
+    {
+      ready.wait(lock);
+    }
+    if(items.empty())
+    {
+      return false;
+    }
+    item = items.front();
+    items.pop_front();
+    return true;
+  }
+
+  void Close()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    ready.notify_all();
+  }
+
+private:
+  std::deque<T> items;
+  /*! Work waiting for a consumer */
+  bool closed;
+  /*! Set when no more work will be pushed */
+  std::mutex mutex;
+  std::condition_variable ready;
+};
+
+#endif /* WORK_QUEUE_H */
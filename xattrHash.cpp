@@ -0,0 +1,76 @@
+/*!
+  @file xattrHash.cpp
+  @author Charles Irick
+*/
+#include <cstring>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "xattrHash.h"
+
+const char* const XattrHash::NAME = "user.fileutils.hash";
+
+/*! Load
+Read the digest kept on a file, if it was taken at the identity the
+file has now
+
+@param const std::string & path
+@param const FileIdentity & ident
+Current size and modification time of the file
+@param Digest & digest
+@return boolean
+If the file holds a digest that is still valid
+*/
+bool XattrHash::Load(const std::string& path, const FileIdentity& ident,
+                     Digest& digest)
+{
+  Record record;
+  ssize_t got = getxattr(path.c_str(), NAME, &record, sizeof(record));
+
+  if(got != (ssize_t)sizeof(record) || record.version != VERSION)
+  {
+    return false;
+  }
+  if(record.size != ident.size || record.mtime_sec != ident.mtime_sec ||
+     record.mtime_nsec != ident.mtime_nsec)
+  {
+    return false;
+  }
+  if(record.digest_size == 0 || record.digest_size != Digest::SizeOf(record.algorithm))
+  {
+    return false;
+  }
+
+  digest = Digest();
+  digest.algorithm = record.algorithm;
+  memcpy(digest.bytes, record.digest, record.digest_size);
+  return true;
+}
+
+/*! Store
+Keep the digest of a file on the file. Fails quietly where extended
+attributes cannot be written, e.g. files of other users, read-only
+or unsupported filesystems.
+
+@param const std::string & path
+@param const FileIdentity & ident
+Identity taken before the content was read
+@param const Digest & digest
+@return boolean
+If the attribute was written
+*/
+bool XattrHash::Store(const std::string& path, const FileIdentity& ident,
+                      const Digest& digest)
+{
+  Record record;
+
+  memset(&record, 0, sizeof(record));
+  record.version = VERSION;
+  record.algorithm = digest.algorithm;
+  record.digest_size = (unsigned char)digest.Size();
+  record.size = ident.size;
+  record.mtime_sec = ident.mtime_sec;
+  record.mtime_nsec = ident.mtime_nsec;
+  memcpy(record.digest, digest.bytes, Digest::MAX_SIZE);
+
+  return setxattr(path.c_str(), NAME, &record, sizeof(record), 0) == 0;
+}
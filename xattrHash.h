@@ -0,0 +1,53 @@
+#ifndef XATTR_HASH_H
+#define XATTR_HASH_H
+/*!
+  @file xattrHash.h
+  @author Charles Irick
+*/
+
+/* Includes */
+#include <cstdint>
+#include <string>
+#include "contentHash.h"
+#include "hashCache.h"
+
+/*!
+  Keeps the content digest of a file in a user.fileutils.* extended
+  attribute on the file itself, next to the size and modification time
+  it was taken at and the digest algorithm. Unlike a central cache the
+  digest follows the file through renames, moves and copies that keep
+  extended attributes, and reading it back is a single getxattr.
+
+  A digest is only trusted while the size and modification time still
+  match. Device and inode are deliberately not recorded, they change
+  when a file is copied.
+
+  @brief Content digests stored in extended attributes.
+ */
+class XattrHash
+{
+public:
+  static bool Load(const std::string& path, const FileIdentity& ident,
+                   Digest& digest);
+  static bool Store(const std::string& path, const FileIdentity& ident,
+                    const Digest& digest);
+
+  static const char* const NAME;
+  static const unsigned char VERSION = 1;
+
+private:
+  /*! Attribute value, native endian */
+  struct Record
+  {
+    unsigned char version;
+    unsigned char algorithm;
+    unsigned char digest_size;
+    unsigned char reserved[5];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    unsigned char digest[Digest::MAX_SIZE];
+  };
+};
+
+#endif /* XATTR_HASH_H */